@@ -0,0 +1,36 @@
+#!/bin/sh
+# Drive a server the way a busy deployment does: a generated map and several
+# rooms full of NPCs and scripted players walking and pinging. Used to train
+# the PGO build and to compare builds.
+#
+#   bench/workload.sh [server binary] [seconds]
+#
+# The last line printed is the CPU time the server used.
+
+set -e
+
+SERVER=${1:-./server}
+SECONDS_TO_RUN=${2:-20}
+ROOMS=${ROOMS:-4}
+NPCS=${NPCS:-4000}
+BOTS=${BOTS:-96}
+PORT=${PORT:-$((40000 + $$ % 20000))}
+
+DIR=$(mktemp -d)
+trap 'kill "$SERVER_PID" 2>/dev/null || true; rm -rf "$DIR"' EXIT
+
+./mapgen -s 7 -d 20 "$DIR/world.map" 512 512 >/dev/null
+"$SERVER" -m "$DIR/world.map" -n "$NPCS" -r "$ROOMS" -l 0 -L 0 \
+  127.0.0.1 "$PORT" >/dev/null 2>&1 &
+SERVER_PID=$!
+sleep 1
+
+./loadgen -b "$BOTS" -r "$ROOMS" -d "$SECONDS_TO_RUN" -s 1 127.0.0.1 "$PORT"
+
+# utime and stime, in clock ticks, are the 14th and 15th fields; the command
+# name before them is in parentheses and contains no spaces here.
+TIMES=$(awk '{ print $14, $15 }' "/proc/$SERVER_PID/stat")
+kill -INT "$SERVER_PID"
+wait "$SERVER_PID" || true
+echo "$TIMES $(getconf CLK_TCK)" |
+  awk '{ printf "server: %.2f s user, %.2f s system\n", $1 / $3, $2 / $3 }'
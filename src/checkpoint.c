@@ -0,0 +1,170 @@
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+typedef struct
+{
+  // 0 while the slot is being written or was never written.
+  _Alignas(64) atomic_uint_fast64_t generation;
+} CheckpointSlot;
+
+static CheckpointSlot *slot_at(const Checkpoint *checkpoint, int index,
+                               int copy);
+
+#define SLOT_ALIGNMENT 64
+
+int checkpoint_open(Checkpoint *checkpoint, const char *path, int count,
+                    size_t slot_size, uint64_t fingerprint)
+{
+  int fd;
+  struct stat st;
+  CheckpointHeader *header;
+  size_t stride;
+  size_t mapping_len;
+
+  stride = (sizeof(CheckpointSlot) + slot_size + SLOT_ALIGNMENT - 1) &
+           ~(size_t)(SLOT_ALIGNMENT - 1);
+  mapping_len = SLOT_ALIGNMENT + stride * 2 * (size_t)count;
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+  if (fd == -1)
+  {
+    perror("open checkpoint");
+    return -1;
+  }
+
+  if (fstat(fd, &st) == -1)
+  {
+    perror("fstat checkpoint");
+    close(fd);
+    return -1;
+  }
+
+  // A file of another size can't be ours; start it over.
+  if ((size_t)st.st_size != mapping_len &&
+      (ftruncate(fd, 0) == -1 || ftruncate(fd, (off_t)mapping_len) == -1))
+  {
+    perror("ftruncate checkpoint");
+    close(fd);
+    return -1;
+  }
+
+  checkpoint->mapping =
+      mmap(NULL, mapping_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (checkpoint->mapping == MAP_FAILED)
+  {
+    perror("mmap checkpoint");
+    return -1;
+  }
+
+  checkpoint->mapping_len = mapping_len;
+  checkpoint->stride = stride;
+  checkpoint->count = count;
+
+  header = checkpoint->mapping;
+  checkpoint->restored =
+      memcmp(header->magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN) == 0 &&
+      header->fingerprint == fingerprint && header->slot_size == slot_size &&
+      header->count == (uint32_t)count;
+
+  if (!checkpoint->restored)
+  {
+    memset(checkpoint->mapping, 0, mapping_len);
+    memcpy(header->magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN);
+    header->fingerprint = fingerprint;
+    header->slot_size = slot_size;
+    header->count = (uint32_t)count;
+  }
+
+  return 0;
+}
+
+void checkpoint_close(Checkpoint *checkpoint)
+{
+  if (checkpoint->mapping != NULL)
+  {
+    munmap(checkpoint->mapping, checkpoint->mapping_len);
+    checkpoint->mapping = NULL;
+  }
+}
+
+void checkpoint_discard(Checkpoint *checkpoint)
+{
+  CheckpointHeader *header = checkpoint->mapping;
+
+  memset(header->magic, 0, CHECKPOINT_MAGIC_LEN);
+  msync(checkpoint->mapping, SLOT_ALIGNMENT, MS_SYNC);
+}
+
+void *checkpoint_begin(Checkpoint *checkpoint, int index)
+{
+  CheckpointSlot *first = slot_at(checkpoint, index, 0);
+  CheckpointSlot *second = slot_at(checkpoint, index, 1);
+  CheckpointSlot *target;
+
+  // Overwrite the older copy and mark it torn until commit.
+  target = atomic_load_explicit(&first->generation, memory_order_relaxed) <=
+                   atomic_load_explicit(&second->generation,
+                                        memory_order_relaxed)
+               ? first
+               : second;
+  atomic_store_explicit(&target->generation, 0, memory_order_release);
+
+  return target + 1;
+}
+
+void checkpoint_commit(Checkpoint *checkpoint, int index)
+{
+  CheckpointSlot *first = slot_at(checkpoint, index, 0);
+  CheckpointSlot *second = slot_at(checkpoint, index, 1);
+  uint64_t first_generation =
+      atomic_load_explicit(&first->generation, memory_order_relaxed);
+  uint64_t second_generation =
+      atomic_load_explicit(&second->generation, memory_order_relaxed);
+
+  // checkpoint_begin zeroed exactly one of the two.
+  if (first_generation == 0)
+  {
+    atomic_store_explicit(&first->generation, second_generation + 1,
+                          memory_order_release);
+  }
+  else
+  {
+    atomic_store_explicit(&second->generation, first_generation + 1,
+                          memory_order_release);
+  }
+}
+
+const void *checkpoint_latest(const Checkpoint *checkpoint, int index)
+{
+  const CheckpointSlot *first = slot_at(checkpoint, index, 0);
+  const CheckpointSlot *second = slot_at(checkpoint, index, 1);
+  uint64_t first_generation =
+      atomic_load_explicit(&first->generation, memory_order_acquire);
+  uint64_t second_generation =
+      atomic_load_explicit(&second->generation, memory_order_acquire);
+
+  if (first_generation == 0 && second_generation == 0)
+  {
+    return NULL;
+  }
+
+  return first_generation > second_generation ? (const void *)(first + 1)
+                                              : (const void *)(second + 1);
+}
+
+static CheckpointSlot *slot_at(const Checkpoint *checkpoint, int index,
+                               int copy)
+{
+  return (CheckpointSlot *)((char *)checkpoint->mapping + SLOT_ALIGNMENT +
+                            checkpoint->stride * (size_t)(index * 2 + copy));
+}
@@ -0,0 +1,48 @@
+#ifndef TG_CHECKPOINT_H
+#define TG_CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A memory-mapped file of fixed-size slots, two per saved object. Writers
+ * alternate between their pair and bump a generation number only once a
+ * slot is complete, so a crash mid-write still leaves the previous copy.
+ * Each pair must have a single writer.
+ *
+ *   CheckpointHeader
+ *   slot[count][2]: CheckpointSlot followed by slot_size bytes
+ */
+
+#define CHECKPOINT_MAGIC "TGCKPT01"
+#define CHECKPOINT_MAGIC_LEN 8
+
+typedef struct
+{
+  char magic[CHECKPOINT_MAGIC_LEN];
+  uint64_t fingerprint;
+  uint64_t slot_size;
+  uint32_t count;
+  uint32_t reserved;
+} CheckpointHeader;
+
+typedef struct
+{
+  void *mapping;
+  size_t mapping_len;
+  size_t stride;
+  int count;
+  // The file held a compatible checkpoint when it was opened.
+  int restored;
+} Checkpoint;
+
+int checkpoint_open(Checkpoint *checkpoint, const char *path, int count,
+                    size_t slot_size, uint64_t fingerprint);
+void checkpoint_close(Checkpoint *checkpoint);
+void checkpoint_discard(Checkpoint *checkpoint);
+
+void *checkpoint_begin(Checkpoint *checkpoint, int index);
+void checkpoint_commit(Checkpoint *checkpoint, int index);
+const void *checkpoint_latest(const Checkpoint *checkpoint, int index);
+
+#endif
@@ -1,8 +1,8 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
-#include <ncurses.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdint.h>
@@ -11,10 +11,34 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-static void parse_arguments(int argc, char *argv[], char **address,
-                            char **port_str);
+#include "clock.h"
+#include "clocksync.h"
+#include "netem.h"
+#include "protocol.h"
+#include "schema.h"
+#include "screen.h"
+#include "snapshot.h"
+#include "spectate.h"
+#include "transport.h"
+#include "world.h"
+
+typedef struct
+{
+  char *address;
+  char *port_str;
+  int room_id;
+  int show_hud;
+  char *impairment;
+  ScreenBackend renderer;
+  char *watch_interface;
+  char *shm_name;
+  char *token_path;
+} ClientOptions;
+
+static void parse_arguments(int argc, char *argv[], ClientOptions *options);
 static void handle_arguments(const char *binary_name, const char *address,
                              const char *port_str, in_port_t *port);
 static in_port_t parse_in_port_t(const char *binary_name, const char *port_str);
@@ -28,10 +52,28 @@ static void get_address_to_server(struct sockaddr_storage *addr,
 static void socket_close(int sockfd);
 
 static void send_init_message(int sockfd, const struct sockaddr *addr,
-                              socklen_t addr_len);
-static void handle_init_message(const char *message);
+                              socklen_t addr_len, int room_id);
+static void handle_welcome_message(const char *message, size_t length);
+static void load_session_token(void);
+static void save_session_token(void);
+static void handle_chunk_message(const char *message, size_t length);
+static void handle_npc_message(const char *message);
+static void handle_near_npc_message(const char *message);
+static void parse_npcs(const char *cursor);
+static void handle_zone_message(const char *message,
+                                struct sockaddr_storage *addr);
+static void request_missing_chunks(int sockfd, const struct sockaddr *addr,
+                                   socklen_t addr_len);
+static void send_ping(int sockfd, const struct sockaddr *addr,
+                      socklen_t addr_len, uint64_t now);
+static void handle_pong(const char *message, size_t length, uint64_t now);
+static int ping_timeout_ms(uint64_t now);
+static void render_view(void);
+static long monotonic_ms(void);
 
 static void handle_input(int sockfd, struct sockaddr *addr, socklen_t addr_len);
+static void handle_text_message(char *input_buffer, size_t bytes_received,
+                                struct sockaddr *addr);
 static void read_from_keyboard(int sockfd, const struct sockaddr *addr,
                                socklen_t addr_len);
 void enableRawMode(void);
@@ -39,14 +81,28 @@ void enableRawMode(void);
 static void send_quit_message(int sockfd, const struct sockaddr *addr,
                               socklen_t addr_len);
 
-void handle_position_change(char *message);
+static void handle_snapshot_fragment(const char *message, size_t length);
+void handle_position_change(char *message, size_t length);
+static void handle_chat_lines(char *lines);
+static void compose_chat(char c, int sockfd, const struct sockaddr *addr,
+                         socklen_t addr_len);
+static void render_chat(void);
+static void handle_for_message(const char *message);
+static void follow_next_player(void);
 
 static void setup_signal_handler(void);
 static void sigint_handler(int signum);
 
 static void draw_boarder(int width, int height);
 
-void place_dot(int x, int y);
+static void hud_record_input(uint64_t now);
+static void hud_record_confirmation(uint64_t now);
+static void hud_record_render(uint64_t elapsed);
+static int hud_timeout_ms(uint64_t now);
+static void hud_update(uint64_t now);
+static uint64_t terminal_bytes_written(void);
+
+void place_dot(int x, int y, int attr);
 
 // static int redirect_output_to_file(const char *file_path);
 
@@ -55,7 +111,23 @@ static volatile sig_atomic_t exit_flag = 0;
 
 #define BUFFER_SIZE 1024
 #define BASE_TEN 10
-#define INIT_MESSAGE_PREFIX_LEN 5
+#define MAX_ROOM_ID 1000000
+#define MAX_PLAYERS 64
+#define MAX_VISIBLE_NPCS 256
+#define CHUNK_CACHE_SHIFT 5
+#define CHUNK_CACHE_DIM (1 << CHUNK_CACHE_SHIFT)
+#define CHUNK_CACHE_MASK (CHUNK_CACHE_DIM - 1)
+#define CHUNK_REQUEST_INTERVAL_MS 250
+#define MS_PER_SECOND 1000
+#define HUD_INTERVAL_MS 1000
+#define HUD_LINE_LENGTH 160
+#define RTT_SAMPLE_TIMEOUT_MS 1000
+#define PING_INTERVAL_MS 500
+#define CHAT_LOG_LINES 4
+// Snapshots numbered up to this far behind the last one drawn are late;
+// further behind, the server has restarted its count.
+#define SNAPSHOT_STALE_WINDOW 64
+#define CHAT_LINE_LENGTH (MAX_USERNAME_LENGTH + 2 + CHAT_TEXT_MAX)
 
 typedef struct
 {
@@ -63,16 +135,167 @@ typedef struct
   int width;
 } WindowDimensions;
 
+typedef struct
+{
+  int valid;
+  int cx;
+  int cy;
+  int requested_cx;
+  int requested_cy;
+  long requested_at;
+  char tiles[WORLD_CHUNK_CELLS];
+} CachedChunk;
+
+typedef struct
+{
+  int x;
+  int y;
+  int state;
+} NpcPosition;
+
+/*
+ * Counters behind the -s overlay. RTT is timed from an input to the server's
+ * confirmation of it, one input at a time, and smoothed the way TCP does
+ * (RFC 6298): srtt follows 1/8 of each change and rttvar, shown as jitter,
+ * 1/4. The rest are totals over the current HUD_INTERVAL_MS window.
+ */
+typedef struct
+{
+  uint64_t srtt_ns;
+  uint64_t rttvar_ns;
+  uint64_t input_sent_ns;
+  uint64_t window_start_ns;
+  uint64_t window_start_bytes;
+  uint64_t snapshots;
+  uint64_t inputs;
+  uint64_t renders;
+  uint64_t render_total_ns;
+  uint64_t render_max_ns;
+} HudStats;
+
+/*
+ * The newest snapshot, put back together from its SNAP: fragments. A
+ * fragment of a later snapshot starts over and one of an earlier snapshot
+ * is dropped, so a snapshot missing a fragment is never drawn; the next
+ * complete one replaces it.
+ */
+typedef struct
+{
+  uint32_t id;
+  // Bit n is set once fragment n is in; count is 0 between snapshots.
+  uint32_t received;
+  uint32_t count;
+  size_t length;
+  int drawn;
+  uint32_t drawn_id;
+  char data[SNAPSHOT_MAX_SIZE + 1];
+} SnapshotAssembly;
+
+static CachedChunk *chunk_slot(int cx, int cy);
+
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 WindowDimensions window;
 
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 char name[BUFFER_SIZE];
 
+// Chunks live on a CHUNK_CACHE_DIM x CHUNK_CACHE_DIM torus indexed by chunk
+// coordinates, so any viewport up to that many chunks across never evicts
+// one of its own chunks.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+CachedChunk chunk_cache[CHUNK_CACHE_DIM * CHUNK_CACHE_DIM];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+SnapshotPlayer players[MAX_PLAYERS];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int player_count;
+
+// The id snapshots give the player we control, or follow as a spectator.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int player_id = SNAPSHOT_NO_ID;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+NpcPosition visible_npcs[MAX_VISIBLE_NPCS];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int visible_npc_count;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+SnapshotAssembly snapshot;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int local_x;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int local_y;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int hud_enabled;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+HudStats hud;
+
+// The server's clock as estimated from PING/PONG, and what the next PING
+// echoes back so the server can do the same for ours.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+ClockSync server_clock;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint32_t ping_seq;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint32_t move_seq;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint64_t next_ping_ns;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint64_t pong_sent_ns;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint64_t pong_received_ns;
+
+// From our WELCOME, sent with every JOIN, MOVE and PING so the server knows
+// us wherever our datagrams come from. With -T it is kept in token_path,
+// and a restarted client takes its player back.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint64_t session_token;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+const char *token_path;
+
+// The last few lines of chat, drawn over the bottom of the view: line n is
+// in chat_log[n % CHAT_LOG_LINES].
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+char chat_log[CHAT_LOG_LINES][CHAT_LINE_LENGTH];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+unsigned chat_lines;
+
+// Set between the Enter that starts a line of chat and the one that sends
+// it.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int composing;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+char chat_draft[CHAT_TEXT_MAX];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+size_t chat_draft_length;
+
+// Set for spectators (-w), who only receive the multicast stream and follow
+// one of the players in `name`.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int watching;
+
+// Kept open so each HUD refresh costs one pread.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int proc_io_fd = -1;
+
 int main(int argc, char *argv[])
 {
-  char *address;
-  char *port_str;
+  ClientOptions options;
   in_port_t port;
   int sockfd;
   struct sockaddr_storage addr;
@@ -80,18 +303,56 @@ int main(int argc, char *argv[])
 
   socklen_t addr_len = sizeof(addr);
 
-  address = NULL;
-  port_str = NULL;
+  memset(&options, 0, sizeof(options));
+
+  parse_arguments(argc, argv, &options);
+
+  if (options.shm_name == NULL)
+  {
+    handle_arguments(argv[0], options.address, options.port_str, &port);
+    convert_address(options.address, &addr, &addr_len);
+    get_address_to_server(&addr, port);
+  }
+
+  if (options.shm_name != NULL)
+  {
+    sockfd = transport_shm_connect(options.shm_name, &addr, &addr_len);
+
+    if (sockfd == -1)
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (options.watch_interface != NULL)
+  {
+    if (port + options.room_id > UINT16_MAX)
+    {
+      usage(argv[0], EXIT_FAILURE, "The room's stream port is out of range.");
+    }
 
-  parse_arguments(argc, argv, &address, &port_str);
-  handle_arguments(argv[0], address, port_str, &port);
-  convert_address(address, &addr, &addr_len);
+    watching = 1;
+    sockfd = spectator_join(options.address,
+                            (in_port_t)(port + options.room_id),
+                            options.watch_interface);
 
-  sockfd = socket_create(addr.ss_family, SOCK_DGRAM, 0);
-  get_address_to_server(&addr, port);
+    if (sockfd == -1)
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  else
+  {
+    sockfd = socket_create(addr.ss_family, SOCK_DGRAM, 0);
+    get_address_to_server(&addr, port);
+  }
 
   setup_signal_handler();
 
+  if (options.impairment != NULL && netem_init(options.impairment) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
   //    if(redirect_output_to_file("output") != 0)
   //    {
   //        return 1;    // Exit if redirection fails
@@ -99,10 +360,26 @@ int main(int argc, char *argv[])
 
   enableRawMode();
 
-  initscr();
-  curs_set(0);
+  if (screen_init(options.renderer, STDOUT_FILENO, 0, 0) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  if (options.show_hud)
+  {
+    hud_enabled = 1;
+    proc_io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    hud.window_start_ns = monotonic_ns();
+    hud.window_start_bytes = terminal_bytes_written();
+  }
 
-  send_init_message(sockfd, (const struct sockaddr *)&addr, addr_len);
+  if (!watching)
+  {
+    token_path = options.token_path;
+    load_session_token();
+    send_init_message(sockfd, (const struct sockaddr *)&addr, addr_len,
+                      options.room_id);
+  }
 
   FD_ZERO(&read_fds);
   FD_SET(sockfd, &read_fds);
@@ -111,13 +388,34 @@ int main(int argc, char *argv[])
   while (!exit_flag)
   {
     fd_set tmp_fds = read_fds;
+    struct timeval timeout;
+    uint64_t now = monotonic_ns();
+    int timeout_ms = hud_timeout_ms(now);
+    int ping_ms = ping_timeout_ms(now);
+    int transport_ms = transport_timeout_ms();
 
-    if (select(sockfd + 1, &tmp_fds, NULL, NULL, NULL) == -1)
+    if (ping_ms >= 0 && (timeout_ms < 0 || ping_ms < timeout_ms))
+    {
+      timeout_ms = ping_ms;
+    }
+
+    if (transport_ms >= 0 && (timeout_ms < 0 || transport_ms < timeout_ms))
+    {
+      timeout_ms = transport_ms;
+    }
+
+    timeout.tv_sec = timeout_ms / MS_PER_SECOND;
+    timeout.tv_usec = (timeout_ms % MS_PER_SECOND) * (NS_PER_MS / NS_PER_US);
+
+    // Wake up for the next PING, HUD refresh or delayed datagram even when
+    // nothing arrives, and straight away while shared memory may hold more.
+    if (select(sockfd + 1, &tmp_fds, NULL, NULL,
+               timeout_ms >= 0 ? &timeout : NULL) == -1)
     {
       break;
     }
 
-    if (FD_ISSET(sockfd, &tmp_fds))
+    if (FD_ISSET(sockfd, &tmp_fds) || transport_ms >= 0)
     {
       handle_input(sockfd, (struct sockaddr *)&addr, addr_len);
     }
@@ -126,12 +424,31 @@ int main(int argc, char *argv[])
     {
       read_from_keyboard(sockfd, (struct sockaddr *)&addr, addr_len);
     }
+
+    now = monotonic_ns();
+
+    if (ping_timeout_ms(now) == 0)
+    {
+      send_ping(sockfd, (struct sockaddr *)&addr, addr_len, now);
+    }
+
+    hud_update(now);
   }
 
-  send_quit_message(sockfd, (struct sockaddr *)&addr, addr_len);
+  if (!watching)
+  {
+    send_quit_message(sockfd, (struct sockaddr *)&addr, addr_len);
+  }
 
-  endwin();
+  screen_shutdown();
+  netem_shutdown();
   socket_close(sockfd);
+  transport_shutdown();
+
+  if (proc_io_fd != -1)
+  {
+    close(proc_io_fd);
+  }
 
   return EXIT_SUCCESS;
 }
@@ -193,28 +510,163 @@ static void draw_boarder(int width, int height)
 {
   for (int i = 0; i < width; i++)
   {
-    mvprintw(0, i, "-");
-    mvprintw(height - 1, i, "-");
+    screen_put(0, i, '-', SCREEN_NORMAL);
+    screen_put(height - 1, i, '-', SCREEN_NORMAL);
   }
 
   for (int i = 1; i < height - 1; i++)
   {
-    mvprintw(i, 0, "|");
-    mvprintw(i, width - 1, "|");
+    screen_put(i, 0, '|', SCREEN_NORMAL);
+    screen_put(i, width - 1, '|', SCREEN_NORMAL);
+  }
+
+  screen_put(0, 0, '+', SCREEN_NORMAL);
+  screen_put(0, width - 1, '+', SCREEN_NORMAL);
+  screen_put(height - 1, 0, '+', SCREEN_NORMAL);
+  screen_put(height - 1, width - 1, '+', SCREEN_NORMAL);
+
+  screen_present();
+}
+
+void place_dot(int x, int y, int attr) { screen_put(y, x, 'o', attr); }
+
+static void hud_record_input(uint64_t now)
+{
+  hud.inputs++;
+
+  // Moves into a wall are never confirmed, so give up on them eventually.
+  if (hud.input_sent_ns == 0 ||
+      now - hud.input_sent_ns > (uint64_t)RTT_SAMPLE_TIMEOUT_MS * NS_PER_MS)
+  {
+    hud.input_sent_ns = now;
+  }
+}
+
+static void hud_record_confirmation(uint64_t now)
+{
+  uint64_t sample;
+  uint64_t error;
+
+  if (hud.input_sent_ns == 0)
+  {
+    return;
+  }
+
+  sample = now - hud.input_sent_ns;
+  hud.input_sent_ns = 0;
+
+  if (hud.srtt_ns == 0)
+  {
+    hud.srtt_ns = sample;
+    hud.rttvar_ns = sample / 2;
+    return;
+  }
+
+  error = sample > hud.srtt_ns ? sample - hud.srtt_ns : hud.srtt_ns - sample;
+  hud.rttvar_ns = hud.rttvar_ns - hud.rttvar_ns / 4 + error / 4;
+  hud.srtt_ns = hud.srtt_ns - hud.srtt_ns / 8 + sample / 8;
+}
+
+static void hud_record_render(uint64_t elapsed)
+{
+  hud.renders++;
+  hud.render_total_ns += elapsed;
+  hud.render_max_ns = elapsed > hud.render_max_ns ? elapsed : hud.render_max_ns;
+}
+
+// How long select may wait before the HUD is due, or -1 to wait forever.
+static int hud_timeout_ms(uint64_t now)
+{
+  uint64_t due;
+
+  if (!hud_enabled)
+  {
+    return -1;
+  }
+
+  due = hud.window_start_ns + (uint64_t)HUD_INTERVAL_MS * NS_PER_MS;
+
+  return due > now ? (int)((due - now + NS_PER_MS - 1) / NS_PER_MS) : 0;
+}
+
+static void hud_update(uint64_t now)
+{
+  char line[HUD_LINE_LENGTH];
+  uint64_t elapsed;
+  uint64_t bytes;
+  double seconds;
+
+  if (!hud_enabled || window.width == 0 ||
+      now - hud.window_start_ns < (uint64_t)HUD_INTERVAL_MS * NS_PER_MS)
+  {
+    return;
+  }
+
+  elapsed = now - hud.window_start_ns;
+  seconds = (double)elapsed / NS_PER_SECOND;
+  bytes = terminal_bytes_written();
+
+  snprintf(line, sizeof(line),
+           " rtt %.1f ms  jitter %.1f ms  ping %.2f ms  clock %+.2f ms  "
+           "%.0f snap/s  %.0f in/s  render %.2f/%.2f ms  tty %.1f KB/s ",
+           (double)hud.srtt_ns / NS_PER_MS, (double)hud.rttvar_ns / NS_PER_MS,
+           (double)server_clock.rtt_ns / NS_PER_MS,
+           (double)server_clock.offset_ns / NS_PER_MS,
+           (double)hud.snapshots / seconds, (double)hud.inputs / seconds,
+           hud.renders != 0
+               ? (double)hud.render_total_ns / (double)hud.renders / NS_PER_MS
+               : 0.0,
+           (double)hud.render_max_ns / NS_PER_MS,
+           (double)(bytes - hud.window_start_bytes) / seconds / 1024);
+
+  // Sits on the top edge of the border, which is redrawn under it first.
+  for (int i = 1; i < screen_cols() - 1; i++)
+  {
+    screen_put(0, i, '-', SCREEN_NORMAL);
   }
 
-  mvprintw(0, 0, "+");
-  mvprintw(0, width - 1, "+");
-  mvprintw(height - 1, 0, "+");
-  mvprintw(height - 1, width - 1, "+");
+  if (screen_cols() > 4)
+  {
+    screen_print(0, 2, "%.*s", screen_cols() - 4, line);
+  }
 
-  refresh();
+  screen_present();
+
+  hud.window_start_ns = now;
+  // Our own refresh above counts towards the next window.
+  hud.window_start_bytes = bytes;
+  hud.snapshots = 0;
+  hud.inputs = 0;
+  hud.renders = 0;
+  hud.render_total_ns = 0;
+  hud.render_max_ns = 0;
 }
 
-void place_dot(int x, int y)
+// Everything the client writes goes to the terminal, so the kernel's count
+// of bytes written by this process is the terminal traffic.
+static uint64_t terminal_bytes_written(void)
 {
-  mvaddch(y, x, 'o');
-  refresh();
+  char buffer[BUFFER_SIZE];
+  const char *field;
+  ssize_t length;
+
+  if (proc_io_fd == -1)
+  {
+    return 0;
+  }
+
+  length = pread(proc_io_fd, buffer, sizeof(buffer) - 1, 0);
+
+  if (length <= 0)
+  {
+    return 0;
+  }
+
+  buffer[length] = '\0';
+  field = strstr(buffer, "wchar: ");
+
+  return field != NULL ? strtoull(field + strlen("wchar: "), NULL, BASE_TEN)
+                       : 0;
 }
 
 #pragma GCC diagnostic push
@@ -250,13 +702,19 @@ static void setup_signal_handler(void)
 }
 
 static void send_init_message(int sockfd, const struct sockaddr *addr,
-                              socklen_t addr_len)
+                              socklen_t addr_len, int room_id)
 {
-  const char *init_message = "INIT";
+  char join_message[JOIN_MESSAGE_SIZE];
+  // Tell the server how much of the world fits inside our border.
+  JoinMessage join = {.rows = (uint16_t)(screen_rows() - 2),
+                      .cols = (uint16_t)(screen_cols() - 2),
+                      .room = (uint32_t)room_id,
+                      .token = session_token};
   ssize_t bytes_sent;
 
-  bytes_sent =
-      sendto(sockfd, init_message, strlen(init_message), 0, addr, addr_len);
+  bytes_sent = transport_sendto(sockfd, join_message,
+                                join_encode(&join, join_message), 0, addr,
+                                addr_len);
 
   if (bytes_sent == -1)
   {
@@ -264,142 +722,816 @@ static void send_init_message(int sockfd, const struct sockaddr *addr,
     exit(EXIT_FAILURE);
   }
 
-  printf("Sent INIT message\n");
+  printf("Sent JOIN message\n");
 }
 
-static void handle_init_message(const char *message)
+static void handle_welcome_message(const char *message, size_t length)
 {
-  char *endptr;
-  long int width;
-  long int height;
+  WelcomeMessage welcome;
 
-  char username[BUFFER_SIZE];
-  int i;
-  for (i = INIT_MESSAGE_PREFIX_LEN; message[i] != '|' && message[i] != '\0';
-       ++i)
+  if (welcome_decode(message, length, &welcome) == -1 ||
+      welcome.height > INT_MAX || welcome.width > INT_MAX)
   {
-    username[i - INIT_MESSAGE_PREFIX_LEN] = message[i];
+    fprintf(stderr, "Invalid WELCOME message\n");
+    return;
   }
 
-  username[i - INIT_MESSAGE_PREFIX_LEN] = '\0';
+  window.height = (int)welcome.height;
+  window.width = (int)welcome.width;
 
-  height = strtol(message + i + 1, &endptr, BASE_TEN);
+  // The stream's WELCOME only gives the world size.
+  if (!watching)
+  {
+    sprintf(name, "%s", welcome.username);
+    player_id = welcome.id;
+    session_token = welcome.token;
+    save_session_token();
+  }
 
-  if (*endptr != '|')
+  draw_boarder(screen_cols(), screen_rows());
+}
+
+static void load_session_token(void)
+{
+  FILE *file;
+
+  if (token_path == NULL)
   {
-    fprintf(stderr, "Invalid INIT message format\n");
     return;
   }
 
-  width = strtol(endptr + 1, &endptr, BASE_TEN);
+  file = fopen(token_path, "r");
 
-  if (*endptr != '\0')
+  // No file yet: this is our first run.
+  if (file == NULL)
   {
-    fprintf(stderr, "Invalid INIT message format\n");
     return;
   }
 
-  if ((height == LONG_MIN || height == LONG_MAX || width == LONG_MIN ||
-       width == LONG_MAX) &&
-      errno == ERANGE)
+  // NOLINTNEXTLINE(cert-err34-c,-warnings-as-errors)
+  if (fscanf(file, "%" SCNu64, &session_token) != 1)
+  {
+    session_token = 0;
+  }
+
+  fclose(file);
+}
+
+static void save_session_token(void)
+{
+  FILE *file;
+
+  if (token_path == NULL)
   {
-    fprintf(stderr, "Conversion error: out of range\n");
     return;
   }
 
-  if (height < INT_MIN || height > INT_MAX || width < INT_MIN ||
-      width > INT_MAX)
+  file = fopen(token_path, "w");
+
+  if (file == NULL)
   {
-    fprintf(stderr, "Conversion error: out of range for int\n");
+    perror("fopen");
     return;
   }
 
-  window.height = (int)height;
-  window.width = (int)width;
+  fprintf(file, "%" PRIu64 "\n", session_token);
 
-  sprintf(name, "%s", username);
-  draw_boarder(window.width, window.height);
+  if (fclose(file) == EOF)
+  {
+    perror("fclose");
+  }
 }
 
-static void handle_input(int sockfd, struct sockaddr *addr,
-                         socklen_t addr_len)
+static void handle_chunk_message(const char *message, size_t length)
 {
-  char input_buffer[BUFFER_SIZE];
-  ssize_t bytes_received;
+  char *endptr;
+  long cx;
+  long cy;
+  size_t header_len;
+  CachedChunk *slot;
 
-  bytes_received =
-      recvfrom(sockfd, input_buffer, sizeof(input_buffer), 0, addr, &addr_len);
+  cx = strtol(message + CHUNK_MESSAGE_PREFIX_LEN, &endptr, BASE_TEN);
 
-  if (bytes_received == -1)
+  if (*endptr != '|')
   {
-    perror("recvfrom");
-    exit(EXIT_FAILURE);
-  } else if (bytes_received == 0)
+    return;
+  }
+
+  cy = strtol(endptr + 1, &endptr, BASE_TEN);
+
+  if (*endptr != '|' || cx < 0 || cy < 0 || cx > INT_MAX || cy > INT_MAX)
   {
-    exit(EXIT_SUCCESS);
+    return;
   }
-  else
+
+  header_len = (size_t)(endptr + 1 - message);
+
+  if (length - header_len != WORLD_CHUNK_CELLS)
   {
-    input_buffer[bytes_received] = '\0';
+    fprintf(stderr, "Invalid CHUNK message length\n");
+    return;
+  }
 
-    if (strcmp(input_buffer, "QUIT") == 0)
-    {
-      exit_flag = 1;
-      return;
-    }
+  slot = chunk_slot((int)cx, (int)cy);
+  slot->valid = 1;
+  slot->cx = (int)cx;
+  slot->cy = (int)cy;
+  memcpy(slot->tiles, message + header_len, WORLD_CHUNK_CELLS);
 
+  render_view();
+}
 
-    if (strncmp(input_buffer, "INIT:", INIT_MESSAGE_PREFIX_LEN) == 0)
-    {
-      handle_init_message(input_buffer);
-    }
-    else
-    {
-      handle_position_change(input_buffer);
-    }
-  }
+static void handle_npc_message(const char *message)
+{
+  visible_npc_count = 0;
+  parse_npcs(message + NPC_MESSAGE_PREFIX_LEN);
+  render_view();
 }
 
-void handle_position_change(char *message)
+// The NPCs around (x, y) replace the ones we had there; those further out
+// stay where the last full list put them.
+static void handle_near_npc_message(const char *message)
 {
-  char *token;
-  char *rest;
+  char *endptr;
+  long x;
+  long y;
+  long radius;
+  int kept = 0;
 
-  int x;
-  int y;
+  x = strtol(message + NEAR_NPC_MESSAGE_PREFIX_LEN, &endptr, BASE_TEN);
 
-  for (int i = 1; i < window.width - 1; i++)
+  if (*endptr != ',')
   {
-    for (int j = 1; j < window.height - 1; j++)
-    {
-      mvprintw(j, i, " ");
-    }
+    return;
   }
 
-  token = strtok_r(message, "()", &rest);
-  while (token != NULL)
+  y = strtol(endptr + 1, &endptr, BASE_TEN);
+
+  if (*endptr != ',')
+  {
+    return;
+  }
+
+  radius = strtol(endptr + 1, &endptr, BASE_TEN);
+
+  if (*endptr != '|' || radius < 0)
   {
-    char username[BUFFER_SIZE];
+    return;
+  }
 
-    // NOLINTNEXTLINE(cert-err34-c,-warnings-as-errors)
-    if (sscanf(token, "%99[^,], %d, %d", username, &x, &y) == 3)
+  for (int i = 0; i < visible_npc_count; i++)
+  {
+    if (labs(visible_npcs[i].x - x) > radius ||
+        labs(visible_npcs[i].y - y) > radius)
     {
-      if (strcmp(name, username) == 0)
-      {
-        attron(COLOR_PAIR(0));
-        attron(A_BOLD);
-        place_dot(x, y);
-        attroff(A_BOLD);
-      }
-      else
-      {
-        attron(COLOR_PAIR(0));
-        place_dot(x, y);
-      }
+      visible_npcs[kept++] = visible_npcs[i];
     }
-
-    token = strtok_r(NULL, "()", &rest);
   }
+
+  visible_npc_count = kept;
+  parse_npcs(endptr + 1);
+  render_view();
+}
+
+// Appends the <x>,<y>,<state> entries of an NPC list.
+static void parse_npcs(const char *cursor)
+{
+  while (*cursor != '\0' && visible_npc_count < MAX_VISIBLE_NPCS)
+  {
+    char *endptr;
+    long x;
+    long y;
+    long state;
+
+    x = strtol(cursor, &endptr, BASE_TEN);
+
+    if (*endptr != ',')
+    {
+      break;
+    }
+
+    y = strtol(endptr + 1, &endptr, BASE_TEN);
+
+    if (*endptr != ',')
+    {
+      break;
+    }
+
+    state = strtol(endptr + 1, &endptr, BASE_TEN);
+
+    if (*endptr != ' ' || x < 0 || y < 0 || x > INT_MAX || y > INT_MAX)
+    {
+      break;
+    }
+
+    visible_npcs[visible_npc_count].x = (int)x;
+    visible_npcs[visible_npc_count].y = (int)y;
+    visible_npcs[visible_npc_count].state = (int)state;
+    visible_npc_count++;
+    cursor = endptr + 1;
+  }
+}
+
+// Our player walked into another zone; that server owns us from now on.
+static void handle_zone_message(const char *message,
+                                struct sockaddr_storage *addr)
+{
+  char host[INET6_ADDRSTRLEN];
+  unsigned int port;
+  struct sockaddr_storage zone_addr;
+  socklen_t zone_addr_len;
+
+  // NOLINTNEXTLINE(cert-err34-c,-warnings-as-errors)
+  if (sscanf(message, ZONE_MESSAGE_PREFIX "%45[^|]|%u", host, &port) != 2 ||
+      port > UINT16_MAX)
+  {
+    return;
+  }
+
+  convert_address(host, &zone_addr, &zone_addr_len);
+
+  // The socket was created for the original family; stay put otherwise.
+  if (zone_addr.ss_family != addr->ss_family)
+  {
+    return;
+  }
+
+  get_address_to_server(&zone_addr, (in_port_t)port);
+  *addr = zone_addr;
+
+  // A different server, with a clock and snapshot numbers of its own.
+  memset(&server_clock, 0, sizeof(server_clock));
+  memset(&snapshot, 0, sizeof(snapshot));
+  pong_sent_ns = 0;
+  next_ping_ns = 0;
+}
+
+static CachedChunk *chunk_slot(int cx, int cy)
+{
+  return &chunk_cache[((cy & CHUNK_CACHE_MASK) << CHUNK_CACHE_SHIFT) |
+                      (cx & CHUNK_CACHE_MASK)];
+}
+
+static void request_missing_chunks(int sockfd, const struct sockaddr *addr,
+                                   socklen_t addr_len)
+{
+  int x0;
+  int y0;
+  int cx0;
+  int cy0;
+  int cx1;
+  int cy1;
+  long now;
+
+  if (window.width == 0)
+  {
+    return;
+  }
+
+  x0 = local_x - (screen_cols() - 2) / 2;
+  y0 = local_y - (screen_rows() - 2) / 2;
+  cx0 = x0 < 0 ? 0 : x0 >> WORLD_CHUNK_SHIFT;
+  cy0 = y0 < 0 ? 0 : y0 >> WORLD_CHUNK_SHIFT;
+  cx1 = (x0 + screen_cols() - 3) >> WORLD_CHUNK_SHIFT;
+  cy1 = (y0 + screen_rows() - 3) >> WORLD_CHUNK_SHIFT;
+  cx1 = cx1 > (window.width - 1) >> WORLD_CHUNK_SHIFT
+            ? (window.width - 1) >> WORLD_CHUNK_SHIFT
+            : cx1;
+  cy1 = cy1 > (window.height - 1) >> WORLD_CHUNK_SHIFT
+            ? (window.height - 1) >> WORLD_CHUNK_SHIFT
+            : cy1;
+  now = monotonic_ms();
+
+  for (int cy = cy0; cy <= cy1; cy++)
+  {
+    for (int cx = cx0; cx <= cx1; cx++)
+    {
+      CachedChunk *slot = chunk_slot(cx, cy);
+      char request[BUFFER_SIZE];
+
+      if (slot->valid && slot->cx == cx && slot->cy == cy)
+      {
+        continue;
+      }
+
+      if (slot->requested_cx == cx && slot->requested_cy == cy &&
+          now - slot->requested_at < CHUNK_REQUEST_INTERVAL_MS)
+      {
+        continue;
+      }
+
+      slot->requested_cx = cx;
+      slot->requested_cy = cy;
+      slot->requested_at = now;
+
+      sprintf(request, CHUNK_REQUEST_PREFIX "%d|%d", cx, cy);
+
+      if (transport_sendto(sockfd, request, strlen(request), 0, addr,
+                           addr_len) == -1)
+      {
+        perror("sendto");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+}
+
+static void send_ping(int sockfd, const struct sockaddr *addr,
+                      socklen_t addr_len, uint64_t now)
+{
+  char message[PING_MESSAGE_SIZE];
+  PingMessage ping = {.seq = ++ping_seq,
+                      .sent = now,
+                      .echoed = pong_sent_ns,
+                      .held = pong_sent_ns != 0 ? now - pong_received_ns : 0,
+                      .token = session_token};
+
+  if (transport_sendto(sockfd, message, ping_encode(&ping, message), 0, addr,
+                       addr_len) == -1)
+  {
+    perror("sendto");
+    exit(EXIT_FAILURE);
+  }
+
+  next_ping_ns = now + (uint64_t)PING_INTERVAL_MS * NS_PER_MS;
+}
+
+static void handle_pong(const char *message, size_t length, uint64_t now)
+{
+  PongMessage pong;
+
+  if (pong_decode(message, length, &pong) == -1 || pong.sent > now)
+  {
+    return;
+  }
+
+  clock_sync_add(&server_clock, pong.sent, pong.received, pong.replied, now);
+  pong_sent_ns = pong.replied;
+  pong_received_ns = now;
+}
+
+// How long until the next PING is due, or -1 before we have joined.
+static int ping_timeout_ms(uint64_t now)
+{
+  if (window.width == 0 || watching)
+  {
+    return -1;
+  }
+
+  return next_ping_ns > now
+             ? (int)((next_ping_ns - now + NS_PER_MS - 1) / NS_PER_MS)
+             : 0;
+}
+
+static void render_view(void)
+{
+  int view_rows = screen_rows() - 2;
+  int view_cols = screen_cols() - 2;
+  int origin_x = local_x - view_cols / 2;
+  int origin_y = local_y - view_rows / 2;
+
+  if (window.width == 0)
+  {
+    return;
+  }
+
+  for (int row = 0; row < view_rows; row++)
+  {
+    int y = origin_y + row;
+
+    for (int col = 0; col < view_cols; col++)
+    {
+      int x = origin_x + col;
+      char tile = WORLD_TILE_VOID;
+
+      if (x >= 0 && y >= 0 && x < window.width && y < window.height)
+      {
+        const CachedChunk *slot =
+            chunk_slot(x >> WORLD_CHUNK_SHIFT, y >> WORLD_CHUNK_SHIFT);
+
+        if (slot->valid && slot->cx == x >> WORLD_CHUNK_SHIFT &&
+            slot->cy == y >> WORLD_CHUNK_SHIFT)
+        {
+          tile = slot->tiles[((y & WORLD_CHUNK_MASK) << WORLD_CHUNK_SHIFT) |
+                             (x & WORLD_CHUNK_MASK)];
+        }
+      }
+
+      screen_put(row + 1, col + 1, tile, SCREEN_NORMAL);
+    }
+  }
+
+  for (int i = 0; i < visible_npc_count; i++)
+  {
+    int col = visible_npcs[i].x - origin_x;
+    int row = visible_npcs[i].y - origin_y;
+
+    if (col < 0 || row < 0 || col >= view_cols || row >= view_rows)
+    {
+      continue;
+    }
+
+    // Hunters stand out; wanderers and the timid ones blend in.
+    screen_put(row + 1, col + 1,
+               visible_npcs[i].state == NPC_STATE_CHASE   ? 'X'
+               : visible_npcs[i].state == NPC_STATE_FLEE ? 'v'
+                                                         : 'x',
+               SCREEN_NORMAL);
+  }
+
+  for (int i = 0; i < player_count; i++)
+  {
+    int col = players[i].x - origin_x;
+    int row = players[i].y - origin_y;
+
+    if (col < 0 || row < 0 || col >= view_cols || row >= view_rows)
+    {
+      continue;
+    }
+
+    place_dot(col + 1, row + 1,
+              players[i].id == player_id && player_id != SNAPSHOT_NO_ID
+                  ? SCREEN_BOLD
+                  : SCREEN_NORMAL);
+  }
+
+  render_chat();
+  screen_present();
+}
+
+static void render_chat(void)
+{
+  int rows = screen_rows();
+  int cols = screen_cols();
+  unsigned shown = chat_lines < CHAT_LOG_LINES ? chat_lines : CHAT_LOG_LINES;
+
+  for (unsigned i = 0; i < shown && cols > 2; i++)
+  {
+    screen_print(rows - 1 - (int)(shown - i), 1, "%.*s", cols - 2,
+                 chat_log[(chat_lines - shown + i) % CHAT_LOG_LINES]);
+  }
+
+  // The line being typed sits on the bottom edge of the border.
+  for (int i = 1; i < cols - 1; i++)
+  {
+    screen_put(rows - 1, i, '-', SCREEN_NORMAL);
+  }
+
+  if (composing && cols > 4)
+  {
+    char line[CHAT_TEXT_MAX + sizeof(" say: _ ")];
+    int length = snprintf(line, sizeof(line), " say: %.*s_ ",
+                          (int)chat_draft_length, chat_draft);
+
+    // Keep the end of a line too long to show, where the typing is.
+    screen_print(rows - 1, 2, "%s",
+                 line + (length > cols - 4 ? length - (cols - 4) : 0));
+  }
+}
+
+static long monotonic_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (long)ts.tv_sec * MS_PER_SECOND + ts.tv_nsec / NS_PER_MS;
+}
+
+static void handle_input(int sockfd, struct sockaddr *addr,
+                         socklen_t addr_len)
+{
+  char input_buffer[BUFFER_SIZE];
+  ssize_t bytes_received;
+
+  bytes_received =
+      transport_recvfrom(sockfd, input_buffer, sizeof(input_buffer) - 1, 0,
+                         addr, &addr_len);
+
+  // Impaired: what arrived is still being held back. Shared memory: nothing
+  // left to read.
+  if (bytes_received == -1 && errno == EAGAIN)
+  {
+    return;
+  }
+
+  if (bytes_received == -1)
+  {
+    perror("recvfrom");
+    exit(EXIT_FAILURE);
+  } else if (bytes_received == 0)
+  {
+    exit(EXIT_SUCCESS);
+  }
+  else
+  {
+    input_buffer[bytes_received] = '\0';
+
+    if (strcmp(input_buffer, "QUIT") == 0)
+    {
+      exit_flag = 1;
+      return;
+    }
+
+    switch (message_type(input_buffer, (size_t)bytes_received))
+    {
+    case MESSAGE_WELCOME:
+      handle_welcome_message(input_buffer, (size_t)bytes_received);
+      break;
+    case MESSAGE_PONG:
+      handle_pong(input_buffer, (size_t)bytes_received, monotonic_ns());
+      break;
+    default:
+      handle_text_message(input_buffer, (size_t)bytes_received, addr);
+      break;
+    }
+
+    // The stream brings every chunk around in time; spectators never ask.
+    if (!watching)
+    {
+      request_missing_chunks(sockfd, addr, addr_len);
+    }
+  }
+}
+
+static void handle_text_message(char *input_buffer, size_t bytes_received,
+                                struct sockaddr *addr)
+{
+  if (strncmp(input_buffer, CHUNK_MESSAGE_PREFIX, CHUNK_MESSAGE_PREFIX_LEN) ==
+      0)
+  {
+    handle_chunk_message(input_buffer, bytes_received);
+  }
+  else if (strncmp(input_buffer, NPC_MESSAGE_PREFIX, NPC_MESSAGE_PREFIX_LEN) ==
+           0)
+  {
+    hud.snapshots++;
+    handle_npc_message(input_buffer);
+  }
+  else if (strncmp(input_buffer, NEAR_NPC_MESSAGE_PREFIX,
+                   NEAR_NPC_MESSAGE_PREFIX_LEN) == 0)
+  {
+    hud.snapshots++;
+    handle_near_npc_message(input_buffer);
+  }
+  else if (strncmp(input_buffer, ZONE_MESSAGE_PREFIX,
+                   ZONE_MESSAGE_PREFIX_LEN) == 0)
+  {
+    handle_zone_message(input_buffer, (struct sockaddr_storage *)addr);
+  }
+  else if (strcmp(input_buffer, CONFIRMATION_MESSAGE) == 0)
+  {
+    hud_record_confirmation(monotonic_ns());
+  }
+  else if (strncmp(input_buffer, FOR_MESSAGE_PREFIX, FOR_MESSAGE_PREFIX_LEN) ==
+           0)
+  {
+    handle_for_message(input_buffer);
+  }
+  else if (strncmp(input_buffer, SNAPSHOT_MESSAGE_PREFIX,
+                   SNAPSHOT_MESSAGE_PREFIX_LEN) == 0)
+  {
+    handle_snapshot_fragment(input_buffer, bytes_received);
+  }
+}
+
+static void handle_snapshot_fragment(const char *message, size_t length)
+{
+  unsigned long id;
+  unsigned long index;
+  unsigned long count;
+  char *end;
+  const char *part;
+  size_t part_length;
+  uint64_t started;
+
+  id = strtoul(message + SNAPSHOT_MESSAGE_PREFIX_LEN, &end, BASE_TEN);
+
+  if (*end != '|')
+  {
+    return;
+  }
+
+  index = strtoul(end + 1, &end, BASE_TEN);
+
+  if (*end != '|')
+  {
+    return;
+  }
+
+  count = strtoul(end + 1, &end, BASE_TEN);
+
+  if (*end != '|' || count == 0 || count > SNAPSHOT_MAX_FRAGMENTS ||
+      index >= count)
+  {
+    return;
+  }
+
+  part = end + 1;
+  part_length = length - (size_t)(part - message);
+
+  // Every fragment but the last is full.
+  if (part_length > SNAPSHOT_FRAGMENT_SIZE ||
+      (index + 1 < count && part_length != SNAPSHOT_FRAGMENT_SIZE))
+  {
+    return;
+  }
+
+  // Already drawn, or older than what was.
+  if (snapshot.drawn &&
+      snapshot.drawn_id - (uint32_t)id < SNAPSHOT_STALE_WINDOW)
+  {
+    return;
+  }
+
+  if (snapshot.count == 0 || snapshot.id != (uint32_t)id)
+  {
+    // A late fragment of a snapshot older than the one under way.
+    if (snapshot.count != 0 &&
+        snapshot.id - (uint32_t)id < SNAPSHOT_STALE_WINDOW)
+    {
+      return;
+    }
+
+    snapshot.id = (uint32_t)id;
+    snapshot.count = (uint32_t)count;
+    snapshot.received = 0;
+  }
+
+  if (snapshot.count != count)
+  {
+    return;
+  }
+
+  memcpy(snapshot.data + index * SNAPSHOT_FRAGMENT_SIZE, part, part_length);
+  snapshot.received |= 1U << index;
+
+  if (index + 1 == count)
+  {
+    snapshot.length = index * SNAPSHOT_FRAGMENT_SIZE + part_length;
+  }
+
+  if (snapshot.received != (1U << count) - 1)
+  {
+    return;
+  }
+
+  snapshot.data[snapshot.length] = '\0';
+  snapshot.count = 0;
+  snapshot.drawn = 1;
+  snapshot.drawn_id = snapshot.id;
+
+  started = monotonic_ns();
+  hud.snapshots++;
+  handle_position_change(snapshot.data, snapshot.length);
+  hud_record_render(monotonic_ns() - started);
+}
+
+void handle_position_change(char *message, size_t length)
+{
+  size_t positions_length;
+  int followed = -1;
+
+  player_count = snapshot_parse(message, length, players, MAX_PLAYERS,
+                                &positions_length);
+
+  // Chat said since the last snapshot follows the players.
+  if (positions_length < length)
+  {
+    handle_chat_lines(message + positions_length + 1);
+  }
+
+  for (int i = 0; i < player_count && player_id != SNAPSHOT_NO_ID; i++)
+  {
+    if (players[i].id == player_id)
+    {
+      followed = i;
+      local_x = players[i].x;
+      local_y = players[i].y;
+      break;
+    }
+  }
+
+  // Spectators follow the first player until told otherwise, and again
+  // when theirs leaves.
+  if (watching && followed == -1)
+  {
+    follow_next_player();
+    return;
+  }
+
+  render_view();
+}
+
+static void handle_chat_lines(char *lines)
+{
+  char *line;
+  char *rest;
+
+  for (line = strtok_r(lines, "\n", &rest); line != NULL;
+       line = strtok_r(NULL, "\n", &rest))
+  {
+    snprintf(chat_log[chat_lines % CHAT_LOG_LINES], CHAT_LINE_LENGTH, "%s",
+             line);
+    chat_lines++;
+  }
+}
+
+// Enter starts a line and sends it, and Backspace takes a character back;
+// an empty line is not sent.
+static void compose_chat(char c, int sockfd, const struct sockaddr *addr,
+                         socklen_t addr_len)
+{
+  char message[CHAT_MESSAGE_PREFIX_LEN + CHAT_TEXT_MAX];
+  int length;
+
+  if (c != '\r' && c != '\n')
+  {
+    if ((c == '\x7f' || c == '\b') && chat_draft_length > 0)
+    {
+      chat_draft_length--;
+    }
+    else if (c >= ' ' && c <= '~' && chat_draft_length < CHAT_TEXT_MAX - 1)
+    {
+      chat_draft[chat_draft_length++] = c;
+    }
+  }
+  else if (!composing)
+  {
+    composing = 1;
+    chat_draft_length = 0;
+  }
+  else
+  {
+    composing = 0;
+
+    if (chat_draft_length != 0)
+    {
+      length = snprintf(message, sizeof(message), CHAT_MESSAGE_PREFIX "%.*s",
+                        (int)chat_draft_length, chat_draft);
+
+      if (transport_sendto(sockfd, message, (size_t)length, 0, addr,
+                           addr_len) == -1)
+      {
+        perror("sendto");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  render_view();
+}
+
+// The spectator stream carries each player's NPCs; keep the followed one's.
+static void handle_for_message(const char *message)
+{
+  const char *separator = strchr(message + FOR_MESSAGE_PREFIX_LEN, '|');
+
+  if (separator == NULL ||
+      strlen(name) != (size_t)(separator - message - FOR_MESSAGE_PREFIX_LEN) ||
+      strncmp(name, message + FOR_MESSAGE_PREFIX_LEN, strlen(name)) != 0)
+  {
+    return;
+  }
+
+  if (strncmp(separator + 1, NPC_MESSAGE_PREFIX, NPC_MESSAGE_PREFIX_LEN) == 0)
+  {
+    hud.snapshots++;
+    handle_npc_message(separator + 1);
+  }
+}
+
+// Players shown from a neighbouring zone have no id to follow them by.
+static void follow_next_player(void)
+{
+  int current = -1;
+
+  for (int i = 0; i < player_count; i++)
+  {
+    if (players[i].id == player_id && player_id != SNAPSHOT_NO_ID)
+    {
+      current = i;
+    }
+  }
+
+  for (int step = 1; step <= player_count; step++)
+  {
+    const SnapshotPlayer *next =
+        &players[(current + step + player_count) % player_count];
+
+    if (next->id != SNAPSHOT_NO_ID)
+    {
+      // The stream's NPCs are addressed to players by name.
+      snprintf(name, sizeof(name), "%s", next->username);
+      player_id = next->id;
+      local_x = next->x;
+      local_y = next->y;
+      visible_npc_count = 0;
+      break;
+    }
+  }
+
+  render_view();
 }
 
 void enableRawMode(void)
@@ -415,7 +1547,8 @@ void read_from_keyboard(int sockfd, const struct sockaddr *addr,
 {
   char c;
   ssize_t bytes_sent;
-  char key_pressed[BUFFER_SIZE];
+  char message[MOVE_MESSAGE_SIZE];
+  MoveMessage move = {.direction = DIRECTION_COUNT, .sent = 0};
   read(STDIN_FILENO, &c, 1);
 
   if (c == '\x1b')
@@ -437,16 +1570,16 @@ void read_from_keyboard(int sockfd, const struct sockaddr *addr,
       switch (seq[1])
       {
       case 'A':
-        sprintf(key_pressed, "Up");
+        move.direction = DIRECTION_UP;
         break;
       case 'B':
-        sprintf(key_pressed, "Down");
+        move.direction = DIRECTION_DOWN;
         break;
       case 'C':
-        sprintf(key_pressed, "Right");
+        move.direction = DIRECTION_RIGHT;
         break;
       case 'D':
-        sprintf(key_pressed, "Left");
+        move.direction = DIRECTION_LEFT;
         break;
 
       default:
@@ -455,6 +1588,12 @@ void read_from_keyboard(int sockfd, const struct sockaddr *addr,
       }
     }
   }
+  // Typing a line of chat; the arrow keys above still move meanwhile.
+  else if (!watching && (composing || c == '\r' || c == '\n'))
+  {
+    compose_chat(c, sockfd, addr, addr_len);
+    return;
+  }
   else
   {
     if (c == 'q')
@@ -462,19 +1601,46 @@ void read_from_keyboard(int sockfd, const struct sockaddr *addr,
       exit_flag = 1;
       return;
     }
-    sprintf(key_pressed, "Key pressed: %c", c);
+  }
+
+  // Spectators only watch; the one key besides q picks whom to follow.
+  if (watching)
+  {
+    if (c == 'n')
+    {
+      follow_next_player();
+    }
+
+    return;
+  }
+
+  // Only the arrow keys move.
+  if (move.direction == DIRECTION_COUNT)
+  {
+    return;
   }
 
   fflush(stdout);
 
-  bytes_sent =
-      sendto(sockfd, key_pressed, strlen(key_pressed), 0, addr, addr_len);
+  // Stamp the input with when it left, on the server's clock.
+  if (server_clock.count != 0)
+  {
+    move.sent = monotonic_ns() + (uint64_t)server_clock.offset_ns;
+  }
+
+  move.seq = ++move_seq;
+  move.token = session_token;
+
+  bytes_sent = transport_sendto(sockfd, message, move_encode(&move, message),
+                                0, addr, addr_len);
 
   if (bytes_sent == -1)
   {
     perror("sendto");
     exit(EXIT_FAILURE);
   }
+
+  hud_record_input(monotonic_ns());
 }
 
 static void send_quit_message(int sockfd, const struct sockaddr *addr,
@@ -484,7 +1650,8 @@ static void send_quit_message(int sockfd, const struct sockaddr *addr,
   ssize_t bytes_sent;
 
   bytes_sent =
-      sendto(sockfd, quit_message, strlen(quit_message), 0, addr, addr_len);
+      transport_sendto(sockfd, quit_message, strlen(quit_message), 0, addr,
+                       addr_len);
 
   if (bytes_sent == -1)
   {
@@ -493,17 +1660,86 @@ static void send_quit_message(int sockfd, const struct sockaddr *addr,
   }
 }
 
-static void parse_arguments(int argc, char *argv[], char **address,
-                            char **port_str)
+static void parse_arguments(int argc, char *argv[], ClientOptions *options)
 {
-  if (argc != 3)
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hsr:I:R:w:S:T:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'r':
+    {
+      char *endptr;
+      long room_id;
+
+      errno = 0;
+      room_id = strtol(optarg, &endptr, BASE_TEN);
+
+      if (errno != 0 || *endptr != '\0' || room_id < 0 ||
+          room_id > MAX_ROOM_ID)
+      {
+        usage(argv[0], EXIT_FAILURE, "Invalid room number.");
+      }
+
+      options->room_id = (int)room_id;
+      break;
+    }
+    case 's':
+      options->show_hud = 1;
+      break;
+    case 'I':
+      options->impairment = optarg;
+      break;
+    case 'R':
+      if (strcmp(optarg, "ansi") == 0)
+      {
+        options->renderer = SCREEN_ANSI;
+      }
+      else if (strcmp(optarg, "ncurses") == 0)
+      {
+        options->renderer = SCREEN_NCURSES;
+      }
+      else
+      {
+        usage(argv[0], EXIT_FAILURE, "Unknown renderer.");
+      }
+      break;
+    case 'w':
+      options->watch_interface = optarg;
+      break;
+    case 'S':
+      options->shm_name = optarg;
+      break;
+    case 'T':
+      options->token_path = optarg;
+      break;
+    case 'h':
+      usage(argv[0], EXIT_SUCCESS, NULL);
+    default:
+      usage(argv[0], EXIT_FAILURE, NULL);
+    }
+  }
+
+  if (options->shm_name != NULL)
+  {
+    if (options->watch_interface != NULL || argc != optind)
+    {
+      usage(argv[0], EXIT_FAILURE,
+            "-S takes the place of the address and port, and cannot watch.");
+    }
+
+    return;
+  }
+
+  if (argc - optind != 2)
   {
     fprintf(stderr, "Usage: %s <server_address> <port>\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  *address = argv[1];
-  *port_str = argv[2];
+  options->address = argv[optind];
+  options->port_str = argv[optind + 1];
 }
 
 static void handle_arguments(const char *binary_name, const char *address,
@@ -557,9 +1793,33 @@ _Noreturn static void usage(const char *program_name, int exit_code,
     fprintf(stderr, "%s\n", message);
   }
 
-  fprintf(stderr, "Usage: %s [-h] <address> <port> <message>\n", program_name);
+  fprintf(stderr,
+          "Usage: %s [-h] [-s] [-r room] [-I impairment] [-R renderer] "
+          "[-T file] [-w interface] <address> <port> | -S name\n",
+          program_name);
   fputs("Options:\n", stderr);
   fputs("  -h  Display this help message\n", stderr);
+  fputs("  -s  Show round trip, update rate and render stats on the top "
+        "border\n",
+        stderr);
+  fputs("  -r  Room to join (default: 0)\n", stderr);
+  fputs("  -I  Impair traffic for testing, e.g. "
+        "delay=40,jitter=10,loss=2,dup=1,reorder=5,seed=7\n",
+        stderr);
+  fputs("  -R  Draw with ncurses or ansi, a diffing renderer that needs no "
+        "curses (default: ncurses)\n",
+        stderr);
+  fputs("  -T  Keep the session's token in this file, so that a restarted "
+        "client\n      takes its player back\n",
+        stderr);
+  fputs("  -w  Watch instead of playing: join the server's spectator stream, "
+        "whose\n      multicast group and base port are then the address and "
+        "port, on the\n      interface with this address; n follows the next "
+        "player\n",
+        stderr);
+  fputs("  -S  Connect through the shared memory of a server on this host "
+        "started with\n      the same -S name, instead of UDP\n",
+        stderr);
   exit(exit_code);
 }
 
@@ -625,7 +1885,7 @@ static void get_address_to_server(struct sockaddr_storage *addr,
 
 static void socket_close(int sockfd)
 {
-  if (close(sockfd) == -1)
+  if (transport_close(sockfd) == -1)
   {
     perror("Error closing socket");
     exit(EXIT_FAILURE);
@@ -0,0 +1,64 @@
+#ifndef TG_CLOCKSYNC_H
+#define TG_CLOCKSYNC_H
+
+#include <stdint.h>
+
+/*
+ * NTP-style estimate of another host's monotonic clock. Every exchange gives
+ * four timestamps: t0 (we send) and t3 (we receive) on our clock, t1 (they
+ * receive) and t2 (they reply) on theirs. Then
+ *
+ *   rtt    = (t3 - t0) - (t2 - t1)
+ *   offset = ((t1 - t0) + (t2 - t3)) / 2     their clock minus ours
+ *
+ * The offset is only exact when both directions take equally long, and the
+ * samples with the shortest round trip are the least skewed by queueing, so
+ * the estimate is the offset of the fastest of the last few exchanges.
+ */
+
+#define CLOCK_SYNC_SAMPLES 8
+
+typedef struct
+{
+  uint64_t rtt_ns;
+  int64_t offset_ns;
+} ClockSample;
+
+typedef struct
+{
+  ClockSample samples[CLOCK_SYNC_SAMPLES];
+  unsigned int next;
+  unsigned int count;
+  // Latest round trip, and the offset picked from the window.
+  uint64_t rtt_ns;
+  int64_t offset_ns;
+} ClockSync;
+
+static inline void clock_sync_add(ClockSync *sync, uint64_t t0, uint64_t t1,
+                                  uint64_t t2, uint64_t t3)
+{
+  uint64_t elapsed = t3 - t0;
+  uint64_t held = t2 - t1;
+  const ClockSample *best;
+
+  sync->rtt_ns = elapsed > held ? elapsed - held : 0;
+  sync->samples[sync->next].rtt_ns = sync->rtt_ns;
+  sync->samples[sync->next].offset_ns =
+      ((int64_t)(t1 - t0) + (int64_t)(t2 - t3)) / 2;
+  sync->next = (sync->next + 1) % CLOCK_SYNC_SAMPLES;
+  sync->count += sync->count < CLOCK_SYNC_SAMPLES;
+
+  best = &sync->samples[0];
+
+  for (unsigned int i = 1; i < sync->count; i++)
+  {
+    if (sync->samples[i].rtt_ns < best->rtt_ns)
+    {
+      best = &sync->samples[i];
+    }
+  }
+
+  sync->offset_ns = best->offset_ns;
+}
+
+#endif
@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "handover.h"
+
+static int handover_address(const char *path, struct sockaddr_un *addr);
+
+int handover_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (handover_address(path, &addr) == -1)
+  {
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd == -1)
+  {
+    perror("handover socket");
+    return -1;
+  }
+
+  // A predecessor's socket file may still be there; we replace it.
+  unlink(path);
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, 1) == -1)
+  {
+    perror("handover bind");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int handover_send(int listen_fd, const int *fds, int count)
+{
+  char control[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+  struct msghdr message;
+  struct cmsghdr *header;
+  struct iovec iov;
+  unsigned char fd_count = (unsigned char)count;
+  int conn_fd;
+  ssize_t sent;
+
+  conn_fd = accept(listen_fd, NULL, NULL);
+
+  if (conn_fd == -1)
+  {
+    perror("handover accept");
+    return -1;
+  }
+
+  memset(&message, 0, sizeof(message));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = &fd_count;
+  iov.iov_len = sizeof(fd_count);
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)count);
+
+  header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)count);
+  memcpy(CMSG_DATA(header), fds, sizeof(int) * (size_t)count);
+
+  sent = sendmsg(conn_fd, &message, 0);
+  close(conn_fd);
+
+  if (sent == -1)
+  {
+    perror("handover sendmsg");
+    return -1;
+  }
+
+  return 0;
+}
+
+int handover_receive(const char *path, int *fds, int max_fds)
+{
+  char control[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+  struct sockaddr_un addr;
+  struct msghdr message;
+  struct cmsghdr *header;
+  struct iovec iov;
+  unsigned char fd_count;
+  int fd;
+  int received;
+
+  if (handover_address(path, &addr) == -1)
+  {
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd == -1)
+  {
+    perror("handover socket");
+    return -1;
+  }
+
+  // Nobody listening just means there is no server to take over from.
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+  {
+    int saved_errno = errno;
+
+    close(fd);
+
+    if (saved_errno == ENOENT || saved_errno == ECONNREFUSED)
+    {
+      return 0;
+    }
+
+    errno = saved_errno;
+    perror("handover connect");
+    return -1;
+  }
+
+  memset(&message, 0, sizeof(message));
+  iov.iov_base = &fd_count;
+  iov.iov_len = sizeof(fd_count);
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  if (recvmsg(fd, &message, MSG_CMSG_CLOEXEC) <= 0)
+  {
+    perror("handover recvmsg");
+    close(fd);
+    return -1;
+  }
+
+  close(fd);
+  header = CMSG_FIRSTHDR(&message);
+
+  if (header == NULL || header->cmsg_level != SOL_SOCKET ||
+      header->cmsg_type != SCM_RIGHTS)
+  {
+    fprintf(stderr, "handover: no sockets received\n");
+    return -1;
+  }
+
+  received = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+
+  if (received > max_fds)
+  {
+    fprintf(stderr, "handover: %d sockets sent, expected at most %d\n",
+            received, max_fds);
+    return -1;
+  }
+
+  memcpy(fds, CMSG_DATA(header), sizeof(int) * (size_t)received);
+
+  return received;
+}
+
+static int handover_address(const char *path, struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr->sun_path))
+  {
+    fprintf(stderr, "%s: handover socket path too long\n", path);
+    return -1;
+  }
+
+  strcpy(addr->sun_path, path);
+
+  return 0;
+}
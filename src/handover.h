@@ -0,0 +1,17 @@
+#ifndef TG_HANDOVER_H
+#define TG_HANDOVER_H
+
+/*
+ * Hot restart: a running server listens on a unix socket, and a new server
+ * started with the same path connects to it and is sent the old process's
+ * bound sockets over SCM_RIGHTS. Datagrams queued on those sockets in the
+ * meantime are simply read by the new process.
+ */
+
+#define HANDOVER_MAX_FDS 4
+
+int handover_listen(const char *path);
+int handover_send(int listen_fd, const int *fds, int count);
+int handover_receive(const char *path, int *fds, int max_fds);
+
+#endif
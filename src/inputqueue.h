@@ -0,0 +1,159 @@
+#ifndef TG_INPUTQUEUE_H
+#define TG_INPUTQUEUE_H
+
+#include <stdint.h>
+
+/*
+ * A session's moves, waiting for the ticks that apply them one at a time.
+ * Clients number their moves, and the queue files them by that number: a
+ * move that arrives twice, or after a later one was applied, is dropped,
+ * and moves that arrive out of order come out in order.
+ *
+ * How many moves the queue collects before it starts draining follows the
+ * session's jitter, estimated as RFC 3550 does from the transit times of
+ * timestamped moves. Moves on a steady link are applied on the next tick;
+ * on a jittery one they are held back just long enough that a bunch that
+ * arrives together still comes out one per tick. A move that never arrives
+ * is given up on once the moves behind it fill that depth, and a session
+ * that sends faster than a move a tick loses its oldest moves rather than
+ * falling ever further behind.
+ */
+
+#define INPUT_QUEUE_CAPACITY 8
+#define INPUT_QUEUE_MAX_DEPTH 4
+// Moves beyond the depth a session may have queued before the oldest go.
+#define INPUT_QUEUE_SLACK 2
+
+typedef struct
+{
+  uint8_t directions[INPUT_QUEUE_CAPACITY];
+  // Bit s is set while directions[s] holds a move.
+  uint32_t present;
+  // The move to apply next; 0 until the first one arrives.
+  uint32_t next_seq;
+  int count;
+  int draining;
+  uint64_t jitter_ns;
+  int64_t last_transit_ns;
+  uint32_t late;
+  uint32_t duplicates;
+  uint32_t lost;
+  uint32_t overrun;
+} InputQueue;
+
+// sent is the move's timestamp on our clock, or 0 if it has none. Returns
+// -1 for a move that is dropped.
+static inline int input_queue_push(InputQueue *queue, uint32_t seq,
+                                   uint8_t direction, uint64_t sent,
+                                   uint64_t received_ns)
+{
+  int32_t ahead = (int32_t)(seq - queue->next_seq);
+  uint32_t slot = seq % INPUT_QUEUE_CAPACITY;
+
+  // The session's first move, or one from far ahead of the rest, such as
+  // after a burst of loss: start over from it.
+  if (queue->next_seq == 0 || ahead >= INPUT_QUEUE_CAPACITY)
+  {
+    queue->next_seq = seq;
+    queue->present = 0;
+    queue->count = 0;
+    queue->draining = 0;
+  }
+  else if (ahead < 0)
+  {
+    queue->late++;
+    return -1;
+  }
+
+  if (queue->present & (1U << slot))
+  {
+    queue->duplicates++;
+    return -1;
+  }
+
+  queue->directions[slot] = direction;
+  queue->present |= 1U << slot;
+  queue->count++;
+
+  if (sent != 0)
+  {
+    int64_t transit = (int64_t)(received_ns - sent);
+    int64_t change = transit - queue->last_transit_ns;
+
+    if (queue->last_transit_ns != 0)
+    {
+      change = change < 0 ? -change : change;
+      queue->jitter_ns = (uint64_t)((int64_t)queue->jitter_ns +
+                                    (change - (int64_t)queue->jitter_ns) / 16);
+    }
+
+    queue->last_transit_ns = transit;
+  }
+
+  return 0;
+}
+
+// Ticks' worth of moves to collect before draining: enough to cover twice
+// the jitter.
+static inline int input_queue_depth(const InputQueue *queue, uint64_t tick_ns)
+{
+  uint64_t depth = (2 * queue->jitter_ns + tick_ns - 1) / tick_ns;
+
+  return depth < INPUT_QUEUE_MAX_DEPTH ? (int)depth : INPUT_QUEUE_MAX_DEPTH;
+}
+
+// Called once a tick; returns whether a move is due, and which.
+static inline int input_queue_pop(InputQueue *queue, uint64_t tick_ns,
+                                  uint8_t *direction)
+{
+  int depth = input_queue_depth(queue, tick_ns);
+  uint32_t slot;
+
+  if (queue->count == 0)
+  {
+    queue->draining = 0;
+    return 0;
+  }
+
+  if (!queue->draining && queue->count <= depth)
+  {
+    return 0;
+  }
+
+  queue->draining = 1;
+  slot = queue->next_seq % INPUT_QUEUE_CAPACITY;
+
+  // Wait for a missing move while there is room, then go on without it.
+  // Past the slack, drop whole moves too.
+  while (!(queue->present & (1U << slot)) ||
+         queue->count > depth + INPUT_QUEUE_SLACK)
+  {
+    if (!(queue->present & (1U << slot)))
+    {
+      if (queue->count <= depth)
+      {
+        return 0;
+      }
+
+      queue->lost++;
+    }
+    else
+    {
+      queue->present &= ~(1U << slot);
+      queue->count--;
+      queue->overrun++;
+    }
+
+    queue->next_seq++;
+    slot = queue->next_seq % INPUT_QUEUE_CAPACITY;
+  }
+
+  *direction = queue->directions[slot];
+  queue->present &= ~(1U << slot);
+  queue->count--;
+  queue->next_seq++;
+
+  return 1;
+}
+
+#endif
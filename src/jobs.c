@@ -0,0 +1,478 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jobs.h"
+
+#define DEQUE_CAPACITY 1024
+#define DEQUE_MASK (DEQUE_CAPACITY - 1)
+#define IDLE_SPINS 64
+
+typedef struct JobGroup JobGroup;
+
+typedef struct Job
+{
+  JobGroup *group;
+  size_t begin;
+  size_t end;
+  struct Job *next;
+} Job;
+
+struct JobGroup
+{
+  JobFunction function;
+  void *context;
+  size_t grain;
+  Job *jobs;
+  atomic_size_t jobs_used;
+  atomic_size_t remaining;
+};
+
+typedef struct
+{
+  atomic_long top;
+  atomic_long bottom;
+  _Atomic(Job *) slots[DEQUE_CAPACITY];
+} JobDeque;
+
+typedef struct
+{
+  JobPool *pool;
+  int index;
+  unsigned int steal_seed;
+  pthread_t thread;
+  JobDeque deque;
+} Worker;
+
+struct JobPool
+{
+  int worker_count;
+  Worker *workers;
+  atomic_int stop;
+
+  pthread_mutex_t inject_lock;
+  Job *inject_head;
+  Job *inject_tail;
+  atomic_int inject_count;
+
+  pthread_mutex_t sleep_lock;
+  pthread_cond_t sleep_cond;
+  atomic_uint epoch;
+  atomic_int sleeping;
+};
+
+static void *worker_main(void *arg);
+static int deque_push(JobDeque *deque, Job *job);
+static Job *deque_pop(JobDeque *deque);
+static Job *deque_steal(JobDeque *deque);
+static void inject_push(JobPool *pool, Job *job);
+static Job *inject_pop(JobPool *pool);
+static Job *find_job(JobPool *pool, Worker *self, unsigned int *seed);
+static void run_job(JobPool *pool, Worker *self, Job *job);
+static void wake_workers(JobPool *pool);
+
+static _Thread_local Worker *current_worker;
+
+JobPool *job_pool_create(int worker_count)
+{
+  JobPool *pool;
+
+  if (worker_count < 1)
+  {
+    worker_count = 1;
+  }
+
+  pool = calloc(1, sizeof(*pool));
+
+  if (pool == NULL)
+  {
+    perror("calloc");
+    return NULL;
+  }
+
+  pool->workers = calloc((size_t)worker_count, sizeof(*pool->workers));
+
+  if (pool->workers == NULL)
+  {
+    perror("calloc");
+    free(pool);
+    return NULL;
+  }
+
+  pool->worker_count = worker_count;
+  pthread_mutex_init(&pool->inject_lock, NULL);
+  pthread_mutex_init(&pool->sleep_lock, NULL);
+  pthread_cond_init(&pool->sleep_cond, NULL);
+
+  for (int i = 0; i < worker_count; i++)
+  {
+    Worker *worker = &pool->workers[i];
+
+    worker->pool = pool;
+    worker->index = i;
+    worker->steal_seed = (unsigned int)i * 2654435761U + 1;
+
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+    {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return pool;
+}
+
+void job_pool_destroy(JobPool *pool)
+{
+  if (pool == NULL)
+  {
+    return;
+  }
+
+  atomic_store(&pool->stop, 1);
+  wake_workers(pool);
+
+  for (int i = 0; i < pool->worker_count; i++)
+  {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+
+  pthread_cond_destroy(&pool->sleep_cond);
+  pthread_mutex_destroy(&pool->sleep_lock);
+  pthread_mutex_destroy(&pool->inject_lock);
+  free(pool->workers);
+  free(pool);
+}
+
+int job_pool_worker_count(const JobPool *pool) { return pool->worker_count; }
+
+void job_pool_parallel_for(JobPool *pool, size_t count, size_t grain,
+                           JobFunction function, void *context)
+{
+  JobGroup group;
+  size_t max_jobs;
+  unsigned int seed;
+
+  if (count == 0)
+  {
+    return;
+  }
+
+  if (grain == 0)
+  {
+    grain = 1;
+  }
+
+  // Splits stay on grain boundaries, so there is at most one job per grain.
+  max_jobs = (count + grain - 1) / grain;
+
+  group.function = function;
+  group.context = context;
+  group.grain = grain;
+  group.jobs = malloc(max_jobs * sizeof(*group.jobs));
+  atomic_init(&group.jobs_used, 1);
+  atomic_init(&group.remaining, count);
+
+  if (group.jobs == NULL)
+  {
+    function(context, 0, count);
+    return;
+  }
+
+  group.jobs[0].group = &group;
+  group.jobs[0].begin = 0;
+  group.jobs[0].end = count;
+
+  if (current_worker != NULL)
+  {
+    if (deque_push(&current_worker->deque, &group.jobs[0]) == -1)
+    {
+      inject_push(pool, &group.jobs[0]);
+    }
+  }
+  else
+  {
+    inject_push(pool, &group.jobs[0]);
+  }
+
+  wake_workers(pool);
+
+  // Help out until every item of this range has been processed.
+  seed = (unsigned int)(size_t)&group;
+
+  while (atomic_load(&group.remaining) != 0)
+  {
+    Job *job = find_job(pool, current_worker, &seed);
+
+    if (job != NULL)
+    {
+      run_job(pool, current_worker, job);
+    }
+    else
+    {
+      sched_yield();
+    }
+  }
+
+  free(group.jobs);
+}
+
+static void *worker_main(void *arg)
+{
+  Worker *self = arg;
+  JobPool *pool = self->pool;
+
+  current_worker = self;
+
+  while (!atomic_load(&pool->stop))
+  {
+    unsigned int epoch = atomic_load(&pool->epoch);
+    Job *job = NULL;
+
+    for (int spin = 0; spin < IDLE_SPINS && job == NULL; spin++)
+    {
+      job = find_job(pool, self, &self->steal_seed);
+    }
+
+    if (job != NULL)
+    {
+      run_job(pool, self, job);
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->sleep_lock);
+    atomic_fetch_add(&pool->sleeping, 1);
+
+    while (atomic_load(&pool->epoch) == epoch && !atomic_load(&pool->stop))
+    {
+      pthread_cond_wait(&pool->sleep_cond, &pool->sleep_lock);
+    }
+
+    atomic_fetch_sub(&pool->sleeping, 1);
+    pthread_mutex_unlock(&pool->sleep_lock);
+  }
+
+  return NULL;
+}
+
+static void run_job(JobPool *pool, Worker *self, Job *job)
+{
+  JobGroup *group = job->group;
+  size_t begin = job->begin;
+  size_t end = job->end;
+  int pushed = 0;
+
+  // Keep the lower half, offer the upper half to thieves.
+  while (end - begin >= 2 * group->grain)
+  {
+    size_t half = (end - begin) / group->grain / 2 * group->grain;
+    size_t index = atomic_fetch_add(&group->jobs_used, 1);
+    Job *split = &group->jobs[index];
+
+    split->group = group;
+    split->begin = begin + half;
+    split->end = end;
+
+    if (self != NULL)
+    {
+      if (deque_push(&self->deque, split) == -1)
+      {
+        inject_push(pool, split);
+      }
+    }
+    else
+    {
+      inject_push(pool, split);
+    }
+
+    end = begin + half;
+    pushed = 1;
+  }
+
+  if (pushed)
+  {
+    wake_workers(pool);
+  }
+
+  group->function(group->context, begin, end);
+
+  // The group may be released by its owner as soon as this hits zero.
+  atomic_fetch_sub(&group->remaining, end - begin);
+}
+
+static Job *find_job(JobPool *pool, Worker *self, unsigned int *seed)
+{
+  Job *job;
+  int start;
+
+  if (self != NULL && (job = deque_pop(&self->deque)) != NULL)
+  {
+    return job;
+  }
+
+  if (atomic_load_explicit(&pool->inject_count, memory_order_relaxed) > 0 &&
+      (job = inject_pop(pool)) != NULL)
+  {
+    return job;
+  }
+
+  *seed = *seed * 1103515245U + 12345U;
+  start = (int)((*seed >> 16) % (unsigned int)pool->worker_count);
+
+  for (int i = 0; i < pool->worker_count; i++)
+  {
+    Worker *victim = &pool->workers[(start + i) % pool->worker_count];
+
+    if (victim == self)
+    {
+      continue;
+    }
+
+    if ((job = deque_steal(&victim->deque)) != NULL)
+    {
+      return job;
+    }
+  }
+
+  return NULL;
+}
+
+static void wake_workers(JobPool *pool)
+{
+  atomic_fetch_add(&pool->epoch, 1);
+
+  if (atomic_load(&pool->sleeping) > 0)
+  {
+    pthread_mutex_lock(&pool->sleep_lock);
+    pthread_cond_broadcast(&pool->sleep_cond);
+    pthread_mutex_unlock(&pool->sleep_lock);
+  }
+}
+
+static void inject_push(JobPool *pool, Job *job)
+{
+  job->next = NULL;
+
+  pthread_mutex_lock(&pool->inject_lock);
+
+  if (pool->inject_tail != NULL)
+  {
+    pool->inject_tail->next = job;
+  }
+  else
+  {
+    pool->inject_head = job;
+  }
+
+  pool->inject_tail = job;
+  atomic_fetch_add(&pool->inject_count, 1);
+  pthread_mutex_unlock(&pool->inject_lock);
+}
+
+static Job *inject_pop(JobPool *pool)
+{
+  Job *job;
+
+  pthread_mutex_lock(&pool->inject_lock);
+  job = pool->inject_head;
+
+  if (job != NULL)
+  {
+    pool->inject_head = job->next;
+
+    if (pool->inject_head == NULL)
+    {
+      pool->inject_tail = NULL;
+    }
+
+    atomic_fetch_sub(&pool->inject_count, 1);
+  }
+
+  pthread_mutex_unlock(&pool->inject_lock);
+
+  return job;
+}
+
+// Chase-Lev deque, following "Correct and Efficient Work-Stealing for Weak
+// Memory Models" (Le et al., PPoPP 2013), with a fixed-size ring.
+static int deque_push(JobDeque *deque, Job *job)
+{
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+  if (bottom - top >= DEQUE_CAPACITY)
+  {
+    return -1;
+  }
+
+  atomic_store_explicit(&deque->slots[bottom & DEQUE_MASK], job,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+
+  return 0;
+}
+
+static Job *deque_pop(JobDeque *deque)
+{
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  long top;
+  Job *job;
+
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (top > bottom)
+  {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  job = atomic_load_explicit(&deque->slots[bottom & DEQUE_MASK],
+                             memory_order_relaxed);
+
+  if (top == bottom)
+  {
+    // Last item: race any thief for it.
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+    {
+      job = NULL;
+    }
+
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+
+  return job;
+}
+
+static Job *deque_steal(JobDeque *deque)
+{
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  long bottom;
+  Job *job;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+  if (top >= bottom)
+  {
+    return NULL;
+  }
+
+  job = atomic_load_explicit(&deque->slots[top & DEQUE_MASK],
+                             memory_order_relaxed);
+
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed))
+  {
+    return NULL;
+  }
+
+  return job;
+}
@@ -0,0 +1,24 @@
+#ifndef TG_JOBS_H
+#define TG_JOBS_H
+
+#include <stddef.h>
+
+/*
+ * Work-stealing thread pool. Each worker owns a Chase-Lev deque; a
+ * parallel_for splits its range in halves, pushing the upper half onto the
+ * local deque so idle workers can steal it. Threads that are not workers
+ * submit through a shared injection queue and help until their range is
+ * done.
+ */
+
+typedef void (*JobFunction)(void *context, size_t begin, size_t end);
+
+typedef struct JobPool JobPool;
+
+JobPool *job_pool_create(int worker_count);
+void job_pool_destroy(JobPool *pool);
+int job_pool_worker_count(const JobPool *pool);
+void job_pool_parallel_for(JobPool *pool, size_t count, size_t grain,
+                           JobFunction function, void *context);
+
+#endif
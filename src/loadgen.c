@@ -0,0 +1,655 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "protocol.h"
+#include "schema.h"
+#include "transport.h"
+
+/*
+ * Scripted players for benchmarks and PGO training. Each bot joins like the
+ * client does, walks at random at about a held key's repeat rate, pings
+ * twice a second and times every move until the server confirms it. A run
+ * has a fixed length and a fixed seed, so the server sees the same work
+ * every time.
+ */
+
+typedef struct
+{
+  char *address;
+  char *port_str;
+  char *shm_name;
+  int bot_count;
+  int room_count;
+  int seconds;
+  int moves_per_second;
+  int chats_per_second;
+  unsigned int seed;
+} LoadgenOptions;
+
+typedef struct
+{
+  int sockfd;
+  int room_id;
+  int joined;
+  unsigned int seed;
+  uint64_t next_init_ns;
+  uint64_t next_move_ns;
+  uint64_t next_ping_ns;
+  uint64_t next_chat_ns;
+  // When the oldest move not yet confirmed was sent, or 0.
+  uint64_t move_sent_ns;
+  uint32_t ping_seq;
+  uint32_t move_seq;
+  uint64_t token;
+} Bot;
+
+typedef struct
+{
+  uint64_t moves;
+  uint64_t confirmed;
+  uint64_t pings;
+  uint64_t pongs;
+  uint64_t chats;
+  uint64_t chats_heard;
+  uint64_t datagrams;
+  uint64_t bytes;
+} LoadStats;
+
+static void parse_arguments(int argc, char *argv[], LoadgenOptions *options);
+static int parse_int(const char *binary_name, const char *str, int max);
+static in_port_t parse_in_port_t(const char *binary_name, const char *str);
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message);
+static void convert_address(const char *address, in_port_t port,
+                            struct sockaddr_storage *addr,
+                            socklen_t *addr_len);
+static int socket_create(int domain, int type, int protocol);
+
+static void setup_signal_handler(void);
+static void sigint_handler(int signum);
+
+static void start_bots(const LoadgenOptions *options);
+static void run_bot(Bot *bot, uint64_t now, const LoadgenOptions *options);
+static void receive_all(Bot *bot, uint64_t now);
+static void send_message(const Bot *bot, const char *message, size_t length);
+static uint64_t next_interval_ns(Bot *bot, int per_second);
+static void record_rtt(uint64_t elapsed);
+static int compare_u32(const void *a, const void *b);
+static void report(const LoadgenOptions *options, uint64_t elapsed);
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t exit_flag = 0;
+
+#define BUFFER_SIZE 2048
+#define BASE_TEN 10
+#define MAX_BOTS 1024
+#define MAX_ROOMS 4096
+#define MAX_SECONDS 3600
+#define MAX_RTT_SAMPLES 1000000
+#define INIT_RETRY_MS 1000
+#define PING_INTERVAL_MS 500
+#define MOVE_TIMEOUT_MS 1000
+#define DEFAULT_BOTS 32
+#define DEFAULT_SECONDS 10
+#define DEFAULT_MOVES_PER_SECOND 20
+#define BOT_VIEW_ROWS 40
+#define BOT_VIEW_COLS 120
+#define PERCENTILE_50 50
+#define PERCENTILE_99 99
+#define PERCENT 100
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+Bot bots[MAX_BOTS];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int bot_count;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+struct sockaddr_storage server_addr;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+socklen_t server_addr_len;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+LoadStats load_stats;
+
+// Move round trips in microseconds, kept whole for exact percentiles.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint32_t *rtt_samples;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+size_t rtt_sample_count;
+
+int main(int argc, char *argv[])
+{
+  LoadgenOptions options;
+  struct pollfd *fds;
+  uint64_t started;
+  uint64_t deadline;
+
+  memset(&options, 0, sizeof(options));
+  options.bot_count = DEFAULT_BOTS;
+  options.room_count = 1;
+  options.seconds = DEFAULT_SECONDS;
+  options.moves_per_second = DEFAULT_MOVES_PER_SECOND;
+  options.seed = 1;
+
+  parse_arguments(argc, argv, &options);
+
+  if (options.shm_name == NULL)
+  {
+    convert_address(options.address,
+                    parse_in_port_t(argv[0], options.port_str), &server_addr,
+                    &server_addr_len);
+  }
+
+  fds = calloc((size_t)options.bot_count, sizeof(*fds));
+  rtt_samples = calloc(MAX_RTT_SAMPLES, sizeof(*rtt_samples));
+
+  if (fds == NULL || rtt_samples == NULL)
+  {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  setup_signal_handler();
+  start_bots(&options);
+
+  started = monotonic_ns();
+  deadline = started + (uint64_t)options.seconds * NS_PER_SECOND;
+
+  while (!exit_flag)
+  {
+    uint64_t now = monotonic_ns();
+    uint64_t earliest = deadline;
+
+    if (now >= deadline)
+    {
+      break;
+    }
+
+    for (int i = 0; i < bot_count; i++)
+    {
+      run_bot(&bots[i], now, &options);
+
+      earliest = bots[i].next_move_ns < earliest ? bots[i].next_move_ns
+                                                 : earliest;
+      earliest = bots[i].next_ping_ns < earliest ? bots[i].next_ping_ns
+                                                 : earliest;
+      earliest = options.chats_per_second != 0 &&
+                         bots[i].next_chat_ns < earliest
+                     ? bots[i].next_chat_ns
+                     : earliest;
+      earliest = !bots[i].joined && bots[i].next_init_ns < earliest
+                     ? bots[i].next_init_ns
+                     : earliest;
+
+      fds[i].fd = bots[i].sockfd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+
+    now = monotonic_ns();
+
+    if (poll(fds, (nfds_t)bot_count,
+             earliest > now
+                 ? (int)((earliest - now + NS_PER_MS - 1) / NS_PER_MS)
+                 : 0) == -1 &&
+        errno != EINTR)
+    {
+      perror("poll");
+      break;
+    }
+
+    now = monotonic_ns();
+
+    for (int i = 0; i < bot_count; i++)
+    {
+      if (fds[i].revents & POLLIN)
+      {
+        receive_all(&bots[i], now);
+      }
+    }
+  }
+
+  for (int i = 0; i < bot_count; i++)
+  {
+    send_message(&bots[i], QUIT_MESSAGE, sizeof(QUIT_MESSAGE) - 1);
+    transport_close(bots[i].sockfd);
+  }
+
+  transport_shutdown();
+
+  report(&options, monotonic_ns() - started);
+
+  free(rtt_samples);
+  free(fds);
+
+  return EXIT_SUCCESS;
+}
+
+static void start_bots(const LoadgenOptions *options)
+{
+  uint64_t now = monotonic_ns();
+
+  bot_count = options->bot_count;
+
+  for (int i = 0; i < bot_count; i++)
+  {
+    Bot *bot = &bots[i];
+
+    memset(bot, 0, sizeof(*bot));
+    bot->sockfd =
+        options->shm_name != NULL
+            ? transport_shm_connect(options->shm_name, &server_addr,
+                                    &server_addr_len)
+            : socket_create(server_addr.ss_family, SOCK_DGRAM, 0);
+
+    if (bot->sockfd == -1)
+    {
+      exit(EXIT_FAILURE);
+    }
+
+    bot->room_id = i % options->room_count;
+    bot->seed = options->seed * (unsigned int)MAX_BOTS + (unsigned int)i;
+    bot->next_init_ns = now;
+    // Spread the first moves so the bots don't march in lockstep.
+    bot->next_move_ns = now + next_interval_ns(bot, options->moves_per_second);
+    bot->next_ping_ns = now + next_interval_ns(bot, 2);
+
+    if (options->chats_per_second != 0)
+    {
+      bot->next_chat_ns =
+          now + next_interval_ns(bot, options->chats_per_second);
+    }
+  }
+}
+
+static void run_bot(Bot *bot, uint64_t now, const LoadgenOptions *options)
+{
+  // Joins can be dropped by the server's limit on new sources; keep asking.
+  if (!bot->joined)
+  {
+    if (now >= bot->next_init_ns)
+    {
+      char message[JOIN_MESSAGE_SIZE];
+      JoinMessage join = {.rows = BOT_VIEW_ROWS,
+                          .cols = BOT_VIEW_COLS,
+                          .room = (uint32_t)bot->room_id};
+
+      send_message(bot, message, join_encode(&join, message));
+      bot->next_init_ns = now + (uint64_t)INIT_RETRY_MS * NS_PER_MS;
+    }
+
+    return;
+  }
+
+  if (now >= bot->next_move_ns)
+  {
+    char message[MOVE_MESSAGE_SIZE];
+    MoveMessage move = {
+        .seq = ++bot->move_seq,
+        .direction = (uint8_t)(rand_r(&bot->seed) % DIRECTION_COUNT),
+        .sent = 0,
+        .token = bot->token};
+
+    send_message(bot, message, move_encode(&move, message));
+    load_stats.moves++;
+
+    // Moves into walls are never confirmed.
+    if (bot->move_sent_ns == 0 ||
+        now - bot->move_sent_ns > (uint64_t)MOVE_TIMEOUT_MS * NS_PER_MS)
+    {
+      bot->move_sent_ns = now;
+    }
+
+    bot->next_move_ns = now + next_interval_ns(bot, options->moves_per_second);
+  }
+
+  if (options->chats_per_second != 0 && now >= bot->next_chat_ns)
+  {
+    char message[BUFFER_SIZE];
+    int length = snprintf(message, sizeof(message),
+                          CHAT_MESSAGE_PREFIX "line %" PRIu64 " from bot %d",
+                          load_stats.chats, (int)(bot - bots));
+
+    send_message(bot, message, (size_t)length);
+    load_stats.chats++;
+    bot->next_chat_ns = now + next_interval_ns(bot, options->chats_per_second);
+  }
+
+  if (now >= bot->next_ping_ns)
+  {
+    char message[PING_MESSAGE_SIZE];
+    PingMessage ping = {
+        .seq = ++bot->ping_seq, .sent = now, .token = bot->token};
+
+    send_message(bot, message, ping_encode(&ping, message));
+    load_stats.pings++;
+    bot->next_ping_ns = now + (uint64_t)PING_INTERVAL_MS * NS_PER_MS;
+  }
+}
+
+static void receive_all(Bot *bot, uint64_t now)
+{
+  char buffer[BUFFER_SIZE];
+  ssize_t bytes_received;
+
+  while ((bytes_received = transport_recvfrom(bot->sockfd, buffer,
+                                              sizeof(buffer) - 1, MSG_DONTWAIT,
+                                              NULL, NULL)) > 0)
+  {
+    buffer[bytes_received] = '\0';
+    load_stats.datagrams++;
+    load_stats.bytes += (uint64_t)bytes_received;
+
+    if (message_type(buffer, (size_t)bytes_received) == MESSAGE_WELCOME)
+    {
+      WelcomeMessage welcome;
+
+      if (welcome_decode(buffer, (size_t)bytes_received, &welcome) == 0)
+      {
+        bot->token = welcome.token;
+      }
+
+      bot->joined = 1;
+    }
+    else if (strcmp(buffer, CONFIRMATION_MESSAGE) == 0 &&
+             bot->move_sent_ns != 0)
+    {
+      record_rtt(now - bot->move_sent_ns);
+      bot->move_sent_ns = 0;
+      load_stats.confirmed++;
+    }
+    else if (message_type(buffer, (size_t)bytes_received) == MESSAGE_PONG)
+    {
+      load_stats.pongs++;
+    }
+    else if (strncmp(buffer, SNAPSHOT_MESSAGE_PREFIX,
+                     SNAPSHOT_MESSAGE_PREFIX_LEN) == 0)
+    {
+      // Part of a snapshot; its chat comes a line at a time.
+      for (const char *c = strchr(buffer, CHAT_SEPARATOR); c != NULL;
+           c = strchr(c + 1, CHAT_SEPARATOR))
+      {
+        load_stats.chats_heard++;
+      }
+    }
+  }
+}
+
+static void send_message(const Bot *bot, const char *message, size_t length)
+{
+  if (transport_sendto(bot->sockfd, message, length, 0,
+                       (const struct sockaddr *)&server_addr,
+                       server_addr_len) == -1)
+  {
+    perror("sendto");
+  }
+}
+
+// Uniform between half and one and a half times the mean interval.
+static uint64_t next_interval_ns(Bot *bot, int per_second)
+{
+  uint64_t mean = (uint64_t)NS_PER_SECOND / (uint64_t)per_second;
+
+  return mean / 2 + (uint64_t)rand_r(&bot->seed) % (mean + 1);
+}
+
+static void record_rtt(uint64_t elapsed)
+{
+  if (rtt_sample_count < MAX_RTT_SAMPLES)
+  {
+    rtt_samples[rtt_sample_count++] = (uint32_t)(elapsed / NS_PER_US);
+  }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+  uint32_t left = *(const uint32_t *)a;
+  uint32_t right = *(const uint32_t *)b;
+
+  return (left > right) - (left < right);
+}
+
+static void report(const LoadgenOptions *options, uint64_t elapsed)
+{
+  double seconds = (double)elapsed / NS_PER_SECOND;
+
+  printf("loadgen: %d bots over %d rooms for %.1f s: %" PRIu64
+         " moves (%.0f/s), %" PRIu64 " confirmed, %" PRIu64 "/%" PRIu64
+         " pings answered, %" PRIu64 " datagrams (%.1f KB/s) received\n",
+         options->bot_count, options->room_count, seconds, load_stats.moves,
+         (double)load_stats.moves / seconds, load_stats.confirmed,
+         load_stats.pongs, load_stats.pings, load_stats.datagrams,
+         (double)load_stats.bytes / seconds / 1024);
+
+  if (load_stats.chats != 0)
+  {
+    printf("loadgen: %" PRIu64 " chat lines said, %" PRIu64 " heard\n",
+           load_stats.chats, load_stats.chats_heard);
+  }
+
+  if (rtt_sample_count != 0)
+  {
+    qsort(rtt_samples, rtt_sample_count, sizeof(*rtt_samples), compare_u32);
+    printf("loadgen: move rtt p50 %" PRIu32 " us, p99 %" PRIu32
+           " us, max %" PRIu32 " us\n",
+           rtt_samples[rtt_sample_count * PERCENTILE_50 / PERCENT],
+           rtt_samples[rtt_sample_count * PERCENTILE_99 / PERCENT],
+           rtt_samples[rtt_sample_count - 1]);
+  }
+
+  fflush(stdout);
+}
+
+static void parse_arguments(int argc, char *argv[], LoadgenOptions *options)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hb:r:d:m:c:s:S:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      options->bot_count = parse_int(argv[0], optarg, MAX_BOTS);
+      break;
+    case 'r':
+      options->room_count = parse_int(argv[0], optarg, MAX_ROOMS);
+      break;
+    case 'd':
+      options->seconds = parse_int(argv[0], optarg, MAX_SECONDS);
+      break;
+    case 'm':
+      options->moves_per_second = parse_int(argv[0], optarg, NS_PER_MS);
+      break;
+    case 'c':
+      options->chats_per_second = parse_int(argv[0], optarg, NS_PER_MS);
+      break;
+    case 's':
+      options->seed = (unsigned int)parse_int(argv[0], optarg, INT32_MAX);
+      break;
+    case 'S':
+      options->shm_name = optarg;
+      break;
+    case 'h':
+      usage(argv[0], EXIT_SUCCESS, NULL);
+    default:
+      usage(argv[0], EXIT_FAILURE, NULL);
+    }
+  }
+
+  if (argc - optind != (options->shm_name != NULL ? 0 : 2))
+  {
+    usage(argv[0], EXIT_FAILURE, NULL);
+  }
+
+  if (options->bot_count < 1 || options->room_count < 1 ||
+      options->moves_per_second < 1)
+  {
+    usage(argv[0], EXIT_FAILURE, "Bots, rooms and move rate must be positive.");
+  }
+
+  if (options->shm_name == NULL)
+  {
+    options->address = argv[optind];
+    options->port_str = argv[optind + 1];
+  }
+}
+
+static int parse_int(const char *binary_name, const char *str, int max)
+{
+  char *endptr;
+  long parsed_value;
+
+  errno = 0;
+  parsed_value = strtol(str, &endptr, BASE_TEN);
+
+  if (errno != 0 || *endptr != '\0' || parsed_value < 0 || parsed_value > max)
+  {
+    usage(binary_name, EXIT_FAILURE, "Invalid number.");
+  }
+
+  return (int)parsed_value;
+}
+
+static in_port_t parse_in_port_t(const char *binary_name, const char *str)
+{
+  char *endptr;
+  uintmax_t parsed_value;
+
+  errno = 0;
+  parsed_value = strtoumax(str, &endptr, BASE_TEN);
+
+  if (errno != 0)
+  {
+    perror("Error parsing in_port_t");
+    exit(EXIT_FAILURE);
+  }
+
+  if (*endptr != '\0')
+  {
+    usage(binary_name, EXIT_FAILURE, "Invalid characters in input.");
+  }
+
+  if (parsed_value > UINT16_MAX)
+  {
+    usage(binary_name, EXIT_FAILURE, "in_port_t value out of range.");
+  }
+
+  return (in_port_t)parsed_value;
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message)
+{
+  if (message)
+  {
+    fprintf(stderr, "%s\n", message);
+  }
+
+  fprintf(stderr,
+          "Usage: %s [-h] [-b bots] [-r rooms] [-d seconds] [-m moves] "
+          "[-c chats] [-s seed] <server address> <server port> | -S name\n",
+          program_name);
+  fputs("Options:\n", stderr);
+  fputs("  -h  Display this help message\n", stderr);
+  fputs("  -b  Number of bots (default: 32)\n", stderr);
+  fputs("  -r  Rooms to spread them over (default: 1)\n", stderr);
+  fputs("  -d  Seconds to run (default: 10)\n", stderr);
+  fputs("  -m  Moves per second per bot (default: 20)\n", stderr);
+  fputs("  -c  Lines of chat per second per bot (default: 0)\n", stderr);
+  fputs("  -s  Random seed (default: 1)\n", stderr);
+  fputs("  -S  Connect through the server's shared memory instead of UDP\n",
+        stderr);
+  exit(exit_code);
+}
+
+static void convert_address(const char *address, in_port_t port,
+                            struct sockaddr_storage *addr,
+                            socklen_t *addr_len)
+{
+  memset(addr, 0, sizeof(*addr));
+
+  if (inet_pton(AF_INET, address, &(((struct sockaddr_in *)addr)->sin_addr)) ==
+      1)
+  {
+    struct sockaddr_in *ipv4_addr = (struct sockaddr_in *)addr;
+
+    ipv4_addr->sin_family = AF_INET;
+    ipv4_addr->sin_port = htons(port);
+    *addr_len = sizeof(*ipv4_addr);
+  }
+  else if (inet_pton(AF_INET6, address,
+                     &(((struct sockaddr_in6 *)addr)->sin6_addr)) == 1)
+  {
+    struct sockaddr_in6 *ipv6_addr = (struct sockaddr_in6 *)addr;
+
+    ipv6_addr->sin6_family = AF_INET6;
+    ipv6_addr->sin6_port = htons(port);
+    *addr_len = sizeof(*ipv6_addr);
+  }
+  else
+  {
+    fprintf(stderr, "%s is not an IPv4 or an IPv6 address\n", address);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int socket_create(int domain, int type, int protocol)
+{
+  int sockfd;
+
+  sockfd = socket(domain, type, protocol);
+
+  if (sockfd == -1)
+  {
+    perror("Socket creation failed");
+    exit(EXIT_FAILURE);
+  }
+
+  return sockfd;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+static void sigint_handler(int signum) { exit_flag = 1; }
+
+#pragma GCC diagnostic pop
+
+static void setup_signal_handler(void)
+{
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+  sa.sa_handler = sigint_handler;
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+
+  if (sigaction(SIGINT, &sa, NULL) == -1)
+  {
+    perror("sigaction");
+    exit(EXIT_FAILURE);
+  }
+}
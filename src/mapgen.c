@@ -0,0 +1,399 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "world.h"
+
+static void parse_arguments(int argc, char *argv[], const char **ascii_path,
+                            const char **output_path, int *width, int *height,
+                            unsigned int *seed, int *density);
+static int parse_int(const char *binary_name, const char *str, int min,
+                     int max);
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message);
+
+static char *read_ascii_map(const char *path, int *width, int *height);
+static char *generate_map(int width, int height, unsigned int seed,
+                          int density);
+static void write_map(const char *path, const char *cells, int width,
+                      int height);
+static int is_walkable_tile(char tile);
+static unsigned int next_random(unsigned int *state);
+
+#define BASE_TEN 10
+#define DEFAULT_DENSITY 8
+#define MAX_DENSITY 100
+#define OBSTACLE_MAX_SIZE 6
+
+int main(int argc, char *argv[])
+{
+  const char *ascii_path;
+  const char *output_path;
+  int width;
+  int height;
+  unsigned int seed;
+  int density;
+  char *cells;
+
+  ascii_path = NULL;
+  output_path = NULL;
+  width = 0;
+  height = 0;
+  seed = 1;
+  density = DEFAULT_DENSITY;
+
+  parse_arguments(argc, argv, &ascii_path, &output_path, &width, &height,
+                  &seed, &density);
+
+  if (ascii_path != NULL)
+  {
+    cells = read_ascii_map(ascii_path, &width, &height);
+  }
+  else
+  {
+    cells = generate_map(width, height, seed, density);
+  }
+
+  write_map(output_path, cells, width, height);
+  printf("Wrote %dx%d map to %s\n", width, height, output_path);
+
+  free(cells);
+
+  return EXIT_SUCCESS;
+}
+
+static void parse_arguments(int argc, char *argv[], const char **ascii_path,
+                            const char **output_path, int *width, int *height,
+                            unsigned int *seed, int *density)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hi:s:d:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'i':
+      *ascii_path = optarg;
+      break;
+    case 's':
+      *seed = (unsigned int)parse_int(argv[0], optarg, 0, INT32_MAX);
+      break;
+    case 'd':
+      *density = parse_int(argv[0], optarg, 0, MAX_DENSITY);
+      break;
+    case 'h':
+      usage(argv[0], EXIT_SUCCESS, NULL);
+    default:
+      usage(argv[0], EXIT_FAILURE, NULL);
+    }
+  }
+
+  if (optind >= argc)
+  {
+    usage(argv[0], EXIT_FAILURE, "The output path is required.");
+  }
+
+  *output_path = argv[optind++];
+
+  if (*ascii_path != NULL)
+  {
+    if (optind != argc)
+    {
+      usage(argv[0], EXIT_FAILURE, "Width and height come from the -i file.");
+    }
+
+    return;
+  }
+
+  if (argc - optind != 2)
+  {
+    usage(argv[0], EXIT_FAILURE, "The width and height are required.");
+  }
+
+  *width = parse_int(argv[0], argv[optind], 3, WORLD_MAX_DIM);
+  *height = parse_int(argv[0], argv[optind + 1], 3, WORLD_MAX_DIM);
+}
+
+static int parse_int(const char *binary_name, const char *str, int min,
+                     int max)
+{
+  char *endptr;
+  intmax_t parsed_value;
+
+  errno = 0;
+  parsed_value = strtoimax(str, &endptr, BASE_TEN);
+
+  if (errno != 0)
+  {
+    perror("Error parsing integer");
+    exit(EXIT_FAILURE);
+  }
+
+  if (*endptr != '\0')
+  {
+    usage(binary_name, EXIT_FAILURE, "Invalid characters in input.");
+  }
+
+  if (parsed_value < min || parsed_value > max)
+  {
+    usage(binary_name, EXIT_FAILURE, "Value out of range.");
+  }
+
+  return (int)parsed_value;
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message)
+{
+  if (message)
+  {
+    fprintf(stderr, "%s\n", message);
+  }
+
+  fprintf(stderr,
+          "Usage: %s [-h] [-s seed] [-d density] <output> <width> <height>\n"
+          "       %s [-h] -i <ascii map> <output>\n",
+          program_name, program_name);
+  fputs("Options:\n", stderr);
+  fputs("  -h  Display this help message\n", stderr);
+  fputs("  -i  Convert a text map ('#' walls, ' ' or '.' floor)\n", stderr);
+  fputs("  -s  Seed for the generated obstacles\n", stderr);
+  fputs("  -d  Obstacle clusters per 1000 cells (0-100)\n", stderr);
+  exit(exit_code);
+}
+
+static char *read_ascii_map(const char *path, int *width, int *height)
+{
+  FILE *file;
+  char *text;
+  char *cells;
+  long size;
+  int line_width;
+  int x;
+  int y;
+
+  file = fopen(path, "re");
+
+  if (file == NULL)
+  {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+
+  if (fseek(file, 0, SEEK_END) == -1 || (size = ftell(file)) < 0 ||
+      fseek(file, 0, SEEK_SET) == -1)
+  {
+    perror("fseek");
+    exit(EXIT_FAILURE);
+  }
+
+  text = malloc((size_t)size + 1);
+
+  if (text == NULL || fread(text, 1, (size_t)size, file) != (size_t)size)
+  {
+    perror("fread");
+    exit(EXIT_FAILURE);
+  }
+
+  text[size] = '\0';
+  fclose(file);
+
+  *width = 0;
+  *height = 0;
+  line_width = 0;
+
+  for (long i = 0; i <= size; i++)
+  {
+    if (text[i] == '\n' || (text[i] == '\0' && line_width > 0))
+    {
+      *height += 1;
+      line_width = 0;
+    }
+    else if (text[i] != '\r' && text[i] != '\0')
+    {
+      line_width++;
+      *width = line_width > *width ? line_width : *width;
+    }
+  }
+
+  if (*width < 3 || *height < 3 || *width > WORLD_MAX_DIM ||
+      *height > WORLD_MAX_DIM)
+  {
+    fprintf(stderr, "%s: map must be between 3x3 and %dx%d\n", path,
+            WORLD_MAX_DIM, WORLD_MAX_DIM);
+    exit(EXIT_FAILURE);
+  }
+
+  cells = malloc((size_t)*width * (size_t)*height);
+
+  if (cells == NULL)
+  {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  // Short lines are padded with walls so the map stays closed.
+  memset(cells, WORLD_TILE_WALL, (size_t)*width * (size_t)*height);
+
+  x = 0;
+  y = 0;
+
+  for (long i = 0; i < size && y < *height; i++)
+  {
+    if (text[i] == '\n')
+    {
+      x = 0;
+      y++;
+    }
+    else if (text[i] != '\r')
+    {
+      cells[(size_t)y * (size_t)*width + (size_t)x] =
+          text[i] == '.' ? WORLD_TILE_FLOOR : text[i];
+      x++;
+    }
+  }
+
+  free(text);
+
+  return cells;
+}
+
+static char *generate_map(int width, int height, unsigned int seed,
+                          int density)
+{
+  char *cells;
+  size_t obstacles;
+
+  cells = malloc((size_t)width * (size_t)height);
+
+  if (cells == NULL)
+  {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int y = 0; y < height; y++)
+  {
+    for (int x = 0; x < width; x++)
+    {
+      int border = x == 0 || y == 0 || x == width - 1 || y == height - 1;
+
+      cells[(size_t)y * (size_t)width + (size_t)x] =
+          border ? WORLD_TILE_WALL : WORLD_TILE_FLOOR;
+    }
+  }
+
+  obstacles = (size_t)width * (size_t)height * (size_t)density / 1000;
+
+  for (size_t i = 0; i < obstacles; i++)
+  {
+    int obstacle_x = (int)(next_random(&seed) % (unsigned int)width);
+    int obstacle_y = (int)(next_random(&seed) % (unsigned int)height);
+    int obstacle_w = 1 + (int)(next_random(&seed) % OBSTACLE_MAX_SIZE);
+    int obstacle_h = 1 + (int)(next_random(&seed) % OBSTACLE_MAX_SIZE);
+    char tile = (next_random(&seed) & 1) ? WORLD_TILE_WALL : '~';
+
+    for (int y = obstacle_y; y < obstacle_y + obstacle_h && y < height; y++)
+    {
+      for (int x = obstacle_x; x < obstacle_x + obstacle_w && x < width; x++)
+      {
+        cells[(size_t)y * (size_t)width + (size_t)x] = tile;
+      }
+    }
+  }
+
+  return cells;
+}
+
+static void write_map(const char *path, const char *cells, int width,
+                      int height)
+{
+  FILE *file;
+  MapHeader header;
+  MapChunk chunk;
+  int chunks_x;
+  int chunks_y;
+
+  chunks_x = (width + WORLD_CHUNK_DIM - 1) / WORLD_CHUNK_DIM;
+  chunks_y = (height + WORLD_CHUNK_DIM - 1) / WORLD_CHUNK_DIM;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, WORLD_MAP_MAGIC, WORLD_MAP_MAGIC_LEN);
+  header.width = (uint32_t)width;
+  header.height = (uint32_t)height;
+  header.chunk_dim = WORLD_CHUNK_DIM;
+  header.chunks_x = (uint32_t)chunks_x;
+  header.chunks_y = (uint32_t)chunks_y;
+
+  file = fopen(path, "we");
+
+  if (file == NULL)
+  {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+
+  if (fwrite(&header, sizeof(header), 1, file) != 1)
+  {
+    perror("fwrite");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int cy = 0; cy < chunks_y; cy++)
+  {
+    for (int cx = 0; cx < chunks_x; cx++)
+    {
+      memset(&chunk, 0, sizeof(chunk));
+
+      for (int ly = 0; ly < WORLD_CHUNK_DIM; ly++)
+      {
+        for (int lx = 0; lx < WORLD_CHUNK_DIM; lx++)
+        {
+          int x = cx * WORLD_CHUNK_DIM + lx;
+          int y = cy * WORLD_CHUNK_DIM + ly;
+          char tile = WORLD_TILE_VOID;
+
+          if (x < width && y < height)
+          {
+            tile = cells[(size_t)y * (size_t)width + (size_t)x];
+          }
+
+          world_chunk_set_cell(&chunk, lx, ly, tile,
+                               x < width && y < height &&
+                                   is_walkable_tile(tile));
+        }
+      }
+
+      if (fwrite(&chunk, sizeof(chunk), 1, file) != 1)
+      {
+        perror("fwrite");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (fclose(file) != 0)
+  {
+    perror("fclose");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int is_walkable_tile(char tile) { return tile == WORLD_TILE_FLOOR; }
+
+static unsigned int next_random(unsigned int *state)
+{
+  // xorshift32; only needs to be repeatable for a given seed.
+  unsigned int x = *state != 0 ? *state : 1;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+
+  return x;
+}
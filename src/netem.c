@@ -0,0 +1,583 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clock.h"
+#include "netem.h"
+
+#define NETEM_QUEUE_CAPACITY 2048
+#define NETEM_MAX_DATAGRAM 2048
+#define NETEM_SPEC_LENGTH 256
+#define PERCENT 100.0
+
+typedef struct
+{
+  double delay_ms;
+  double jitter_ms;
+  double loss;
+  double duplicate;
+  double reorder;
+  uint64_t seed;
+} NetemConfig;
+
+typedef struct
+{
+  uint64_t due_ns;
+  // Ties leave in arrival order.
+  uint64_t seq;
+  int sockfd;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  size_t length;
+  char data[NETEM_MAX_DATAGRAM];
+} NetemDatagram;
+
+// Min-heap on due time over slot indices, so sifting never moves payloads.
+typedef struct
+{
+  NetemDatagram *slots;
+  uint32_t *heap;
+  uint32_t *free_slots;
+  size_t count;
+  size_t free_count;
+  uint64_t next_seq;
+} NetemQueue;
+
+typedef struct
+{
+  uint64_t datagrams;
+  uint64_t lost;
+  uint64_t duplicated;
+  uint64_t reordered;
+  uint64_t overflowed;
+} NetemStats;
+
+static int parse_spec(NetemConfig *config, const char *spec);
+static int queue_init(NetemQueue *queue);
+static void queue_free(NetemQueue *queue);
+static int queue_push(NetemQueue *queue, uint64_t due_ns, int sockfd,
+                      const void *data, size_t length,
+                      const struct sockaddr *addr, socklen_t addr_len);
+static int queue_earlier(const NetemQueue *queue, size_t a, size_t b);
+static const NetemDatagram *queue_peek(const NetemQueue *queue);
+static void queue_pop(NetemQueue *queue, NetemDatagram *out);
+static double random_unit(void);
+static void impair(NetemQueue *queue, int sockfd, const void *data,
+                   size_t length, const struct sockaddr *addr,
+                   socklen_t addr_len, uint64_t now);
+static void *sender_main(void *arg);
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static int netem_enabled;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static NetemConfig netem_config;
+
+// Guards both queues, the random state and the stats.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_mutex_t netem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_cond_t netem_wake;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static pthread_t netem_sender;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static int netem_stopping;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static NetemQueue outbound;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static NetemQueue inbound;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static uint64_t random_state;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static NetemStats netem_stats;
+
+int netem_init(const char *spec)
+{
+  pthread_condattr_t attr;
+
+  if (parse_spec(&netem_config, spec) == -1)
+  {
+    fprintf(stderr, "Invalid impairment spec: %s\n", spec);
+    return -1;
+  }
+
+  if (queue_init(&outbound) == -1 || queue_init(&inbound) == -1)
+  {
+    perror("calloc");
+    return -1;
+  }
+
+  // The sender sleeps against the monotonic clock the due times use.
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&netem_wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  random_state = netem_config.seed != 0 ? netem_config.seed : 1;
+  netem_enabled = 1;
+
+  if (pthread_create(&netem_sender, NULL, sender_main, NULL) != 0)
+  {
+    perror("pthread_create");
+    netem_enabled = 0;
+    return -1;
+  }
+
+  printf("Impairing traffic: delay %.1f ms, jitter %.1f ms, loss %.1f%%, "
+         "duplicate %.1f%%, reorder %.1f%%, seed %" PRIu64 "\n",
+         netem_config.delay_ms, netem_config.jitter_ms, netem_config.loss,
+         netem_config.duplicate, netem_config.reorder, netem_config.seed);
+
+  return 0;
+}
+
+void netem_shutdown(void)
+{
+  if (!netem_enabled)
+  {
+    return;
+  }
+
+  // The sender flushes whatever is still queued, ignoring the delay, so
+  // final messages such as QUIT are not lost with the process.
+  pthread_mutex_lock(&netem_lock);
+  netem_stopping = 1;
+  pthread_cond_signal(&netem_wake);
+  pthread_mutex_unlock(&netem_lock);
+  pthread_join(netem_sender, NULL);
+
+  printf("netem: %" PRIu64 " datagrams, %" PRIu64 " lost, %" PRIu64
+         " duplicated, %" PRIu64 " reordered, %" PRIu64 " over queue capacity\n",
+         netem_stats.datagrams, netem_stats.lost, netem_stats.duplicated,
+         netem_stats.reordered, netem_stats.overflowed);
+
+  netem_enabled = 0;
+  queue_free(&outbound);
+  queue_free(&inbound);
+  pthread_cond_destroy(&netem_wake);
+}
+
+ssize_t netem_sendto(int sockfd, const void *buffer, size_t length, int flags,
+                     const struct sockaddr *addr, socklen_t addr_len)
+{
+  const NetemDatagram *earliest;
+
+  if (!netem_enabled)
+  {
+    return sendto(sockfd, buffer, length, flags, addr, addr_len);
+  }
+
+  if (length > NETEM_MAX_DATAGRAM)
+  {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  pthread_mutex_lock(&netem_lock);
+  earliest = queue_peek(&outbound);
+  impair(&outbound, sockfd, buffer, length, addr, addr_len, monotonic_ns());
+
+  if (queue_peek(&outbound) != earliest)
+  {
+    pthread_cond_signal(&netem_wake);
+  }
+
+  pthread_mutex_unlock(&netem_lock);
+
+  // Like the network, we can't tell whether it will arrive.
+  return (ssize_t)length;
+}
+
+ssize_t netem_recvfrom(int sockfd, void *buffer, size_t length, int flags,
+                       struct sockaddr *addr, socklen_t *addr_len)
+{
+  char datagram[NETEM_MAX_DATAGRAM];
+  struct sockaddr_storage from;
+  socklen_t from_len;
+  ssize_t received;
+  const NetemDatagram *due;
+  NetemDatagram popped;
+  uint64_t now;
+
+  if (!netem_enabled)
+  {
+    return recvfrom(sockfd, buffer, length, flags, addr, addr_len);
+  }
+
+  pthread_mutex_lock(&netem_lock);
+
+  // Everything waiting on the socket joins the queue first.
+  for (;;)
+  {
+    from_len = sizeof(from);
+    received = recvfrom(sockfd, datagram, sizeof(datagram), MSG_DONTWAIT,
+                        (struct sockaddr *)&from, &from_len);
+
+    if (received == -1)
+    {
+      break;
+    }
+
+    impair(&inbound, sockfd, datagram, (size_t)received,
+           (const struct sockaddr *)&from, from_len, monotonic_ns());
+  }
+
+  if (errno != EAGAIN && errno != EWOULDBLOCK)
+  {
+    pthread_mutex_unlock(&netem_lock);
+    return -1;
+  }
+
+  now = monotonic_ns();
+  due = queue_peek(&inbound);
+
+  if (due == NULL || due->due_ns > now || due->sockfd != sockfd)
+  {
+    pthread_mutex_unlock(&netem_lock);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  queue_pop(&inbound, &popped);
+  pthread_mutex_unlock(&netem_lock);
+
+  received = (ssize_t)(popped.length < length ? popped.length : length);
+  memcpy(buffer, popped.data, (size_t)received);
+
+  if (addr != NULL)
+  {
+    *addr_len = popped.addr_len < *addr_len ? popped.addr_len : *addr_len;
+    memcpy(addr, &popped.addr, *addr_len);
+  }
+
+  return received;
+}
+
+int netem_timeout_ms(void)
+{
+  const NetemDatagram *due;
+  uint64_t now;
+  int timeout_ms = -1;
+
+  if (!netem_enabled)
+  {
+    return -1;
+  }
+
+  pthread_mutex_lock(&netem_lock);
+  due = queue_peek(&inbound);
+  now = monotonic_ns();
+
+  if (due != NULL)
+  {
+    timeout_ms = due->due_ns > now
+                     ? (int)((due->due_ns - now + NS_PER_MS - 1) / NS_PER_MS)
+                     : 0;
+  }
+
+  pthread_mutex_unlock(&netem_lock);
+
+  return timeout_ms;
+}
+
+static int parse_spec(NetemConfig *config, const char *spec)
+{
+  char copy[NETEM_SPEC_LENGTH];
+  char *saveptr;
+
+  memset(config, 0, sizeof(*config));
+
+  if (strlen(spec) >= sizeof(copy))
+  {
+    return -1;
+  }
+
+  strcpy(copy, spec);
+
+  for (char *item = strtok_r(copy, ",", &saveptr); item != NULL;
+       item = strtok_r(NULL, ",", &saveptr))
+  {
+    char *value = strchr(item, '=');
+    char *endptr;
+    double number;
+
+    if (value == NULL)
+    {
+      return -1;
+    }
+
+    *value++ = '\0';
+    number = strtod(value, &endptr);
+
+    if (*endptr != '\0' || endptr == value || number < 0)
+    {
+      return -1;
+    }
+
+    if (strcmp(item, "delay") == 0)
+    {
+      config->delay_ms = number;
+    }
+    else if (strcmp(item, "jitter") == 0)
+    {
+      config->jitter_ms = number;
+    }
+    else if (strcmp(item, "loss") == 0 && number <= PERCENT)
+    {
+      config->loss = number;
+    }
+    else if (strcmp(item, "dup") == 0 && number <= PERCENT)
+    {
+      config->duplicate = number;
+    }
+    else if (strcmp(item, "reorder") == 0 && number <= PERCENT)
+    {
+      config->reorder = number;
+    }
+    else if (strcmp(item, "seed") == 0)
+    {
+      config->seed = (uint64_t)number;
+    }
+    else
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int queue_init(NetemQueue *queue)
+{
+  memset(queue, 0, sizeof(*queue));
+  queue->slots = calloc(NETEM_QUEUE_CAPACITY, sizeof(*queue->slots));
+  queue->heap = calloc(NETEM_QUEUE_CAPACITY, sizeof(*queue->heap));
+  queue->free_slots = calloc(NETEM_QUEUE_CAPACITY, sizeof(*queue->free_slots));
+
+  if (queue->slots == NULL || queue->heap == NULL || queue->free_slots == NULL)
+  {
+    queue_free(queue);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < NETEM_QUEUE_CAPACITY; i++)
+  {
+    queue->free_slots[i] = NETEM_QUEUE_CAPACITY - 1 - i;
+  }
+
+  queue->free_count = NETEM_QUEUE_CAPACITY;
+
+  return 0;
+}
+
+static void queue_free(NetemQueue *queue)
+{
+  free(queue->slots);
+  free(queue->heap);
+  free(queue->free_slots);
+  memset(queue, 0, sizeof(*queue));
+}
+
+static int queue_push(NetemQueue *queue, uint64_t due_ns, int sockfd,
+                      const void *data, size_t length,
+                      const struct sockaddr *addr, socklen_t addr_len)
+{
+  NetemDatagram *datagram;
+  uint32_t slot;
+  size_t index;
+
+  if (queue->free_count == 0)
+  {
+    return -1;
+  }
+
+  slot = queue->free_slots[--queue->free_count];
+  datagram = &queue->slots[slot];
+  datagram->due_ns = due_ns;
+  datagram->seq = queue->next_seq++;
+  datagram->sockfd = sockfd;
+  memcpy(&datagram->addr, addr, addr_len);
+  datagram->addr_len = addr_len;
+  memcpy(datagram->data, data, length);
+  datagram->length = length;
+
+  index = queue->count++;
+  queue->heap[index] = slot;
+
+  while (index > 0 && queue_earlier(queue, index, (index - 1) / 2))
+  {
+    uint32_t parent = queue->heap[(index - 1) / 2];
+
+    queue->heap[(index - 1) / 2] = queue->heap[index];
+    queue->heap[index] = parent;
+    index = (index - 1) / 2;
+  }
+
+  return 0;
+}
+
+static int queue_earlier(const NetemQueue *queue, size_t a, size_t b)
+{
+  const NetemDatagram *first = &queue->slots[queue->heap[a]];
+  const NetemDatagram *second = &queue->slots[queue->heap[b]];
+
+  return first->due_ns != second->due_ns ? first->due_ns < second->due_ns
+                                         : first->seq < second->seq;
+}
+
+static const NetemDatagram *queue_peek(const NetemQueue *queue)
+{
+  return queue->count != 0 ? &queue->slots[queue->heap[0]] : NULL;
+}
+
+static void queue_pop(NetemQueue *queue, NetemDatagram *out)
+{
+  size_t index = 0;
+
+  memcpy(out, &queue->slots[queue->heap[0]], sizeof(*out));
+  queue->free_slots[queue->free_count++] = queue->heap[0];
+  queue->heap[0] = queue->heap[--queue->count];
+
+  for (;;)
+  {
+    size_t smallest = index;
+    size_t left = index * 2 + 1;
+    size_t right = left + 1;
+    uint32_t swap;
+
+    if (left < queue->count && queue_earlier(queue, left, smallest))
+    {
+      smallest = left;
+    }
+
+    if (right < queue->count && queue_earlier(queue, right, smallest))
+    {
+      smallest = right;
+    }
+
+    if (smallest == index)
+    {
+      break;
+    }
+
+    swap = queue->heap[index];
+    queue->heap[index] = queue->heap[smallest];
+    queue->heap[smallest] = swap;
+    index = smallest;
+  }
+}
+
+// xorshift64*, so a seed replays the same impairments.
+static double random_unit(void)
+{
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+
+  return (double)((random_state * 2685821657736338717ULL) >> 11) /
+         (double)(1ULL << 53);
+}
+
+// Called with netem_lock held.
+static void impair(NetemQueue *queue, int sockfd, const void *data,
+                   size_t length, const struct sockaddr *addr,
+                   socklen_t addr_len, uint64_t now)
+{
+  int copies = 1;
+
+  netem_stats.datagrams++;
+
+  if (random_unit() * PERCENT < netem_config.loss)
+  {
+    netem_stats.lost++;
+    return;
+  }
+
+  if (random_unit() * PERCENT < netem_config.duplicate)
+  {
+    netem_stats.duplicated++;
+    copies = 2;
+  }
+
+  for (int i = 0; i < copies; i++)
+  {
+    double delay_ms = netem_config.delay_ms +
+                      netem_config.jitter_ms * (2 * random_unit() - 1);
+    uint64_t due_ns;
+
+    if (random_unit() * PERCENT < netem_config.reorder)
+    {
+      netem_stats.reordered++;
+      delay_ms = 0;
+    }
+
+    due_ns = now + (delay_ms > 0 ? (uint64_t)(delay_ms * NS_PER_MS) : 0);
+
+    if (queue_push(queue, due_ns, sockfd, data, length, addr, addr_len) == -1)
+    {
+      netem_stats.overflowed++;
+    }
+  }
+}
+
+static void *sender_main(void *arg)
+{
+  (void)arg;
+
+  pthread_mutex_lock(&netem_lock);
+
+  for (;;)
+  {
+    const NetemDatagram *due = queue_peek(&outbound);
+    NetemDatagram datagram;
+
+    if (due == NULL)
+    {
+      if (netem_stopping)
+      {
+        break;
+      }
+
+      pthread_cond_wait(&netem_wake, &netem_lock);
+      continue;
+    }
+
+    if (!netem_stopping && due->due_ns > monotonic_ns())
+    {
+      struct timespec until;
+
+      until.tv_sec = (time_t)(due->due_ns / NS_PER_SECOND);
+      until.tv_nsec = (long)(due->due_ns % NS_PER_SECOND);
+      pthread_cond_timedwait(&netem_wake, &netem_lock, &until);
+      continue;
+    }
+
+    queue_pop(&outbound, &datagram);
+    pthread_mutex_unlock(&netem_lock);
+
+    if (sendto(datagram.sockfd, datagram.data, datagram.length, 0,
+               (const struct sockaddr *)&datagram.addr,
+               datagram.addr_len) == -1)
+    {
+      perror("netem sendto");
+    }
+
+    pthread_mutex_lock(&netem_lock);
+  }
+
+  pthread_mutex_unlock(&netem_lock);
+
+  return NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef TG_NETEM_H
+#define TG_NETEM_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * Optional network impairment for testing on one machine. Once enabled with
+ * a spec such as
+ *
+ *   delay=40,jitter=10,loss=2,dup=1,reorder=5,seed=7
+ *
+ * (milliseconds and percentages; anything left out is zero) every datagram
+ * going through netem_sendto or netem_recvfrom may be dropped, duplicated,
+ * or held back in a delay queue for delay +/- jitter. A reordered datagram
+ * skips the queue. Outgoing datagrams are released by a timer thread;
+ * incoming ones by netem_recvfrom once due, so the caller has to come back
+ * after netem_timeout_ms even when its socket stays quiet. The same seed
+ * makes the same decisions, packet for packet.
+ *
+ * Until netem_init is called both wrappers are plain sendto/recvfrom.
+ */
+
+int netem_init(const char *spec);
+void netem_shutdown(void);
+
+ssize_t netem_sendto(int sockfd, const void *buffer, size_t length, int flags,
+                     const struct sockaddr *addr, socklen_t addr_len);
+ssize_t netem_recvfrom(int sockfd, void *buffer, size_t length, int flags,
+                       struct sockaddr *addr, socklen_t *addr_len);
+int netem_timeout_ms(void);
+
+#endif
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+
+#include "npc.h"
+
+#define SPAWN_ATTEMPTS 1000
+#define HEADING_COUNT 4
+#define HEADING_MIN_TICKS 3
+#define HEADING_EXTRA_TICKS 8
+
+static const int heading_dx[HEADING_COUNT] = {0, 1, 0, -1};
+static const int heading_dy[HEADING_COUNT] = {-1, 0, 1, 0};
+
+static uint32_t npc_random(uint32_t *state);
+static int nearest_target(const NpcTick *tick, const Npc *npc, int *target_x,
+                          int *target_y);
+static int try_step(const NpcTick *tick, Npc *npc, int dx, int dy);
+static void step_towards(const NpcTick *tick, Npc *npc, int target_x,
+                         int target_y, int away);
+static void wander(const NpcTick *tick, Npc *npc);
+static int sign(int value);
+
+void npc_spawn(Npc *npcs, size_t count, const World *world,
+               const WorldRect *bounds, uint32_t seed)
+{
+  uint32_t width = (uint32_t)(bounds->x1 - bounds->x0);
+  uint32_t height = (uint32_t)(bounds->y1 - bounds->y0);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    Npc *npc = &npcs[i];
+
+    npc->rng = seed ^ (uint32_t)((i + 1) * 2654435761U);
+    npc->rng = npc->rng != 0 ? npc->rng : 1;
+    npc->state = NPC_WANDER;
+    npc->timid = (uint8_t)(npc_random(&npc->rng) & 1);
+    npc->heading = (uint8_t)(npc_random(&npc->rng) % HEADING_COUNT);
+    npc->heading_ticks = 0;
+    npc->x = -1;
+    npc->y = -1;
+
+    for (int attempt = 0; attempt < SPAWN_ATTEMPTS; attempt++)
+    {
+      int x = bounds->x0 + (int)(npc_random(&npc->rng) % width);
+      int y = bounds->y0 + (int)(npc_random(&npc->rng) % height);
+
+      if (world_walkable(world, x, y))
+      {
+        npc->x = x;
+        npc->y = y;
+        break;
+      }
+    }
+  }
+}
+
+void npc_step_range(void *context, size_t begin, size_t end)
+{
+  const NpcTick *tick = context;
+
+  for (size_t i = begin; i < end; i++)
+  {
+    Npc *npc = &tick->npcs[i];
+    int target_x;
+    int target_y;
+
+    if (npc->x < 0)
+    {
+      continue;
+    }
+
+    if (nearest_target(tick, npc, &target_x, &target_y))
+    {
+      npc->state = npc->timid ? NPC_FLEE : NPC_CHASE;
+    }
+    else
+    {
+      npc->state = NPC_WANDER;
+    }
+
+    // Think every tick, but only walk every NPC_MOVE_PERIOD ticks; the
+    // offset spreads movers evenly across ticks.
+    if ((tick->tick + i) % NPC_MOVE_PERIOD != 0)
+    {
+      continue;
+    }
+
+    switch (npc->state)
+    {
+    case NPC_CHASE:
+      step_towards(tick, npc, target_x, target_y, 0);
+      break;
+    case NPC_FLEE:
+      step_towards(tick, npc, target_x, target_y, 1);
+      break;
+    default:
+      wander(tick, npc);
+      break;
+    }
+  }
+}
+
+static int nearest_target(const NpcTick *tick, const Npc *npc, int *target_x,
+                          int *target_y)
+{
+  int best = NPC_SIGHT_RADIUS + 1;
+
+  for (size_t i = 0; i < tick->target_count; i++)
+  {
+    int dx = abs(tick->targets[i].x - npc->x);
+    int dy = abs(tick->targets[i].y - npc->y);
+    int distance = dx > dy ? dx : dy;
+
+    if (distance < best)
+    {
+      best = distance;
+      *target_x = tick->targets[i].x;
+      *target_y = tick->targets[i].y;
+    }
+  }
+
+  return best <= NPC_SIGHT_RADIUS;
+}
+
+static void step_towards(const NpcTick *tick, Npc *npc, int target_x,
+                         int target_y, int away)
+{
+  int dx = sign(target_x - npc->x);
+  int dy = sign(target_y - npc->y);
+
+  if (away)
+  {
+    dx = -dx;
+    dy = -dy;
+  }
+  else if (abs(target_x - npc->x) + abs(target_y - npc->y) <= 1)
+  {
+    // Already next to the player.
+    return;
+  }
+
+  // Close the larger gap first and slide along walls on the other axis.
+  if (abs(target_x - npc->x) >= abs(target_y - npc->y))
+  {
+    if (!try_step(tick, npc, dx, 0))
+    {
+      try_step(tick, npc, 0, dy);
+    }
+  }
+  else
+  {
+    if (!try_step(tick, npc, 0, dy))
+    {
+      try_step(tick, npc, dx, 0);
+    }
+  }
+}
+
+static void wander(const NpcTick *tick, Npc *npc)
+{
+  if (npc->heading_ticks == 0 ||
+      !try_step(tick, npc, heading_dx[npc->heading],
+                heading_dy[npc->heading]))
+  {
+    npc->heading = (uint8_t)(npc_random(&npc->rng) % HEADING_COUNT);
+    npc->heading_ticks = (uint8_t)(HEADING_MIN_TICKS +
+                                   npc_random(&npc->rng) % HEADING_EXTRA_TICKS);
+    return;
+  }
+
+  npc->heading_ticks--;
+}
+
+static int try_step(const NpcTick *tick, Npc *npc, int dx, int dy)
+{
+  if ((dx == 0 && dy == 0) ||
+      !world_rect_contains(&tick->bounds, npc->x + dx, npc->y + dy) ||
+      !world_walkable(tick->world, npc->x + dx, npc->y + dy))
+  {
+    return 0;
+  }
+
+  npc->x += dx;
+  npc->y += dy;
+
+  return 1;
+}
+
+static uint32_t npc_random(uint32_t *state)
+{
+  uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+
+  return x;
+}
+
+static int sign(int value) { return (value > 0) - (value < 0); }
@@ -0,0 +1,57 @@
+#ifndef TG_NPC_H
+#define TG_NPC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "world.h"
+
+#define NPC_SIGHT_RADIUS 8
+#define NPC_MOVE_PERIOD 4
+
+typedef enum
+{
+  NPC_WANDER = NPC_STATE_WANDER,
+  NPC_CHASE = NPC_STATE_CHASE,
+  NPC_FLEE = NPC_STATE_FLEE
+} NpcState;
+
+typedef struct
+{
+  int x;
+  int y;
+  uint32_t rng;
+  uint8_t state;
+  uint8_t timid;
+  uint8_t heading;
+  uint8_t heading_ticks;
+} Npc;
+
+typedef struct
+{
+  int x;
+  int y;
+} NpcTarget;
+
+/*
+ * Everything one tick of NPC simulation reads. Each NPC only writes to its
+ * own slot and draws from its own random stream, so any split of the array
+ * across jobs produces the same result.
+ */
+typedef struct
+{
+  const World *world;
+  // NPCs never step outside this rectangle (a zone, or the whole world).
+  WorldRect bounds;
+  Npc *npcs;
+  const NpcTarget *targets;
+  size_t target_count;
+  uint64_t tick;
+} NpcTick;
+
+void npc_spawn(Npc *npcs, size_t count, const World *world,
+               const WorldRect *bounds, uint32_t seed);
+void npc_step_range(void *context, size_t begin, size_t end);
+
+#endif
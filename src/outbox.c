@@ -0,0 +1,468 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "outbox.h"
+#include "transport.h"
+
+// Datagrams sent from one outbox before looking at the next, so a room
+// with a big backlog does not hold up the others on the same thread.
+#define SENDER_BUDGET 64
+
+static int has_pending(const Outbox *outbox);
+static size_t send_pending(Outbox *outbox, size_t budget);
+static void give_back(Outbox *outbox, OutboxBuffer *buffer);
+static void reclaim(Outbox *outbox);
+static void wake_sender(Sender *sender);
+static int queue_traces(Outbox *outbox, OutboxDatagram *datagram);
+static void finish_traces(Outbox *outbox, const OutboxDatagram *datagram);
+static void finish_inline_traces(Outbox *outbox);
+static void *sender_main(void *arg);
+
+Outbox *outbox_create(void)
+{
+  Outbox *outbox = calloc(1, sizeof(*outbox));
+
+  if (outbox == NULL)
+  {
+    perror("calloc");
+    return NULL;
+  }
+
+  outbox->buffers = calloc(OUTBOX_BUFFERS, sizeof(*outbox->buffers));
+
+  if (outbox->buffers == NULL)
+  {
+    perror("calloc");
+    free(outbox);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < OUTBOX_BUFFERS; i++)
+  {
+    outbox->free_buffers[i] = &outbox->buffers[i];
+  }
+
+  outbox->free_count = OUTBOX_BUFFERS;
+
+  return outbox;
+}
+
+void outbox_destroy(Outbox *outbox)
+{
+  if (outbox == NULL)
+  {
+    return;
+  }
+
+  free(outbox->traces);
+  free(outbox->buffers);
+  free(outbox);
+}
+
+int outbox_enable_trace(Outbox *outbox, TraceLog *trace)
+{
+  outbox->traces = calloc(OUTBOX_TRACES, sizeof(*outbox->traces));
+
+  if (outbox->traces == NULL)
+  {
+    perror("calloc");
+    return -1;
+  }
+
+  outbox->trace = trace;
+
+  return 0;
+}
+
+void outbox_trace_next(Outbox *outbox, const TraceRecord *records,
+                       size_t count)
+{
+  outbox->trace_next = records;
+  outbox->trace_next_count = count;
+}
+
+char *outbox_begin(Outbox *outbox)
+{
+  if (outbox->sender == NULL)
+  {
+    outbox->open = NULL;
+    return outbox->scratch + OUTBOX_HEADROOM;
+  }
+
+  if (outbox->free_count == 0)
+  {
+    reclaim(outbox);
+  }
+
+  if (outbox->free_count == 0)
+  {
+    outbox->open = NULL;
+    return outbox->scratch + OUTBOX_HEADROOM;
+  }
+
+  outbox->open = outbox->free_buffers[--outbox->free_count];
+  outbox->pushed = 0;
+  // The room's own hold, dropped by outbox_end.
+  atomic_store_explicit(&outbox->open->refs, 1, memory_order_relaxed);
+
+  return outbox->open->data + OUTBOX_HEADROOM;
+}
+
+ssize_t outbox_push(Outbox *outbox, const char *data, size_t length,
+                    int sockfd, const struct sockaddr *addr,
+                    socklen_t addr_len)
+{
+  size_t tail = atomic_load_explicit(&outbox->tail, memory_order_relaxed);
+  OutboxDatagram *datagram;
+  ssize_t sent;
+
+  if (outbox->open == NULL ||
+      tail - atomic_load_explicit(&outbox->head, memory_order_acquire) ==
+          OUTBOX_CAPACITY ||
+      addr_len > sizeof(datagram->addr) ||
+      !queue_traces(outbox, &outbox->queue[tail % OUTBOX_CAPACITY]))
+  {
+    outbox->sent_inline++;
+    sent = transport_sendto(sockfd, data, length, 0, addr, addr_len);
+
+    finish_inline_traces(outbox);
+
+    return sent;
+  }
+
+  datagram = &outbox->queue[tail % OUTBOX_CAPACITY];
+  datagram->buffer = outbox->open;
+  datagram->data = data;
+  datagram->length = length;
+  datagram->sockfd = sockfd;
+  datagram->addr_len = addr_len;
+  memcpy(&datagram->addr, addr, addr_len);
+  atomic_fetch_add_explicit(&outbox->open->refs, 1, memory_order_relaxed);
+  atomic_store_explicit(&outbox->tail, tail + 1, memory_order_release);
+  outbox->pushed = 1;
+
+  return (ssize_t)length;
+}
+
+void outbox_end(Outbox *outbox)
+{
+  if (outbox->open == NULL)
+  {
+    return;
+  }
+
+  // Every datagram may already be sent, leaving the buffer to us.
+  if (atomic_fetch_sub_explicit(&outbox->open->refs, 1,
+                                memory_order_acq_rel) == 1)
+  {
+    outbox->free_buffers[outbox->free_count++] = outbox->open;
+  }
+
+  outbox->open = NULL;
+
+  if (outbox->pushed)
+  {
+    wake_sender(outbox->sender);
+  }
+}
+
+ssize_t outbox_send(Outbox *outbox, const void *data, size_t length,
+                    int sockfd, const struct sockaddr *addr,
+                    socklen_t addr_len)
+{
+  char *message = outbox_begin(outbox);
+  ssize_t sent;
+
+  length = length < OUTBOX_MESSAGE_SIZE ? length : OUTBOX_MESSAGE_SIZE;
+  memcpy(message, data, length);
+  sent = outbox_push(outbox, message, length, sockfd, addr, addr_len);
+  outbox_end(outbox);
+
+  return sent;
+}
+
+int sender_start(Sender *sender, Outbox *const *outboxes, int outbox_count)
+{
+  memset(sender, 0, sizeof(*sender));
+  sender->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  sender->outboxes = calloc((size_t)outbox_count, sizeof(*sender->outboxes));
+
+  if (sender->wake_fd == -1 || sender->outboxes == NULL)
+  {
+    perror("send thread setup");
+    return -1;
+  }
+
+  memcpy(sender->outboxes, outboxes,
+         (size_t)outbox_count * sizeof(*sender->outboxes));
+  sender->outbox_count = outbox_count;
+
+  for (int i = 0; i < outbox_count; i++)
+  {
+    outboxes[i]->sender = sender;
+  }
+
+  if (pthread_create(&sender->thread, NULL, sender_main, sender) != 0)
+  {
+    perror("pthread_create");
+    return -1;
+  }
+
+  return 0;
+}
+
+void sender_stop(Sender *sender)
+{
+  uint64_t one = 1;
+
+  atomic_store(&sender->stopping, 1);
+
+  if (write(sender->wake_fd, &one, sizeof(one)) == -1)
+  {
+    perror("write eventfd");
+  }
+
+  pthread_join(sender->thread, NULL);
+  close(sender->wake_fd);
+
+  for (int i = 0; i < sender->outbox_count; i++)
+  {
+    sender->outboxes[i]->sender = NULL;
+  }
+
+  free(sender->outboxes);
+}
+
+static int has_pending(const Outbox *outbox)
+{
+  return atomic_load_explicit(&outbox->tail, memory_order_acquire) !=
+         atomic_load_explicit(&outbox->head, memory_order_relaxed);
+}
+
+static size_t send_pending(Outbox *outbox, size_t budget)
+{
+  size_t head = atomic_load_explicit(&outbox->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&outbox->tail, memory_order_acquire);
+  size_t sent = 0;
+
+  while (head != tail && sent < budget)
+  {
+    const OutboxDatagram *datagram = &outbox->queue[head % OUTBOX_CAPACITY];
+
+    if (transport_sendto(datagram->sockfd, datagram->data, datagram->length, 0,
+                         (const struct sockaddr *)&datagram->addr,
+                         datagram->addr_len) == -1)
+    {
+      perror("sendto");
+    }
+
+    if (datagram->trace_count != 0)
+    {
+      finish_traces(outbox, datagram);
+    }
+
+    give_back(outbox, datagram->buffer);
+    head++;
+    sent++;
+    atomic_store_explicit(&outbox->head, head, memory_order_release);
+  }
+
+  return sent;
+}
+
+// Moves the traces for the next push into the ring, to be written once the
+// datagram is sent. Returns 0 if they do not fit, and the datagram has to
+// go out inline.
+static int queue_traces(Outbox *outbox, OutboxDatagram *datagram)
+{
+  size_t count = outbox->trace_next_count;
+
+  datagram->trace_count = 0;
+
+  if (count == 0)
+  {
+    return 1;
+  }
+
+  if (outbox->trace_tail + count -
+          atomic_load_explicit(&outbox->trace_head, memory_order_acquire) >
+      OUTBOX_TRACES)
+  {
+    return 0;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    outbox->traces[(outbox->trace_tail + i) % OUTBOX_TRACES] =
+        outbox->trace_next[i];
+  }
+
+  datagram->trace_first = outbox->trace_tail;
+  datagram->trace_count = count;
+  outbox->trace_tail += count;
+  outbox->trace_next_count = 0;
+
+  return 1;
+}
+
+// Stamps a sent datagram's traces and writes them out, on the send thread.
+static void finish_traces(Outbox *outbox, const OutboxDatagram *datagram)
+{
+  TraceRecord records[OUTBOX_TRACES / OUTBOX_CAPACITY];
+  uint64_t now = monotonic_ns();
+  size_t done = 0;
+
+  while (done < datagram->trace_count)
+  {
+    size_t batch = datagram->trace_count - done;
+
+    batch = batch < sizeof(records) / sizeof(records[0])
+                ? batch
+                : sizeof(records) / sizeof(records[0]);
+
+    for (size_t i = 0; i < batch; i++)
+    {
+      records[i] =
+          outbox->traces[(datagram->trace_first + done + i) % OUTBOX_TRACES];
+      records[i].sent_ns = now;
+    }
+
+    trace_write(outbox->trace, records, batch);
+    done += batch;
+  }
+
+  atomic_store_explicit(&outbox->trace_head,
+                        datagram->trace_first + datagram->trace_count,
+                        memory_order_release);
+}
+
+// The same for the traces of a datagram the room's thread just sent itself.
+static void finish_inline_traces(Outbox *outbox)
+{
+  uint64_t now = monotonic_ns();
+
+  for (size_t i = 0; i < outbox->trace_next_count; i++)
+  {
+    TraceRecord record = outbox->trace_next[i];
+
+    record.sent_ns = now;
+    trace_write(outbox->trace, &record, 1);
+  }
+
+  outbox->trace_next_count = 0;
+}
+
+// The returned ring has room for every buffer there is, so it never fills.
+static void give_back(Outbox *outbox, OutboxBuffer *buffer)
+{
+  size_t tail;
+
+  if (atomic_fetch_sub_explicit(&buffer->refs, 1, memory_order_acq_rel) != 1)
+  {
+    return;
+  }
+
+  tail = atomic_load_explicit(&outbox->returned_tail, memory_order_relaxed);
+  outbox->returned[tail % OUTBOX_BUFFERS] = buffer;
+  atomic_store_explicit(&outbox->returned_tail, tail + 1,
+                        memory_order_release);
+}
+
+static void reclaim(Outbox *outbox)
+{
+  size_t head =
+      atomic_load_explicit(&outbox->returned_head, memory_order_relaxed);
+  size_t tail =
+      atomic_load_explicit(&outbox->returned_tail, memory_order_acquire);
+
+  while (head != tail)
+  {
+    outbox->free_buffers[outbox->free_count++] =
+        outbox->returned[head % OUTBOX_BUFFERS];
+    head++;
+  }
+
+  atomic_store_explicit(&outbox->returned_head, head, memory_order_release);
+}
+
+static void wake_sender(Sender *sender)
+{
+  uint64_t one = 1;
+
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (atomic_load_explicit(&sender->sleeping, memory_order_relaxed) &&
+      atomic_exchange(&sender->sleeping, 0) &&
+      write(sender->wake_fd, &one, sizeof(one)) == -1)
+  {
+    perror("write eventfd");
+  }
+}
+
+static void *sender_main(void *arg)
+{
+  Sender *self = arg;
+
+  for (;;)
+  {
+    // Rooms queue their last messages before stopping is set, so once it
+    // is, a pass that finds nothing has sent everything.
+    int stopping = atomic_load(&self->stopping);
+    size_t passed = 0;
+    int busy = 0;
+    int pending = 0;
+    struct pollfd pfd;
+    uint64_t count;
+
+    for (int i = 0; i < self->outbox_count; i++)
+    {
+      size_t sent = send_pending(self->outboxes[i], SENDER_BUDGET);
+
+      self->sent += sent;
+      passed += sent;
+      busy |= sent == SENDER_BUDGET;
+    }
+
+    if (stopping && passed == 0)
+    {
+      break;
+    }
+
+    if (busy || stopping)
+    {
+      continue;
+    }
+
+    // Announce we are about to sleep, then look once more so a datagram
+    // queued in between is never missed.
+    atomic_store(&self->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    for (int i = 0; i < self->outbox_count; i++)
+    {
+      pending |= has_pending(self->outboxes[i]);
+    }
+
+    if (!pending)
+    {
+      pfd.fd = self->wake_fd;
+      pfd.events = POLLIN;
+
+      if (poll(&pfd, 1, -1) > 0 &&
+          read(self->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+      {
+        perror("read eventfd");
+      }
+    }
+
+    atomic_store(&self->sleeping, 0);
+  }
+
+  return NULL;
+}
@@ -0,0 +1,138 @@
+#ifndef TG_OUTBOX_H
+#define TG_OUTBOX_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "trace.h"
+
+/*
+ * The last stage of the server's pipeline. The dispatcher receives and
+ * routes datagrams into each room's inbox, the room's thread simulates and
+ * formats what to send, and a send thread makes the sendto calls, so a
+ * broadcast to a full room never holds up the next tick or the next input.
+ *
+ * A room formats each message once, straight into a buffer from its
+ * outbox's pool, and queues a pointer to it for every destination. The
+ * buffer is not written again until the send thread has sent the last of
+ * those and handed it back:
+ *
+ *   char *message = outbox_begin(outbox);
+ *   length = snprintf(message, OUTBOX_MESSAGE_SIZE, ...);
+ *   outbox_push(outbox, message, length, sockfd, addr_a, addr_len);
+ *   outbox_push(outbox, message, length, sockfd, addr_b, addr_len);
+ *   outbox_end(outbox);
+ *
+ * OUTBOX_HEADROOM bytes in front of the message are free for a header that
+ * some destinations get and others do not, such as a relay's, so a push may
+ * start before the message; every push that includes the header must want
+ * the same one. Only one message is open at a time.
+ *
+ * When every buffer is out or the queue is full, the room sends the message
+ * itself, as it did before there was a send thread. A push with no message
+ * open is sent at once too, for datagrams that must not wait in the queue.
+ *
+ * With a trace log, outbox_trace_next hands the next push packet traces
+ * to finish: they get the time that datagram was sent and go to the log.
+ */
+
+// The room's BUFFER_SIZE.
+#define OUTBOX_MESSAGE_SIZE 1024
+#define OUTBOX_HEADROOM 32
+#define OUTBOX_CAPACITY 1024
+#define OUTBOX_BUFFERS 256
+// Traces waiting in the queue for their datagram to go out.
+#define OUTBOX_TRACES (OUTBOX_CAPACITY * 4)
+
+typedef struct
+{
+  atomic_int refs;
+  char data[OUTBOX_HEADROOM + OUTBOX_MESSAGE_SIZE];
+} OutboxBuffer;
+
+typedef struct
+{
+  OutboxBuffer *buffer;
+  const char *data;
+  size_t length;
+  int sockfd;
+  socklen_t addr_len;
+  struct sockaddr_storage addr;
+  // Its traces: traces[trace_first .. trace_first + trace_count).
+  size_t trace_first;
+  size_t trace_count;
+} OutboxDatagram;
+
+struct Sender;
+
+typedef struct
+{
+  // Room thread to send thread.
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+  OutboxDatagram queue[OUTBOX_CAPACITY];
+
+  // Send thread to room thread: buffers whose last datagram has gone out.
+  _Alignas(64) atomic_size_t returned_head;
+  _Alignas(64) atomic_size_t returned_tail;
+  OutboxBuffer *returned[OUTBOX_BUFFERS];
+
+  // Only the room's thread touches the rest.
+  _Alignas(64) OutboxBuffer *buffers;
+  OutboxBuffer *free_buffers[OUTBOX_BUFFERS];
+  size_t free_count;
+  OutboxBuffer *open;
+  int pushed;
+  char scratch[OUTBOX_HEADROOM + OUTBOX_MESSAGE_SIZE];
+  uint64_t sent_inline;
+  struct Sender *sender;
+
+  // NULL unless tracing. The send thread moves trace_head past the traces
+  // it has written.
+  TraceLog *trace;
+  TraceRecord *traces;
+  size_t trace_tail;
+  const TraceRecord *trace_next;
+  size_t trace_next_count;
+  _Alignas(64) atomic_size_t trace_head;
+} Outbox;
+
+typedef struct Sender
+{
+  pthread_t thread;
+  int wake_fd;
+  atomic_int sleeping;
+  atomic_int stopping;
+  Outbox **outboxes;
+  int outbox_count;
+  uint64_t sent;
+} Sender;
+
+Outbox *outbox_create(void);
+void outbox_destroy(Outbox *outbox);
+
+char *outbox_begin(Outbox *outbox);
+ssize_t outbox_push(Outbox *outbox, const char *data, size_t length,
+                    int sockfd, const struct sockaddr *addr,
+                    socklen_t addr_len);
+void outbox_end(Outbox *outbox);
+int outbox_enable_trace(Outbox *outbox, TraceLog *trace);
+// records stay the caller's; the next push copies them.
+void outbox_trace_next(Outbox *outbox, const TraceRecord *records,
+                       size_t count);
+// begin, a copy of data, push and end, for messages not worth formatting
+// in place.
+ssize_t outbox_send(Outbox *outbox, const void *data, size_t length,
+                    int sockfd, const struct sockaddr *addr,
+                    socklen_t addr_len);
+
+// Until sender_start, or after sender_stop, every message is sent inline.
+int sender_start(Sender *sender, Outbox *const *outboxes, int outbox_count);
+// Sends whatever is still queued before returning.
+void sender_stop(Sender *sender);
+
+#endif
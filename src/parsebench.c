@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "protocol.h"
+#include "snapshot.h"
+
+/*
+ * Parses the same snapshot over and over with the client's parser and with
+ * the strtok_r and sscanf loop it replaced, and prints the CPU time each
+ * spends per snapshot and per player. The snapshot is laid out as the
+ * server writes it: every player's entry, then a few lines of chat. Both
+ * parsers start from a fresh copy of it each time, as the old one cut the
+ * text up while it went.
+ */
+
+typedef struct
+{
+  int players;
+  int snapshots;
+  int chat_lines;
+} BenchOptions;
+
+static void parse_arguments(int argc, char *argv[], BenchOptions *options);
+static int parse_int(const char *binary_name, const char *str, int min,
+                     int max);
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message);
+static size_t make_snapshot(const BenchOptions *options, char *snapshot);
+static int parse_with_sscanf(char *message);
+static int parse_with_snapshot_parse(char *message, size_t length);
+static void run(const char *name, const BenchOptions *options,
+                const char *snapshot, size_t length, int stream);
+static uint64_t cpu_ns(void);
+
+#define BASE_TEN 10
+#define DEFAULT_PLAYERS 32
+#define DEFAULT_SNAPSHOTS 200000
+#define DEFAULT_CHAT_LINES 2
+#define MAX_PLAYERS 512
+#define MAX_SNAPSHOTS 100000000
+#define MAX_CHAT_LINES 16
+#define MAP_DIM 4096
+#define LOCAL_PLAYER 7
+// The old parser's scratch space for a name.
+#define USERNAME_BUFFER_SIZE 1024
+#define SNAPSHOT_SEED 7
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+SnapshotPlayer players[MAX_PLAYERS];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int local_x;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int local_y;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+char name[MAX_USERNAME_LENGTH];
+
+int main(int argc, char *argv[])
+{
+  static char snapshot[SNAPSHOT_MAX_SIZE + 1];
+  BenchOptions options;
+  size_t length;
+
+  options.players = DEFAULT_PLAYERS;
+  options.snapshots = DEFAULT_SNAPSHOTS;
+  options.chat_lines = DEFAULT_CHAT_LINES;
+  parse_arguments(argc, argv, &options);
+
+  length = make_snapshot(&options, snapshot);
+
+  if (options.players > LOCAL_PLAYER)
+  {
+    snprintf(name, sizeof(name), "client%d", LOCAL_PLAYER + 1);
+  }
+
+  printf("%d snapshots of %d players and %d chat lines, %zu bytes\n",
+         options.snapshots, options.players, options.chat_lines, length);
+  printf("%-8s %14s %12s\n", "parser", "ns/snapshot", "ns/player");
+
+  run("sscanf", &options, snapshot, length, 0);
+  run("stream", &options, snapshot, length, 1);
+
+  return EXIT_SUCCESS;
+}
+
+static size_t make_snapshot(const BenchOptions *options, char *snapshot)
+{
+  unsigned int seed = SNAPSHOT_SEED;
+  size_t length = 0;
+
+  for (int i = 0; i < options->players; i++)
+  {
+    int written = snprintf(snapshot + length, SNAPSHOT_MAX_SIZE - length,
+                           "(%d, client%d, %d, %d) ", i, i + 1,
+                           rand_r(&seed) % MAP_DIM, rand_r(&seed) % MAP_DIM);
+
+    if (written < 0 || (size_t)written >= SNAPSHOT_MAX_SIZE - length)
+    {
+      usage("parsebench", EXIT_FAILURE, "Too many players for a snapshot.");
+    }
+
+    length += (size_t)written;
+  }
+
+  for (int i = 0; i < options->chat_lines; i++)
+  {
+    int written =
+        snprintf(snapshot + length, SNAPSHOT_MAX_SIZE - length,
+                 "%cclient%d: line %d", CHAT_SEPARATOR, i % 4 + 1, i);
+
+    if (written < 0 || (size_t)written >= SNAPSHOT_MAX_SIZE - length)
+    {
+      usage("parsebench", EXIT_FAILURE, "Too much chat for a snapshot.");
+    }
+
+    length += (size_t)written;
+  }
+
+  return length;
+}
+
+static void run(const char *name, const BenchOptions *options,
+                const char *snapshot, size_t length, int stream)
+{
+  static char message[SNAPSHOT_MAX_SIZE + 1];
+  uint64_t started;
+  uint64_t elapsed;
+  uint64_t parsed = 0;
+
+  started = cpu_ns();
+
+  for (int i = 0; i < options->snapshots; i++)
+  {
+    memcpy(message, snapshot, length + 1);
+    parsed += (uint64_t)(stream ? parse_with_snapshot_parse(message, length)
+                                : parse_with_sscanf(message));
+  }
+
+  elapsed = cpu_ns() - started;
+
+  if (parsed != (uint64_t)options->players * (uint64_t)options->snapshots)
+  {
+    fprintf(stderr, "%s parsed %" PRIu64 " players, expected %d a snapshot\n",
+            name, parsed, options->players);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%-8s %14.1f %12.2f\n", name, (double)elapsed / options->snapshots,
+         options->players != 0
+             ? (double)elapsed / options->snapshots / options->players
+             : 0.0);
+  fflush(stdout);
+}
+
+// What the client did before snapshot_parse.
+static int parse_with_sscanf(char *message)
+{
+  char *token;
+  char *rest;
+  char *chat = strchr(message, CHAT_SEPARATOR);
+  int count = 0;
+  int id;
+  int x;
+  int y;
+
+  if (chat != NULL)
+  {
+    *chat = '\0';
+  }
+
+  token = strtok_r(message, "()", &rest);
+
+  while (token != NULL && count < MAX_PLAYERS)
+  {
+    char username[USERNAME_BUFFER_SIZE];
+
+    // NOLINTNEXTLINE(cert-err34-c,-warnings-as-errors)
+    if (sscanf(token, "%d, %99[^,], %d, %d", &id, username, &x, &y) == 4)
+    {
+      snprintf(players[count].username, MAX_USERNAME_LENGTH, "%.*s",
+               MAX_USERNAME_LENGTH - 1, username);
+      players[count].id = id;
+      players[count].x = x;
+      players[count].y = y;
+      count++;
+
+      if (strcmp(name, username) == 0)
+      {
+        local_x = x;
+        local_y = y;
+      }
+    }
+
+    token = strtok_r(NULL, "()", &rest);
+  }
+
+  return count;
+}
+
+static int parse_with_snapshot_parse(char *message, size_t length)
+{
+  size_t positions_length;
+  int count = snapshot_parse(message, length, players, MAX_PLAYERS,
+                             &positions_length);
+
+  for (int i = 0; i < count; i++)
+  {
+    if (players[i].id == LOCAL_PLAYER)
+    {
+      local_x = players[i].x;
+      local_y = players[i].y;
+      break;
+    }
+  }
+
+  return count;
+}
+
+static uint64_t cpu_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+  return (uint64_t)ts.tv_sec * NS_PER_SECOND + (uint64_t)ts.tv_nsec;
+}
+
+static void parse_arguments(int argc, char *argv[], BenchOptions *options)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hp:n:c:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'p':
+      options->players = parse_int(argv[0], optarg, 0, MAX_PLAYERS);
+      break;
+    case 'n':
+      options->snapshots = parse_int(argv[0], optarg, 1, MAX_SNAPSHOTS);
+      break;
+    case 'c':
+      options->chat_lines = parse_int(argv[0], optarg, 0, MAX_CHAT_LINES);
+      break;
+    case 'h':
+      usage(argv[0], EXIT_SUCCESS, NULL);
+    default:
+      usage(argv[0], EXIT_FAILURE, NULL);
+    }
+  }
+
+  if (optind != argc)
+  {
+    usage(argv[0], EXIT_FAILURE, NULL);
+  }
+}
+
+static int parse_int(const char *binary_name, const char *str, int min,
+                     int max)
+{
+  char *endptr;
+  long parsed_value;
+
+  errno = 0;
+  parsed_value = strtol(str, &endptr, BASE_TEN);
+
+  if (errno != 0 || *endptr != '\0' || parsed_value < min ||
+      parsed_value > max)
+  {
+    usage(binary_name, EXIT_FAILURE, "Invalid number.");
+  }
+
+  return (int)parsed_value;
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message)
+{
+  if (message)
+  {
+    fprintf(stderr, "%s\n", message);
+  }
+
+  fprintf(stderr, "Usage: %s [-h] [-p players] [-n snapshots] [-c chat]\n",
+          program_name);
+  fputs("Options:\n", stderr);
+  fputs("  -h  Display this help message\n", stderr);
+  fputs("  -p  Players per snapshot (default: 32)\n", stderr);
+  fputs("  -n  Snapshots per parser (default: 200000)\n", stderr);
+  fputs("  -c  Chat lines after the players (default: 2)\n", stderr);
+  exit(exit_code);
+}
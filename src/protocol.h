@@ -0,0 +1,105 @@
+#ifndef TG_PROTOCOL_H
+#define TG_PROTOCOL_H
+
+#include "world.h"
+
+/*
+ * Messages shared by the server and the client. Joining, moves and clock
+ * probes are fixed-size binary messages generated from schema.h; the rest
+ * are text:
+ *
+ *   CHUNK:<cx>|<cy>|<tiles>             server -> client, raw chunk tiles
+ *   CHUNK?<cx>|<cy>                     client -> server, resend a chunk
+ *   SNAP:<id>|<n>|<count>|<part>        server -> client, fragment n of a
+ *                                       snapshot numbered id, which is
+ *   (<id>, <username>, <x>, <y>) ...    the players' positions
+ *   [\n<username>: <text>] ...          and the chat since the last one
+ *   SAY:<text>                          client -> server, a line of chat
+ *   NPCS:<x>,<y>,<state> ...            server -> client, NPCs in view
+ *   NPCN:<x>,<y>,<r>|<x>,<y>,<state> ... server -> client, only the NPCs
+ *                                       within r of (x, y); the client
+ *                                       keeps the ones it has further out
+ *   ZONE:<address>|<port>               server -> client, continue there
+ *   QUIT                                either direction
+ *
+ * Every fragment but a snapshot's last carries SNAPSHOT_FRAGMENT_SIZE bytes
+ * of it, so a full room's snapshot is never cut short, and one fragment
+ * with its headers fits the 1024-byte datagrams everything here is sized
+ * for, well inside a 1280-byte MTU. Snapshots are numbered per room and
+ * a client only draws one it has every fragment of. A player's id is its
+ * slot in the room, as given in its WELCOME, or SNAPSHOT_NO_ID for one in a
+ * neighbouring zone.
+ *
+ * Times are monotonic nanoseconds on the clock of whoever took them. A PING
+ * echoes the send time of the last PONG and how long the client held it
+ * before sending this PING, so the server gets a full exchange too
+ * (clocksync.h). Moves may carry the time they were sent on the server's
+ * clock, once the client has an estimate of it.
+ *
+ * Between the servers of a zone-sharded world (see zone.h):
+ *
+ *   HANDOFF:<room>|<address>|<port>|<username>|<x>|<y>|<rows>|<cols>
+ *   HANDOFF_ACK:<room>|<username>
+ *   GHOSTS:<room>|<zone>|<username>,<x>,<y> ...
+ *
+ * Between a relay and the server; clients talk to a relay exactly as they
+ * would to the server:
+ *
+ *   RELAY:<room>                        relay -> server, subscribe
+ *   VIA:<session>|<message>             relay -> server, a client's message
+ *   TO:<session>|<message>              server -> relay, for one client
+ *   ALL:<message>                       server -> relay, for every client
+ *
+ * The multicast stream for spectators (see spectate.h) reuses the messages
+ * above and adds
+ *
+ *   FOR:<username>|<message>            server -> group, one player's view
+ */
+
+#define MAX_USERNAME_LENGTH 20
+
+#define CHUNK_MESSAGE_PREFIX "CHUNK:"
+#define CHUNK_MESSAGE_PREFIX_LEN 6
+#define CHUNK_REQUEST_PREFIX "CHUNK?"
+#define CHUNK_REQUEST_PREFIX_LEN 6
+#define NPC_MESSAGE_PREFIX "NPCS:"
+#define NPC_MESSAGE_PREFIX_LEN 5
+#define NEAR_NPC_MESSAGE_PREFIX "NPCN:"
+#define NEAR_NPC_MESSAGE_PREFIX_LEN 5
+#define NPC_ENTRY_MAX_LEN 32
+#define NPC_STATE_WANDER 0
+#define NPC_STATE_CHASE 1
+#define NPC_STATE_FLEE 2
+#define ZONE_MESSAGE_PREFIX "ZONE:"
+#define ZONE_MESSAGE_PREFIX_LEN 5
+#define HANDOFF_MESSAGE_PREFIX "HANDOFF:"
+#define HANDOFF_MESSAGE_PREFIX_LEN 8
+#define HANDOFF_ACK_MESSAGE_PREFIX "HANDOFF_ACK:"
+#define HANDOFF_ACK_MESSAGE_PREFIX_LEN 12
+#define GHOSTS_MESSAGE_PREFIX "GHOSTS:"
+#define GHOSTS_MESSAGE_PREFIX_LEN 7
+#define RELAY_MESSAGE_PREFIX "RELAY:"
+#define RELAY_MESSAGE_PREFIX_LEN 6
+#define VIA_MESSAGE_PREFIX "VIA:"
+#define VIA_MESSAGE_PREFIX_LEN 4
+#define TO_MESSAGE_PREFIX "TO:"
+#define TO_MESSAGE_PREFIX_LEN 3
+#define ALL_MESSAGE_PREFIX "ALL:"
+#define ALL_MESSAGE_PREFIX_LEN 4
+#define FOR_MESSAGE_PREFIX "FOR:"
+#define FOR_MESSAGE_PREFIX_LEN 4
+#define SNAPSHOT_MESSAGE_PREFIX "SNAP:"
+#define SNAPSHOT_MESSAGE_PREFIX_LEN 5
+#define SNAPSHOT_FRAGMENT_SIZE 960
+#define SNAPSHOT_MAX_FRAGMENTS 16
+#define SNAPSHOT_MAX_SIZE (SNAPSHOT_FRAGMENT_SIZE * SNAPSHOT_MAX_FRAGMENTS)
+#define SNAPSHOT_NO_ID (-1)
+#define CHAT_MESSAGE_PREFIX "SAY:"
+#define CHAT_MESSAGE_PREFIX_LEN 4
+// Longest line of chat, terminator included; the server cuts longer ones.
+#define CHAT_TEXT_MAX 80
+#define CHAT_SEPARATOR '\n'
+#define CONFIRMATION_MESSAGE "Server: message confirmation"
+#define QUIT_MESSAGE "QUIT"
+
+#endif
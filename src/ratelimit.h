@@ -0,0 +1,45 @@
+#ifndef TG_RATELIMIT_H
+#define TG_RATELIMIT_H
+
+#include <stdint.h>
+
+#include "clock.h"
+
+/*
+ * Token bucket kept in its "theoretical arrival time" form: a bucket is one
+ * timestamp, the moment it would be full again, and all buckets sharing a
+ * RateLimit refill at the same rate. A packet is admitted while that moment
+ * lies less than a burst ahead of now, and pushes it one interval further.
+ */
+
+typedef struct
+{
+  uint64_t interval_ns;
+  uint64_t tolerance_ns;
+} RateLimit;
+
+// Zero per_second disables the limit.
+static inline void rate_limit_init(RateLimit *limit, uint32_t per_second,
+                                   uint32_t burst)
+{
+  limit->interval_ns = per_second != 0 ? NS_PER_SECOND / per_second : 0;
+  limit->tolerance_ns =
+      burst > 1 ? (uint64_t)(burst - 1) * limit->interval_ns : 0;
+}
+
+static inline int rate_limit_admit(const RateLimit *limit, uint64_t *bucket,
+                                   uint64_t now)
+{
+  uint64_t next = *bucket > now ? *bucket : now;
+
+  if (next - now > limit->tolerance_ns)
+  {
+    return 0;
+  }
+
+  *bucket = next + limit->interval_ns;
+
+  return 1;
+}
+
+#endif
@@ -0,0 +1,687 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "protocol.h"
+#include "schema.h"
+
+/*
+ * A relay subscribes to one room of the authoritative server and serves its
+ * own clients from it. Snapshots arrive once as ALL:<message> and are fanned
+ * out here, so each relay adds send capacity; client messages go upstream as
+ * VIA:<session>|<message>, and per-client replies come back as TO:.
+ */
+
+typedef struct
+{
+  char *listen_address;
+  char *listen_port_str;
+  char *server_address;
+  char *server_port_str;
+  int room_id;
+} RelayOptions;
+
+typedef struct
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  uint32_t session;
+  int used;
+  // When the oldest input not yet confirmed by the server arrived.
+  uint64_t input_ns;
+} RelayClient;
+
+typedef struct
+{
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+} LatencyStats;
+
+static void parse_arguments(int argc, char *argv[], RelayOptions *options);
+static in_port_t parse_in_port_t(const char *binary_name, const char *str);
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message);
+static void convert_address(const char *address, in_port_t port,
+                            struct sockaddr_storage *addr,
+                            socklen_t *addr_len);
+static int socket_create(int domain, int type, int protocol);
+static void socket_close(int sockfd);
+
+static void setup_signal_handler(void);
+static void sigint_handler(int signum);
+
+static void subscribe(int upstream_fd, int room_id);
+static void handle_client_datagram(int listen_fd, int upstream_fd);
+static void handle_server_datagram(int upstream_fd, int listen_fd);
+static void fan_out(int listen_fd, const char *message, size_t length);
+static void deliver(int listen_fd, const char *buffer, size_t length);
+static RelayClient *find_client(const struct sockaddr_storage *addr);
+static RelayClient *add_client(const struct sockaddr_storage *addr,
+                               socklen_t addr_len);
+static RelayClient *find_session(uint32_t session);
+static void shutdown_clients(int listen_fd, int upstream_fd);
+static void record_latency(LatencyStats *stats, uint64_t elapsed);
+static void report_stats(void);
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t exit_flag = 0;
+
+#define BUFFER_SIZE 2048
+#define BASE_TEN 10
+#define MAX_ROOM_ID 1000000
+#define MAX_RELAY_CLIENTS 64
+#define SUBSCRIBE_INTERVAL_MS 1000
+#define STATS_INTERVAL_MS 5000
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+RelayClient clients[MAX_RELAY_CLIENTS];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int client_count;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint32_t next_session;
+
+// Time from a datagram arriving at the relay until it has been forwarded:
+// inbound to the server, outbound until the last client has its copy.
+// Together they are what one relay hop adds to input-to-display latency.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+LatencyStats inbound_hop;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+LatencyStats outbound_hop;
+
+// From forwarding an input to the server's confirmation coming back.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+LatencyStats upstream_rtt;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint64_t fanned_out;
+
+int main(int argc, char *argv[])
+{
+  RelayOptions options;
+  struct sockaddr_storage listen_addr;
+  struct sockaddr_storage server_addr;
+  socklen_t listen_addr_len;
+  socklen_t server_addr_len;
+  int listen_fd;
+  int upstream_fd;
+  uint64_t next_subscribe_ns;
+  uint64_t next_stats_ns;
+
+  memset(&options, 0, sizeof(options));
+
+  parse_arguments(argc, argv, &options);
+  convert_address(options.listen_address,
+                  parse_in_port_t(argv[0], options.listen_port_str),
+                  &listen_addr, &listen_addr_len);
+  convert_address(options.server_address,
+                  parse_in_port_t(argv[0], options.server_port_str),
+                  &server_addr, &server_addr_len);
+
+  listen_fd = socket_create(listen_addr.ss_family, SOCK_DGRAM, 0);
+
+  if (bind(listen_fd, (struct sockaddr *)&listen_addr, listen_addr_len) == -1)
+  {
+    perror("Binding failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // Connected, so only the server's datagrams reach this socket.
+  upstream_fd = socket_create(server_addr.ss_family, SOCK_DGRAM, 0);
+
+  if (connect(upstream_fd, (struct sockaddr *)&server_addr,
+              server_addr_len) == -1)
+  {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+
+  setup_signal_handler();
+
+  printf("Relaying %s:%s to room %d of %s:%s\n", options.listen_address,
+         options.listen_port_str, options.room_id, options.server_address,
+         options.server_port_str);
+
+  next_subscribe_ns = 0;
+  next_stats_ns = monotonic_ns() + (uint64_t)STATS_INTERVAL_MS * NS_PER_MS;
+
+  while (!exit_flag)
+  {
+    struct pollfd fds[2];
+    uint64_t now = monotonic_ns();
+
+    // Subscriptions are idempotent; repeating them survives a lost one.
+    if (now >= next_subscribe_ns)
+    {
+      subscribe(upstream_fd, options.room_id);
+      next_subscribe_ns = now + (uint64_t)SUBSCRIBE_INTERVAL_MS * NS_PER_MS;
+    }
+
+    if (now >= next_stats_ns)
+    {
+      report_stats();
+      next_stats_ns = now + (uint64_t)STATS_INTERVAL_MS * NS_PER_MS;
+    }
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = upstream_fd;
+    fds[1].events = POLLIN;
+
+    if (poll(fds, 2, SUBSCRIBE_INTERVAL_MS) == -1)
+    {
+      break;
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      handle_client_datagram(listen_fd, upstream_fd);
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      handle_server_datagram(upstream_fd, listen_fd);
+    }
+  }
+
+  shutdown_clients(listen_fd, upstream_fd);
+  report_stats();
+
+  socket_close(upstream_fd);
+  socket_close(listen_fd);
+
+  return EXIT_SUCCESS;
+}
+
+static void subscribe(int upstream_fd, int room_id)
+{
+  char message[BUFFER_SIZE];
+
+  snprintf(message, sizeof(message), RELAY_MESSAGE_PREFIX "%d", room_id);
+
+  if (send(upstream_fd, message, strlen(message), 0) == -1)
+  {
+    perror("send");
+  }
+}
+
+static void handle_client_datagram(int listen_fd, int upstream_fd)
+{
+  char buffer[BUFFER_SIZE];
+  char forwarded[BUFFER_SIZE];
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  ssize_t bytes_received;
+  uint64_t arrived;
+  RelayClient *client;
+  int header_len;
+
+  memset(&addr, 0, sizeof(addr));
+  bytes_received = recvfrom(listen_fd, buffer, sizeof(buffer) / 2, 0,
+                            (struct sockaddr *)&addr, &addr_len);
+  arrived = monotonic_ns();
+
+  if (bytes_received <= 0)
+  {
+    return;
+  }
+
+  buffer[bytes_received] = '\0';
+  client = find_client(&addr);
+
+  if (client == NULL)
+  {
+    client = add_client(&addr, addr_len);
+
+    if (client == NULL)
+    {
+      return;
+    }
+  }
+
+  header_len = snprintf(forwarded, sizeof(forwarded),
+                        VIA_MESSAGE_PREFIX "%" PRIu32 "|", client->session);
+  memcpy(forwarded + header_len, buffer, (size_t)bytes_received);
+
+  if (send(upstream_fd, forwarded, (size_t)header_len + (size_t)bytes_received,
+           0) == -1)
+  {
+    perror("send");
+  }
+
+  record_latency(&inbound_hop, monotonic_ns() - arrived);
+
+  if (strcmp(buffer, QUIT_MESSAGE) == 0)
+  {
+    client->used = 0;
+    client_count--;
+  }
+  else if (client->input_ns == 0 &&
+           strncmp(buffer, CHUNK_REQUEST_PREFIX, CHUNK_REQUEST_PREFIX_LEN) !=
+               0 &&
+           message_type(buffer, (size_t)bytes_received) != MESSAGE_PING)
+  {
+    client->input_ns = arrived;
+  }
+}
+
+static void handle_server_datagram(int upstream_fd, int listen_fd)
+{
+  char buffer[BUFFER_SIZE];
+  ssize_t bytes_received;
+  uint64_t arrived;
+
+  bytes_received = recv(upstream_fd, buffer, sizeof(buffer) - 1, 0);
+  arrived = monotonic_ns();
+
+  if (bytes_received <= 0)
+  {
+    return;
+  }
+
+  buffer[bytes_received] = '\0';
+
+  if (strncmp(buffer, ALL_MESSAGE_PREFIX, ALL_MESSAGE_PREFIX_LEN) == 0)
+  {
+    fan_out(listen_fd, buffer + ALL_MESSAGE_PREFIX_LEN,
+            (size_t)bytes_received - ALL_MESSAGE_PREFIX_LEN);
+
+    // The server is going away; the clients were just told.
+    if (strcmp(buffer + ALL_MESSAGE_PREFIX_LEN, QUIT_MESSAGE) == 0)
+    {
+      for (int i = 0; i < MAX_RELAY_CLIENTS; i++)
+      {
+        clients[i].used = 0;
+      }
+
+      client_count = 0;
+      exit_flag = 1;
+    }
+  }
+  else if (strncmp(buffer, TO_MESSAGE_PREFIX, TO_MESSAGE_PREFIX_LEN) == 0)
+  {
+    deliver(listen_fd, buffer, (size_t)bytes_received);
+  }
+  else
+  {
+    return;
+  }
+
+  record_latency(&outbound_hop, monotonic_ns() - arrived);
+}
+
+static void fan_out(int listen_fd, const char *message, size_t length)
+{
+  for (int i = 0; i < MAX_RELAY_CLIENTS; i++)
+  {
+    if (!clients[i].used)
+    {
+      continue;
+    }
+
+    if (sendto(listen_fd, message, length, 0,
+               (const struct sockaddr *)&clients[i].addr,
+               clients[i].addr_len) == -1)
+    {
+      perror("sendto");
+      continue;
+    }
+
+    fanned_out++;
+  }
+}
+
+static void deliver(int listen_fd, const char *buffer, size_t length)
+{
+  const char *payload;
+  char *endptr;
+  unsigned long session;
+  RelayClient *client;
+  uint64_t now;
+
+  session = strtoul(buffer + TO_MESSAGE_PREFIX_LEN, &endptr, BASE_TEN);
+
+  if (*endptr != '|' || session > UINT32_MAX)
+  {
+    return;
+  }
+
+  client = find_session((uint32_t)session);
+
+  if (client == NULL)
+  {
+    return;
+  }
+
+  payload = endptr + 1;
+
+  if (sendto(listen_fd, payload, length - (size_t)(payload - buffer), 0,
+             (const struct sockaddr *)&client->addr, client->addr_len) == -1)
+  {
+    perror("sendto");
+    return;
+  }
+
+  fanned_out++;
+  now = monotonic_ns();
+
+  if (client->input_ns != 0 && strcmp(payload, CONFIRMATION_MESSAGE) == 0)
+  {
+    record_latency(&upstream_rtt, now - client->input_ns);
+    client->input_ns = 0;
+  }
+}
+
+// A linear scan: a relay serves one room, so it never has many clients.
+static RelayClient *find_client(const struct sockaddr_storage *addr)
+{
+  for (int i = 0; i < MAX_RELAY_CLIENTS; i++)
+  {
+    if (clients[i].used &&
+        memcmp(addr, &clients[i].addr, sizeof(struct sockaddr_storage)) == 0)
+    {
+      return &clients[i];
+    }
+  }
+
+  return NULL;
+}
+
+static RelayClient *add_client(const struct sockaddr_storage *addr,
+                               socklen_t addr_len)
+{
+  for (int i = 0; i < MAX_RELAY_CLIENTS; i++)
+  {
+    if (!clients[i].used)
+    {
+      RelayClient *client = &clients[i];
+
+      client->addr = *addr;
+      client->addr_len = addr_len;
+      // Never reused, so a late reply can't reach the slot's next owner.
+      client->session = next_session++;
+      client->input_ns = 0;
+      client->used = 1;
+      client_count++;
+
+      return client;
+    }
+  }
+
+  fprintf(stderr, "Relay full, dropping a new client\n");
+
+  return NULL;
+}
+
+static RelayClient *find_session(uint32_t session)
+{
+  for (int i = 0; i < MAX_RELAY_CLIENTS; i++)
+  {
+    if (clients[i].used && clients[i].session == session)
+    {
+      return &clients[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void shutdown_clients(int listen_fd, int upstream_fd)
+{
+  for (int i = 0; i < MAX_RELAY_CLIENTS; i++)
+  {
+    char message[BUFFER_SIZE];
+
+    if (!clients[i].used)
+    {
+      continue;
+    }
+
+    // Free the session upstream and stop the client waiting on us.
+    snprintf(message, sizeof(message),
+             VIA_MESSAGE_PREFIX "%" PRIu32 "|" QUIT_MESSAGE,
+             clients[i].session);
+
+    if (send(upstream_fd, message, strlen(message), 0) == -1)
+    {
+      perror("send");
+    }
+
+    if (sendto(listen_fd, QUIT_MESSAGE, strlen(QUIT_MESSAGE), 0,
+               (const struct sockaddr *)&clients[i].addr,
+               clients[i].addr_len) == -1)
+    {
+      perror("sendto");
+    }
+
+    clients[i].used = 0;
+  }
+
+  client_count = 0;
+}
+
+static void record_latency(LatencyStats *stats, uint64_t elapsed)
+{
+  stats->count++;
+  stats->total_ns += elapsed;
+
+  if (elapsed > stats->max_ns)
+  {
+    stats->max_ns = elapsed;
+  }
+}
+
+static void report_stats(void)
+{
+  const LatencyStats *all[] = {&inbound_hop, &outbound_hop, &upstream_rtt};
+  const char *names[] = {"inbound hop", "outbound hop", "upstream rtt"};
+
+  printf("relay: %d clients, %" PRIu64 " datagrams out", client_count,
+         fanned_out);
+
+  for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+  {
+    if (all[i]->count != 0)
+    {
+      printf(", %s avg %" PRIu64 " us max %" PRIu64 " us", names[i],
+             all[i]->total_ns / all[i]->count / NS_PER_US,
+             all[i]->max_ns / NS_PER_US);
+    }
+  }
+
+  printf("\n");
+  fflush(stdout);
+
+  memset(&inbound_hop, 0, sizeof(inbound_hop));
+  memset(&outbound_hop, 0, sizeof(outbound_hop));
+  memset(&upstream_rtt, 0, sizeof(upstream_rtt));
+  fanned_out = 0;
+}
+
+static void parse_arguments(int argc, char *argv[], RelayOptions *options)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hr:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'r':
+    {
+      char *endptr;
+      long room_id;
+
+      errno = 0;
+      room_id = strtol(optarg, &endptr, BASE_TEN);
+
+      if (errno != 0 || *endptr != '\0' || room_id < 0 ||
+          room_id > MAX_ROOM_ID)
+      {
+        usage(argv[0], EXIT_FAILURE, "Invalid room number.");
+      }
+
+      options->room_id = (int)room_id;
+      break;
+    }
+    case 'h':
+      usage(argv[0], EXIT_SUCCESS, NULL);
+    default:
+      usage(argv[0], EXIT_FAILURE, NULL);
+    }
+  }
+
+  if (argc - optind != 4)
+  {
+    usage(argv[0], EXIT_FAILURE, NULL);
+  }
+
+  options->listen_address = argv[optind];
+  options->listen_port_str = argv[optind + 1];
+  options->server_address = argv[optind + 2];
+  options->server_port_str = argv[optind + 3];
+}
+
+static in_port_t parse_in_port_t(const char *binary_name, const char *str)
+{
+  char *endptr;
+  uintmax_t parsed_value;
+
+  errno = 0;
+  parsed_value = strtoumax(str, &endptr, BASE_TEN);
+
+  if (errno != 0)
+  {
+    perror("Error parsing in_port_t");
+    exit(EXIT_FAILURE);
+  }
+
+  if (*endptr != '\0')
+  {
+    usage(binary_name, EXIT_FAILURE, "Invalid characters in input.");
+  }
+
+  if (parsed_value > UINT16_MAX)
+  {
+    usage(binary_name, EXIT_FAILURE, "in_port_t value out of range.");
+  }
+
+  return (in_port_t)parsed_value;
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message)
+{
+  if (message)
+  {
+    fprintf(stderr, "%s\n", message);
+  }
+
+  fprintf(stderr,
+          "Usage: %s [-h] [-r room] <listen address> <listen port> "
+          "<server address> <server port>\n",
+          program_name);
+  fputs("Options:\n", stderr);
+  fputs("  -h  Display this help message\n", stderr);
+  fputs("  -r  Room to relay (default: 0)\n", stderr);
+  exit(exit_code);
+}
+
+static void convert_address(const char *address, in_port_t port,
+                            struct sockaddr_storage *addr,
+                            socklen_t *addr_len)
+{
+  memset(addr, 0, sizeof(*addr));
+
+  if (inet_pton(AF_INET, address, &(((struct sockaddr_in *)addr)->sin_addr)) ==
+      1)
+  {
+    struct sockaddr_in *ipv4_addr = (struct sockaddr_in *)addr;
+
+    ipv4_addr->sin_family = AF_INET;
+    ipv4_addr->sin_port = htons(port);
+    *addr_len = sizeof(*ipv4_addr);
+  }
+  else if (inet_pton(AF_INET6, address,
+                     &(((struct sockaddr_in6 *)addr)->sin6_addr)) == 1)
+  {
+    struct sockaddr_in6 *ipv6_addr = (struct sockaddr_in6 *)addr;
+
+    ipv6_addr->sin6_family = AF_INET6;
+    ipv6_addr->sin6_port = htons(port);
+    *addr_len = sizeof(*ipv6_addr);
+  }
+  else
+  {
+    fprintf(stderr, "%s is not an IPv4 or an IPv6 address\n", address);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int socket_create(int domain, int type, int protocol)
+{
+  int sockfd;
+
+  sockfd = socket(domain, type, protocol);
+
+  if (sockfd == -1)
+  {
+    perror("Socket creation failed");
+    exit(EXIT_FAILURE);
+  }
+
+  return sockfd;
+}
+
+static void socket_close(int sockfd)
+{
+  if (close(sockfd) == -1)
+  {
+    perror("Error closing socket");
+    exit(EXIT_FAILURE);
+  }
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+static void sigint_handler(int signum) { exit_flag = 1; }
+
+#pragma GCC diagnostic pop
+
+static void setup_signal_handler(void)
+{
+  struct sigaction sa;
+
+  memset(&sa, 0, sizeof(sa));
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+  sa.sa_handler = sigint_handler;
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+
+  if (sigaction(SIGINT, &sa, NULL) == -1)
+  {
+    perror("sigaction");
+    exit(EXIT_FAILURE);
+  }
+}
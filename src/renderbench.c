@@ -0,0 +1,296 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "screen.h"
+#include "world.h"
+
+/*
+ * Draws the frames the client draws, through both screen backends, into a
+ * scratch file standing in for the terminal, and prints the CPU time and
+ * bytes each backend spends per frame. "walk" scrolls the whole view one
+ * cell every frame as a moving player does; "idle" keeps the view still and
+ * only moves the NPCs, as while the player stands and watches.
+ */
+
+typedef struct
+{
+  int frames;
+  int rows;
+  int cols;
+  int npcs;
+} BenchOptions;
+
+typedef struct
+{
+  int x;
+  int y;
+} BenchNpc;
+
+typedef struct
+{
+  const char *name;
+  int walking;
+} BenchScene;
+
+static void parse_arguments(int argc, char *argv[], BenchOptions *options);
+static int parse_int(const char *binary_name, const char *str, int min,
+                     int max);
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message);
+static void make_map(void);
+static void run(const BenchOptions *options, ScreenBackend backend,
+                const BenchScene *scene);
+static void draw_frame(const BenchOptions *options, int origin_x,
+                       int origin_y);
+static uint64_t cpu_ns(void);
+
+#define BASE_TEN 10
+#define MAP_DIM 1024
+#define MAP_MASK (MAP_DIM - 1)
+#define WALL_PERCENT 12
+#define PERCENT 100
+#define DEFAULT_FRAMES 2000
+#define DEFAULT_ROWS 50
+#define DEFAULT_COLS 180
+#define DEFAULT_NPCS 40
+#define MAX_FRAMES 1000000
+#define MAX_DIM 1000
+#define MAX_NPCS 4096
+#define MAP_SEED 7
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+char map[MAP_DIM * MAP_DIM];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+BenchNpc npcs[MAX_NPCS];
+
+int main(int argc, char *argv[])
+{
+  static const BenchScene scenes[] = {{"walk", 1}, {"idle", 0}};
+  BenchOptions options;
+
+  options.frames = DEFAULT_FRAMES;
+  options.rows = DEFAULT_ROWS;
+  options.cols = DEFAULT_COLS;
+  options.npcs = DEFAULT_NPCS;
+  parse_arguments(argc, argv, &options);
+
+  // ncurses needs a terminal description even when writing to a file.
+  setenv("TERM", "xterm-256color", 0);
+  make_map();
+
+  printf("%d frames of %dx%d with %d NPCs\n", options.frames, options.rows,
+         options.cols, options.npcs);
+  printf("%-8s %-6s %12s %14s\n", "backend", "scene", "us/frame",
+         "bytes/frame");
+
+  for (size_t i = 0; i < sizeof(scenes) / sizeof(scenes[0]); i++)
+  {
+    run(&options, SCREEN_NCURSES, &scenes[i]);
+    run(&options, SCREEN_ANSI, &scenes[i]);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static void make_map(void)
+{
+  unsigned int seed = MAP_SEED;
+
+  for (int i = 0; i < MAP_DIM * MAP_DIM; i++)
+  {
+    map[i] = rand_r(&seed) % PERCENT < WALL_PERCENT ? WORLD_TILE_WALL
+                                                    : WORLD_TILE_FLOOR;
+  }
+}
+
+static void run(const BenchOptions *options, ScreenBackend backend,
+                const BenchScene *scene)
+{
+  char path[] = "/tmp/renderbench.XXXXXX";
+  struct stat before;
+  struct stat after;
+  unsigned int seed = MAP_SEED;
+  uint64_t started;
+  uint64_t elapsed;
+  int fd;
+
+  fd = mkstemp(path);
+
+  if (fd == -1)
+  {
+    perror("mkstemp");
+    exit(EXIT_FAILURE);
+  }
+
+  unlink(path);
+
+  for (int i = 0; i < options->npcs; i++)
+  {
+    npcs[i].x = rand_r(&seed) % options->cols;
+    npcs[i].y = rand_r(&seed) % options->rows;
+  }
+
+  if (screen_init(backend, fd, options->rows, options->cols) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  // The first frame paints everything either way; count the ones after it.
+  draw_frame(options, 0, 0);
+  screen_present();
+  fstat(fd, &before);
+  started = cpu_ns();
+
+  for (int frame = 1; frame <= options->frames; frame++)
+  {
+    for (int i = 0; i < options->npcs; i++)
+    {
+      npcs[i].x += (int)(rand_r(&seed) % 3) - 1;
+      npcs[i].y += (int)(rand_r(&seed) % 3) - 1;
+    }
+
+    draw_frame(options, scene->walking ? frame : 0, 0);
+    screen_present();
+  }
+
+  elapsed = cpu_ns() - started;
+  fstat(fd, &after);
+  screen_shutdown();
+  close(fd);
+
+  printf("%-8s %-6s %12.1f %14.0f\n",
+         backend == SCREEN_ANSI ? "ansi" : "ncurses", scene->name,
+         (double)elapsed / NS_PER_US / options->frames,
+         (double)(after.st_size - before.st_size) / options->frames);
+  fflush(stdout);
+}
+
+// Laid out like the client's view: a border, the map, NPCs and the player in
+// bold at the centre.
+static void draw_frame(const BenchOptions *options, int origin_x,
+                       int origin_y)
+{
+  int view_rows = options->rows - 2;
+  int view_cols = options->cols - 2;
+
+  for (int i = 0; i < options->cols; i++)
+  {
+    screen_put(0, i, '-', SCREEN_NORMAL);
+    screen_put(options->rows - 1, i, '-', SCREEN_NORMAL);
+  }
+
+  for (int i = 1; i < options->rows - 1; i++)
+  {
+    screen_put(i, 0, '|', SCREEN_NORMAL);
+    screen_put(i, options->cols - 1, '|', SCREEN_NORMAL);
+  }
+
+  for (int row = 0; row < view_rows; row++)
+  {
+    for (int col = 0; col < view_cols; col++)
+    {
+      screen_put(row + 1, col + 1,
+                 map[(((origin_y + row) & MAP_MASK) * MAP_DIM) +
+                     ((origin_x + col) & MAP_MASK)],
+                 SCREEN_NORMAL);
+    }
+  }
+
+  // NPCs keep up with the player, so the view never empties.
+  for (int i = 0; i < options->npcs; i++)
+  {
+    int col = ((npcs[i].x % view_cols) + view_cols) % view_cols;
+    int row = ((npcs[i].y % view_rows) + view_rows) % view_rows;
+
+    screen_put(row + 1, col + 1, 'x', SCREEN_NORMAL);
+  }
+
+  screen_put(view_rows / 2 + 1, view_cols / 2 + 1, 'o', SCREEN_BOLD);
+}
+
+static uint64_t cpu_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+  return (uint64_t)ts.tv_sec * NS_PER_SECOND + (uint64_t)ts.tv_nsec;
+}
+
+static void parse_arguments(int argc, char *argv[], BenchOptions *options)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hf:r:c:n:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'f':
+      options->frames = parse_int(argv[0], optarg, 1, MAX_FRAMES);
+      break;
+    case 'r':
+      options->rows = parse_int(argv[0], optarg, 3, MAX_DIM);
+      break;
+    case 'c':
+      options->cols = parse_int(argv[0], optarg, 3, MAX_DIM);
+      break;
+    case 'n':
+      options->npcs = parse_int(argv[0], optarg, 0, MAX_NPCS);
+      break;
+    case 'h':
+      usage(argv[0], EXIT_SUCCESS, NULL);
+    default:
+      usage(argv[0], EXIT_FAILURE, NULL);
+    }
+  }
+
+  if (optind != argc)
+  {
+    usage(argv[0], EXIT_FAILURE, NULL);
+  }
+}
+
+static int parse_int(const char *binary_name, const char *str, int min,
+                     int max)
+{
+  char *endptr;
+  long parsed_value;
+
+  errno = 0;
+  parsed_value = strtol(str, &endptr, BASE_TEN);
+
+  if (errno != 0 || *endptr != '\0' || parsed_value < min ||
+      parsed_value > max)
+  {
+    usage(binary_name, EXIT_FAILURE, "Invalid number.");
+  }
+
+  return (int)parsed_value;
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message)
+{
+  if (message)
+  {
+    fprintf(stderr, "%s\n", message);
+  }
+
+  fprintf(stderr, "Usage: %s [-h] [-f frames] [-r rows] [-c cols] [-n npcs]\n",
+          program_name);
+  fputs("Options:\n", stderr);
+  fputs("  -h  Display this help message\n", stderr);
+  fputs("  -f  Frames per run (default: 2000)\n", stderr);
+  fputs("  -r  Terminal rows (default: 50)\n", stderr);
+  fputs("  -c  Terminal columns (default: 180)\n", stderr);
+  fputs("  -n  NPCs in view (default: 40)\n", stderr);
+  exit(exit_code);
+}
@@ -0,0 +1,72 @@
+#ifndef TG_RNG_H
+#define TG_RNG_H
+
+#include <stdint.h>
+
+/*
+ * xoshiro256** (Blackman and Vigna), the random stream each room draws from.
+ * A draw is a handful of shifts and adds on 32 bytes of state that only its
+ * room's thread touches, so nothing is reseeded or shared between draws, and
+ * the same seed replays the same draws. The state is filled from the seed
+ * with splitmix64, as the authors recommend, so any seed will do, even 0 or
+ * consecutive ones.
+ */
+
+typedef struct
+{
+  uint64_t s[4];
+} Rng;
+
+static inline uint64_t rng_rotl(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+static inline void rng_seed(Rng *rng, uint64_t seed)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    rng->s[i] = z ^ (z >> 31);
+  }
+}
+
+static inline uint64_t rng_next(Rng *rng)
+{
+  uint64_t *s = rng->s;
+  uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rng_rotl(s[3], 45);
+
+  return result;
+}
+
+// Uniform in [0, bound) for bound > 0, by Lemire's multiply-and-reject,
+// which almost never needs a second draw and never divides on the first.
+static inline uint32_t rng_below(Rng *rng, uint32_t bound)
+{
+  uint64_t product = (rng_next(rng) >> 32) * bound;
+
+  if ((uint32_t)product < bound)
+  {
+    uint32_t threshold = -bound % bound;
+
+    while ((uint32_t)product < threshold)
+    {
+      product = (rng_next(rng) >> 32) * bound;
+    }
+  }
+
+  return (uint32_t)(product >> 32);
+}
+
+#endif
@@ -0,0 +1,2518 @@
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "protocol.h"
+#include "outbox.h"
+#include "room.h"
+#include "schema.h"
+
+typedef struct
+{
+  uint64_t tick;
+  Rng rng;
+  uint32_t joins;
+  // Clients drop snapshots numbered behind the last one they drew, so the
+  // numbering carries on across a restart.
+  uint32_t snapshot_id;
+  int relay_count;
+  RelayLink relays[MAX_RELAYS];
+  ClientInfo clients[MAX_CLIENTS];
+  SimPlayer players[MAX_CLIENTS];
+  // Followed by the room's Npc array.
+} RoomSnapshot;
+
+static void initialize_clients(Room *room);
+static int add_client(Room *room, const struct sockaddr_storage *client_addr,
+                      int relay, uint32_t session, int view_rows,
+                      int view_cols);
+static int welcome_client(Room *room, int index);
+static ssize_t send_welcome(Room *room, int index);
+static uint64_t new_session_token(const Room *room, int index);
+static int find_client(const Room *room,
+                       const struct sockaddr_storage *client_addr, int relay,
+                       uint32_t session);
+static int find_session(Room *room, uint64_t token,
+                        const struct sockaddr_storage *client_addr, int relay,
+                        uint32_t session);
+static void remove_client(Room *room, int index);
+static int claim_route(Room *room, int index, int relay);
+static void post_route_update(Room *room, RouteChange change,
+                              const struct sockaddr_storage *addr,
+                              const struct sockaddr_storage *from, int relay);
+static void broadcast(Room *room, char *message, int sender_index);
+static ssize_t push_to_client(Room *room, int index, char *message,
+                              size_t length);
+static ssize_t push_to_session(Room *room,
+                               const struct sockaddr_storage *addr,
+                               int relay, uint32_t session, char *message,
+                               size_t length);
+static ssize_t send_to_client(Room *room, int index, const char *message,
+                              size_t length);
+static ssize_t send_to_session(Room *room,
+                               const struct sockaddr_storage *addr,
+                               int relay, uint32_t session,
+                               const char *message, size_t length);
+static void handle_packet(Room *room,
+                          const struct sockaddr_storage *client_addr,
+                          int from_peer, const char *buffer, size_t bytes,
+                          uint64_t received_ns);
+static void handle_client_packet(Room *room,
+                                 const struct sockaddr_storage *client_addr,
+                                 int relay, uint32_t session,
+                                 const char *buffer, size_t bytes,
+                                 uint64_t received_ns);
+static void handle_relayed_packet(Room *room,
+                                  const struct sockaddr_storage *relay_addr,
+                                  const char *buffer, size_t bytes,
+                                  uint64_t received_ns);
+static void log_join(const Room *room,
+                     const struct sockaddr_storage *client_addr);
+static int add_relay(Room *room, const struct sockaddr_storage *relay_addr);
+static int find_relay(const Room *room,
+                      const struct sockaddr_storage *relay_addr);
+
+static int handle_move_outcome(Room *room, int index, uint8_t direction,
+                               uint8_t outcome);
+static void apply_inputs(Room *room);
+static size_t serialize_all_client_positions(Room *room, char *buffer);
+static size_t append_position(char *buffer, size_t length, int id,
+                              const char *username, int x, int y);
+static void broadcast_snapshot(Room *room, int sender_index);
+static size_t count_fragments(size_t length);
+static size_t format_fragment(char *message, uint32_t id,
+                              const char *snapshot, size_t length,
+                              size_t index, size_t count);
+static void handle_chat(Room *room, int index, const char *text);
+static size_t append_chat(Room *room, char *message, size_t length,
+                          uint64_t *cursor);
+
+static void stream_visible_chunks(Room *room, int index);
+static void handle_chunk_request(Room *room, int index, const char *buffer);
+static void visible_chunk_range(const Room *room, int index, int *cx0,
+                                int *cy0, int *cx1, int *cy1);
+static void send_chunk(Room *room, int index, int cx, int cy);
+static int format_chunk(const Room *room, int cx, int cy, char *message);
+
+static void send_visible_npcs(Room *room, int index);
+static size_t format_visible_npcs(const Room *room, int index, char *message,
+                                  size_t size, int radius, int *visible,
+                                  int *near);
+static void report_tick_stats(Room *room);
+static int npc_full_update_due(const Room *room, int index);
+static void watch_tick(Room *room, uint64_t work_ns);
+static void report_watchdog(const Room *room);
+
+static void handle_ping(Room *room, int index, const PingMessage *ping,
+                        uint64_t received_ns);
+static void record_rtt(SessionClock *clock, uint64_t rtt_ns);
+static void record_input_delay(SessionClock *clock, uint64_t sent,
+                               uint64_t received_ns);
+static uint64_t rtt_percentile_us(const SessionClock *clock,
+                                  uint32_t percent);
+static void report_session_clocks(Room *room);
+
+static void handle_peer_packet(Room *room,
+                               const struct sockaddr_storage *peer_addr,
+                               const char *buffer);
+static void begin_handoff(Room *room, int index, int zone, int x, int y);
+static void send_handoff(Room *room, int index);
+static void update_handoffs(Room *room);
+static void handle_handoff(Room *room,
+                           const struct sockaddr_storage *peer_addr,
+                           const char *buffer);
+static void handle_handoff_ack(Room *room, const char *buffer);
+static void send_ghosts(Room *room);
+static void handle_ghosts(Room *room, const char *buffer);
+static void expire_ghosts(Room *room);
+static int find_client_by_name(const Room *room, const char *username);
+
+static void publish(Room *room, const char *message, size_t length);
+static void publish_tick(Room *room);
+static void publish_chunks(Room *room);
+
+static void trace_begin(Room *room, const Datagram *slot, uint64_t now);
+static void trace_end(Room *room);
+static void trace_next_push(Room *room, int index, int relay);
+static void trace_drop(Room *room, int index);
+
+#define BASE_TEN 10
+#define DEFAULT_VIEW_ROWS 24
+#define DEFAULT_VIEW_COLS 80
+#define MAX_VIEW_DIMENSION 1000
+#define STATS_INTERVAL_TICKS 100
+#define HANDOFF_RETRY_MS 100
+#define HANDOFF_TIMEOUT_MS 2000
+#define GHOST_EXPIRY_TICKS 20
+#define RELAY_HEADER_MAX 16
+#define PERCENT 100
+#define SPECTATOR_CHUNKS_PER_TICK 4
+#define SPECTATOR_WORLD_INTERVAL_TICKS 20
+#define SHED_DISTANT_INTERVAL_TICKS 4
+#define SHED_MERGED_MOVES 2
+
+Room *room_create(int id, int sockfd, const World *world,
+                  const SpawnCells *spawns, JobPool *job_pool,
+                  const ZoneMap *zones, const SpectatorStream *spectators,
+                  size_t npc_count, uint32_t seed, uint64_t tick_budget_ns)
+{
+  Room *room;
+
+  room = calloc(1, sizeof(*room));
+
+  if (room == NULL)
+  {
+    perror("calloc");
+    return NULL;
+  }
+
+  room->id = id;
+  room->sockfd = sockfd;
+  room->world = world;
+  room->zones = zones;
+  room->area = spawns->area;
+  room->spectators = spectators;
+  room->watchdog.budget_ns = tick_budget_ns;
+
+  if (spectators != NULL)
+  {
+    room->spectator_addr = spectators->group;
+    room->spectator_addr.sin_port =
+        htons((in_port_t)(ntohs(spectators->group.sin_port) + id));
+  }
+
+  room->outbox = outbox_create();
+
+  if (room->outbox == NULL)
+  {
+    room_destroy(room);
+    return NULL;
+  }
+
+  if (sim_init(&room->sim, world, spawns, job_pool, npc_count, seed) == -1)
+  {
+    room_destroy(room);
+    return NULL;
+  }
+
+  room->next_tick_ns = monotonic_ns() + (uint64_t)TICK_INTERVAL_MS * NS_PER_MS;
+  initialize_clients(room);
+
+  return room;
+}
+
+void room_destroy(Room *room)
+{
+  if (room == NULL)
+  {
+    return;
+  }
+
+  if (room->trace_pending != NULL)
+  {
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+      trace_drop(room, i);
+    }
+  }
+
+  sim_destroy(&room->sim);
+  outbox_destroy(room->outbox);
+  free(room->trace_pending);
+  free(room->trace_batch);
+  free(room);
+}
+
+int room_enable_trace(Room *room, TraceLog *trace)
+{
+  room->trace_pending = calloc(MAX_CLIENTS, sizeof(*room->trace_pending));
+  // Room for every record a relay's copy of a snapshot can carry.
+  room->trace_batch =
+      calloc(MAX_CLIENTS * TRACE_PENDING + 1, sizeof(*room->trace_batch));
+
+  if (room->trace_pending == NULL || room->trace_batch == NULL)
+  {
+    perror("calloc");
+    return -1;
+  }
+
+  if (outbox_enable_trace(room->outbox, trace) == -1)
+  {
+    return -1;
+  }
+
+  room->trace = trace;
+  room->trace_client = -1;
+
+  return 0;
+}
+
+int room_enqueue(Room *room, const struct sockaddr_storage *addr,
+                 socklen_t addr_len, int from_peer, int routed,
+                 const char *data, size_t length, uint64_t kernel_ns)
+{
+  size_t tail = atomic_load_explicit(&room->inbox.tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&room->inbox.head, memory_order_acquire);
+  Datagram *slot;
+
+  if (tail - head == ROOM_INBOX_CAPACITY || length > BUFFER_SIZE)
+  {
+    atomic_fetch_add_explicit(&room->packets_dropped, 1,
+                              memory_order_relaxed);
+    return -1;
+  }
+
+  slot = &room->inbox.slots[tail % ROOM_INBOX_CAPACITY];
+
+  // Sessions are matched with memcmp, so the unused tail must be zero.
+  memset(&slot->addr, 0, sizeof(slot->addr));
+  memcpy(&slot->addr, addr, addr_len);
+  slot->from_peer = from_peer;
+  slot->routed = routed;
+  slot->received_ns = monotonic_ns();
+  slot->kernel_ns = kernel_ns;
+  memcpy(slot->data, data, length);
+  slot->data[length] = '\0';
+  slot->length = length;
+
+  atomic_store_explicit(&room->inbox.tail, tail + 1, memory_order_release);
+
+  return 0;
+}
+
+int room_has_pending(Room *room)
+{
+  return atomic_load_explicit(&room->inbox.tail, memory_order_acquire) !=
+         atomic_load_explicit(&room->inbox.head, memory_order_relaxed);
+}
+
+int room_take_route_update(Room *room, RouteUpdate *update)
+{
+  RouteUpdateQueue *queue = &room->route_updates;
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+  if (head == tail)
+  {
+    return 0;
+  }
+
+  *update = queue->slots[head % ROOM_ROUTE_UPDATES];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+  return 1;
+}
+
+size_t room_drain(Room *room, size_t budget)
+{
+  size_t head = atomic_load_explicit(&room->inbox.head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&room->inbox.tail, memory_order_acquire);
+  size_t handled = 0;
+  uint64_t start;
+
+  if (head == tail)
+  {
+    return 0;
+  }
+
+  start = monotonic_ns();
+
+  while (head != tail && handled < budget)
+  {
+    const Datagram *slot = &room->inbox.slots[head % ROOM_INBOX_CAPACITY];
+
+    if (room->trace != NULL && !slot->from_peer)
+    {
+      trace_begin(room, slot, handled == 0 ? start : monotonic_ns());
+    }
+
+    room->routed = slot->routed;
+    handle_packet(room, &slot->addr, slot->from_peer, slot->data,
+                  slot->length, slot->received_ns);
+    trace_end(room);
+    head++;
+    handled++;
+    atomic_store_explicit(&room->inbox.head, head, memory_order_release);
+  }
+
+  room->tick_stats.packets += handled;
+  room->drain_ns += monotonic_ns() - start;
+
+  return handled;
+}
+
+void room_tick(Room *room)
+{
+  uint64_t start = monotonic_ns();
+  uint64_t interval_ns = room_tick_interval_ns(room);
+  int level = room->watchdog.level;
+
+  // Before the moves, so what these change goes out in this tick's
+  // snapshot.
+  if (room->zones != NULL)
+  {
+    update_handoffs(room);
+    expire_ghosts(room);
+  }
+
+  apply_inputs(room);
+
+  if (room->sim.npc_count > 0)
+  {
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+      if (room->clients[i].addr_len != 0)
+      {
+        send_visible_npcs(room, i);
+      }
+    }
+  }
+
+  if (room->zones != NULL &&
+      (level < SHED_DISTANT ||
+       room->sim.tick % SHED_DISTANT_INTERVAL_TICKS == 0))
+  {
+    send_ghosts(room);
+  }
+
+  if (room->spectators != NULL && level < SHED_NON_ESSENTIAL)
+  {
+    publish_tick(room);
+  }
+
+  // A merged tick stands in for several and may take as long as they would.
+  watch_tick(room, (room->drain_ns + (monotonic_ns() - start)) /
+                       (interval_ns / ((uint64_t)TICK_INTERVAL_MS * NS_PER_MS)));
+  room->drain_ns = 0;
+
+  if (room->sim.tick % STATS_INTERVAL_TICKS == 0)
+  {
+    report_tick_stats(room);
+  }
+}
+
+uint64_t room_tick_interval_ns(const Room *room)
+{
+  uint64_t interval = (uint64_t)TICK_INTERVAL_MS * NS_PER_MS;
+
+  return room->watchdog.level >= SHED_MERGE_INPUTS
+             ? interval * SHED_MERGED_MOVES
+             : interval;
+}
+
+void room_shutdown(Room *room)
+{
+  char *message;
+
+  // No snapshot is coming for what still waits on one.
+  if (room->trace != NULL)
+  {
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+      trace_drop(room, i);
+    }
+  }
+
+  message = outbox_begin(room->outbox);
+  strcpy(message, QUIT_MESSAGE);
+  broadcast(room, message, -1);
+
+  if (room->spectators != NULL)
+  {
+    publish(room, QUIT_MESSAGE, strlen(QUIT_MESSAGE));
+  }
+
+  report_watchdog(room);
+}
+
+size_t room_snapshot_size(size_t npc_count)
+{
+  return sizeof(RoomSnapshot) + npc_count * sizeof(Npc);
+}
+
+void room_snapshot(const Room *room, void *buffer)
+{
+  RoomSnapshot *snapshot = buffer;
+
+  snapshot->tick = room->sim.tick;
+  snapshot->rng = room->sim.rng;
+  snapshot->joins = room->joins;
+  snapshot->snapshot_id = room->snapshot_id;
+  snapshot->relay_count = room->relay_count;
+  memcpy(snapshot->relays, room->relays, sizeof(snapshot->relays));
+  memcpy(snapshot->clients, room->clients, sizeof(snapshot->clients));
+  memcpy(snapshot->players, room->sim.players, sizeof(snapshot->players));
+  memcpy(snapshot + 1, room->sim.npcs, room->sim.npc_count * sizeof(Npc));
+}
+
+void room_restore(Room *room, const void *buffer)
+{
+  const RoomSnapshot *snapshot = buffer;
+  int sessions = 0;
+
+  room->sim.tick = snapshot->tick;
+  room->sim.rng = snapshot->rng;
+  room->joins = snapshot->joins;
+  room->snapshot_id = snapshot->snapshot_id;
+  room->relay_count = snapshot->relay_count;
+  memcpy(room->relays, snapshot->relays, sizeof(room->relays));
+  memcpy(room->clients, snapshot->clients, sizeof(room->clients));
+  memcpy(room->sim.players, snapshot->players, sizeof(room->sim.players));
+
+  if (room->sim.npc_count > 0)
+  {
+    memcpy(room->sim.npcs, snapshot + 1, room->sim.npc_count * sizeof(Npc));
+    sim_index_npcs(&room->sim);
+  }
+
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    sessions += room->clients[i].addr_len != 0;
+  }
+
+  printf("Room %d: restored %d sessions at tick %" PRIu64 "\n", room->id,
+         sessions, room->sim.tick);
+}
+
+int room_parse_join(const char *buffer, size_t length, int *view_rows,
+                    int *view_cols, int *room_id, uint64_t *token)
+{
+  JoinMessage join;
+
+  if (join_decode(buffer, length, &join) == -1)
+  {
+    return 0;
+  }
+
+  *view_rows = DEFAULT_VIEW_ROWS;
+  *view_cols = DEFAULT_VIEW_COLS;
+  *room_id = join.room <= INT_MAX ? (int)join.room : 0;
+  *token = join.token;
+
+  if (join.rows >= 1 && join.cols >= 1 && join.rows <= MAX_VIEW_DIMENSION &&
+      join.cols <= MAX_VIEW_DIMENSION)
+  {
+    *view_rows = join.rows;
+    *view_cols = join.cols;
+  }
+
+  return 1;
+}
+
+int room_token_room(const char *buffer, size_t length)
+{
+  MoveMessage move;
+  PingMessage ping;
+  uint64_t token;
+
+  if (ping_decode(buffer, length, &ping) == 0)
+  {
+    token = ping.token;
+  }
+  else if (move_decode(buffer, length, &move) == 0)
+  {
+    token = move.token;
+  }
+  else
+  {
+    return -1;
+  }
+
+  return token != 0 ? SESSION_TOKEN_ROOM(token) : -1;
+}
+
+// buffer holds SNAPSHOT_MAX_SIZE bytes; returns the length written.
+static size_t serialize_all_client_positions(Room *room, char *buffer)
+{
+  size_t length = 0;
+
+  buffer[0] = '\0';
+
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    if (room->clients[i].addr_len != 0)
+    {
+      length = append_position(buffer, length, i, room->clients[i].username,
+                               room->sim.players[i].x,
+                               room->sim.players[i].y);
+    }
+  }
+
+  // Players across a zone border, unless they were just handed to us and
+  // the neighbour's report is stale.
+  for (int z = 0; room->zones != NULL && z < room->zones->count; z++)
+  {
+    for (int g = 0; g < room->ghosts[z].count; g++)
+    {
+      const GhostPlayer *ghost = &room->ghosts[z].players[g];
+
+      if (find_client_by_name(room, ghost->username) == -1)
+      {
+        length = append_position(buffer, length, SNAPSHOT_NO_ID,
+                                 ghost->username, ghost->x, ghost->y);
+      }
+    }
+  }
+
+  return length;
+}
+
+// A player that does not fit is left out whole.
+static size_t append_position(char *buffer, size_t length, int id,
+                              const char *username, int x, int y)
+{
+  int written = snprintf(buffer + length, SNAPSHOT_MAX_SIZE - length,
+                         "(%d, %s, %d, %d) ", id, username, x, y);
+
+  if (written < 0 || (size_t)written >= SNAPSHOT_MAX_SIZE - length)
+  {
+    buffer[length] = '\0';
+    return length;
+  }
+
+  return length + (size_t)written;
+}
+
+// Sends every client the positions and the chat since the last snapshot,
+// in as many fragments as that takes, each formatted once for everyone.
+static void broadcast_snapshot(Room *room, int sender_index)
+{
+  char snapshot[SNAPSHOT_MAX_SIZE];
+  size_t length = serialize_all_client_positions(room, snapshot);
+  size_t count;
+
+  length = append_chat(room, snapshot, length, &room->chat_sent);
+  count = count_fragments(length);
+  room->snapshot_id++;
+  room->snapshot_dirty = 0;
+
+  for (size_t f = 0; f < count; f++)
+  {
+    char *message = outbox_begin(room->outbox);
+
+    format_fragment(message, room->snapshot_id, snapshot, length, f, count);
+    // Confirmed once, after the last fragment.
+    broadcast(room, message, f + 1 == count ? sender_index : -1);
+  }
+}
+
+// An empty snapshot still goes out, as one empty fragment.
+static size_t count_fragments(size_t length)
+{
+  return length == 0 ? 1
+                     : (length + SNAPSHOT_FRAGMENT_SIZE - 1) /
+                           SNAPSHOT_FRAGMENT_SIZE;
+}
+
+static size_t format_fragment(char *message, uint32_t id,
+                              const char *snapshot, size_t length,
+                              size_t index, size_t count)
+{
+  size_t offset = index * SNAPSHOT_FRAGMENT_SIZE;
+  size_t part = length - offset < SNAPSHOT_FRAGMENT_SIZE
+                    ? length - offset
+                    : SNAPSHOT_FRAGMENT_SIZE;
+  int header = snprintf(message, BUFFER_SIZE,
+                        SNAPSHOT_MESSAGE_PREFIX "%" PRIu32 "|%zu|%zu|", id,
+                        index, count);
+
+  memcpy(message + header, snapshot + offset, part);
+  message[(size_t)header + part] = '\0';
+
+  return (size_t)header + part;
+}
+
+// message is open in the room's outbox, and is finished here.
+static void broadcast(Room *room, char *message, int sender_index)
+{
+  size_t length = strlen(message);
+
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    if (room->clients[i].addr_len == 0 || room->clients[i].relay != -1)
+    {
+      continue;
+    }
+
+    trace_next_push(room, i, -1);
+
+    if (outbox_push(room->outbox, message, length, room->sockfd,
+                    (const struct sockaddr *)&room->clients[i].addr,
+                    room->clients[i].addr_len) == -1)
+    {
+      perror("sendto");
+    }
+  }
+
+  // Relayed clients get one copy per relay, which fans it out for us.
+  memcpy(message - ALL_MESSAGE_PREFIX_LEN, ALL_MESSAGE_PREFIX,
+         ALL_MESSAGE_PREFIX_LEN);
+
+  for (int r = 0; r < room->relay_count; r++)
+  {
+    if (room->relays[r].clients == 0)
+    {
+      continue;
+    }
+
+    trace_next_push(room, -1, r);
+
+    if (outbox_push(room->outbox, message - ALL_MESSAGE_PREFIX_LEN,
+                    length + ALL_MESSAGE_PREFIX_LEN, room->sockfd,
+                    (const struct sockaddr *)&room->relays[r].addr,
+                    sizeof(struct sockaddr_storage)) == -1)
+    {
+      perror("sendto relay");
+    }
+  }
+
+  outbox_end(room->outbox);
+
+  if (sender_index != -1)
+  {
+    ssize_t confirmation_bytes;
+
+    confirmation_bytes =
+        send_to_client(room, sender_index, CONFIRMATION_MESSAGE,
+                       strlen(CONFIRMATION_MESSAGE));
+
+    if (confirmation_bytes == -1)
+    {
+      perror("sendto");
+      return;
+    }
+  }
+}
+
+static void initialize_clients(Room *room)
+{
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    room->clients[i].addr_len = 0;
+    room->clients[i].relay = -1;
+    room->clients[i].handoff_zone = -1;
+    sprintf(room->clients[i].username, "client%d", i + 1);
+  }
+}
+
+static int add_client(Room *room, const struct sockaddr_storage *client_addr,
+                      int relay, uint32_t session, int view_rows,
+                      int view_cols)
+{
+  const char *no_room_message;
+  ssize_t error_bytes;
+
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    if (room->clients[i].addr_len == 0)
+    {
+      ClientInfo *client = &room->clients[i];
+
+      client->addr = *client_addr;
+      client->addr_len = sizeof(struct sockaddr_storage);
+      client->relay = relay;
+      client->session = session;
+      client->token = new_session_token(room, i);
+      client->view_rows = view_rows;
+      client->view_cols = view_cols;
+      client->chunks_sent = 0;
+      client->npcs_in_view = 0;
+      client->handoff_zone = -1;
+      memset(&client->clock, 0, sizeof(client->clock));
+      memset(&client->inputs, 0, sizeof(client->inputs));
+
+      // Names must stay unique after players move between processes.
+      if (room->zones != NULL)
+      {
+        snprintf(client->username, sizeof(client->username), "client%u@%d",
+                 ++room->joins, zone_self(room->zones)->id);
+      }
+
+      sim_spawn(&room->sim, i);
+
+      if (relay != -1)
+      {
+        room->relays[relay].clients++;
+      }
+      else
+      {
+        post_route_update(room, ROUTE_JOINED, client_addr, NULL, 0);
+      }
+
+      return welcome_client(room, i);
+    }
+  }
+
+  no_room_message = "Server: No room available for new clients.";
+  error_bytes = send_to_session(room, client_addr, relay, session,
+                                no_room_message, strlen(no_room_message));
+  printf("Room %d: no available space to add client\n", room->id);
+  if (error_bytes == -1)
+  {
+    perror("sendto");
+  }
+
+  return -1;
+}
+
+// Everything a client needs to start drawing: its WELCOME, the chunks
+// around it and where everyone is.
+static int welcome_client(Room *room, int index)
+{
+  char client_confirmation[BUFFER_SIZE];
+  ssize_t dimention_bytes;
+  ssize_t bytes_sent;
+
+  sprintf(client_confirmation,
+          "Server: Successfully joined room %d. You're %s", room->id,
+          room->clients[index].username);
+
+  dimention_bytes = send_welcome(room, index);
+  bytes_sent = send_to_client(room, index, client_confirmation,
+                              strlen(client_confirmation));
+
+  stream_visible_chunks(room, index);
+  broadcast_snapshot(room, index);
+
+  if (bytes_sent == -1 || dimention_bytes == -1)
+  {
+    perror("sendto");
+    return -1;
+  }
+
+  return index;
+}
+
+static ssize_t send_welcome(Room *room, int index)
+{
+  char screen_dimentions[WELCOME_MESSAGE_SIZE];
+  const ClientInfo *client = &room->clients[index];
+  WelcomeMessage welcome;
+
+  memcpy(welcome.username, client->username, sizeof(welcome.username));
+  welcome.height = (uint32_t)room->world->height;
+  welcome.width = (uint32_t)room->world->width;
+  welcome.id = (uint8_t)index;
+  welcome.token = client->token;
+
+  return send_to_client(room, index, screen_dimentions,
+                        welcome_encode(&welcome, screen_dimentions));
+}
+
+// Random above the room and slot it names, and never 0.
+static uint64_t new_session_token(const Room *room, int index)
+{
+  uint64_t secret;
+
+  do
+  {
+    secret = ((uint64_t)arc4random() << 32 | arc4random()) >>
+             (SESSION_TOKEN_SLOT_BITS + SESSION_TOKEN_ROOM_BITS);
+  } while (secret == 0);
+
+  return secret << (SESSION_TOKEN_SLOT_BITS + SESSION_TOKEN_ROOM_BITS) |
+         (uint64_t)room->id << SESSION_TOKEN_SLOT_BITS | (uint64_t)index;
+}
+
+static int find_client(const Room *room,
+                       const struct sockaddr_storage *client_addr, int relay,
+                       uint32_t session)
+{
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    if (room->clients[i].addr_len != 0 && room->clients[i].relay == relay &&
+        (relay != -1 ? room->clients[i].session == session
+                     : memcmp(client_addr, &room->clients[i].addr,
+                              sizeof(struct sockaddr_storage)) == 0))
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// The session a token names, straight from its slot, or else the one at
+// the sender's address. A token that turns up from somewhere new moves its
+// session there: the client's NAT gave it another port, or it came back
+// through another relay.
+static int find_session(Room *room, uint64_t token,
+                        const struct sockaddr_storage *client_addr, int relay,
+                        uint32_t session)
+{
+  int index = SESSION_TOKEN_SLOT(token);
+  ClientInfo *client = &room->clients[index % MAX_CLIENTS];
+
+  if (token == 0 || index >= MAX_CLIENTS || client->addr_len == 0 ||
+      client->token != token)
+  {
+    return claim_route(room, find_client(room, client_addr, relay, session),
+                       relay);
+  }
+
+  if (client->relay == relay &&
+      (relay != -1 ? client->session == session
+                   : memcmp(client_addr, &client->addr,
+                            sizeof(struct sockaddr_storage)) == 0))
+  {
+    return claim_route(room, index, relay);
+  }
+
+  // The old address's route goes, and its bucket with the player.
+  if (client->relay == -1 && relay == -1)
+  {
+    post_route_update(room, ROUTE_MOVED, client_addr, &client->addr, 0);
+  }
+  else if (client->relay == -1)
+  {
+    post_route_update(room, ROUTE_LEFT, &client->addr, NULL, 0);
+  }
+  else if (relay == -1)
+  {
+    post_route_update(room, ROUTE_JOINED, client_addr, NULL, 0);
+  }
+
+  if (client->relay != -1)
+  {
+    room->relays[client->relay].clients--;
+  }
+
+  if (relay != -1)
+  {
+    room->relays[relay].clients++;
+  }
+
+  client->addr = *client_addr;
+  client->relay = relay;
+  client->session = session;
+
+  printf("Room %d: %s resumed its session from a new address\n", room->id,
+         client->username);
+
+  return index;
+}
+
+static void remove_client(Room *room, int index)
+{
+
+  if (index < 0 || index >= MAX_CLIENTS)
+  {
+    fprintf(stderr, "Invalid client index\n");
+    return;
+  }
+
+  printf("Room %d: removing client at index %d\n", room->id, index);
+
+  if (room->clients[index].addr_len != 0 && room->clients[index].relay != -1)
+  {
+    room->relays[room->clients[index].relay].clients--;
+  }
+  else if (room->clients[index].addr_len != 0)
+  {
+    post_route_update(room, ROUTE_LEFT, &room->clients[index].addr, NULL, 0);
+  }
+
+  if (room->trace != NULL)
+  {
+    trace_drop(room, index);
+  }
+
+  room->clients[index].addr_len = 0;
+  sim_remove(&room->sim, index);
+}
+
+// A session the network thread has no route for, because the update that
+// made one was lost or the player joined another room since, gets one back
+// from its next packet here.
+static int claim_route(Room *room, int index, int relay)
+{
+  if (index != -1 && relay == -1 && !room->routed)
+  {
+    post_route_update(room, ROUTE_JOINED, &room->clients[index].addr, NULL,
+                      0);
+  }
+
+  return index;
+}
+
+static void post_route_update(Room *room, RouteChange change,
+                              const struct sockaddr_storage *addr,
+                              const struct sockaddr_storage *from, int relay)
+{
+  RouteUpdateQueue *queue = &room->route_updates;
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  RouteUpdate *update;
+
+  // Only full if the network thread has been away for ages. claim_route
+  // brings a lost route back, and a stale one is the first to be evicted.
+  if (tail - head == ROOM_ROUTE_UPDATES)
+  {
+    return;
+  }
+
+  update = &queue->slots[tail % ROOM_ROUTE_UPDATES];
+  update->change = change;
+  update->relay = relay;
+  update->addr = *addr;
+
+  if (from != NULL)
+  {
+    update->from = *from;
+  }
+
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  atomic_fetch_add_explicit(room->route_updates_posted, 1,
+                            memory_order_release);
+}
+
+// One queued move per session goes into a single step of the simulation,
+// then one snapshot of where everyone is for all of them, however many
+// moved. While the watchdog has the room merging inputs, ticks come less
+// often and take that many moves each, so players keep their speed: all
+// but the last go ahead of the step.
+static void apply_inputs(Room *room)
+{
+  SimInputs inputs;
+  SimStep step;
+  int moved[MAX_CLIENTS] = {0};
+  int movers[MAX_CLIENTS];
+  int mover_count = 0;
+  int merged = room->watchdog.level >= SHED_MERGE_INPUTS ? SHED_MERGED_MOVES
+                                                         : 1;
+  uint64_t start;
+  uint64_t elapsed;
+
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    ClientInfo *client = &room->clients[i];
+    uint8_t direction;
+
+    inputs.moves[i] = SIM_NO_MOVE;
+
+    for (int m = 0;
+         m < merged && client->addr_len != 0 &&
+         input_queue_pop(&client->inputs,
+                         (uint64_t)TICK_INTERVAL_MS * NS_PER_MS, &direction);
+         m++)
+    {
+      if (inputs.moves[i] != SIM_NO_MOVE)
+      {
+        uint8_t outcome = (uint8_t)sim_move(&room->sim, i, inputs.moves[i]);
+
+        moved[i] |= handle_move_outcome(room, i, inputs.moves[i], outcome) == 0;
+        inputs.moves[i] = SIM_NO_MOVE;
+      }
+
+      // Moves queued before a handoff started are dropped like later ones.
+      if (client->handoff_zone == -1)
+      {
+        inputs.moves[i] = direction;
+      }
+    }
+  }
+
+  start = monotonic_ns();
+  sim_step(&room->sim, &inputs, &step);
+
+  if (room->sim.npc_count > 0)
+  {
+    elapsed = monotonic_ns() - start;
+    room->tick_stats.ticks++;
+    room->tick_stats.total_ns += elapsed;
+
+    if (elapsed > room->tick_stats.max_ns)
+    {
+      room->tick_stats.max_ns = elapsed;
+    }
+  }
+
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    moved[i] |=
+        handle_move_outcome(room, i, inputs.moves[i], step.outcomes[i]) == 0;
+
+    if (moved[i])
+    {
+      stream_visible_chunks(room, i);
+      movers[mover_count++] = i;
+    }
+  }
+
+  if (mover_count == 0 && room->chat_sent == room->chat_said &&
+      !room->snapshot_dirty)
+  {
+    return;
+  }
+
+  broadcast_snapshot(room, -1);
+
+  for (int m = 0; m < mover_count; m++)
+  {
+    if (send_to_client(room, movers[m], CONFIRMATION_MESSAGE,
+                       strlen(CONFIRMATION_MESSAGE)) == -1)
+    {
+      perror("sendto");
+    }
+  }
+}
+
+// 0 if the player moved. A step out of the area only happens in a sharded
+// world: the owning zone takes over, and cells no zone owns are treated as
+// walls.
+static int handle_move_outcome(Room *room, int index, uint8_t direction,
+                               uint8_t outcome)
+{
+  const ClientInfo *client = &room->clients[index];
+  const SimPlayer *player = &room->sim.players[index];
+  int next_x = player->x + direction_dx(direction);
+  int next_y = player->y + direction_dy(direction);
+
+  if (outcome == SIM_LEFT_AREA)
+  {
+    int zone = zone_index_at(room->zones, next_x, next_y);
+
+    // Relayed sessions live on their relay's address, so they stay put.
+    if (zone != -1 && client->relay == -1)
+    {
+      begin_handoff(room, index, zone, next_x, next_y);
+    }
+
+    return -1;
+  }
+
+  if (outcome != SIM_MOVED)
+  {
+    return -1;
+  }
+
+  if (room->watchdog.level >= SHED_NON_ESSENTIAL)
+  {
+    return 0;
+  }
+
+  printf("%d/%s: (%d, %d) -> (%d, %d)\n", room->id, client->username,
+         player->x - direction_dx(direction),
+         player->y - direction_dy(direction), player->x, player->y);
+
+  return 0;
+}
+
+// Only printable characters are kept, so a line can neither break the
+// snapshot it rides in nor the terminal it is drawn on.
+static void handle_chat(Room *room, int index, const char *text)
+{
+  ChatLine *line = &room->chat[room->chat_said % CHAT_HISTORY];
+  size_t length = 0;
+
+  for (; *text != '\0' && length < CHAT_TEXT_MAX - 1; text++)
+  {
+    if (*text >= ' ' && *text <= '~')
+    {
+      line->text[length++] = *text;
+    }
+  }
+
+  if (length == 0)
+  {
+    return;
+  }
+
+  line->text[length] = '\0';
+  memcpy(line->username, room->clients[index].username,
+         sizeof(line->username));
+  room->chat_said++;
+  room->tick_stats.chat_lines++;
+}
+
+// Adds the lines from *cursor on to a snapshot of length bytes, as many as
+// fit, and returns its new length. The rest wait for the next tick; lines
+// that fell out of the history before then are lost.
+static size_t append_chat(Room *room, char *message, size_t length,
+                          uint64_t *cursor)
+{
+  if (room->chat_said - *cursor > CHAT_HISTORY)
+  {
+    *cursor = room->chat_said - CHAT_HISTORY;
+  }
+
+  for (; *cursor != room->chat_said; (*cursor)++)
+  {
+    const ChatLine *line = &room->chat[*cursor % CHAT_HISTORY];
+    int written = snprintf(message + length, SNAPSHOT_MAX_SIZE - length,
+                           "%c%s: %s", CHAT_SEPARATOR, line->username,
+                           line->text);
+
+    if (written < 0 || (size_t)written >= SNAPSHOT_MAX_SIZE - length)
+    {
+      break;
+    }
+
+    length += (size_t)written;
+  }
+
+  message[length] = '\0';
+
+  return length;
+}
+
+static void visible_chunk_range(const Room *room, int index, int *cx0,
+                                int *cy0, int *cx1, int *cy1)
+{
+  // The client keeps its own player in the middle of the viewport.
+  const ClientInfo *client = &room->clients[index];
+  const SimPlayer *player = &room->sim.players[index];
+  int x0 = player->x - client->view_cols / 2;
+  int y0 = player->y - client->view_rows / 2;
+  int x1 = x0 + client->view_cols - 1;
+  int y1 = y0 + client->view_rows - 1;
+
+  x0 = x0 < 0 ? 0 : x0;
+  y0 = y0 < 0 ? 0 : y0;
+  x1 = x1 >= room->world->width ? room->world->width - 1 : x1;
+  y1 = y1 >= room->world->height ? room->world->height - 1 : y1;
+
+  *cx0 = x0 >> WORLD_CHUNK_SHIFT;
+  *cy0 = y0 >> WORLD_CHUNK_SHIFT;
+  *cx1 = x1 >> WORLD_CHUNK_SHIFT;
+  *cy1 = y1 >> WORLD_CHUNK_SHIFT;
+}
+
+static void stream_visible_chunks(Room *room, int index)
+{
+  int cx0;
+  int cy0;
+  int cx1;
+  int cy1;
+  ClientInfo *client = &room->clients[index];
+
+  visible_chunk_range(room, index, &cx0, &cy0, &cx1, &cy1);
+
+  for (int cy = cy0; cy <= cy1; cy++)
+  {
+    for (int cx = cx0; cx <= cx1; cx++)
+    {
+      // Only chunks that just scrolled into view; the client re-requests
+      // any that were lost.
+      if (client->chunks_sent && cx >= client->sent_cx0 &&
+          cx <= client->sent_cx1 && cy >= client->sent_cy0 &&
+          cy <= client->sent_cy1)
+      {
+        continue;
+      }
+
+      send_chunk(room, index, cx, cy);
+    }
+  }
+
+  client->chunks_sent = 1;
+  client->sent_cx0 = cx0;
+  client->sent_cy0 = cy0;
+  client->sent_cx1 = cx1;
+  client->sent_cy1 = cy1;
+}
+
+static void handle_chunk_request(Room *room, int index, const char *buffer)
+{
+  char *endptr;
+  long cx;
+  long cy;
+  int cx0;
+  int cy0;
+  int cx1;
+  int cy1;
+
+  cx = strtol(buffer + CHUNK_REQUEST_PREFIX_LEN, &endptr, BASE_TEN);
+
+  if (*endptr != '|')
+  {
+    return;
+  }
+
+  cy = strtol(endptr + 1, &endptr, BASE_TEN);
+
+  if (*endptr != '\0')
+  {
+    return;
+  }
+
+  visible_chunk_range(room, index, &cx0, &cy0, &cx1, &cy1);
+
+  if (cx < cx0 || cx > cx1 || cy < cy0 || cy > cy1)
+  {
+    return;
+  }
+
+  send_chunk(room, index, (int)cx, (int)cy);
+}
+
+static void send_chunk(Room *room, int index, int cx, int cy)
+{
+  char *message = outbox_begin(room->outbox);
+  int length;
+
+  length = format_chunk(room, cx, cy, message);
+
+  if (length != -1 &&
+      push_to_client(room, index, message, (size_t)length) == -1)
+  {
+    perror("sendto");
+  }
+
+  outbox_end(room->outbox);
+}
+
+// message must hold BUFFER_SIZE bytes; returns -1 for chunks off the map.
+static int format_chunk(const Room *room, int cx, int cy, char *message)
+{
+  const MapChunk *chunk;
+  int header_len;
+
+  chunk = world_chunk(room->world, cx, cy);
+
+  if (chunk == NULL)
+  {
+    return -1;
+  }
+
+  header_len =
+      snprintf(message, BUFFER_SIZE, CHUNK_MESSAGE_PREFIX "%d|%d|", cx, cy);
+  memcpy(message + header_len, chunk->tiles, WORLD_CHUNK_CELLS);
+
+  return header_len + WORLD_CHUNK_CELLS;
+}
+
+static ssize_t push_to_client(Room *room, int index, char *message,
+                              size_t length)
+{
+  const ClientInfo *client = &room->clients[index];
+
+  return push_to_session(room, &client->addr, client->relay, client->session,
+                         message, length);
+}
+
+// message is open in the room's outbox, or a buffer with the same headroom
+// in front of it to be sent at once.
+static ssize_t push_to_session(Room *room,
+                               const struct sockaddr_storage *addr,
+                               int relay, uint32_t session, char *message,
+                               size_t length)
+{
+  char header[RELAY_HEADER_MAX];
+  int header_len;
+
+  trace_next_push(room, -1, -1);
+
+  if (relay == -1)
+  {
+    return outbox_push(room->outbox, message, length, room->sockfd,
+                       (const struct sockaddr *)addr,
+                       sizeof(struct sockaddr_storage));
+  }
+
+  header_len = snprintf(header, sizeof(header),
+                        TO_MESSAGE_PREFIX "%" PRIu32 "|", session);
+  memcpy(message - header_len, header, (size_t)header_len);
+
+  return outbox_push(room->outbox, message - header_len,
+                     (size_t)header_len + length, room->sockfd,
+                     (const struct sockaddr *)&room->relays[relay].addr,
+                     sizeof(struct sockaddr_storage));
+}
+
+static ssize_t send_to_client(Room *room, int index, const char *message,
+                              size_t length)
+{
+  const ClientInfo *client = &room->clients[index];
+
+  return send_to_session(room, &client->addr, client->relay, client->session,
+                         message, length);
+}
+
+static ssize_t send_to_session(Room *room,
+                               const struct sockaddr_storage *addr,
+                               int relay, uint32_t session,
+                               const char *message, size_t length)
+{
+  char *copy = outbox_begin(room->outbox);
+  ssize_t sent;
+
+  length = length < BUFFER_SIZE ? length : BUFFER_SIZE;
+  memcpy(copy, message, length);
+  sent = push_to_session(room, addr, relay, session, copy, length);
+  outbox_end(room->outbox);
+
+  return sent;
+}
+
+static void send_visible_npcs(Room *room, int index)
+{
+  char *message = outbox_begin(room->outbox);
+  size_t length;
+  int visible;
+  int near;
+  int send;
+  ClientInfo *client = &room->clients[index];
+
+  if (npc_full_update_due(room, index))
+  {
+    length = format_visible_npcs(room, index, message, BUFFER_SIZE, -1,
+                                 &visible, &near);
+    // An empty list is still sent once so the client clears the last NPCs.
+    send = visible != 0 || client->npcs_in_view != 0;
+    client->npcs_in_view = visible;
+  }
+  else
+  {
+    length = format_visible_npcs(room, index, message, BUFFER_SIZE,
+                                 NPC_SIGHT_RADIUS, &visible, &near);
+    send = near != 0 || client->npcs_near != 0;
+  }
+
+  client->npcs_near = near;
+
+  if (send)
+  {
+    if (push_to_client(room, index, message, length) == -1)
+    {
+      perror("sendto");
+    }
+  }
+
+  outbox_end(room->outbox);
+}
+
+// With a radius of 0 or more, only the NPCs that close to the player, as
+// NPCN: for the client to merge with the ones it has; otherwise every NPC
+// in view.
+static size_t format_visible_npcs(const Room *room, int index, char *message,
+                                  size_t size, int radius, int *visible,
+                                  int *near)
+{
+  size_t length;
+  int x0;
+  int y0;
+  int cx0;
+  int cy0;
+  int cx1;
+  int cy1;
+  const ClientInfo *client = &room->clients[index];
+  const SimPlayer *player = &room->sim.players[index];
+
+  x0 = player->x - client->view_cols / 2;
+  y0 = player->y - client->view_rows / 2;
+  visible_chunk_range(room, index, &cx0, &cy0, &cx1, &cy1);
+
+  length = radius < 0 ? (size_t)snprintf(message, size, NPC_MESSAGE_PREFIX)
+                      : (size_t)snprintf(message, size,
+                                         NEAR_NPC_MESSAGE_PREFIX "%d,%d,%d|",
+                                         player->x, player->y, radius);
+  *visible = 0;
+  *near = 0;
+
+  for (int cy = cy0; cy <= cy1; cy++)
+  {
+    for (int cx = cx0; cx <= cx1; cx++)
+    {
+      size_t chunk = (size_t)cy * (size_t)room->world->chunks_x + (size_t)cx;
+
+      for (size_t j = room->sim.npc_chunk_start[chunk];
+           j < room->sim.npc_chunk_start[chunk + 1]; j++)
+      {
+        const Npc *npc = &room->sim.npcs[room->sim.npc_order[j]];
+
+        if (npc->x < x0 || npc->y < y0 || npc->x >= x0 + client->view_cols ||
+            npc->y >= y0 + client->view_rows ||
+            (radius >= 0 && (abs(npc->x - player->x) > radius ||
+                             abs(npc->y - player->y) > radius)) ||
+            length + NPC_ENTRY_MAX_LEN >= size)
+        {
+          continue;
+        }
+
+        length += (size_t)sprintf(message + length, "%d,%d,%d ", npc->x,
+                                  npc->y, npc->state);
+        (*visible)++;
+        *near += abs(npc->x - player->x) <= NPC_SIGHT_RADIUS &&
+                 abs(npc->y - player->y) <= NPC_SIGHT_RADIUS;
+      }
+    }
+  }
+
+  return length;
+}
+
+// While the room sheds distant entities, a player gets every NPC in view
+// only every few ticks, staggered so that the full updates do not all land
+// on the same tick, and in between only those within sight.
+static int npc_full_update_due(const Room *room, int index)
+{
+  return room->watchdog.level < SHED_DISTANT ||
+         (room->sim.tick + (uint64_t)index) % SHED_DISTANT_INTERVAL_TICKS ==
+             0;
+}
+
+static void watch_tick(Room *room, uint64_t work_ns)
+{
+  Watchdog *watchdog = &room->watchdog;
+  int change = watchdog_record(watchdog, work_ns);
+
+  room->tick_stats.overruns += work_ns > watchdog->budget_ns &&
+                               watchdog->budget_ns != 0;
+
+  if (work_ns > room->tick_stats.work_max_ns)
+  {
+    room->tick_stats.work_max_ns = work_ns;
+  }
+
+  if (change > 0)
+  {
+    printf("Room %d: tick %" PRIu64 " took %" PRIu64 " us of a %" PRIu64
+           " us budget, shedding load: %s\n",
+           room->id, room->sim.tick, work_ns / NS_PER_US,
+           watchdog->budget_ns / NS_PER_US,
+           watchdog_level_name(watchdog->level));
+  }
+  else if (change < 0)
+  {
+    printf("Room %d: tick %" PRIu64 " back under budget, restoring: %s\n",
+           room->id, room->sim.tick, watchdog_level_name(watchdog->level));
+  }
+}
+
+// What the room needed over its lifetime, for sizing: how often it ran
+// over budget and how long it spent at each shed level.
+static void report_watchdog(const Room *room)
+{
+  const Watchdog *watchdog = &room->watchdog;
+
+  if (watchdog->budget_ns == 0)
+  {
+    return;
+  }
+
+  printf("Room %d: %" PRIu64 " ticks over the %" PRIu64 " us budget, worst %"
+         PRIu64 " us, shed %" PRIu64 " times, restored %" PRIu64
+         " times; ticks per level:",
+         room->id, watchdog->overruns, watchdog->budget_ns / NS_PER_US,
+         watchdog->worst_ns / NS_PER_US, watchdog->sheds, watchdog->restores);
+
+  for (int level = 0; level < WATCHDOG_LEVELS; level++)
+  {
+    printf(" %" PRIu64, watchdog->level_ticks[level]);
+  }
+
+  printf("\n");
+}
+
+static void report_tick_stats(Room *room)
+{
+  TickStats *stats = &room->tick_stats;
+  uint64_t dropped;
+
+  dropped = atomic_exchange_explicit(&room->packets_dropped, 0,
+                                     memory_order_relaxed);
+
+  if (stats->packets != 0 || dropped != 0 || stats->ticks != 0 ||
+      stats->chat_lines != 0 || stats->overruns != 0)
+  {
+    printf("room %d tick %" PRIu64 ": %" PRIu64 " packets, %" PRIu64
+           " dropped",
+           room->id, room->sim.tick, stats->packets, dropped);
+
+    if (stats->ticks != 0)
+    {
+      printf(", sim avg %" PRIu64 " us, max %" PRIu64 " us (%zu npcs, "
+             "%d threads)",
+             stats->total_ns / stats->ticks / NS_PER_US,
+             stats->max_ns / NS_PER_US, room->sim.npc_count,
+             job_pool_worker_count(room->sim.job_pool));
+    }
+
+    if (stats->chat_lines != 0)
+    {
+      printf(", %" PRIu64 " chat lines", stats->chat_lines);
+    }
+
+    if (stats->overruns != 0 || room->watchdog.level != SHED_NONE)
+    {
+      printf(", %" PRIu64 " ticks over budget (worst %" PRIu64 " us), %s",
+             stats->overruns, stats->work_max_ns / NS_PER_US,
+             watchdog_level_name(room->watchdog.level));
+    }
+
+    printf("\n");
+    report_session_clocks(room);
+    fflush(stdout);
+  }
+
+  memset(stats, 0, sizeof(*stats));
+}
+
+static void handle_ping(Room *room, int index, const PingMessage *ping,
+                        uint64_t received_ns)
+{
+  SessionClock *clock = &room->clients[index].clock;
+  char reply[OUTBOX_HEADROOM + PONG_MESSAGE_SIZE];
+  char *message = reply + OUTBOX_HEADROOM;
+  PongMessage pong;
+
+  // Our last PONG left at echoed and reached the client at sent - held,
+  // both of which close an exchange from our side.
+  if (ping->echoed != 0 && ping->echoed < received_ns &&
+      ping->held <= ping->sent)
+  {
+    clock_sync_add(&clock->sync, ping->echoed, ping->sent - ping->held,
+                   ping->sent, received_ns);
+    record_rtt(clock, clock->sync.rtt_ns);
+  }
+
+  pong.seq = ping->seq;
+  pong.sent = ping->sent;
+  pong.received = received_ns;
+  pong.replied = monotonic_ns();
+
+  // Pushed with no message open, so it leaves now and the time in it is
+  // not off by however long the send queue is.
+  if (push_to_client(room, index, message, pong_encode(&pong, message)) == -1)
+  {
+    perror("sendto");
+  }
+}
+
+static void record_rtt(SessionClock *clock, uint64_t rtt_ns)
+{
+  uint64_t us = rtt_ns / NS_PER_US;
+  int bucket = 0;
+
+  while (us > 1 && bucket < RTT_HISTOGRAM_BUCKETS - 1)
+  {
+    us >>= 1;
+    bucket++;
+  }
+
+  clock->rtt_histogram[bucket]++;
+  clock->rtt_samples++;
+  clock->rtt_max_ns = rtt_ns > clock->rtt_max_ns ? rtt_ns : clock->rtt_max_ns;
+}
+
+static void record_input_delay(SessionClock *clock, uint64_t sent,
+                               uint64_t received_ns)
+{
+  if (sent == 0)
+  {
+    return;
+  }
+
+  // A client's estimate of our clock can be slightly ahead of us.
+  clock->input_delay_total_ns += received_ns > sent ? received_ns - sent : 0;
+  clock->input_delays++;
+}
+
+// Upper edge of the histogram bucket holding the given percentile.
+static uint64_t rtt_percentile_us(const SessionClock *clock, uint32_t percent)
+{
+  uint64_t rank = ((uint64_t)clock->rtt_samples * percent + PERCENT - 1) /
+                  PERCENT;
+  uint64_t seen = 0;
+
+  for (int bucket = 0; bucket < RTT_HISTOGRAM_BUCKETS; bucket++)
+  {
+    seen += clock->rtt_histogram[bucket];
+
+    if (seen >= rank)
+    {
+      return (uint64_t)2 << bucket;
+    }
+  }
+
+  return (uint64_t)2 << (RTT_HISTOGRAM_BUCKETS - 1);
+}
+
+static void report_session_clocks(Room *room)
+{
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    ClientInfo *client = &room->clients[i];
+    SessionClock *clock = &client->clock;
+
+    if (client->addr_len == 0 || clock->rtt_samples == 0 ||
+        clock->reported == (int)clock->rtt_samples)
+    {
+      continue;
+    }
+
+    printf("room %d %s: rtt p50 <%" PRIu64 " us, p99 <%" PRIu64
+           " us, max %" PRIu64 " us over %" PRIu32 " pings, clock offset %"
+           PRId64 " us",
+           room->id, client->username, rtt_percentile_us(clock, 50),
+           rtt_percentile_us(clock, 99), clock->rtt_max_ns / NS_PER_US,
+           clock->rtt_samples, clock->sync.offset_ns / NS_PER_US);
+
+    if (clock->input_delays != 0)
+    {
+      printf(", input delay avg %" PRIu64 " us",
+             clock->input_delay_total_ns / clock->input_delays / NS_PER_US);
+    }
+
+    if (client->inputs.jitter_ns != 0 || client->inputs.late != 0 ||
+        client->inputs.duplicates != 0 || client->inputs.lost != 0 ||
+        client->inputs.overrun != 0)
+    {
+      printf(", input jitter %" PRIu64 " us held %d ticks, %" PRIu32
+             " late, %" PRIu32 " duplicate, %" PRIu32 " lost, %" PRIu32
+             " overrun",
+             client->inputs.jitter_ns / NS_PER_US,
+             input_queue_depth(&client->inputs,
+                               (uint64_t)TICK_INTERVAL_MS * NS_PER_MS),
+             client->inputs.late, client->inputs.duplicates,
+             client->inputs.lost, client->inputs.overrun);
+    }
+
+    printf("\n");
+    clock->reported = (int)clock->rtt_samples;
+  }
+}
+
+static void handle_peer_packet(Room *room,
+                               const struct sockaddr_storage *peer_addr,
+                               const char *buffer)
+{
+  if (strncmp(buffer, HANDOFF_MESSAGE_PREFIX, HANDOFF_MESSAGE_PREFIX_LEN) == 0)
+  {
+    handle_handoff(room, peer_addr, buffer);
+  }
+  else if (strncmp(buffer, HANDOFF_ACK_MESSAGE_PREFIX,
+                   HANDOFF_ACK_MESSAGE_PREFIX_LEN) == 0)
+  {
+    handle_handoff_ack(room, buffer);
+  }
+  else if (strncmp(buffer, GHOSTS_MESSAGE_PREFIX,
+                   GHOSTS_MESSAGE_PREFIX_LEN) == 0)
+  {
+    handle_ghosts(room, buffer);
+  }
+}
+
+static void begin_handoff(Room *room, int index, int zone, int x, int y)
+{
+  ClientInfo *client = &room->clients[index];
+
+  client->home_x = room->sim.players[index].x;
+  client->home_y = room->sim.players[index].y;
+  sim_place(&room->sim, index, x, y);
+  client->handoff_zone = zone;
+  client->handoff_started_ns = monotonic_ns();
+
+  printf("%d/%s: handing off to zone %d at (%d, %d)\n", room->id,
+         client->username, room->zones->zones[zone].id, x, y);
+
+  send_handoff(room, index);
+}
+
+static void send_handoff(Room *room, int index)
+{
+  ClientInfo *client = &room->clients[index];
+  const Zone *zone = &room->zones->zones[client->handoff_zone];
+  ZoneHandoff handoff;
+  char message[BUFFER_SIZE];
+  int length;
+
+  handoff.room_id = room->id;
+  handoff.addr = client->addr;
+  handoff.addr_len = client->addr_len;
+  memcpy(handoff.username, client->username, sizeof(handoff.username));
+  handoff.x = room->sim.players[index].x;
+  handoff.y = room->sim.players[index].y;
+  handoff.view_rows = client->view_rows;
+  handoff.view_cols = client->view_cols;
+
+  length = zone_format_handoff(&handoff, message, sizeof(message));
+  client->handoff_sent_ns = monotonic_ns();
+
+  if (length < 0)
+  {
+    return;
+  }
+
+  if (sendto(room->zones->peer_sockfd, message, (size_t)length, 0,
+             (const struct sockaddr *)&zone->peer_addr,
+             zone->peer_addr_len) == -1)
+  {
+    perror("sendto peer");
+  }
+}
+
+static void update_handoffs(Room *room)
+{
+  uint64_t now = monotonic_ns();
+
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    ClientInfo *client = &room->clients[i];
+
+    if (client->addr_len == 0 || client->handoff_zone == -1)
+    {
+      continue;
+    }
+
+    // The neighbour is down or full: put the player back where it was.
+    if (now - client->handoff_started_ns >=
+        (uint64_t)HANDOFF_TIMEOUT_MS * NS_PER_MS)
+    {
+      printf("%d/%s: handoff to zone %d timed out\n", room->id,
+             client->username, room->zones->zones[client->handoff_zone].id);
+      sim_place(&room->sim, i, client->home_x, client->home_y);
+      client->handoff_zone = -1;
+      stream_visible_chunks(room, i);
+      room->snapshot_dirty = 1;
+    }
+    else if (now - client->handoff_sent_ns >=
+             (uint64_t)HANDOFF_RETRY_MS * NS_PER_MS)
+    {
+      send_handoff(room, i);
+    }
+  }
+}
+
+static void handle_handoff(Room *room,
+                           const struct sockaddr_storage *peer_addr,
+                           const char *buffer)
+{
+  ZoneHandoff handoff;
+  char ack[BUFFER_SIZE];
+  int index;
+
+  if (zone_parse_handoff(buffer, &handoff) == -1 ||
+      !world_rect_contains(&room->area, handoff.x, handoff.y) ||
+      !world_walkable(room->world, handoff.x, handoff.y))
+  {
+    return;
+  }
+
+  // A retry after our ack was lost finds the player already here.
+  index = -1;
+
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    if (room->clients[i].addr_len != 0 && room->clients[i].relay == -1 &&
+        memcmp(&handoff.addr, &room->clients[i].addr,
+               sizeof(struct sockaddr_storage)) == 0)
+    {
+      index = i;
+      break;
+    }
+  }
+
+  for (int i = 0; i < MAX_CLIENTS && index == -1; i++)
+  {
+    if (room->clients[i].addr_len == 0)
+    {
+      ClientInfo *client = &room->clients[i];
+
+      client->addr = handoff.addr;
+      client->addr_len = sizeof(struct sockaddr_storage);
+      client->relay = -1;
+      client->token = new_session_token(room, i);
+      memcpy(client->username, handoff.username, sizeof(client->username));
+      sim_place(&room->sim, i, handoff.x, handoff.y);
+      client->view_rows = handoff.view_rows;
+      client->view_cols = handoff.view_cols;
+      client->chunks_sent = 0;
+      client->npcs_in_view = 0;
+      client->handoff_zone = -1;
+      memset(&client->clock, 0, sizeof(client->clock));
+      memset(&client->inputs, 0, sizeof(client->inputs));
+      index = i;
+
+      printf("%d/%s: arrived by handoff at (%d, %d)\n", room->id,
+             client->username, handoff.x, handoff.y);
+      post_route_update(room, ROUTE_JOINED, &handoff.addr, NULL, 0);
+
+      // The token from the last zone means nothing here.
+      if (send_welcome(room, i) == -1)
+      {
+        perror("sendto");
+      }
+
+      stream_visible_chunks(room, i);
+      room->snapshot_dirty = 1;
+    }
+  }
+
+  // Full: stay silent and let the sender's timeout put the player back.
+  if (index == -1)
+  {
+    return;
+  }
+
+  snprintf(ack, sizeof(ack), HANDOFF_ACK_MESSAGE_PREFIX "%d|%s", room->id,
+           room->clients[index].username);
+
+  if (sendto(room->zones->peer_sockfd, ack, strlen(ack), 0,
+             (const struct sockaddr *)peer_addr,
+             sizeof(struct sockaddr_storage)) == -1)
+  {
+    perror("sendto peer");
+  }
+}
+
+static void handle_handoff_ack(Room *room, const char *buffer)
+{
+  char username[MAX_USERNAME_LENGTH];
+  char redirect[BUFFER_SIZE];
+  const Zone *zone;
+  int room_id;
+  int index;
+
+  // NOLINTNEXTLINE(cert-err34-c,-warnings-as-errors)
+  if (sscanf(buffer, HANDOFF_ACK_MESSAGE_PREFIX "%d|%19s", &room_id,
+             username) != 2)
+  {
+    return;
+  }
+
+  index = find_client_by_name(room, username);
+
+  if (index == -1 || room->clients[index].handoff_zone == -1)
+  {
+    return;
+  }
+
+  zone = &room->zones->zones[room->clients[index].handoff_zone];
+  snprintf(redirect, sizeof(redirect), ZONE_MESSAGE_PREFIX "%s|%u",
+           zone->host, (unsigned int)zone->client_port);
+
+  if (send_to_client(room, index, redirect, strlen(redirect)) == -1)
+  {
+    perror("sendto");
+  }
+
+  printf("%d/%s: now in zone %d\n", room->id, username, zone->id);
+
+  // Its route goes with it, so nothing it still sends lands here.
+  remove_client(room, index);
+  room->snapshot_dirty = 1;
+}
+
+static void send_ghosts(Room *room)
+{
+  const ZoneMap *zones = room->zones;
+
+  for (int z = 0; z < zones->count; z++)
+  {
+    const Zone *zone = &zones->zones[z];
+    char message[BUFFER_SIZE];
+    size_t length;
+    int count;
+
+    if (z == zones->self)
+    {
+      continue;
+    }
+
+    length = (size_t)snprintf(message, sizeof(message),
+                              GHOSTS_MESSAGE_PREFIX "%d|%d|", room->id,
+                              zone_self(zones)->id);
+    count = 0;
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+    {
+      const ClientInfo *client = &room->clients[i];
+      const SimPlayer *player = &room->sim.players[i];
+      int written;
+
+      if (client->addr_len == 0 || client->handoff_zone != -1 ||
+          !zone_near(zone, player->x, player->y, ZONE_BORDER_MARGIN))
+      {
+        continue;
+      }
+
+      written = snprintf(message + length, sizeof(message) - length,
+                         "%s,%d,%d ", client->username, player->x, player->y);
+
+      if ((size_t)written >= sizeof(message) - length)
+      {
+        message[length] = '\0';
+        break;
+      }
+
+      length += (size_t)written;
+      count++;
+    }
+
+    // Like the NPC list, an empty set goes out once to clear the far side.
+    if (count == 0 && room->ghosts_sent[z] == 0)
+    {
+      continue;
+    }
+
+    room->ghosts_sent[z] = count;
+
+    if (sendto(zones->peer_sockfd, message, length, 0,
+               (const struct sockaddr *)&zone->peer_addr,
+               zone->peer_addr_len) == -1)
+    {
+      perror("sendto peer");
+    }
+  }
+}
+
+static void handle_ghosts(Room *room, const char *buffer)
+{
+  GhostSet incoming;
+  GhostSet *stored;
+  const char *cursor;
+  int room_id;
+  int zone_id;
+  int zone;
+  int offset = 0;
+
+  // NOLINTNEXTLINE(cert-err34-c,-warnings-as-errors)
+  if (sscanf(buffer, GHOSTS_MESSAGE_PREFIX "%d|%d|%n", &room_id, &zone_id,
+             &offset) != 2 ||
+      offset == 0)
+  {
+    return;
+  }
+
+  zone = zone_index_by_id(room->zones, zone_id);
+
+  if (zone == -1 || zone == room->zones->self)
+  {
+    return;
+  }
+
+  // Zeroed so that unchanged sets compare equal byte for byte.
+  memset(&incoming, 0, sizeof(incoming));
+  cursor = buffer + offset;
+
+  while (incoming.count < MAX_CLIENTS)
+  {
+    GhostPlayer *ghost = &incoming.players[incoming.count];
+    int consumed = 0;
+
+    // NOLINTNEXTLINE(cert-err34-c,-warnings-as-errors)
+    if (sscanf(cursor, "%19[^,],%d,%d %n", ghost->username, &ghost->x,
+               &ghost->y, &consumed) != 3 ||
+        consumed == 0)
+    {
+      memset(ghost, 0, sizeof(*ghost));
+      break;
+    }
+
+    cursor += consumed;
+    incoming.count++;
+  }
+
+  stored = &room->ghosts[zone];
+  stored->updated_tick = room->sim.tick;
+
+  if (incoming.count == stored->count &&
+      memcmp(incoming.players, stored->players,
+             (size_t)incoming.count * sizeof(*incoming.players)) == 0)
+  {
+    return;
+  }
+
+  memcpy(stored->players, incoming.players, sizeof(stored->players));
+  stored->count = incoming.count;
+  room->snapshot_dirty = 1;
+}
+
+static void expire_ghosts(Room *room)
+{
+  for (int z = 0; z < room->zones->count; z++)
+  {
+    GhostSet *ghosts = &room->ghosts[z];
+
+    // A neighbour that went quiet takes its players with it.
+    if (ghosts->count != 0 &&
+        room->sim.tick - ghosts->updated_tick > GHOST_EXPIRY_TICKS)
+    {
+      ghosts->count = 0;
+      room->snapshot_dirty = 1;
+    }
+  }
+}
+
+static int find_client_by_name(const Room *room, const char *username)
+{
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    if (room->clients[i].addr_len != 0 &&
+        strcmp(room->clients[i].username, username) == 0)
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void publish(Room *room, const char *message, size_t length)
+{
+  if (outbox_send(room->outbox, message, length, room->spectators->sockfd,
+                  (const struct sockaddr *)&room->spectator_addr,
+                  sizeof(room->spectator_addr)) == -1)
+  {
+    perror("sendto spectators");
+  }
+}
+
+// One copy of the tick for every spectator, however many are watching.
+static void publish_tick(Room *room)
+{
+  char message[BUFFER_SIZE];
+  char snapshot[SNAPSHOT_MAX_SIZE];
+  size_t snapshot_length;
+  size_t fragments;
+  int length;
+
+  if (room->sim.tick % SPECTATOR_WORLD_INTERVAL_TICKS == 1)
+  {
+    WelcomeMessage welcome = {.height = (uint32_t)room->world->height,
+                              .width = (uint32_t)room->world->width};
+
+    publish(room, message, welcome_encode(&welcome, message));
+  }
+
+  snapshot_length = serialize_all_client_positions(room, snapshot);
+
+  // Nobody to watch.
+  if (snapshot_length == 0)
+  {
+    return;
+  }
+
+  snapshot_length = append_chat(room, snapshot, snapshot_length,
+                                &room->chat_published);
+  fragments = count_fragments(snapshot_length);
+  room->snapshot_id++;
+
+  for (size_t f = 0; f < fragments; f++)
+  {
+    publish(room, message,
+            format_fragment(message, room->snapshot_id, snapshot,
+                            snapshot_length, f, fragments));
+  }
+
+  for (int i = 0; i < MAX_CLIENTS && room->sim.npc_count > 0; i++)
+  {
+    int visible;
+    int near;
+
+    if (room->clients[i].addr_len == 0)
+    {
+      continue;
+    }
+
+    length = snprintf(message, sizeof(message), FOR_MESSAGE_PREFIX "%s|",
+                      room->clients[i].username);
+    length += (int)format_visible_npcs(room, i, message + length,
+                                       sizeof(message) - (size_t)length, -1,
+                                       &visible, &near);
+    publish(room, message, (size_t)length);
+  }
+
+  publish_chunks(room);
+}
+
+// Cycles through the chunks each player can see, a few per tick, so a
+// spectator following anyone has the map around them within a few seconds.
+static void publish_chunks(Room *room)
+{
+  char message[BUFFER_SIZE];
+  int sent = 0;
+  int skipped = 0;
+
+  while (sent < SPECTATOR_CHUNKS_PER_TICK && skipped <= MAX_CLIENTS)
+  {
+    int index = room->spectator_client;
+    int cx0;
+    int cy0;
+    int cx1;
+    int cy1;
+    int length;
+
+    if (room->clients[index].addr_len != 0)
+    {
+      visible_chunk_range(room, index, &cx0, &cy0, &cx1, &cy1);
+
+      if (room->spectator_chunk < (cx1 - cx0 + 1) * (cy1 - cy0 + 1))
+      {
+        length = format_chunk(room,
+                              cx0 + room->spectator_chunk % (cx1 - cx0 + 1),
+                              cy0 + room->spectator_chunk / (cx1 - cx0 + 1),
+                              message);
+        room->spectator_chunk++;
+
+        if (length != -1)
+        {
+          publish(room, message, (size_t)length);
+          sent++;
+        }
+
+        skipped = 0;
+        continue;
+      }
+    }
+
+    room->spectator_client = (index + 1) % MAX_CLIENTS;
+    room->spectator_chunk = 0;
+    skipped++;
+  }
+}
+
+static void trace_begin(Room *room, const Datagram *slot, uint64_t now)
+{
+  TraceRecord *record = &room->trace_record;
+
+  memset(record, 0, sizeof(*record));
+  record->kernel_ns = slot->kernel_ns;
+  record->dequeued_ns = slot->received_ns;
+  record->started_ns = now;
+  record->room = (uint32_t)room->id;
+  room->trace_current = record;
+  room->trace_client = -1;
+}
+
+// A packet no datagram answered waits for its player's next snapshot. Past
+// TRACE_PENDING of them, the oldest is logged as never answered.
+static void trace_end(Room *room)
+{
+  TraceRecord *record = room->trace_current;
+  TracePending *pending;
+
+  if (record == NULL)
+  {
+    return;
+  }
+
+  room->trace_current = NULL;
+  record->handled_ns = monotonic_ns();
+
+  if (room->trace_client == -1 ||
+      room->clients[room->trace_client].addr_len == 0)
+  {
+    trace_write(room->trace, record, 1);
+    return;
+  }
+
+  pending = &room->trace_pending[room->trace_client];
+
+  if (pending->count == TRACE_PENDING)
+  {
+    trace_write(room->trace, &pending->records[0], 1);
+    memmove(&pending->records[0], &pending->records[1],
+            (TRACE_PENDING - 1) * sizeof(pending->records[0]));
+    pending->count--;
+  }
+
+  pending->records[pending->count++] = *record;
+}
+
+// Hands the next outbox_push the packet being handled, if nothing took it
+// yet, and whatever waits on client index or on the clients behind relay.
+static void trace_next_push(Room *room, int index, int relay)
+{
+  size_t count = 0;
+
+  if (room->trace == NULL)
+  {
+    return;
+  }
+
+  if (room->trace_current != NULL)
+  {
+    room->trace_current->handled_ns = monotonic_ns();
+    room->trace_batch[count++] = *room->trace_current;
+    room->trace_current = NULL;
+  }
+
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    TracePending *pending = &room->trace_pending[i];
+
+    if (pending->count != 0 &&
+        (i == index || (relay != -1 && room->clients[i].addr_len != 0 &&
+                        room->clients[i].relay == relay)))
+    {
+      memcpy(&room->trace_batch[count], pending->records,
+             (size_t)pending->count * sizeof(pending->records[0]));
+      count += (size_t)pending->count;
+      pending->count = 0;
+    }
+  }
+
+  outbox_trace_next(room->outbox, room->trace_batch, count);
+}
+
+static void trace_drop(Room *room, int index)
+{
+  TracePending *pending = &room->trace_pending[index];
+
+  trace_write(room->trace, pending->records, (size_t)pending->count);
+  pending->count = 0;
+}
+
+// Only a JOIN is logged with its address, so only it pays for the lookup.
+static void log_join(const Room *room,
+                     const struct sockaddr_storage *client_addr)
+{
+  char client_host[NI_MAXHOST];
+  char client_port[NI_MAXSERV];
+  int ret;
+
+  ret = getnameinfo((const struct sockaddr *)client_addr,
+                    sizeof(struct sockaddr_storage), client_host, NI_MAXHOST,
+                    client_port, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+
+  if (ret != 0)
+  {
+    fprintf(stderr, "getnameinfo: %s\n", gai_strerror(ret));
+    return;
+  }
+
+  printf("Received 'JOIN' message from %s:%s for room %d. Sending "
+         "confirmation...\n",
+         client_host, client_port, room->id);
+}
+
+static int add_relay(Room *room, const struct sockaddr_storage *relay_addr)
+{
+  int relay = find_relay(room, relay_addr);
+
+  // Relays re-subscribe periodically; only the first one counts.
+  if (relay != -1)
+  {
+    return relay;
+  }
+
+  if (room->relay_count == MAX_RELAYS)
+  {
+    printf("Room %d: no available space to add relay\n", room->id);
+    return -1;
+  }
+
+  relay = room->relay_count++;
+  room->relays[relay].addr = *relay_addr;
+  room->relays[relay].clients = 0;
+  printf("Room %d: relay %d subscribed\n", room->id, relay);
+
+  return relay;
+}
+
+static int find_relay(const Room *room,
+                      const struct sockaddr_storage *relay_addr)
+{
+  for (int r = 0; r < room->relay_count; r++)
+  {
+    if (memcmp(relay_addr, &room->relays[r].addr,
+               sizeof(struct sockaddr_storage)) == 0)
+    {
+      return r;
+    }
+  }
+
+  return -1;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+static void handle_packet(Room *room,
+                          const struct sockaddr_storage *client_addr,
+                          int from_peer, const char *buffer, size_t bytes,
+                          uint64_t received_ns)
+{
+  if (from_peer)
+  {
+    handle_peer_packet(room, client_addr, buffer);
+    return;
+  }
+
+  // Relays re-subscribe now and then, which also brings back a lost route.
+  if (strncmp(buffer, RELAY_MESSAGE_PREFIX, RELAY_MESSAGE_PREFIX_LEN) == 0)
+  {
+    if (add_relay(room, client_addr) != -1 && !room->routed)
+    {
+      post_route_update(room, ROUTE_JOINED, client_addr, NULL, 1);
+    }
+
+    return;
+  }
+
+  if (strncmp(buffer, VIA_MESSAGE_PREFIX, VIA_MESSAGE_PREFIX_LEN) == 0)
+  {
+    handle_relayed_packet(room, client_addr, buffer, bytes, received_ns);
+    return;
+  }
+
+  handle_client_packet(room, client_addr, -1, 0, buffer, bytes, received_ns);
+}
+
+static void handle_relayed_packet(Room *room,
+                                  const struct sockaddr_storage *relay_addr,
+                                  const char *buffer, size_t bytes,
+                                  uint64_t received_ns)
+{
+  const char *payload;
+  char *endptr;
+  unsigned long session;
+  int relay;
+
+  relay = find_relay(room, relay_addr);
+
+  if (relay == -1)
+  {
+    return;
+  }
+
+  session = strtoul(buffer + VIA_MESSAGE_PREFIX_LEN, &endptr, BASE_TEN);
+
+  if (*endptr != '|' || session > UINT32_MAX)
+  {
+    return;
+  }
+
+  payload = endptr + 1;
+  handle_client_packet(room, relay_addr, relay, (uint32_t)session, payload,
+                       bytes - (size_t)(payload - buffer), received_ns);
+}
+
+static void handle_client_packet(Room *room,
+                                 const struct sockaddr_storage *client_addr,
+                                 int relay, uint32_t session,
+                                 const char *buffer, size_t bytes,
+                                 uint64_t received_ns)
+{
+  int type = message_type(buffer, bytes);
+  int sender_index;
+  int view_rows;
+  int view_cols;
+  int room_id;
+  int moved;
+  uint64_t token;
+  MoveMessage move = {.token = 0};
+  PingMessage ping;
+
+  if (room->trace_current != NULL)
+  {
+    room->trace_current->type = (uint8_t)type;
+  }
+
+  // Only sessions we already have are answered; a PING never joins.
+  if (type == MESSAGE_PING)
+  {
+    int index;
+
+    if (ping_decode(buffer, bytes, &ping) == -1)
+    {
+      return;
+    }
+
+    index = find_session(room, ping.token, client_addr, relay, session);
+
+    if (index != -1)
+    {
+      handle_ping(room, index, &ping, received_ns);
+    }
+
+    return;
+  }
+
+  if (room_parse_join(buffer, bytes, &view_rows, &view_cols, &room_id,
+                      &token))
+  {
+    ClientInfo *client;
+
+    if (room->watchdog.level < SHED_NON_ESSENTIAL)
+    {
+      log_join(room, client_addr);
+    }
+
+    sender_index = find_session(room, token, client_addr, relay, session);
+
+    if (sender_index == -1)
+    {
+      add_client(room, client_addr, relay, session, view_rows, view_cols);
+      return;
+    }
+
+    // A restarted client, or one whose WELCOME was lost, gets its player
+    // back where it left it, and starts over on everything else.
+    client = &room->clients[sender_index];
+
+    client->view_rows = view_rows;
+    client->view_cols = view_cols;
+    client->chunks_sent = 0;
+    client->npcs_in_view = 0;
+    memset(&client->clock, 0, sizeof(client->clock));
+    memset(&client->inputs, 0, sizeof(client->inputs));
+    welcome_client(room, sender_index);
+    return;
+  }
+
+  if (strcmp(buffer, QUIT_MESSAGE) == 0)
+  {
+    sender_index = find_client(room, client_addr, relay, session);
+
+    if (sender_index != -1)
+    {
+      remove_client(room, sender_index);
+      room->snapshot_dirty = 1;
+    }
+
+    return;
+  }
+
+  // Unknown senders are ignored: sessions only start with a JOIN, and come
+  // back with their token.
+  moved = move_decode(buffer, bytes, &move) == 0;
+  sender_index = find_session(room, move.token, client_addr, relay, session);
+
+  if (sender_index == -1)
+  {
+    return;
+  }
+
+  room->trace_client = sender_index;
+
+  if (strncmp(buffer, CHUNK_REQUEST_PREFIX, CHUNK_REQUEST_PREFIX_LEN) == 0)
+  {
+    handle_chunk_request(room, sender_index, buffer);
+    return;
+  }
+
+  if (strncmp(buffer, CHAT_MESSAGE_PREFIX, CHAT_MESSAGE_PREFIX_LEN) == 0)
+  {
+    handle_chat(room, sender_index, buffer + CHAT_MESSAGE_PREFIX_LEN);
+    return;
+  }
+
+  if (!moved)
+  {
+    return;
+  }
+
+  record_input_delay(&room->clients[sender_index].clock, move.sent,
+                     received_ns);
+
+  // The player already belongs to the next zone as far as we know.
+  if (room->clients[sender_index].handoff_zone != -1)
+  {
+    return;
+  }
+
+  input_queue_push(&room->clients[sender_index].inputs, move.seq,
+                   move.direction, move.sent, received_ns);
+}
+
+#pragma GCC diagnostic pop
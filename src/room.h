@@ -0,0 +1,304 @@
+#ifndef TG_ROOM_H
+#define TG_ROOM_H
+
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "clocksync.h"
+#include "inputqueue.h"
+#include "jobs.h"
+#include "outbox.h"
+#include "protocol.h"
+#include "sim.h"
+#include "spectate.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "world.h"
+#include "zone.h"
+
+#define BUFFER_SIZE 1024
+#define MAX_CLIENTS SIM_MAX_PLAYERS
+#define ROOM_INBOX_CAPACITY 256
+#define ROOM_ROUTE_UPDATES 128
+#define TICK_INTERVAL_MS 50
+#define MAX_RELAYS 8
+// Bump whenever a change to RoomSnapshot, ClientInfo, RelayLink, SimPlayer
+// or Npc makes old checkpoints unreadable.
+#define ROOM_SNAPSHOT_VERSION 7
+#define RTT_HISTOGRAM_BUCKETS 16
+#define CHAT_HISTORY 64
+// Traced packets a player can have waiting for its next snapshot.
+#define TRACE_PENDING 8
+
+/*
+ * A session's resumption token, handed out in its WELCOME. The low bits say
+ * where the session lives, so a token from an address we have never seen
+ * leads straight to its room and slot, and the rest are random, so only
+ * the client that was welcomed knows them. 0 is never a token.
+ */
+#define SESSION_TOKEN_SLOT_BITS 8
+#define SESSION_TOKEN_ROOM_BITS 16
+#define SESSION_TOKEN_SLOT(token)                                              \
+  ((int)((token) & ((1U << SESSION_TOKEN_SLOT_BITS) - 1)))
+#define SESSION_TOKEN_ROOM(token)                                              \
+  ((int)(((token) >> SESSION_TOKEN_SLOT_BITS) &                                \
+         ((1U << SESSION_TOKEN_ROOM_BITS) - 1)))
+
+/*
+ * What a session's PINGs tell us: its clock relative to ours, and how its
+ * round trips are distributed. Bucket b counts round trips of 2^b to
+ * 2^(b+1) microseconds; the last one also takes anything slower.
+ */
+typedef struct
+{
+  ClockSync sync;
+  uint32_t rtt_histogram[RTT_HISTOGRAM_BUCKETS];
+  uint32_t rtt_samples;
+  uint64_t rtt_max_ns;
+  // Time from a timestamped input being sent to it reaching this process.
+  uint64_t input_delay_total_ns;
+  uint32_t input_delays;
+  int reported;
+} SessionClock;
+
+typedef struct
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  char username[MAX_USERNAME_LENGTH];
+  // Index into Room.relays, or -1 for a client talking to us directly.
+  // Relayed clients are told apart by the relay's session number.
+  int relay;
+  uint32_t session;
+  // Lets the client pick up this session from another address.
+  uint64_t token;
+  // Where the player stands is room->sim.players[index].
+  int view_rows;
+  int view_cols;
+  int chunks_sent;
+  int sent_cx0;
+  int sent_cy0;
+  int sent_cx1;
+  int sent_cy1;
+  int npcs_in_view;
+  // NPCs within sight of the player at its last NPC update. While the room
+  // sheds distant entities, only these are sent between full updates.
+  int npcs_near;
+  // Zone the player is being handed to, or -1. While set, moves are held
+  // back and (home_x, home_y) is where the player returns if it fails.
+  int handoff_zone;
+  uint64_t handoff_started_ns;
+  uint64_t handoff_sent_ns;
+  int home_x;
+  int home_y;
+  SessionClock clock;
+  // Moves that arrived and wait for their tick.
+  InputQueue inputs;
+} ClientInfo;
+
+typedef struct
+{
+  uint64_t ticks;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t packets;
+  uint64_t chat_lines;
+  // Ticks whose work went over the watchdog's budget.
+  uint64_t overruns;
+  uint64_t work_max_ns;
+} TickStats;
+
+typedef struct
+{
+  struct sockaddr_storage addr;
+  int clients;
+} RelayLink;
+
+typedef struct
+{
+  char username[MAX_USERNAME_LENGTH];
+  int x;
+  int y;
+} GhostPlayer;
+
+typedef struct
+{
+  char username[MAX_USERNAME_LENGTH];
+  char text[CHAT_TEXT_MAX];
+} ChatLine;
+
+// Players a neighbouring zone reported near our border.
+typedef struct
+{
+  GhostPlayer players[MAX_CLIENTS];
+  int count;
+  uint64_t updated_tick;
+} GhostSet;
+
+typedef struct
+{
+  struct sockaddr_storage addr;
+  int from_peer;
+  // Whether the network thread has a route to this room for addr.
+  int routed;
+  uint64_t received_ns;
+  // When the kernel received it, or 0 if unknown.
+  uint64_t kernel_ns;
+  size_t length;
+  char data[BUFFER_SIZE + 1];
+} Datagram;
+
+typedef struct
+{
+  TraceRecord records[TRACE_PENDING];
+  int count;
+} TracePending;
+
+/*
+ * Single-producer single-consumer ring: the network thread pushes, the
+ * thread that owns the room pops.
+ */
+typedef struct
+{
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+  Datagram slots[ROOM_INBOX_CAPACITY];
+} DatagramQueue;
+
+typedef enum
+{
+  ROUTE_JOINED,
+  ROUTE_MOVED,
+  ROUTE_LEFT
+} RouteChange;
+
+/*
+ * A change the network thread must make to its routes: a session or relay
+ * now at addr, a session that moved there from another address, or an
+ * address the room no longer answers.
+ */
+typedef struct
+{
+  RouteChange change;
+  int relay;
+  struct sockaddr_storage addr;
+  struct sockaddr_storage from;
+} RouteUpdate;
+
+// The same kind of ring the other way: the room pushes, the network thread
+// pops.
+typedef struct
+{
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+  RouteUpdate slots[ROOM_ROUTE_UPDATES];
+} RouteUpdateQueue;
+
+typedef struct
+{
+  int id;
+  int sockfd;
+  const World *world;
+
+  // NULL unless the world is sharded; area is then the part this process
+  // owns, otherwise the whole map.
+  const ZoneMap *zones;
+  WorldRect area;
+  GhostSet ghosts[MAX_ZONES];
+  int ghosts_sent[MAX_ZONES];
+  uint32_t joins;
+
+  ClientInfo clients[MAX_CLIENTS];
+  RelayLink relays[MAX_RELAYS];
+  int relay_count;
+
+  // NULL unless spectators are on. The room publishes on the stream's port
+  // plus its id, and walks the players' views a few chunks per tick.
+  const SpectatorStream *spectators;
+  struct sockaddr_in spectator_addr;
+  int spectator_client;
+  int spectator_chunk;
+
+  // The last CHAT_HISTORY lines said in the room: line n is in
+  // chat[n % CHAT_HISTORY]. Players get the lines from chat_sent on with
+  // the next snapshot, and spectators those from chat_published on.
+  ChatLine chat[CHAT_HISTORY];
+  uint64_t chat_said;
+  uint64_t chat_sent;
+  uint64_t chat_published;
+  // The number of the last snapshot sent or published.
+  uint32_t snapshot_id;
+  // Players came, went or were moved outside the tick; the next tick's
+  // snapshot shows it, so there is still only one per tick.
+  int snapshot_dirty;
+
+  // The players' positions, the NPCs and the tick; a player's slot there
+  // is its index in clients.
+  Sim sim;
+  uint64_t next_tick_ns;
+  TickStats tick_stats;
+  // Time spent handling packets since the last tick, which the watchdog
+  // charges to the next one.
+  uint64_t drain_ns;
+  Watchdog watchdog;
+  atomic_uint_fast64_t packets_dropped;
+
+  DatagramQueue inbox;
+  // Everything the room sends goes through here to its thread's sender.
+  Outbox *outbox;
+
+  // Sessions starting, moving and ending, for the network thread's routes.
+  // Every push also bumps route_updates_posted, shared by all the rooms, so
+  // that thread only looks at the rings when one has something. routed is
+  // the flag of the packet being handled.
+  RouteUpdateQueue route_updates;
+  atomic_uint_fast64_t *route_updates_posted;
+  int routed;
+
+  // NULL unless tracing. While a packet is handled, trace_current is its
+  // record until a datagram takes it, and trace_client the player it came
+  // from; a record no datagram took waits in that player's trace_pending
+  // for its next snapshot.
+  TraceLog *trace;
+  TracePending *trace_pending;
+  TraceRecord *trace_batch;
+  TraceRecord trace_record;
+  TraceRecord *trace_current;
+  int trace_client;
+} Room;
+
+// spawns covers the area the room runs: the zone's, or the whole world.
+Room *room_create(int id, int sockfd, const World *world,
+                  const SpawnCells *spawns, JobPool *job_pool,
+                  const ZoneMap *zones, const SpectatorStream *spectators,
+                  size_t npc_count, uint32_t seed, uint64_t tick_budget_ns);
+void room_destroy(Room *room);
+int room_enable_trace(Room *room, TraceLog *trace);
+
+int room_enqueue(Room *room, const struct sockaddr_storage *addr,
+                 socklen_t addr_len, int from_peer, int routed,
+                 const char *data, size_t length, uint64_t kernel_ns);
+int room_has_pending(Room *room);
+// Whether there was an update to take; only the network thread calls it.
+int room_take_route_update(Room *room, RouteUpdate *update);
+size_t room_drain(Room *room, size_t budget);
+void room_tick(Room *room);
+// Longer while the room sheds load by merging inputs.
+uint64_t room_tick_interval_ns(const Room *room);
+void room_shutdown(Room *room);
+
+size_t room_snapshot_size(size_t npc_count);
+void room_snapshot(const Room *room, void *buffer);
+void room_restore(Room *room, const void *buffer);
+
+// Whether buffer is a JOIN; out-of-range view sizes fall back to defaults.
+// token is the session the client asks to resume, or 0.
+int room_parse_join(const char *buffer, size_t length, int *view_rows,
+                    int *view_cols, int *room_id, uint64_t *token);
+// The room a MOVE or PING's token points to, or -1 for anything else.
+int room_token_room(const char *buffer, size_t length);
+
+#endif
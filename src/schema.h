@@ -0,0 +1,315 @@
+#ifndef TG_SCHEMA_H
+#define TG_SCHEMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "protocol.h"
+
+/*
+ * The fixed-size messages between clients and the server, described once
+ * below. Each becomes a struct, a size known at compile time, and an
+ * encode and a decode routine:
+ *
+ *   char buffer[MOVE_MESSAGE_SIZE];
+ *   MoveMessage move = {.seq = 1, .direction = DIRECTION_UP, .sent = 0};
+ *
+ *   move_encode(&move, buffer);
+ *   ...
+ *   switch (message_type(buffer, length))
+ *   {
+ *   case MESSAGE_MOVE:
+ *     move_decode(buffer, length, &move);
+ *
+ * On the wire a message is its type byte and then its fields in order,
+ * integers little-endian and names NUL-padded to their full width. Type
+ * bytes are control characters, which no text message in protocol.h starts
+ * with, so both kinds share every socket, relay and queue; message_type is
+ * MESSAGE_TEXT for anything that is not one of these at its exact size.
+ *
+ *   JOIN      client -> server, viewport size and room (was INIT:...),
+ *             and the token of a session to take back up, if any
+ *   WELCOME   server -> client, username, world size, the player's id in
+ *             snapshots and the session's token; the spectator stream's has
+ *             only the world size
+ *   MOVE      client -> server, numbered from 1 per session, a direction
+ *             and, once the client has an estimate of the server's clock,
+ *             when it was sent on it
+ *   PING      client -> server, clock probe
+ *   PONG      server -> client, its answer
+ *
+ * MOVE and PING carry the session's token as well, so a client whose
+ * address changed under it, say when a NAT forgets its mapping, is
+ * recognised by its next one.
+ *
+ * Times are as described in protocol.h, with 0 for "none".
+ */
+
+#define MESSAGES(X)                                                            \
+  X(JOIN, Join, join, 0x01)                                                    \
+  X(WELCOME, Welcome, welcome, 0x02)                                           \
+  X(MOVE, Move, move, 0x03)                                                    \
+  X(PING, Ping, ping, 0x04)                                                    \
+  X(PONG, Pong, pong, 0x05)
+
+#define JOIN_FIELDS(F)                                                         \
+  F(u16, rows)                                                                 \
+  F(u16, cols)                                                                 \
+  F(u32, room)                                                                 \
+  F(u64, token)
+
+#define WELCOME_FIELDS(F)                                                      \
+  F(name, username)                                                            \
+  F(u32, height)                                                               \
+  F(u32, width)                                                                \
+  F(u8, id)                                                                    \
+  F(u64, token)
+
+#define MOVE_FIELDS(F)                                                         \
+  F(u32, seq)                                                                  \
+  F(u8, direction)                                                             \
+  F(u64, sent)                                                                 \
+  F(u64, token)
+
+#define PING_FIELDS(F)                                                         \
+  F(u32, seq)                                                                  \
+  F(u64, sent)                                                                 \
+  F(u64, echoed)                                                               \
+  F(u64, held)                                                                 \
+  F(u64, token)
+
+#define PONG_FIELDS(F)                                                         \
+  F(u32, seq)                                                                  \
+  F(u64, sent)                                                                 \
+  F(u64, received)                                                             \
+  F(u64, replied)
+
+// Name, x step and y step.
+#define DIRECTIONS(X)                                                          \
+  X(UP, 0, -1)                                                                 \
+  X(DOWN, 0, 1)                                                                \
+  X(LEFT, -1, 0)                                                               \
+  X(RIGHT, 1, 0)
+
+// What each kind of field is in a struct, and how wide on the wire.
+#define SCHEMA_DECLARE_u8(field) uint8_t field;
+#define SCHEMA_DECLARE_u16(field) uint16_t field;
+#define SCHEMA_DECLARE_u32(field) uint32_t field;
+#define SCHEMA_DECLARE_u64(field) uint64_t field;
+#define SCHEMA_DECLARE_name(field) char field[MAX_USERNAME_LENGTH];
+#define SCHEMA_SIZE_u8 1
+#define SCHEMA_SIZE_u16 2
+#define SCHEMA_SIZE_u32 4
+#define SCHEMA_SIZE_u64 8
+#define SCHEMA_SIZE_name MAX_USERNAME_LENGTH
+
+#define SCHEMA_DECLARE(kind, field) SCHEMA_DECLARE_##kind(field)
+#define SCHEMA_SIZE(kind, field) +SCHEMA_SIZE_##kind
+#define SCHEMA_PUT(kind, field)                                                \
+  cursor = schema_put_##kind(cursor, message->field);
+#define SCHEMA_GET(kind, field)                                                \
+  cursor = schema_get_##kind(cursor, &message->field);
+
+enum
+{
+  MESSAGE_TEXT = 0,
+#define SCHEMA_TYPE(NAME, Name, name, type) MESSAGE_##NAME = (type),
+  MESSAGES(SCHEMA_TYPE)
+#undef SCHEMA_TYPE
+  MESSAGE_TYPE_COUNT
+};
+
+enum
+{
+#define SCHEMA_MESSAGE_SIZE(NAME, Name, name, type)                            \
+  NAME##_MESSAGE_SIZE = 1 NAME##_FIELDS(SCHEMA_SIZE),
+  MESSAGES(SCHEMA_MESSAGE_SIZE)
+#undef SCHEMA_MESSAGE_SIZE
+};
+
+enum
+{
+#define SCHEMA_DIRECTION(NAME, dx, dy) DIRECTION_##NAME,
+  DIRECTIONS(SCHEMA_DIRECTION)
+#undef SCHEMA_DIRECTION
+  DIRECTION_COUNT
+};
+
+#define SCHEMA_STRUCT(NAME, Name, name, type)                                  \
+  typedef struct                                                               \
+  {                                                                            \
+    NAME##_FIELDS(SCHEMA_DECLARE)                                              \
+  } Name##Message;
+MESSAGES(SCHEMA_STRUCT)
+#undef SCHEMA_STRUCT
+
+static inline char *schema_put_uint(char *cursor, uint64_t value, int size)
+{
+  for (int i = 0; i < size; i++)
+  {
+    cursor[i] = (char)(value >> (8 * i));
+  }
+
+  return cursor + size;
+}
+
+static inline uint64_t schema_get_uint(const char *cursor, int size)
+{
+  uint64_t value = 0;
+
+  for (int i = 0; i < size; i++)
+  {
+    value |= (uint64_t)(unsigned char)cursor[i] << (8 * i);
+  }
+
+  return value;
+}
+
+static inline char *schema_put_u8(char *cursor, uint8_t value)
+{
+  return schema_put_uint(cursor, value, SCHEMA_SIZE_u8);
+}
+
+static inline char *schema_put_u16(char *cursor, uint16_t value)
+{
+  return schema_put_uint(cursor, value, SCHEMA_SIZE_u16);
+}
+
+static inline char *schema_put_u32(char *cursor, uint32_t value)
+{
+  return schema_put_uint(cursor, value, SCHEMA_SIZE_u32);
+}
+
+static inline char *schema_put_u64(char *cursor, uint64_t value)
+{
+  return schema_put_uint(cursor, value, SCHEMA_SIZE_u64);
+}
+
+static inline char *schema_put_name(char *cursor, const char *value)
+{
+  size_t length = strnlen(value, SCHEMA_SIZE_name - 1);
+
+  memcpy(cursor, value, length);
+  memset(cursor + length, 0, SCHEMA_SIZE_name - length);
+
+  return cursor + SCHEMA_SIZE_name;
+}
+
+static inline const char *schema_get_u8(const char *cursor, uint8_t *value)
+{
+  *value = (uint8_t)schema_get_uint(cursor, SCHEMA_SIZE_u8);
+
+  return cursor + SCHEMA_SIZE_u8;
+}
+
+static inline const char *schema_get_u16(const char *cursor, uint16_t *value)
+{
+  *value = (uint16_t)schema_get_uint(cursor, SCHEMA_SIZE_u16);
+
+  return cursor + SCHEMA_SIZE_u16;
+}
+
+static inline const char *schema_get_u32(const char *cursor, uint32_t *value)
+{
+  *value = (uint32_t)schema_get_uint(cursor, SCHEMA_SIZE_u32);
+
+  return cursor + SCHEMA_SIZE_u32;
+}
+
+static inline const char *schema_get_u64(const char *cursor, uint64_t *value)
+{
+  *value = schema_get_uint(cursor, SCHEMA_SIZE_u64);
+
+  return cursor + SCHEMA_SIZE_u64;
+}
+
+// Always terminated, however the sender padded it.
+static inline const char *schema_get_name(const char *cursor,
+                                          char (*value)[SCHEMA_SIZE_name])
+{
+  memcpy(*value, cursor, SCHEMA_SIZE_name);
+  (*value)[SCHEMA_SIZE_name - 1] = '\0';
+
+  return cursor + SCHEMA_SIZE_name;
+}
+
+// buffer must hold <NAME>_MESSAGE_SIZE bytes; returns that size.
+#define SCHEMA_ENCODE(NAME, Name, name, type)                                  \
+  static inline size_t name##_encode(const Name##Message *message,             \
+                                     char *buffer)                             \
+  {                                                                            \
+    char *cursor = buffer;                                                     \
+                                                                               \
+    *cursor++ = (char)(type);                                                  \
+    NAME##_FIELDS(SCHEMA_PUT)                                                  \
+                                                                               \
+    return (size_t)(cursor - buffer);                                          \
+  }
+MESSAGES(SCHEMA_ENCODE)
+#undef SCHEMA_ENCODE
+
+// -1 unless buffer holds exactly this message.
+#define SCHEMA_DECODE(NAME, Name, name, type)                                  \
+  static inline int name##_decode(const char *buffer, size_t length,           \
+                                  Name##Message *message)                      \
+  {                                                                            \
+    const char *cursor = buffer + 1;                                           \
+                                                                               \
+    if (length != NAME##_MESSAGE_SIZE || buffer[0] != (char)(type))            \
+    {                                                                          \
+      return -1;                                                               \
+    }                                                                          \
+                                                                               \
+    NAME##_FIELDS(SCHEMA_GET)                                                  \
+                                                                               \
+    return 0;                                                                  \
+  }
+MESSAGES(SCHEMA_DECODE)
+#undef SCHEMA_DECODE
+
+// One table lookup, whatever the datagram holds.
+static inline int message_type(const char *buffer, size_t length)
+{
+  static const size_t sizes[MESSAGE_TYPE_COUNT] = {
+#define SCHEMA_TYPE_SIZE(NAME, Name, name, type)                               \
+  [MESSAGE_##NAME] = NAME##_MESSAGE_SIZE,
+      MESSAGES(SCHEMA_TYPE_SIZE)
+#undef SCHEMA_TYPE_SIZE
+  };
+  unsigned char type;
+
+  if (length == 0)
+  {
+    return MESSAGE_TEXT;
+  }
+
+  type = (unsigned char)buffer[0];
+
+  return type < MESSAGE_TYPE_COUNT && sizes[type] == length ? type
+                                                            : MESSAGE_TEXT;
+}
+
+static inline int direction_dx(uint8_t direction)
+{
+  static const int steps[DIRECTION_COUNT] = {
+#define SCHEMA_DIRECTION_DX(NAME, dx, dy) [DIRECTION_##NAME] = (dx),
+      DIRECTIONS(SCHEMA_DIRECTION_DX)
+#undef SCHEMA_DIRECTION_DX
+  };
+
+  return direction < DIRECTION_COUNT ? steps[direction] : 0;
+}
+
+static inline int direction_dy(uint8_t direction)
+{
+  static const int steps[DIRECTION_COUNT] = {
+#define SCHEMA_DIRECTION_DY(NAME, dx, dy) [DIRECTION_##NAME] = (dy),
+      DIRECTIONS(SCHEMA_DIRECTION_DY)
+#undef SCHEMA_DIRECTION_DY
+  };
+
+  return direction < DIRECTION_COUNT ? steps[direction] : 0;
+}
+
+#endif
@@ -0,0 +1,340 @@
+#include <errno.h>
+#include <ncurses.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "screen.h"
+
+#define DEFAULT_ROWS 24
+#define DEFAULT_COLS 80
+#define PRINT_BUFFER_SIZE 512
+// A cursor position, a change of attribute and the character itself.
+#define MAX_CELL_BYTES 16
+#define MAX_ESCAPE_BYTES 64
+// Unchanged cells this close are cheaper to print again than to jump over.
+#define MAX_REPRINT_GAP 4
+#define ANSI_ENTER "\x1b[?1049h\x1b[?25l\x1b[0m\x1b[2J"
+#define ANSI_LEAVE "\x1b[0m\x1b[?25h\x1b[?1049l"
+
+typedef struct
+{
+  char ch;
+  unsigned char attr;
+} ScreenCell;
+
+typedef struct
+{
+  char *data;
+  size_t length;
+} OutputBuffer;
+
+static void ansi_present(void);
+static void append(OutputBuffer *out, const char *data, size_t length);
+static void append_move(OutputBuffer *out, int row, int col);
+static void append_forward(OutputBuffer *out, int count);
+static void write_all(const char *data, size_t length);
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static ScreenBackend screen_backend;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static int screen_fd;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static int rows;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static int cols;
+
+// What the next frame should look like, and what the terminal shows now.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static ScreenCell *back;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static ScreenCell *front;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static OutputBuffer output;
+
+// Only set when ncurses writes somewhere other than stdout.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static SCREEN *curses_screen;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static FILE *curses_output;
+
+int screen_init(ScreenBackend backend, int fd, int height, int width)
+{
+  struct winsize size;
+
+  screen_backend = backend;
+  screen_fd = fd;
+
+  if (backend == SCREEN_NCURSES)
+  {
+    if (fd == STDOUT_FILENO && height == 0)
+    {
+      initscr();
+    }
+    else
+    {
+      curses_output = fdopen(dup(fd), "w");
+
+      if (curses_output == NULL ||
+          (curses_screen = newterm(NULL, curses_output, stdin)) == NULL)
+      {
+        fprintf(stderr, "Cannot start ncurses\n");
+        return -1;
+      }
+
+      if (height != 0)
+      {
+        resizeterm(height, width);
+      }
+    }
+
+    curs_set(0);
+    rows = LINES;
+    cols = COLS;
+
+    return 0;
+  }
+
+  if (height == 0 && ioctl(fd, TIOCGWINSZ, &size) == 0 && size.ws_row != 0)
+  {
+    height = size.ws_row;
+    width = size.ws_col;
+  }
+  else if (height == 0)
+  {
+    height = DEFAULT_ROWS;
+    width = DEFAULT_COLS;
+  }
+
+  rows = height;
+  cols = width;
+  back = malloc((size_t)rows * (size_t)cols * sizeof(*back));
+  front = malloc((size_t)rows * (size_t)cols * sizeof(*front));
+  output.data =
+      malloc((size_t)rows * (size_t)cols * MAX_CELL_BYTES + MAX_ESCAPE_BYTES);
+
+  if (back == NULL || front == NULL || output.data == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  for (int i = 0; i < rows * cols; i++)
+  {
+    back[i].ch = ' ';
+    back[i].attr = SCREEN_NORMAL;
+    // Matches nothing, so the first frame paints over whatever was printed
+    // before it.
+    front[i].ch = '\0';
+    front[i].attr = SCREEN_NORMAL;
+  }
+
+  write_all(ANSI_ENTER, strlen(ANSI_ENTER));
+
+  return 0;
+}
+
+void screen_shutdown(void)
+{
+  if (screen_backend == SCREEN_NCURSES)
+  {
+    endwin();
+
+    if (curses_screen != NULL)
+    {
+      delscreen(curses_screen);
+      fclose(curses_output);
+      curses_screen = NULL;
+    }
+
+    return;
+  }
+
+  write_all(ANSI_LEAVE, strlen(ANSI_LEAVE));
+  free(back);
+  free(front);
+  free(output.data);
+  back = NULL;
+  front = NULL;
+  output.data = NULL;
+}
+
+int screen_rows(void) { return rows; }
+
+int screen_cols(void) { return cols; }
+
+void screen_put(int row, int col, char ch, int attr)
+{
+  if (row < 0 || col < 0 || row >= rows || col >= cols)
+  {
+    return;
+  }
+
+  if (screen_backend == SCREEN_NCURSES)
+  {
+    mvaddch(row, col,
+            (chtype)(unsigned char)ch | (attr == SCREEN_BOLD ? A_BOLD : 0));
+    return;
+  }
+
+  back[row * cols + col].ch = ch;
+  back[row * cols + col].attr = (unsigned char)attr;
+}
+
+void screen_print(int row, int col, const char *format, ...)
+{
+  char buffer[PRINT_BUFFER_SIZE];
+  va_list args;
+  int length;
+
+  va_start(args, format);
+  length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  for (int i = 0; i < length && i < (int)sizeof(buffer) - 1; i++)
+  {
+    screen_put(row, col + i, buffer[i], SCREEN_NORMAL);
+  }
+}
+
+void screen_present(void)
+{
+  if (screen_backend == SCREEN_NCURSES)
+  {
+    refresh();
+    return;
+  }
+
+  ansi_present();
+}
+
+/*
+ * Walks the grid in order, tracking where the terminal's cursor is and which
+ * attribute is active so each changed cell costs as little as possible: no
+ * move when the cursor is already there, a reprint of a few unchanged cells
+ * or a relative move along the same row, and an absolute move otherwise.
+ */
+static void ansi_present(void)
+{
+  int cursor_row = -1;
+  int cursor_col = -1;
+  int attr = SCREEN_NORMAL;
+
+  output.length = 0;
+
+  for (int row = 0; row < rows; row++)
+  {
+    for (int col = 0; col < cols; col++)
+    {
+      ScreenCell *cell = &back[row * cols + col];
+      ScreenCell *shown = &front[row * cols + col];
+
+      if (cell->ch == shown->ch && cell->attr == shown->attr)
+      {
+        continue;
+      }
+
+      if (row == cursor_row && col > cursor_col &&
+          col - cursor_col <= MAX_REPRINT_GAP)
+      {
+        int gap_ok = 1;
+
+        for (int i = cursor_col; i < col; i++)
+        {
+          gap_ok &= back[row * cols + i].attr == attr;
+        }
+
+        if (gap_ok)
+        {
+          for (int i = cursor_col; i < col; i++)
+          {
+            output.data[output.length++] = back[row * cols + i].ch;
+          }
+        }
+        else
+        {
+          append_forward(&output, col - cursor_col);
+        }
+      }
+      else if (row == cursor_row && col > cursor_col)
+      {
+        append_forward(&output, col - cursor_col);
+      }
+      else if (row != cursor_row || col != cursor_col)
+      {
+        append_move(&output, row, col);
+      }
+
+      if (cell->attr != attr)
+      {
+        attr = cell->attr;
+        append(&output, attr == SCREEN_BOLD ? "\x1b[1m" : "\x1b[0m", 4);
+      }
+
+      output.data[output.length++] = cell->ch;
+      *shown = *cell;
+      // Writing the last column leaves the cursor waiting to wrap, which
+      // terminals disagree about; position explicitly after it.
+      cursor_row = col + 1 < cols ? row : -1;
+      cursor_col = col + 1 < cols ? col + 1 : -1;
+    }
+  }
+
+  if (attr != SCREEN_NORMAL)
+  {
+    append(&output, "\x1b[0m", 4);
+  }
+
+  if (output.length != 0)
+  {
+    write_all(output.data, output.length);
+  }
+}
+
+static void append(OutputBuffer *out, const char *data, size_t length)
+{
+  memcpy(out->data + out->length, data, length);
+  out->length += length;
+}
+
+static void append_move(OutputBuffer *out, int row, int col)
+{
+  out->length += (size_t)sprintf(out->data + out->length, "\x1b[%d;%dH",
+                                 row + 1, col + 1);
+}
+
+static void append_forward(OutputBuffer *out, int count)
+{
+  out->length +=
+      (size_t)sprintf(out->data + out->length, "\x1b[%dC", count);
+}
+
+static void write_all(const char *data, size_t length)
+{
+  while (length != 0)
+  {
+    ssize_t written = write(screen_fd, data, length);
+
+    if (written == -1 && errno == EINTR)
+    {
+      continue;
+    }
+
+    if (written == -1)
+    {
+      return;
+    }
+
+    data += written;
+    length -= (size_t)written;
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef TG_SCREEN_H
+#define TG_SCREEN_H
+
+/*
+ * Where the client draws. Callers put characters into a rows x cols grid and
+ * call screen_present once the frame is complete; nothing reaches the
+ * terminal before that.
+ *
+ * SCREEN_NCURSES hands every cell to ncurses and lets refresh work out the
+ * update. SCREEN_ANSI keeps the grid itself next to a copy of what the
+ * terminal shows, and turns the cells that differ into cursor moves, bold
+ * on/off and characters, written with one write() per frame.
+ */
+
+typedef enum
+{
+  SCREEN_NCURSES,
+  SCREEN_ANSI
+} ScreenBackend;
+
+#define SCREEN_NORMAL 0
+#define SCREEN_BOLD 1
+
+// A zero height takes the size of the terminal on fd.
+int screen_init(ScreenBackend backend, int fd, int height, int width);
+void screen_shutdown(void);
+
+int screen_rows(void);
+int screen_cols(void);
+
+void screen_put(int row, int col, char ch, int attr);
+void screen_print(int row, int col, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+void screen_present(void);
+
+#endif
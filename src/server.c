@@ -1,21 +1,100 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 #include <limits.h>
 
-static void parse_arguments(int argc, char *argv[], char **ip_address,
-                            char **port);
+#include "checkpoint.h"
+#include "clock.h"
+#include "handover.h"
+#include "jobs.h"
+#include "netem.h"
+#include "protocol.h"
+#include "ratelimit.h"
+#include "room.h"
+#include "spectate.h"
+#include "trace.h"
+#include "transport.h"
+#include "world.h"
+#include "zone.h"
+
+typedef struct
+{
+  char *address;
+  char *port_str;
+  char *map_path;
+  char *zone_path;
+  int zone_id;
+  char *checkpoint_path;
+  char *handover_path;
+  char *impairment;
+  char *spectator_spec;
+  char *shm_name;
+  char *trace_path;
+  size_t npc_count;
+  int worker_count;
+  int room_count;
+  int room_thread_count;
+  uint32_t session_rate;
+  uint32_t new_source_rate;
+  // Work a room may do per tick before it sheds load; 0 never sheds.
+  uint32_t tick_budget_ms;
+  // Room r draws from seed + r; unless -s is given the seeds are random.
+  int seeded;
+  uint32_t seed;
+} ServerOptions;
+
+typedef struct
+{
+  pthread_t thread;
+  int cpu;
+  int wake_fd;
+  atomic_int sleeping;
+  Room **rooms;
+  int room_count;
+  // Sends what the thread's rooms queue in their outboxes.
+  Sender sender;
+} RoomThread;
+
+typedef struct
+{
+  struct sockaddr_storage addr;
+  int room_id;
+  int relay;
+  uint64_t bucket;
+  // When the address last sent anything, to pick which route to evict.
+  uint64_t seen_ns;
+  int used;
+} RouteEntry;
+
+typedef struct
+{
+  uint64_t packets;
+  uint64_t session_drops;
+  uint64_t new_source_drops;
+  uint64_t next_report_ns;
+} DispatchStats;
+
+static void parse_arguments(int argc, char *argv[], ServerOptions *options);
+static size_t parse_count(const char *binary_name, const char *str,
+                          size_t max);
 static void handle_arguments(const char *binary_name, const char *ip_address,
                              const char *port_str, in_port_t *port);
 static in_port_t parse_in_port_t(const char *binary_name, const char *port_str);
@@ -25,46 +104,61 @@ static void convert_address(const char *address, struct sockaddr_storage *addr);
 static int socket_create(int domain, int type, int protocol);
 static void socket_bind(int sockfd, struct sockaddr_storage *addr,
                         in_port_t port);
-static void handle_packet(int client_sockfd,
-                          const struct sockaddr_storage *client_addr,
-                          const char *buffer, size_t bytes);
 static void socket_close(int sockfd);
 
-static void initialize_clients(void);
-static int add_client(int sockfd, const struct sockaddr_storage *client_addr);
-static int get_client_index(int sockfd,
-                            const struct sockaddr_storage *client_addr);
-static void remove_client(int index);
-static void broadcast(int sockfd, const char *message, int sender_index);
-
 static void setup_signal_handler(void);
 static void sigint_handler(int signum);
 
-void get_terminal_dimensions(void);
-int handle_position_change(const char *buffer, int sender_index);
-
-void serialize_all_client_positions(char *buffer);
-
-void set_init_position(int sender_index);
+static void load_world(const char *map_path);
+static void load_zones(const ServerOptions *options, int inherited_fd);
+static void open_checkpoint(const ServerOptions *options);
+static uint64_t checkpoint_fingerprint(const ServerOptions *options);
+static void save_checkpoint(Room *room);
+static void restore_routes(const Room *room);
+
+static void start_rooms(int sockfd, const ServerOptions *options);
+static void stop_rooms(int handing_over);
+static void *room_thread_main(void *arg);
+static void wake_room_thread(RoomThread *room_thread);
+static void dispatch_packet(const struct sockaddr_storage *client_addr,
+                            socklen_t client_addr_len, const char *buffer,
+                            size_t bytes, uint64_t kernel_ns);
+static void dispatch_peer_packet(const struct sockaddr_storage *peer_addr,
+                                 socklen_t peer_addr_len, const char *buffer,
+                                 size_t bytes);
+static int receive_into(int sockfd, int impaired, char *buffer, size_t size,
+                        struct sockaddr_storage *addr, socklen_t *addr_len,
+                        uint64_t *kernel_ns);
+static void init_rate_limits(const ServerOptions *options);
+static int admit_packet(RouteEntry *route, uint64_t now);
+static void report_dispatch_stats(uint64_t now);
+
+static void routes_init(size_t session_capacity);
+static size_t route_hash(const struct sockaddr_storage *addr);
+static RouteEntry *route_find(const struct sockaddr_storage *addr);
+static RouteEntry *route_set(const struct sockaddr_storage *addr,
+                             int room_id, int relay);
+static void route_remove(const struct sockaddr_storage *addr);
+static void route_evict_oldest(void);
+static void apply_route_updates(void);
+static void apply_route_update(int room_id, const RouteUpdate *update);
 
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 static volatile sig_atomic_t exit_flag = 0;
 
-#define BUFFER_SIZE 1024
 #define BASE_TEN 10
-#define MAX_USERNAME_LENGTH 20
-#define MAX_CLIENTS 32
-#define MIN_X 0
-#define MIN_Y 0
-
-typedef struct
-{
-  struct sockaddr_storage addr;
-  socklen_t addr_len;
-  char username[MAX_USERNAME_LENGTH];
-  int x_coord;
-  int y_coord;
-} ClientInfo;
+#define MAX_NPCS 1000000
+#define MAX_WORKERS 256
+#define MAX_ROOMS 4096
+#define ROOM_PACKET_BUDGET 64
+#define CHECKPOINT_INTERVAL_TICKS 10
+#define DEFAULT_SESSION_RATE 100
+#define DEFAULT_NEW_SOURCE_RATE 50
+#define DEFAULT_TICK_BUDGET_MS 40
+#define MAX_RATE 1000000
+#define DISPATCH_REPORT_INTERVAL_MS 5000
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
 
 typedef struct
 {
@@ -72,233 +166,1177 @@ typedef struct
   int width;
 } WindowDimensions;
 
-// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-ClientInfo clients[MAX_CLIENTS];
+void get_terminal_dimensions(WindowDimensions *window);
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+World world;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+JobPool *job_pool;
+
+// The zone layout when the world is sharded across processes (-z).
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+ZoneMap zone_map;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+const ZoneMap *zones;
+
+// The multicast group rooms publish to for spectators (-M).
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+SpectatorStream spectator_stream = {.sockfd = -1};
+
+// Where players may spawn in this process's area, shared by all its rooms.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+SpawnCells spawn_cells;
+
+// Sessions and NPCs of every room, saved by the room threads (-c).
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+Checkpoint checkpoint;
+
+// Where every client packet's time went, when tracing (-T).
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+TraceLog *trace_log;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+Room **rooms;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int room_count;
+
+// Index of the thread that owns each room.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int *room_owner;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+RoomThread *room_threads;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+int room_thread_count;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+atomic_int rooms_stopping;
+
+// Which room each session and relay belongs to. Only the network thread
+// reads or writes it, so it needs no locking; the rooms tell it what to
+// change through their route update rings.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+RouteEntry *routes;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+size_t route_mask;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+size_t route_count;
+
+// Bumped by the rooms for every route update they push, and the value the
+// network thread saw when it last emptied the rings.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+atomic_uint_fast64_t route_updates_posted;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint64_t route_updates_applied;
+
+// Packets each known address may send, refilled per second (-l). A relay
+// speaks for up to a room of players, so it gets that many times more.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+RateLimit session_limit;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+RateLimit relay_limit;
+
+// One bucket shared by every address without a route (-L).
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+RateLimit new_source_limit;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+uint64_t new_source_bucket;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+DispatchStats dispatch_stats;
+
+int main(int argc, char *argv[])
+{
+  ServerOptions options;
+  in_port_t port;
+  int sockfd;
+  char buffer[BUFFER_SIZE + 1];
+  struct sockaddr_storage client_addr;
+  socklen_t client_addr_len;
+  struct sockaddr_storage addr;
+  int inherited[HANDOVER_MAX_FDS];
+  int inherited_count = 0;
+  int handover_fd = -1;
+  int handed_over = 0;
+  int shm_fd = -1;
+  // The kernel's receive times are lost once netem holds a datagram back.
+  int kernel_stamps = 0;
+  uint64_t kernel_ns = 0;
+
+  memset(&options, 0, sizeof(options));
+  options.room_count = 1;
+  options.session_rate = DEFAULT_SESSION_RATE;
+  options.new_source_rate = DEFAULT_NEW_SOURCE_RATE;
+  options.tick_budget_ms = DEFAULT_TICK_BUDGET_MS;
+
+  parse_arguments(argc, argv, &options);
+  handle_arguments(argv[0], options.address, options.port_str, &port);
+  convert_address(options.address, &addr);
+
+  // Take over from a running server if there is one on the handover path.
+  if (options.handover_path != NULL)
+  {
+    inherited_count = handover_receive(options.handover_path, inherited,
+                                       HANDOVER_MAX_FDS);
+
+    if (inherited_count == -1)
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (inherited_count > 0)
+  {
+    sockfd = inherited[0];
+    printf("Took over the socket of the running server\n");
+  }
+  else
+  {
+    sockfd = socket_create(addr.ss_family, SOCK_DGRAM, 0);
+    socket_bind(sockfd, &addr, port);
+  }
+
+  setup_signal_handler();
+
+  if (options.impairment != NULL && netem_init(options.impairment) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  load_world(options.map_path);
+  printf("width: %d, height: %d\n", world.width, world.height);
+  load_zones(&options, inherited_count > 1 ? inherited[1] : -1);
+  open_checkpoint(&options);
+  init_rate_limits(&options);
+
+  if (options.spectator_spec != NULL &&
+      spectator_open(&spectator_stream, options.spectator_spec, &addr) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  if (options.shm_name != NULL &&
+      (shm_fd = transport_shm_listen(options.shm_name)) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  if (options.trace_path != NULL)
+  {
+    trace_log = trace_open(options.trace_path);
+
+    if (trace_log == NULL)
+    {
+      exit(EXIT_FAILURE);
+    }
+
+    kernel_stamps = options.impairment == NULL &&
+                    trace_enable_timestamps(sockfd) == 0;
+  }
+
+  start_rooms(sockfd, &options);
+
+  if (options.handover_path != NULL)
+  {
+    handover_fd = handover_listen(options.handover_path);
+
+    if (handover_fd == -1)
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  while (!exit_flag)
+  {
+    struct pollfd fds[4];
+    int bytes_received;
+    int netem_ms = netem_timeout_ms();
+    int timeout_ms = transport_timeout_ms();
+
+    fds[0].fd = sockfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = zones != NULL ? zones->peer_sockfd : -1;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    fds[2].fd = handover_fd;
+    fds[2].events = POLLIN;
+    fds[2].revents = 0;
+    fds[3].fd = shm_fd;
+    fds[3].events = POLLIN;
+    fds[3].revents = 0;
+
+    // poll skips the negative descriptors of features not in use. Delayed
+    // datagrams fall due without the socket becoming readable again, and
+    // the shared-memory doorbell only rings once its rings were found empty.
+    if (poll(fds, 4, timeout_ms) == -1)
+    {
+      break;
+    }
+
+    // Anything a room changed before this wakeup's packets were sent.
+    apply_route_updates();
+
+    // A new server wants our sockets; finish up and hand them over.
+    if (fds[2].revents & POLLIN)
+    {
+      handed_over = 1;
+      break;
+    }
+
+    if ((fds[0].revents & POLLIN) || netem_ms >= 0)
+    {
+      bytes_received = receive_into(sockfd, 1, buffer, sizeof(buffer),
+                                    &client_addr, &client_addr_len,
+                                    kernel_stamps ? &kernel_ns : NULL);
+
+      if (bytes_received >= 0)
+      {
+        dispatch_packet(&client_addr, client_addr_len, buffer,
+                        (size_t)bytes_received, kernel_ns);
+      }
+      else if (errno != EAGAIN)
+      {
+        break;
+      }
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      bytes_received = receive_into(zones->peer_sockfd, 0, buffer,
+                                    sizeof(buffer), &client_addr,
+                                    &client_addr_len, NULL);
+
+      if (bytes_received == -1)
+      {
+        break;
+      }
+
+      dispatch_peer_packet(&client_addr, client_addr_len, buffer,
+                           (size_t)bytes_received);
+    }
+
+    if ((fds[3].revents & POLLIN) || transport_pending(shm_fd))
+    {
+      bytes_received = receive_into(shm_fd, 1, buffer, sizeof(buffer),
+                                    &client_addr, &client_addr_len, NULL);
+
+      if (bytes_received >= 0)
+      {
+        dispatch_packet(&client_addr, client_addr_len, buffer,
+                        (size_t)bytes_received, 0);
+      }
+    }
+  }
+
+  stop_rooms(handed_over);
+  netem_shutdown();
+
+  if (trace_log != NULL)
+  {
+    printf("Traced %" PRIu64 " packets to %s\n", trace_log->records,
+           options.trace_path);
+    trace_close(trace_log);
+  }
+
+  if (handed_over)
+  {
+    int fds[2] = {sockfd, zones != NULL ? zones->peer_sockfd : -1};
+
+    if (handover_send(handover_fd, fds, zones != NULL ? 2 : 1) == 0)
+    {
+      printf("Handed the sockets over to the new server\n");
+    }
+  }
+  else if (checkpoint.mapping != NULL)
+  {
+    // Everyone was sent QUIT, so there are no sessions left to resume.
+    checkpoint_discard(&checkpoint);
+  }
+
+  if (handover_fd != -1)
+  {
+    close(handover_fd);
+
+    if (!handed_over)
+    {
+      unlink(options.handover_path);
+    }
+  }
+
+  checkpoint_close(&checkpoint);
+  spectator_close(&spectator_stream);
+  transport_shutdown();
+
+  if (zones != NULL)
+  {
+    close(zones->peer_sockfd);
+  }
+
+  socket_close(sockfd);
+  job_pool_destroy(job_pool);
+  free(routes);
+  world_unload(&world);
+
+  return EXIT_SUCCESS;
+}
+
+void get_terminal_dimensions(WindowDimensions *window)
+{
+  struct winsize ws;
+  ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+  window->height = ws.ws_row;
+  window->width = ws.ws_col;
+}
+
+static void load_world(const char *map_path)
+{
+  WindowDimensions window;
+
+  if (map_path != NULL)
+  {
+    if (world_load(&world, map_path) == -1)
+    {
+      exit(EXIT_FAILURE);
+    }
+
+    return;
+  }
+
+  // Without a map the world is a walled room the size of this terminal.
+  get_terminal_dimensions(&window);
+
+  if (world_create_bordered(&world, window.width, window.height) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void load_zones(const ServerOptions *options, int inherited_fd)
+{
+  const Zone *self;
+
+  if (options->zone_path == NULL)
+  {
+    return;
+  }
+
+  if (zone_map_load(&zone_map, options->zone_path, options->zone_id) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  if (inherited_fd != -1)
+  {
+    zone_map.peer_sockfd = inherited_fd;
+  }
+  else if (zone_map_open_peer_socket(&zone_map) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  zones = &zone_map;
+  self = zone_self(zones);
+  printf("Running zone %d of %d: (%d, %d) to (%d, %d)\n", self->id,
+         zones->count, self->area.x0, self->area.y0, self->area.x1,
+         self->area.y1);
+}
+
+static void open_checkpoint(const ServerOptions *options)
+{
+  if (options->checkpoint_path == NULL)
+  {
+    return;
+  }
+
+  if (checkpoint_open(&checkpoint, options->checkpoint_path,
+                      options->room_count,
+                      room_snapshot_size(options->npc_count),
+                      checkpoint_fingerprint(options)) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  if (checkpoint.restored)
+  {
+    printf("Resuming from checkpoint %s\n", options->checkpoint_path);
+  }
+}
+
+// Checkpoints only resume into a server running the same world and zone.
+static uint64_t checkpoint_fingerprint(const ServerOptions *options)
+{
+  const uint64_t fields[] = {ROOM_SNAPSHOT_VERSION, (uint64_t)world.width,
+                             (uint64_t)world.height,
+                             zones != NULL ? (uint64_t)options->zone_id + 1
+                                           : 0};
+  uint64_t hash = FNV_OFFSET_BASIS;
+
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+  {
+    hash = (hash ^ fields[i]) * FNV_PRIME;
+  }
+
+  return hash;
+}
+
+static void save_checkpoint(Room *room)
+{
+  if (checkpoint.mapping == NULL)
+  {
+    return;
+  }
+
+  room_snapshot(room, checkpoint_begin(&checkpoint, room->id));
+  checkpoint_commit(&checkpoint, room->id);
+}
+
+static void restore_routes(const Room *room)
+{
+  for (int i = 0; i < MAX_CLIENTS; i++)
+  {
+    if (room->clients[i].addr_len != 0 && room->clients[i].relay == -1)
+    {
+      route_set(&room->clients[i].addr, room->id, 0);
+    }
+  }
+
+  for (int r = 0; r < room->relay_count; r++)
+  {
+    route_set(&room->relays[r].addr, room->id, 1);
+  }
+}
+
+static void start_rooms(int sockfd, const ServerOptions *options)
+{
+  int cpu_count;
+  WorldRect area = {0, 0, world.width, world.height};
+
+  cpu_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_count = cpu_count > 0 ? cpu_count : 1;
+
+  if (options->npc_count > 0)
+  {
+    job_pool = job_pool_create(options->worker_count > 0
+                                   ? options->worker_count
+                                   : cpu_count);
+
+    if (job_pool == NULL)
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  room_count = options->room_count;
+  room_thread_count = options->room_thread_count;
+
+  if (room_thread_count == 0)
+  {
+    room_thread_count = room_count < cpu_count ? room_count : cpu_count;
+  }
+
+  room_thread_count =
+      room_thread_count > room_count ? room_count : room_thread_count;
+
+  rooms = calloc((size_t)room_count, sizeof(*rooms));
+  room_owner = calloc((size_t)room_count, sizeof(*room_owner));
+  room_threads = calloc((size_t)room_thread_count, sizeof(*room_threads));
+
+  if (rooms == NULL || room_owner == NULL || room_threads == NULL)
+  {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  routes_init((size_t)room_count * (MAX_CLIENTS + MAX_RELAYS));
+
+  if (zones != NULL)
+  {
+    area = zone_self(zones)->area;
+  }
+
+  if (spawn_cells_build(&spawn_cells, &world, &area) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  for (int t = 0; t < room_thread_count; t++)
+  {
+    RoomThread *room_thread = &room_threads[t];
+
+    room_thread->cpu = t % cpu_count;
+    room_thread->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    room_thread->rooms = calloc(
+        (size_t)(room_count + room_thread_count - 1) / (size_t)room_thread_count,
+        sizeof(*room_thread->rooms));
+
+    if (room_thread->wake_fd == -1 || room_thread->rooms == NULL)
+    {
+      perror("room thread setup");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Rooms are dealt round-robin, so each thread carries an equal share.
+  for (int r = 0; r < room_count; r++)
+  {
+    RoomThread *room_thread = &room_threads[r % room_thread_count];
+
+    rooms[r] = room_create(
+        r, sockfd, &world, &spawn_cells, job_pool, zones,
+        spectator_stream.sockfd != -1 ? &spectator_stream : NULL,
+        options->npc_count,
+        options->seeded ? options->seed + (uint32_t)r : arc4random(),
+        (uint64_t)options->tick_budget_ms * NS_PER_MS);
+
+    if (rooms[r] == NULL ||
+        (trace_log != NULL && room_enable_trace(rooms[r], trace_log) == -1))
+    {
+      exit(EXIT_FAILURE);
+    }
+
+    rooms[r]->route_updates_posted = &route_updates_posted;
+
+    if (checkpoint.restored && checkpoint_latest(&checkpoint, r) != NULL)
+    {
+      room_restore(rooms[r], checkpoint_latest(&checkpoint, r));
+      restore_routes(rooms[r]);
+    }
+
+    room_owner[r] = r % room_thread_count;
+    room_thread->rooms[room_thread->room_count++] = rooms[r];
+  }
+
+  for (int t = 0; t < room_thread_count; t++)
+  {
+    RoomThread *room_thread = &room_threads[t];
+    Outbox **outboxes = calloc((size_t)room_thread->room_count,
+                               sizeof(*outboxes));
+
+    if (outboxes == NULL)
+    {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < room_thread->room_count; i++)
+    {
+      outboxes[i] = room_thread->rooms[i]->outbox;
+    }
+
+    if (sender_start(&room_thread->sender, outboxes,
+                     room_thread->room_count) == -1)
+    {
+      exit(EXIT_FAILURE);
+    }
+
+    free(outboxes);
+  }
+
+  for (int t = 0; t < room_thread_count; t++)
+  {
+    if (pthread_create(&room_threads[t].thread, NULL, room_thread_main,
+                       &room_threads[t]) != 0)
+    {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  printf("Hosting %d room%s on %d pinned thread%s, each with a send thread\n",
+         room_count, room_count == 1 ? "" : "s", room_thread_count,
+         room_thread_count == 1 ? "" : "s");
+
+  if (job_pool != NULL)
+  {
+    printf("Spawned %zu NPCs per room, simulating on %d threads\n",
+           options->npc_count, job_pool_worker_count(job_pool));
+  }
+}
+
+static void stop_rooms(int handing_over)
+{
+  atomic_store(&rooms_stopping, 1);
+
+  for (int t = 0; t < room_thread_count; t++)
+  {
+    uint64_t one = 1;
+
+    if (write(room_threads[t].wake_fd, &one, sizeof(one)) == -1)
+    {
+      perror("write eventfd");
+    }
+
+    pthread_join(room_threads[t].thread, NULL);
+    close(room_threads[t].wake_fd);
+    free(room_threads[t].rooms);
+  }
+
+  for (int r = 0; r < room_count; r++)
+  {
+    if (handing_over)
+    {
+      // Nothing reads the socket until the successor starts, so handle
+      // what is already queued and leave the clients connected.
+      room_drain(rooms[r], ROOM_INBOX_CAPACITY);
+      save_checkpoint(rooms[r]);
+    }
+    else
+    {
+      room_shutdown(rooms[r]);
+    }
+  }
+
+  // Only now is everything the rooms will ever send in their outboxes.
+  for (int t = 0; t < room_thread_count; t++)
+  {
+    sender_stop(&room_threads[t].sender);
+  }
+
+  for (int r = 0; r < room_count; r++)
+  {
+    room_destroy(rooms[r]);
+  }
+
+  spawn_cells_free(&spawn_cells);
+
+  free(room_threads);
+  free(room_owner);
+  free(rooms);
+}
+
+static void *room_thread_main(void *arg)
+{
+  RoomThread *self = arg;
+  cpu_set_t cpus;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(self->cpu, &cpus);
+
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+  {
+    fprintf(stderr, "Could not pin room thread to CPU %d\n", self->cpu);
+  }
+
+  while (!atomic_load(&rooms_stopping))
+  {
+    uint64_t now = monotonic_ns();
+    uint64_t earliest = UINT64_MAX;
+    int busy = 0;
+    int timeout_ms;
+    struct pollfd pfd;
+
+    for (int i = 0; i < self->room_count; i++)
+    {
+      Room *room = self->rooms[i];
+
+      // A bounded share per pass keeps a flooded room from starving the
+      // other rooms on this thread.
+      if (room_drain(room, ROOM_PACKET_BUDGET) == ROOM_PACKET_BUDGET)
+      {
+        busy = 1;
+      }
+
+      if (now >= room->next_tick_ns)
+      {
+        room_tick(room);
+
+        if (room->sim.tick % CHECKPOINT_INTERVAL_TICKS == 0)
+        {
+          save_checkpoint(room);
+        }
+
+        room->next_tick_ns += room_tick_interval_ns(room);
+
+        // Don't try to catch up on ticks lost while stalled.
+        if (room->next_tick_ns < now)
+        {
+          room->next_tick_ns = now + room_tick_interval_ns(room);
+        }
+      }
+
+      earliest = room->next_tick_ns < earliest ? room->next_tick_ns : earliest;
+    }
+
+    if (busy)
+    {
+      continue;
+    }
+
+    // Announce we are about to sleep, then look once more so a packet
+    // queued in between is never missed.
+    atomic_store(&self->sleeping, 1);
+
+    for (int i = 0; i < self->room_count && !busy; i++)
+    {
+      busy = room_has_pending(self->rooms[i]);
+    }
+
+    if (busy)
+    {
+      atomic_store(&self->sleeping, 0);
+      continue;
+    }
+
+    now = monotonic_ns();
+    timeout_ms = earliest > now
+                     ? (int)((earliest - now + NS_PER_MS - 1) / NS_PER_MS)
+                     : 0;
+    pfd.fd = self->wake_fd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, timeout_ms) > 0)
+    {
+      uint64_t count;
+
+      if (read(self->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+      {
+        perror("read eventfd");
+      }
+    }
+
+    atomic_store(&self->sleeping, 0);
+  }
+
+  return NULL;
+}
+
+static void wake_room_thread(RoomThread *room_thread)
+{
+  if (atomic_load(&room_thread->sleeping))
+  {
+    uint64_t one = 1;
+
+    if (write(room_thread->wake_fd, &one, sizeof(one)) == -1 &&
+        errno != EAGAIN)
+    {
+      perror("write eventfd");
+    }
+  }
+}
+
+static void dispatch_packet(const struct sockaddr_storage *client_addr,
+                            socklen_t client_addr_len, const char *buffer,
+                            size_t bytes, uint64_t kernel_ns)
+{
+  struct sockaddr_storage key;
+  RouteEntry *route;
+  uint64_t now;
+  int view_rows;
+  int view_cols;
+  int room_id;
+  uint64_t token;
+
+  memset(&key, 0, sizeof(key));
+  memcpy(&key, client_addr, client_addr_len);
+
+  // Rate limits apply before the payload is even looked at, so a flood
+  // costs one route lookup per packet and never reaches the rooms.
+  route = route_find(&key);
+  now = monotonic_ns();
+  report_dispatch_stats(now);
+
+  if (!admit_packet(route, now))
+  {
+    return;
+  }
+
+  if (route != NULL)
+  {
+    route->seen_ns = now;
+  }
+
+  // A relay subscribes to one room, and all its clients' traffic follows.
+  if (strncmp(buffer, RELAY_MESSAGE_PREFIX, RELAY_MESSAGE_PREFIX_LEN) == 0)
+  {
+    char *endptr;
+    long id = strtol(buffer + RELAY_MESSAGE_PREFIX_LEN, &endptr, BASE_TEN);
+
+    if (*endptr != '\0' || id < 0 || id >= room_count)
+    {
+      return;
+    }
+
+    room_id = (int)id;
+  }
+  else if (room_parse_join(buffer, bytes, &view_rows, &view_cols,
+                           &room_id, &token))
+  {
+    if (room_id >= room_count)
+    {
+      const char *message = "Server: No such room.";
+
+      if (transport_sendto(rooms[0]->sockfd, message, strlen(message), 0,
+                           (const struct sockaddr *)client_addr,
+                           client_addr_len) == -1)
+      {
+        perror("sendto");
+      }
+
+      return;
+    }
+  }
+  else if (route != NULL)
+  {
+    room_id = route->room_id;
+  }
+  else
+  {
+    // An unknown sender with a session token is a player whose address
+    // changed; its token says which room has the session. Anyone else lands
+    // in room 0, which ignores them. Nobody gets a route until a room lets
+    // them in, so forged sources never take up the table.
+    room_id = room_token_room(buffer, bytes);
+
+    if (room_id < 0 || room_id >= room_count)
+    {
+      room_id = 0;
+    }
+  }
 
-// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-WindowDimensions window;
+  if (room_enqueue(rooms[room_id], &key, client_addr_len, 0,
+                   route != NULL && route->room_id == room_id, buffer, bytes,
+                   kernel_ns) == 0)
+  {
+    wake_room_thread(&room_threads[room_owner[room_id]]);
+  }
+}
 
-int main(int argc, char *argv[])
+static void dispatch_peer_packet(const struct sockaddr_storage *peer_addr,
+                                 socklen_t peer_addr_len, const char *buffer,
+                                 size_t bytes)
 {
-  char *address;
-  char *port_str;
-  in_port_t port;
-  int sockfd;
-  char buffer[BUFFER_SIZE + 1];
-  struct sockaddr_storage client_addr;
-  socklen_t client_addr_len;
-  struct sockaddr_storage addr;
+  int room_id;
 
-  address = NULL;
-  port_str = NULL;
-
-  parse_arguments(argc, argv, &address, &port_str);
-  handle_arguments(argv[0], address, port_str, &port);
-  convert_address(address, &addr);
+  // Every inter-zone message names its room right after the prefix.
+  if (zone_parse_room_id(buffer, &room_id) == -1 || room_id >= room_count)
+  {
+    return;
+  }
 
-  sockfd = socket_create(addr.ss_family, SOCK_DGRAM, 0);
-  socket_bind(sockfd, &addr, port);
+  // An arriving player is routed once the room takes it, before its ack
+  // goes out, so the player's first packet here already finds its room.
+  if (room_enqueue(rooms[room_id], peer_addr, peer_addr_len, 1, 0, buffer,
+                   bytes, 0) == 0)
+  {
+    wake_room_thread(&room_threads[room_owner[room_id]]);
+  }
+}
 
-  setup_signal_handler();
+// Only client traffic goes through the impairment layer and the shared-memory
+// transport; the links between zone servers are assumed to be good. With
+// kernel_ns, the datagram is read straight off the socket with the time the
+// kernel received it.
+static int receive_into(int sockfd, int impaired, char *buffer, size_t size,
+                        struct sockaddr_storage *addr, socklen_t *addr_len,
+                        uint64_t *kernel_ns)
+{
+  ssize_t bytes_received;
 
-  get_terminal_dimensions();
-  printf("width: %d, height: %d\n", window.width, window.height);
-  initialize_clients();
+  *addr_len = sizeof(*addr);
 
-  while (!exit_flag)
+  if (kernel_ns != NULL)
+  {
+    bytes_received = trace_recvfrom(sockfd, buffer, size - 1,
+                                    (struct sockaddr *)addr, addr_len,
+                                    kernel_ns);
+  }
+  else
   {
-    ssize_t bytes_received;
-    client_addr_len = sizeof(client_addr);
     bytes_received =
-        recvfrom(sockfd, buffer, sizeof(buffer) - 1, 0,
-                 (struct sockaddr *)&client_addr, &client_addr_len);
-
-    if (bytes_received == -1)
-    {
-      break;
-    }
-
-    buffer[(size_t)bytes_received] = '\0';
-    handle_packet(sockfd, &client_addr, buffer, (size_t)bytes_received);
+        impaired ? transport_recvfrom(sockfd, buffer, size - 1, 0,
+                                      (struct sockaddr *)addr, addr_len)
+                 : recvfrom(sockfd, buffer, size - 1, 0,
+                            (struct sockaddr *)addr, addr_len);
   }
 
-  broadcast(sockfd, "QUIT", -1);
+  if (bytes_received == -1)
+  {
+    return -1;
+  }
 
-  socket_close(sockfd);
+  buffer[(size_t)bytes_received] = '\0';
 
-  return EXIT_SUCCESS;
+  return (int)bytes_received;
 }
 
-void get_terminal_dimensions(void)
+static void init_rate_limits(const ServerOptions *options)
 {
-  struct winsize ws;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
-  window.height = ws.ws_row;
-  window.width = ws.ws_col;
+  // A second's worth of burst covers a client asking for every chunk of a
+  // freshly opened view at once.
+  rate_limit_init(&session_limit, options->session_rate, options->session_rate);
+  rate_limit_init(&relay_limit, options->session_rate * MAX_CLIENTS,
+                  options->session_rate * MAX_CLIENTS);
+  rate_limit_init(&new_source_limit, options->new_source_rate,
+                  options->new_source_rate);
+  dispatch_stats.next_report_ns =
+      monotonic_ns() + (uint64_t)DISPATCH_REPORT_INTERVAL_MS * NS_PER_MS;
 }
 
-void serialize_all_client_positions(char *buffer)
+static int admit_packet(RouteEntry *route, uint64_t now)
 {
-  buffer[0] = '\0';
-
+  dispatch_stats.packets++;
 
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  if (route != NULL)
   {
-    if (clients[i].addr_len != 0)
+    if (rate_limit_admit(route->relay ? &relay_limit : &session_limit,
+                         &route->bucket, now))
     {
-
-      snprintf(buffer + strlen(buffer), BUFFER_SIZE - strlen(buffer),
-               "(%s, %d, %d) ", clients[i].username, clients[i].x_coord,
-               clients[i].y_coord);
+      return 1;
     }
+
+    dispatch_stats.session_drops++;
+    return 0;
   }
-}
 
-// NOLINTNEXTLINE(misc-no-recursion,-warnings-as-errors)
-static void broadcast(int sockfd, const char *message, int sender_index)
-{
-  char message_with_identifier[BUFFER_SIZE];
+  // Source addresses cost nothing to forge, so a bucket per unknown address
+  // would not slow a JOIN flood down. They all draw from one instead;
+  // players already in the game are never charged against it.
+  if (rate_limit_admit(&new_source_limit, &new_source_bucket, now))
+  {
+    return 1;
+  }
 
-  snprintf(message_with_identifier, BUFFER_SIZE, "%s", message);
+  dispatch_stats.new_source_drops++;
+  return 0;
+}
 
-  for (int i = 0; i < MAX_CLIENTS; i++)
+static void report_dispatch_stats(uint64_t now)
+{
+  if (now < dispatch_stats.next_report_ns)
   {
-    if (clients[i].addr_len != 0)
-    {
-      ssize_t bytes_sent;
+    return;
+  }
 
-      bytes_sent = sendto(
-          sockfd, message_with_identifier, strlen(message_with_identifier), 0,
-          (const struct sockaddr *)&clients[i].addr, sizeof(struct sockaddr));
+  if (dispatch_stats.session_drops != 0 || dispatch_stats.new_source_drops != 0)
+  {
+    printf("dispatch: %" PRIu64 " packets, %" PRIu64
+           " over session limit, %" PRIu64 " from unknown sources dropped\n",
+           dispatch_stats.packets, dispatch_stats.session_drops,
+           dispatch_stats.new_source_drops);
+  }
 
-      if (bytes_sent == -1)
-      {
-        char all_positions[BUFFER_SIZE];
-        remove_client(i);
-        serialize_all_client_positions(all_positions);
+  dispatch_stats.packets = 0;
+  dispatch_stats.session_drops = 0;
+  dispatch_stats.new_source_drops = 0;
+  dispatch_stats.next_report_ns =
+      now + (uint64_t)DISPATCH_REPORT_INTERVAL_MS * NS_PER_MS;
+}
 
-        broadcast(sockfd, all_positions, i);
-        perror("sendto");
-        return;
-      }
-    }
-  }
+static void routes_init(size_t session_capacity)
+{
+  size_t capacity = 1;
 
-  if (sender_index != -1)
+  // Keep the load factor at or below one half.
+  while (capacity < session_capacity * 2)
   {
-    ssize_t confirmation_bytes;
+    capacity <<= 1;
+  }
 
-    confirmation_bytes =
-        sendto(sockfd, "Server: message confirmation",
-               strlen("Server: message confirmation"), 0,
-               (const struct sockaddr *)&clients[sender_index].addr,
-               sizeof(struct sockaddr));
+  routes = calloc(capacity, sizeof(*routes));
 
-    if (confirmation_bytes == -1)
-    {
-      perror("sendto");
-      return;
-    }
+  if (routes == NULL)
+  {
+    perror("calloc");
+    exit(EXIT_FAILURE);
   }
+
+  route_mask = capacity - 1;
 }
 
-static void initialize_clients(void)
+static size_t route_hash(const struct sockaddr_storage *addr)
 {
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  const unsigned char *bytes = (const unsigned char *)addr;
+  size_t length = addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                              : sizeof(struct sockaddr_in);
+  uint64_t hash = 1469598103934665603ULL;
+
+  // FNV-1a over the meaningful part of the address.
+  for (size_t i = 0; i < length; i++)
   {
-    clients[i].addr_len = 0;
-    sprintf(clients[i].username, "client%d", i + 1);
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
   }
+
+  return (size_t)hash;
 }
 
-static int add_client(int sockfd, const struct sockaddr_storage *client_addr)
+static RouteEntry *route_find(const struct sockaddr_storage *addr)
 {
-  const char *no_room_message;
-  ssize_t error_bytes;
-  char client_confirmation[BUFFER_SIZE];
-  char screen_dimentions[BUFFER_SIZE];
-  char all_positions[BUFFER_SIZE];
+  size_t index = route_hash(addr) & route_mask;
 
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  for (size_t probes = 0; probes <= route_mask && routes[index].used;
+       probes++)
   {
-    if (clients[i].addr_len == 0)
+    if (memcmp(&routes[index].addr, addr, sizeof(*addr)) == 0)
     {
-      ssize_t bytes_sent;
-      ssize_t dimention_bytes;
-
-      clients[i].addr = *client_addr;
-      clients[i].addr_len = sizeof(struct sockaddr_storage);
+      return &routes[index];
+    }
 
-      set_init_position(i);
+    index = (index + 1) & route_mask;
+  }
 
-      serialize_all_client_positions(all_positions);
+  return NULL;
+}
 
-      sprintf(client_confirmation,
-              "Server: Successfully joined the game. You're %s",
-              clients[i].username);
-      sprintf(screen_dimentions, "INIT:%s|%d|%d", clients[i].username,
-              window.height, window.width);
+static RouteEntry *route_set(const struct sockaddr_storage *addr,
+                             int room_id, int relay)
+{
+  RouteEntry *route = route_find(addr);
+  size_t index;
 
-      dimention_bytes =
-          sendto(sockfd, screen_dimentions, strlen(screen_dimentions), 0,
-                 (const struct sockaddr *)client_addr, sizeof(struct sockaddr));
-      bytes_sent =
-          sendto(sockfd, client_confirmation, strlen(client_confirmation), 0,
-                 (const struct sockaddr *)client_addr, sizeof(struct sockaddr));
+  // An existing route keeps its bucket, so rejoining does not refill it.
+  if (route != NULL)
+  {
+    route->room_id = room_id;
+    route->relay = relay;
+    return route;
+  }
 
-      broadcast(sockfd, all_positions, i);
+  // Every session and relay fits at half load, so only routes whose
+  // update was lost can get us here; the one idle longest goes.
+  if (route_count == (route_mask + 1) / 2)
+  {
+    route_evict_oldest();
+  }
 
-      if (bytes_sent == -1 || dimention_bytes == -1)
-      {
-        perror("sendto");
-        return -1;
-      }
+  index = route_hash(addr) & route_mask;
 
-      return i;
-    }
+  while (routes[index].used)
+  {
+    index = (index + 1) & route_mask;
   }
 
-  no_room_message = "Server: No room available for new clients.";
-  error_bytes =
-      sendto(sockfd, no_room_message, strlen(no_room_message), 0,
-             (const struct sockaddr *)client_addr, sizeof(struct sockaddr));
-  printf("No available space to add client\n");
-  if (error_bytes == -1)
+  route_count++;
+  routes[index].addr = *addr;
+  routes[index].room_id = room_id;
+  routes[index].relay = relay;
+  routes[index].bucket = 0;
+  routes[index].seen_ns = monotonic_ns();
+  routes[index].used = 1;
+
+  return &routes[index];
+}
+
+static void route_remove(const struct sockaddr_storage *addr)
+{
+  RouteEntry *route = route_find(addr);
+  size_t hole;
+  size_t index;
+
+  if (route == NULL)
   {
-    perror("sendto");
+    return;
   }
 
-  return -1;
+  route_count--;
+  hole = (size_t)(route - routes);
+  routes[hole].used = 0;
+  index = (hole + 1) & route_mask;
+
+  // Backward-shift deletion keeps linear probing free of tombstones.
+  while (routes[index].used)
+  {
+    size_t home = route_hash(&routes[index].addr) & route_mask;
+
+    if (((index - home) & route_mask) >= ((index - hole) & route_mask))
+    {
+      routes[hole] = routes[index];
+      routes[index].used = 0;
+      hole = index;
+    }
+
+    index = (index + 1) & route_mask;
+  }
 }
 
-static int get_client_index(int sockfd,
-                            const struct sockaddr_storage *client_addr)
+static void route_evict_oldest(void)
 {
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  RouteEntry *oldest = NULL;
+
+  for (size_t i = 0; i <= route_mask; i++)
   {
-    if (clients[i].addr_len != 0 &&
-        memcmp(client_addr, &clients[i].addr,
-               sizeof(struct sockaddr_storage)) == 0)
+    if (routes[i].used &&
+        (oldest == NULL || routes[i].seen_ns < oldest->seen_ns))
     {
-      return i;
+      oldest = &routes[i];
     }
   }
 
-  return add_client(sockfd, client_addr);
+  if (oldest != NULL)
+  {
+    struct sockaddr_storage addr = oldest->addr;
+
+    route_remove(&addr);
+  }
 }
 
-static void remove_client(int index)
+// The rooms only push; a counter that has not moved saves looking at
+// every room's ring for each packet.
+static void apply_route_updates(void)
 {
+  uint64_t posted =
+      atomic_load_explicit(&route_updates_posted, memory_order_acquire);
+  RouteUpdate update;
 
-  if (index < 0 || index >= MAX_CLIENTS)
+  if (posted == route_updates_applied)
   {
-    fprintf(stderr, "Invalid client index\n");
     return;
   }
 
-  printf("Removing client at index %d\n", index);
+  route_updates_applied = posted;
+
+  for (int r = 0; r < room_count; r++)
+  {
+    while (room_take_route_update(rooms[r], &update))
+    {
+      apply_route_update(r, &update);
+    }
+  }
+}
+
+static void apply_route_update(int room_id, const RouteUpdate *update)
+{
+  RouteEntry *route;
+  uint64_t bucket = 0;
+
+  switch (update->change)
+  {
+  case ROUTE_JOINED:
+    route_set(&update->addr, room_id, update->relay);
+    break;
+  case ROUTE_MOVED:
+    route = route_find(&update->from);
+
+    if (route != NULL && route->room_id == room_id)
+    {
+      bucket = route->bucket;
+      route_remove(&update->from);
+    }
+
+    // Whichever address had spent more decides, so moving never refills.
+    route = route_set(&update->addr, room_id, 0);
+    route->bucket = bucket > route->bucket ? bucket : route->bucket;
+    break;
+  case ROUTE_LEFT:
+    route = route_find(&update->addr);
 
-  clients[index].addr_len = 0;
+    // The address may have joined another room since.
+    if (route != NULL && route->room_id == room_id)
+    {
+      route_remove(&update->addr);
+    }
+
+    break;
+  }
 }
 
 #pragma GCC diagnostic push
@@ -333,16 +1371,122 @@ static void setup_signal_handler(void)
   }
 }
 
-void parse_arguments(int argc, char *argv[], char **address, char **port_str)
+void parse_arguments(int argc, char *argv[], ServerOptions *options)
 {
-  if (argc < 3)
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hm:n:j:r:t:z:Z:c:H:l:L:B:I:M:S:T:s:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'm':
+      options->map_path = optarg;
+      break;
+    case 'n':
+      options->npc_count = parse_count(argv[0], optarg, MAX_NPCS);
+      break;
+    case 'j':
+      options->worker_count = (int)parse_count(argv[0], optarg, MAX_WORKERS);
+      break;
+    case 'r':
+      options->room_count = (int)parse_count(argv[0], optarg, MAX_ROOMS);
+      break;
+    case 't':
+      options->room_thread_count =
+          (int)parse_count(argv[0], optarg, MAX_WORKERS);
+      break;
+    case 'z':
+      options->zone_path = optarg;
+      break;
+    case 'Z':
+      options->zone_id = (int)parse_count(argv[0], optarg, INT_MAX);
+      break;
+    case 'c':
+      options->checkpoint_path = optarg;
+      break;
+    case 'H':
+      options->handover_path = optarg;
+      break;
+    case 'l':
+      options->session_rate = (uint32_t)parse_count(argv[0], optarg, MAX_RATE);
+      break;
+    case 'L':
+      options->new_source_rate =
+          (uint32_t)parse_count(argv[0], optarg, MAX_RATE);
+      break;
+    case 'B':
+      options->tick_budget_ms =
+          (uint32_t)parse_count(argv[0], optarg, TICK_INTERVAL_MS);
+      break;
+    case 'I':
+      options->impairment = optarg;
+      break;
+    case 'M':
+      options->spectator_spec = optarg;
+      break;
+    case 'S':
+      options->shm_name = optarg;
+      break;
+    case 'T':
+      options->trace_path = optarg;
+      break;
+    case 's':
+      options->seeded = 1;
+      options->seed = (uint32_t)parse_count(argv[0], optarg, UINT32_MAX);
+      break;
+    case 'h':
+      usage(argv[0], EXIT_SUCCESS, NULL);
+    default:
+      usage(argv[0], EXIT_FAILURE, NULL);
+    }
+  }
+
+  if (argc - optind < 2)
   {
     fprintf(stderr, "Usage: %s <server_address> <port>\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
-  *address = argv[1];
-  *port_str = argv[2];
+  if (options->room_count < 1)
+  {
+    usage(argv[0], EXIT_FAILURE, "At least one room is required.");
+  }
+
+  if (options->handover_path != NULL && options->checkpoint_path == NULL)
+  {
+    usage(argv[0], EXIT_FAILURE, "Hot restart (-H) needs a checkpoint (-c).");
+  }
+
+  options->address = argv[optind];
+  options->port_str = argv[optind + 1];
+}
+
+static size_t parse_count(const char *binary_name, const char *str,
+                          size_t max)
+{
+  char *endptr;
+  uintmax_t parsed_value;
+
+  errno = 0;
+  parsed_value = strtoumax(str, &endptr, BASE_TEN);
+
+  if (errno != 0)
+  {
+    perror("Error parsing count");
+    exit(EXIT_FAILURE);
+  }
+
+  if (*endptr != '\0')
+  {
+    usage(binary_name, EXIT_FAILURE, "Invalid characters in input.");
+  }
+
+  if (parsed_value > max)
+  {
+    usage(binary_name, EXIT_FAILURE, "Count out of range.");
+  }
+
+  return (size_t)parsed_value;
 }
 
 static void handle_arguments(const char *binary_name, const char *ip_address,
@@ -396,9 +1540,55 @@ _Noreturn static void usage(const char *program_name, int exit_code,
     fprintf(stderr, "%s\n", message);
   }
 
-  fprintf(stderr, "Usage: %s [-h] <ip address> <port>\n", program_name);
+  fprintf(stderr,
+          "Usage: %s [-h] [-m map] [-n npcs] [-j workers] [-r rooms] "
+          "[-t threads] [-z zones -Z zone] [-c checkpoint] [-H socket] "
+          "[-l rate] [-L rate] [-B ms] [-I impairment] [-M group:port] [-S name] "
+          "[-T file] [-s seed] <ip address> <port>\n",
+          program_name);
   fputs("Options:\n", stderr);
   fputs("  -h  Display this help message\n", stderr);
+  fputs("  -m  Map file made by mapgen (default: terminal-sized room)\n",
+        stderr);
+  fputs("  -n  Server-simulated NPCs per room (default: 0)\n", stderr);
+  fputs("  -j  NPC simulation threads (default: one per online CPU)\n",
+        stderr);
+  fputs("  -r  Number of independent rooms (default: 1)\n", stderr);
+  fputs("  -t  Pinned room threads (default: one per room, up to the CPU "
+        "count)\n",
+        stderr);
+  fputs("  -z  Zone file splitting the map across server processes\n",
+        stderr);
+  fputs("  -Z  Id of the zone this process runs (default: 0)\n", stderr);
+  fputs("  -c  Checkpoint file to save sessions to and resume from\n",
+        stderr);
+  fputs("  -H  Unix socket for hot restart: take over a running server "
+        "listening there,\n      then listen for the next one\n",
+        stderr);
+  fputs("  -l  Packets per second each client may send, 0 for no limit "
+        "(default: 100)\n",
+        stderr);
+  fputs("  -L  Packets per second accepted from addresses with no session, "
+        "0 for no limit\n      (default: 50)\n",
+        stderr);
+  fputs("  -B  Milliseconds of work a room may do per tick before it sheds "
+        "load, 0 to\n      never shed (default: 40)\n",
+        stderr);
+  fputs("  -I  Impair client traffic for testing, e.g. "
+        "delay=40,jitter=10,loss=2,dup=1,reorder=5,seed=7\n",
+        stderr);
+  fputs("  -M  Publish every room to spectators on this IPv4 multicast "
+        "group; room r\n      uses port + r, e.g. 239.255.0.1:6000\n",
+        stderr);
+  fputs("  -S  Also serve clients on this host through shared memory "
+        "/dev/shm/<name>\n",
+        stderr);
+  fputs("  -T  Trace where each client packet's time goes, from the kernel "
+        "to the reply,\n      into this file for tracestat\n",
+        stderr);
+  fputs("  -s  Seed for spawn points and NPCs, so a run can be replayed "
+        "(default: random)\n",
+        stderr);
   exit(exit_code);
 }
 
@@ -494,140 +1684,6 @@ static void socket_bind(int sockfd, struct sockaddr_storage *addr,
   printf("Bound to socket: %s:%u\n", addr_str, port);
 }
 
-int handle_position_change(const char *buffer, int sender_index)
-{
-
-  int prev_x = clients[sender_index].x_coord;
-  int prev_y = clients[sender_index].y_coord;
-
-  if (strcmp(buffer, "Up") == 0)
-  {
-    if (clients[sender_index].y_coord - 1 > MIN_Y)
-    {
-      clients[sender_index].y_coord -= 1;
-    }
-  }
-  else if (strcmp(buffer, "Down") == 0)
-  {
-    if (clients[sender_index].y_coord + 1 < window.height - 1)
-    {
-      clients[sender_index].y_coord += 1;
-    }
-  }
-  else if (strcmp(buffer, "Left") == 0)
-  {
-    if (clients[sender_index].x_coord - 1 > MIN_X)
-    {
-      clients[sender_index].x_coord -= 1;
-    }
-
-  } else if (strcmp(buffer, "Right") == 0)
-  {
-    if (clients[sender_index].x_coord + 1 < window.width - 1)
-    {
-      clients[sender_index].x_coord += 1;
-    }
-  }
-  else
-  {
-    return -1;
-  }
-
-  if (prev_x != clients[sender_index].x_coord ||
-      prev_y != clients[sender_index].y_coord)
-  {
-    printf("%s: (%d, %d) -> (%d, %d)\n", clients[sender_index].username, prev_x,
-           prev_y, clients[sender_index].x_coord,
-           clients[sender_index].y_coord);
-  }
-  else
-  {
-    return -1;
-  }
-
-  return 0;
-}
-
-void set_init_position(int sender_index)
-{
-  unsigned int seed = arc4random_uniform(UINT_MAX);
-  srand(seed);
-
-  clients[sender_index].x_coord =
-      MIN_X + 1 + rand() % (window.width - MIN_X - 1);
-  clients[sender_index].y_coord =
-      MIN_Y + 1 + rand() % (window.height - MIN_Y - 1);
-}
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-
-void handle_packet(int sockfd, const struct sockaddr_storage *client_addr,
-                   const char *buffer, size_t bytes)
-{
-  char client_host[NI_MAXHOST];
-  char client_port[NI_MAXSERV];
-  char all_positions[BUFFER_SIZE];
-  int sender_index = 0;
-
-  int ret =
-      getnameinfo((const struct sockaddr *)client_addr,
-                  sizeof(struct sockaddr_storage), client_host, NI_MAXHOST,
-                  client_port, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
-
-  if (ret != 0)
-  {
-    fprintf(stderr, "getnameinfo: %s\n", gai_strerror(ret));
-    return;
-  }
-
-  if (strcmp(buffer, "INIT") == 0)
-  {
-    int client_index;
-
-    printf("Received 'INIT' message from %s:%s. Sending confirmation...\n",
-           client_host, client_port);
-
-    client_index = add_client(sockfd, client_addr);
-    if (client_index == -1)
-    {
-      return;
-    }
-
-    return;
-  }
-
-  if (strcmp(buffer, "QUIT") == 0)
-  {
-
-    char positions[BUFFER_SIZE];
-    remove_client(get_client_index(sockfd, client_addr));
-
-    serialize_all_client_positions(positions);
-
-    broadcast(sockfd, positions, sender_index);
-    return;
-  }
-
-  // Get the sender index
-  sender_index = get_client_index(sockfd, client_addr);
-  if (sender_index == -1)
-  {
-    return;
-  }
-
-  if (handle_position_change(buffer, sender_index) == -1)
-  {
-    return;
-  }
-
-  serialize_all_client_positions(all_positions);
-
-  printf("BROADCASTING: %s\n", all_positions);
-  broadcast(sockfd, all_positions, sender_index);
-}
-
-#pragma GCC diagnostic pop
 
 static void socket_close(int sockfd)
 {
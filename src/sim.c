@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+static int cell_occupied(const Sim *sim, int x, int y, int except);
+static void step_npcs(Sim *sim);
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t length);
+static uint64_t hash_int(uint64_t hash, int64_t value);
+
+#define SPAWN_CELLS_INITIAL 1024
+#define NPC_JOB_GRAIN 256
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+int sim_init(Sim *sim, const World *world, const SpawnCells *spawns,
+             JobPool *job_pool, size_t npc_count, uint32_t seed)
+{
+  size_t chunk_count;
+
+  memset(sim, 0, sizeof(*sim));
+  sim->world = world;
+  sim->area = spawns->area;
+  sim->spawns = spawns;
+  sim->job_pool = job_pool;
+
+  rng_seed(&sim->rng, seed);
+
+  if (npc_count == 0)
+  {
+    return 0;
+  }
+
+  chunk_count = (size_t)world->chunks_x * (size_t)world->chunks_y;
+  sim->npc_count = npc_count;
+  sim->npcs = calloc(npc_count, sizeof(*sim->npcs));
+  sim->npc_order = calloc(npc_count, sizeof(*sim->npc_order));
+  sim->npc_chunk_start =
+      calloc(chunk_count + 1, sizeof(*sim->npc_chunk_start));
+
+  if (sim->npcs == NULL || sim->npc_order == NULL ||
+      sim->npc_chunk_start == NULL)
+  {
+    perror("calloc");
+    sim_destroy(sim);
+    return -1;
+  }
+
+  npc_spawn(sim->npcs, npc_count, world, &sim->area, seed);
+  sim_index_npcs(sim);
+
+  return 0;
+}
+
+void sim_destroy(Sim *sim)
+{
+  free(sim->npcs);
+  free(sim->npc_order);
+  free(sim->npc_chunk_start);
+  sim->npcs = NULL;
+  sim->npc_order = NULL;
+  sim->npc_chunk_start = NULL;
+}
+
+// One pass over the area, growing the list as it goes.
+int spawn_cells_build(SpawnCells *spawns, const World *world,
+                      const WorldRect *area)
+{
+  uint32_t width = (uint32_t)(area->x1 - area->x0);
+  size_t capacity = SPAWN_CELLS_INITIAL;
+
+  memset(spawns, 0, sizeof(*spawns));
+  spawns->area = *area;
+  spawns->cells = malloc(capacity * sizeof(*spawns->cells));
+
+  if (spawns->cells == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  for (int y = area->y0; y < area->y1; y++)
+  {
+    for (int x = area->x0; x < area->x1; x++)
+    {
+      if (!world_walkable(world, x, y))
+      {
+        continue;
+      }
+
+      if (spawns->count == capacity)
+      {
+        uint32_t *grown;
+
+        capacity *= 2;
+        grown = realloc(spawns->cells, capacity * sizeof(*grown));
+
+        if (grown == NULL)
+        {
+          perror("realloc");
+          spawn_cells_free(spawns);
+          return -1;
+        }
+
+        spawns->cells = grown;
+      }
+
+      spawns->cells[spawns->count++] =
+          (uint32_t)(y - area->y0) * width + (uint32_t)(x - area->x0);
+    }
+  }
+
+  if (spawns->count == 0)
+  {
+    fprintf(stderr, "Map has no walkable cells\n");
+    spawn_cells_free(spawns);
+    return -1;
+  }
+
+  return 0;
+}
+
+void spawn_cells_free(SpawnCells *spawns)
+{
+  free(spawns->cells);
+  spawns->cells = NULL;
+  spawns->count = 0;
+}
+
+// Every cell in the list is walkable, and only the other players can hold
+// one, so walking on from a random draw past the taken ones reaches a free
+// cell within SIM_MAX_PLAYERS steps however full the area is, each step a
+// check against the players alone. A cell just after a taken one is a
+// little likelier to come up, which spawns do not mind. In an area with
+// fewer cells than players, the player shares the last one looked at.
+void sim_spawn(Sim *sim, int player)
+{
+  const SpawnCells *spawns = sim->spawns;
+  uint32_t width = (uint32_t)(sim->area.x1 - sim->area.x0);
+  size_t looks = spawns->count < SIM_MAX_PLAYERS + 1 ? spawns->count
+                                                     : SIM_MAX_PLAYERS + 1;
+  // Only a full 65536x65536 area has more cells than a draw reaches.
+  size_t start = rng_below(&sim->rng, spawns->count < UINT32_MAX
+                                          ? (uint32_t)spawns->count
+                                          : UINT32_MAX);
+  int x = 0;
+  int y = 0;
+
+  for (size_t i = 0; i < looks; i++)
+  {
+    uint32_t cell = spawns->cells[(start + i) % spawns->count];
+
+    x = sim->area.x0 + (int)(cell % width);
+    y = sim->area.y0 + (int)(cell / width);
+
+    if (!cell_occupied(sim, x, y, player))
+    {
+      break;
+    }
+  }
+
+  sim_place(sim, player, x, y);
+}
+
+void sim_place(Sim *sim, int player, int x, int y)
+{
+  sim->players[player].active = 1;
+  sim->players[player].x = x;
+  sim->players[player].y = y;
+}
+
+void sim_remove(Sim *sim, int player)
+{
+  sim->players[player].active = 0;
+}
+
+static int cell_occupied(const Sim *sim, int x, int y, int except)
+{
+  for (int i = 0; i < SIM_MAX_PLAYERS; i++)
+  {
+    if (i != except && sim->players[i].active && sim->players[i].x == x &&
+        sim->players[i].y == y)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void sim_step(Sim *sim, const SimInputs *inputs, SimStep *step)
+{
+  sim->tick++;
+
+  for (int i = 0; i < SIM_MAX_PLAYERS; i++)
+  {
+    step->outcomes[i] = SIM_STAYED;
+
+    if (sim->players[i].active && inputs->moves[i] != SIM_NO_MOVE)
+    {
+      step->outcomes[i] = (uint8_t)sim_move(sim, i, inputs->moves[i]);
+    }
+  }
+
+  if (sim->npc_count > 0)
+  {
+    step_npcs(sim);
+  }
+}
+
+int sim_move(Sim *sim, int player, uint8_t direction)
+{
+  SimPlayer *moving = &sim->players[player];
+  int next_x = moving->x + direction_dx(direction);
+  int next_y = moving->y + direction_dy(direction);
+
+  if (direction >= DIRECTION_COUNT ||
+      !world_walkable(sim->world, next_x, next_y))
+  {
+    return SIM_BLOCKED;
+  }
+
+  // Whoever owns the area next door decides; the player stays for now.
+  if (!world_rect_contains(&sim->area, next_x, next_y))
+  {
+    return SIM_LEFT_AREA;
+  }
+
+  moving->x = next_x;
+  moving->y = next_y;
+
+  return SIM_MOVED;
+}
+
+static void step_npcs(Sim *sim)
+{
+  NpcTarget targets[SIM_MAX_PLAYERS];
+  NpcTick tick;
+
+  tick.world = sim->world;
+  tick.bounds = sim->area;
+  tick.npcs = sim->npcs;
+  tick.targets = targets;
+  tick.target_count = 0;
+  tick.tick = sim->tick;
+
+  for (int i = 0; i < SIM_MAX_PLAYERS; i++)
+  {
+    if (sim->players[i].active)
+    {
+      targets[tick.target_count].x = sim->players[i].x;
+      targets[tick.target_count].y = sim->players[i].y;
+      tick.target_count++;
+    }
+  }
+
+  if (sim->job_pool != NULL)
+  {
+    job_pool_parallel_for(sim->job_pool, sim->npc_count, NPC_JOB_GRAIN,
+                          npc_step_range, &tick);
+  }
+  else
+  {
+    npc_step_range(&tick, 0, sim->npc_count);
+  }
+
+  sim_index_npcs(sim);
+}
+
+void sim_index_npcs(Sim *sim)
+{
+  const World *world = sim->world;
+  size_t chunk_count = (size_t)world->chunks_x * (size_t)world->chunks_y;
+  size_t *start = sim->npc_chunk_start;
+
+  if (sim->npc_count == 0)
+  {
+    return;
+  }
+
+  memset(start, 0, (chunk_count + 1) * sizeof(*start));
+
+  // Counting sort: histogram, exclusive prefix sum, scatter.
+  for (size_t i = 0; i < sim->npc_count; i++)
+  {
+    const Npc *npc = &sim->npcs[i];
+
+    if (npc->x >= 0)
+    {
+      start[(size_t)(npc->y >> WORLD_CHUNK_SHIFT) * (size_t)world->chunks_x +
+            (size_t)(npc->x >> WORLD_CHUNK_SHIFT) + 1]++;
+    }
+  }
+
+  for (size_t c = 0; c < chunk_count; c++)
+  {
+    start[c + 1] += start[c];
+  }
+
+  for (size_t i = 0; i < sim->npc_count; i++)
+  {
+    const Npc *npc = &sim->npcs[i];
+
+    if (npc->x >= 0)
+    {
+      size_t chunk =
+          (size_t)(npc->y >> WORLD_CHUNK_SHIFT) * (size_t)world->chunks_x +
+          (size_t)(npc->x >> WORLD_CHUNK_SHIFT);
+
+      sim->npc_order[start[chunk]++] = i;
+    }
+  }
+
+  // The scatter advanced each start to the next chunk's; shift back.
+  memmove(start + 1, start, chunk_count * sizeof(*start));
+  start[0] = 0;
+}
+
+// FNV-1a over every field that decides what happens next, one at a time
+// so that padding never counts.
+uint64_t sim_hash(const Sim *sim)
+{
+  uint64_t hash = FNV_OFFSET_BASIS;
+
+  hash = hash_bytes(hash, &sim->tick, sizeof(sim->tick));
+  hash = hash_bytes(hash, sim->rng.s, sizeof(sim->rng.s));
+
+  for (int i = 0; i < SIM_MAX_PLAYERS; i++)
+  {
+    const SimPlayer *player = &sim->players[i];
+
+    hash = hash_int(hash, player->active);
+    hash = hash_int(hash, player->active ? player->x : 0);
+    hash = hash_int(hash, player->active ? player->y : 0);
+  }
+
+  for (size_t i = 0; i < sim->npc_count; i++)
+  {
+    const Npc *npc = &sim->npcs[i];
+
+    hash = hash_int(hash, npc->x);
+    hash = hash_int(hash, npc->y);
+    hash = hash_int(hash, npc->rng);
+    hash = hash_int(hash, npc->state);
+    hash = hash_int(hash, npc->timid);
+    hash = hash_int(hash, npc->heading);
+    hash = hash_int(hash, npc->heading_ticks);
+  }
+
+  return hash;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t length)
+{
+  const unsigned char *bytes = data;
+
+  for (size_t i = 0; i < length; i++)
+  {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+
+  return hash;
+}
+
+static uint64_t hash_int(uint64_t hash, int64_t value)
+{
+  return hash_bytes(hash, &value, sizeof(value));
+}
@@ -0,0 +1,114 @@
+#ifndef TG_SIM_H
+#define TG_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "jobs.h"
+#include "npc.h"
+#include "rng.h"
+#include "schema.h"
+#include "world.h"
+
+/*
+ * The game without the network: where the players stand, the NPCs around
+ * them and the random stream spawns draw from, moved on one tick at a time
+ * by sim_step. Nothing here touches a socket, a clock or stdout, so a
+ * room, a replay or a benchmark can all drive it the same way.
+ *
+ * The same world, seed and inputs always give the same states, whatever
+ * the job pool's size, and sim_hash sums a state up so two runs can be
+ * compared tick by tick.
+ *
+ * Players are numbered by slot; a room uses its clients' indices. Moves
+ * go through sim_step, or through sim_move for one that has to land
+ * before the step's own.
+ */
+
+#define SIM_MAX_PLAYERS 32
+// A player that sends nothing this tick.
+#define SIM_NO_MOVE DIRECTION_COUNT
+
+typedef enum
+{
+  SIM_STAYED,
+  SIM_MOVED,
+  SIM_BLOCKED,
+  // The step was onto a walkable cell outside the area: another zone's.
+  SIM_LEFT_AREA
+} SimOutcome;
+
+typedef struct
+{
+  int active;
+  int x;
+  int y;
+} SimPlayer;
+
+typedef struct
+{
+  // One direction per slot, SIM_NO_MOVE for none.
+  uint8_t moves[SIM_MAX_PLAYERS];
+} SimInputs;
+
+typedef struct
+{
+  uint8_t outcomes[SIM_MAX_PLAYERS];
+} SimStep;
+
+// Every walkable cell of an area, as row-major offsets into it, for spawns
+// to draw from. Built once per area and shared, read-only, by every Sim in
+// it, so a process's rooms do not each scan and hold the map again.
+typedef struct
+{
+  WorldRect area;
+  uint32_t *cells;
+  size_t count;
+} SpawnCells;
+
+typedef struct
+{
+  const World *world;
+  // Players spawn and NPCs stay inside this (a zone, or the whole world).
+  WorldRect area;
+  const SpawnCells *spawns;
+  // NULL steps the NPCs on the calling thread.
+  JobPool *job_pool;
+  uint64_t tick;
+  Rng rng;
+
+  SimPlayer players[SIM_MAX_PLAYERS];
+
+  Npc *npcs;
+  size_t npc_count;
+  // npc_order[npc_chunk_start[c] .. npc_chunk_start[c + 1]) are in chunk c.
+  size_t *npc_chunk_start;
+  size_t *npc_order;
+} Sim;
+
+int spawn_cells_build(SpawnCells *spawns, const World *world,
+                      const WorldRect *area);
+void spawn_cells_free(SpawnCells *spawns);
+
+// The sim plays out in spawns->area, which must outlive it.
+int sim_init(Sim *sim, const World *world, const SpawnCells *spawns,
+             JobPool *job_pool, size_t npc_count, uint32_t seed);
+void sim_destroy(Sim *sim);
+
+// A random free cell of the area, or any walkable one if none is free.
+// Takes at most SIM_MAX_PLAYERS + 1 looks, however full the area is.
+void sim_spawn(Sim *sim, int player);
+// Anywhere, as when a player arrives from another zone.
+void sim_place(Sim *sim, int player, int x, int y);
+void sim_remove(Sim *sim, int player);
+
+void sim_step(Sim *sim, const SimInputs *inputs, SimStep *step);
+// One move on its own, without a tick passing: how a room merges several
+// of a player's moves into one step. Returns its SimOutcome.
+int sim_move(Sim *sim, int player, uint8_t direction);
+uint64_t sim_hash(const Sim *sim);
+
+// After the NPCs were overwritten from outside, as a restore does.
+void sim_index_npcs(Sim *sim);
+
+#endif
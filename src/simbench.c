@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "jobs.h"
+#include "sim.h"
+#include "world.h"
+
+/*
+ * Runs the server's simulation with no network in the way: the same
+ * players, the same random moves and the same NPCs, stepped as fast as the
+ * machine goes, first on this thread alone and then through a job pool.
+ * Prints ticks per second for each and the hash of the final state, which
+ * must be the same for both; a run that diverges exits with an error.
+ * Then times joins into a room one player short of full, the worst case
+ * for finding a free spawn cell.
+ */
+
+typedef struct
+{
+  const char *map_path;
+  int width;
+  int height;
+  int players;
+  int npcs;
+  int ticks;
+  int workers;
+  uint32_t seed;
+} BenchOptions;
+
+static void parse_arguments(int argc, char *argv[], BenchOptions *options);
+static int parse_int(const char *binary_name, const char *str, int min,
+                     int max);
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message);
+static uint64_t run(const char *name, const BenchOptions *options,
+                    const World *world, const SpawnCells *spawns,
+                    JobPool *job_pool);
+static void run_joins(const BenchOptions *options, const World *world,
+                      const SpawnCells *spawns);
+
+#define BASE_TEN 10
+#define DEFAULT_DIM 1024
+#define DEFAULT_PLAYERS SIM_MAX_PLAYERS
+#define DEFAULT_NPCS 20000
+#define DEFAULT_TICKS 2000
+#define DEFAULT_WORKERS 4
+#define DEFAULT_SEED 1
+#define MIN_DIM 3
+#define MAX_DIM 16384
+#define MAX_NPCS 10000000
+#define MAX_TICKS 100000000
+#define MAX_WORKERS 64
+// One tick in this many, a player does not move.
+#define IDLE_ODDS 4
+#define JOINS 1000000
+
+int main(int argc, char *argv[])
+{
+  BenchOptions options;
+  World world;
+  WorldRect area;
+  SpawnCells spawns;
+  JobPool *job_pool;
+  uint64_t started;
+  uint64_t inline_hash;
+  uint64_t pool_hash;
+
+  options.map_path = NULL;
+  options.width = DEFAULT_DIM;
+  options.height = DEFAULT_DIM;
+  options.players = DEFAULT_PLAYERS;
+  options.npcs = DEFAULT_NPCS;
+  options.ticks = DEFAULT_TICKS;
+  options.workers = DEFAULT_WORKERS;
+  options.seed = DEFAULT_SEED;
+  parse_arguments(argc, argv, &options);
+
+  if (options.map_path != NULL ? world_load(&world, options.map_path) == -1
+                               : world_create_bordered(&world, options.width,
+                                                       options.height) == -1)
+  {
+    return EXIT_FAILURE;
+  }
+
+  area = (WorldRect){0, 0, world.width, world.height};
+  started = monotonic_ns();
+
+  if (spawn_cells_build(&spawns, &world, &area) == -1)
+  {
+    world_unload(&world);
+    return EXIT_FAILURE;
+  }
+
+  printf("Listed %zu spawn cells in %.1f ms\n", spawns.count,
+         (double)(monotonic_ns() - started) / NS_PER_MS);
+
+  job_pool = job_pool_create(options.workers);
+
+  if (job_pool == NULL)
+  {
+    spawn_cells_free(&spawns);
+    world_unload(&world);
+    return EXIT_FAILURE;
+  }
+
+  printf("%d ticks of %d players and %d npcs on a %dx%d world\n",
+         options.ticks, options.players, options.npcs, world.width,
+         world.height);
+  printf("%-10s %12s %12s %18s\n", "run", "ticks/s", "us/tick", "state hash");
+
+  inline_hash = run("inline", &options, &world, &spawns, NULL);
+  pool_hash = run("pool", &options, &world, &spawns, job_pool);
+  run_joins(&options, &world, &spawns);
+
+  job_pool_destroy(job_pool);
+  spawn_cells_free(&spawns);
+  world_unload(&world);
+
+  if (inline_hash != pool_hash)
+  {
+    fprintf(stderr, "The runs diverged\n");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static uint64_t run(const char *name, const BenchOptions *options,
+                    const World *world, const SpawnCells *spawns,
+                    JobPool *job_pool)
+{
+  unsigned int input_seed = options->seed;
+  SimInputs inputs;
+  SimStep step;
+  Sim sim;
+  uint64_t started;
+  uint64_t elapsed;
+  uint64_t hash;
+
+  if (sim_init(&sim, world, spawns, job_pool, (size_t)options->npcs,
+               options->seed) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < options->players; i++)
+  {
+    sim_spawn(&sim, i);
+  }
+
+  started = monotonic_ns();
+
+  for (int t = 0; t < options->ticks; t++)
+  {
+    for (int i = 0; i < SIM_MAX_PLAYERS; i++)
+    {
+      int roll = rand_r(&input_seed) % (DIRECTION_COUNT * IDLE_ODDS);
+
+      inputs.moves[i] =
+          roll < DIRECTION_COUNT * (IDLE_ODDS - 1)
+              ? (uint8_t)(roll % DIRECTION_COUNT)
+              : SIM_NO_MOVE;
+    }
+
+    sim_step(&sim, &inputs, &step);
+  }
+
+  elapsed = monotonic_ns() - started;
+  hash = sim_hash(&sim);
+  sim_destroy(&sim);
+
+  printf("%-10s %12.0f %12.2f   %016" PRIx64 "\n", name,
+         elapsed != 0 ? (double)options->ticks * NS_PER_SECOND / elapsed : 0.0,
+         (double)elapsed / options->ticks / NS_PER_US, hash);
+  fflush(stdout);
+
+  return hash;
+}
+
+static void run_joins(const BenchOptions *options, const World *world,
+                      const SpawnCells *spawns)
+{
+  Sim sim;
+  uint64_t started;
+  uint64_t elapsed;
+
+  if (sim_init(&sim, world, spawns, NULL, 0, options->seed) == -1)
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < SIM_MAX_PLAYERS - 1; i++)
+  {
+    sim_spawn(&sim, i);
+  }
+
+  started = monotonic_ns();
+
+  for (int j = 0; j < JOINS; j++)
+  {
+    sim_spawn(&sim, SIM_MAX_PLAYERS - 1);
+    sim_remove(&sim, SIM_MAX_PLAYERS - 1);
+  }
+
+  elapsed = monotonic_ns() - started;
+  sim_destroy(&sim);
+
+  printf("%d joins beside %d players: %.1f ns per join\n", JOINS,
+         SIM_MAX_PLAYERS - 1, (double)elapsed / JOINS);
+}
+
+static void parse_arguments(int argc, char *argv[], BenchOptions *options)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "hm:W:H:p:n:t:j:s:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'm':
+      options->map_path = optarg;
+      break;
+    case 'W':
+      options->width = parse_int(argv[0], optarg, MIN_DIM, MAX_DIM);
+      break;
+    case 'H':
+      options->height = parse_int(argv[0], optarg, MIN_DIM, MAX_DIM);
+      break;
+    case 'p':
+      options->players = parse_int(argv[0], optarg, 0, SIM_MAX_PLAYERS);
+      break;
+    case 'n':
+      options->npcs = parse_int(argv[0], optarg, 0, MAX_NPCS);
+      break;
+    case 't':
+      options->ticks = parse_int(argv[0], optarg, 1, MAX_TICKS);
+      break;
+    case 'j':
+      options->workers = parse_int(argv[0], optarg, 1, MAX_WORKERS);
+      break;
+    case 's':
+      options->seed = (uint32_t)parse_int(argv[0], optarg, 0, INT32_MAX);
+      break;
+    case 'h':
+      usage(argv[0], EXIT_SUCCESS, NULL);
+    default:
+      usage(argv[0], EXIT_FAILURE, NULL);
+    }
+  }
+
+  if (optind != argc)
+  {
+    usage(argv[0], EXIT_FAILURE, NULL);
+  }
+}
+
+static int parse_int(const char *binary_name, const char *str, int min,
+                     int max)
+{
+  char *endptr;
+  long parsed_value;
+
+  errno = 0;
+  parsed_value = strtol(str, &endptr, BASE_TEN);
+
+  if (errno != 0 || *endptr != '\0' || parsed_value < min ||
+      parsed_value > max)
+  {
+    usage(binary_name, EXIT_FAILURE, "Invalid number.");
+  }
+
+  return (int)parsed_value;
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message)
+{
+  if (message)
+  {
+    fprintf(stderr, "%s\n", message);
+  }
+
+  fprintf(stderr,
+          "Usage: %s [-h] [-m map] [-W width] [-H height] [-p players] "
+          "[-n npcs] [-t ticks] [-j workers] [-s seed]\n",
+          program_name);
+  fputs("Options:\n", stderr);
+  fputs("  -h  Display this help message\n", stderr);
+  fputs("  -m  Map file to load (default: an empty bordered world)\n",
+        stderr);
+  fputs("  -W  Width of the bordered world (default: 1024)\n", stderr);
+  fputs("  -H  Height of the bordered world (default: 1024)\n", stderr);
+  fputs("  -p  Players moving at random (default: 32)\n", stderr);
+  fputs("  -n  NPCs (default: 20000)\n", stderr);
+  fputs("  -t  Ticks per run (default: 2000)\n", stderr);
+  fputs("  -j  Workers in the pool run (default: 4)\n", stderr);
+  fputs("  -s  Seed for the spawns, NPCs and moves (default: 1)\n", stderr);
+  exit(exit_code);
+}
@@ -0,0 +1,142 @@
+#include <string.h>
+
+#include "snapshot.h"
+
+static const char *parse_number(const char *cursor, const char *end,
+                                int *value);
+static const char *skip_separator(const char *cursor, const char *end);
+static const char *parse_player(const char *cursor, const char *end,
+                                SnapshotPlayer *player);
+
+#define BASE_TEN 10
+// Enough for any coordinate, and too few to overflow an int.
+#define MAX_DIGITS 9
+
+int snapshot_parse(const char *data, size_t length, SnapshotPlayer *players,
+                   int capacity, size_t *positions_length)
+{
+  const char *cursor = data;
+  const char *end = data + length;
+  int count = 0;
+
+  while (cursor < end && *cursor != CHAT_SEPARATOR)
+  {
+    const char *next = NULL;
+
+    // A full table only needs the end of the positions found.
+    if (count == capacity)
+    {
+      next = memchr(cursor, CHAT_SEPARATOR, (size_t)(end - cursor));
+      cursor = next != NULL ? next : end;
+      break;
+    }
+
+    if (*cursor == '(')
+    {
+      next = parse_player(cursor + 1, end, &players[count]);
+    }
+
+    if (next != NULL)
+    {
+      count++;
+      cursor = next;
+    }
+    else
+    {
+      cursor++;
+    }
+  }
+
+  *positions_length = (size_t)(cursor - data);
+
+  return count;
+}
+
+// <id>, <username>, <x>, <y>)
+static const char *parse_player(const char *cursor, const char *end,
+                                SnapshotPlayer *player)
+{
+  const char *comma;
+  size_t name_length;
+
+  cursor = parse_number(cursor, end, &player->id);
+  cursor = skip_separator(cursor, end);
+
+  if (cursor == NULL)
+  {
+    return NULL;
+  }
+
+  comma = memchr(cursor, ',', (size_t)(end - cursor));
+
+  if (comma == NULL || comma == cursor ||
+      (size_t)(comma - cursor) >= MAX_USERNAME_LENGTH)
+  {
+    return NULL;
+  }
+
+  name_length = (size_t)(comma - cursor);
+  memcpy(player->username, cursor, name_length);
+  player->username[name_length] = '\0';
+
+  cursor = parse_number(skip_separator(comma, end), end, &player->x);
+  cursor = parse_number(skip_separator(cursor, end), end, &player->y);
+
+  if (cursor == NULL || cursor == end || *cursor != ')')
+  {
+    return NULL;
+  }
+
+  return cursor + 1;
+}
+
+// NULL in, NULL out, so calls chain and the last one is checked.
+static const char *parse_number(const char *cursor, const char *end,
+                                int *value)
+{
+  const char *digits;
+  int negative;
+  int result = 0;
+
+  if (cursor == NULL || cursor == end)
+  {
+    return NULL;
+  }
+
+  negative = *cursor == '-';
+  cursor += negative;
+  digits = cursor;
+
+  while (cursor < end && *cursor >= '0' && *cursor <= '9' &&
+         cursor - digits < MAX_DIGITS)
+  {
+    result = result * BASE_TEN + (*cursor - '0');
+    cursor++;
+  }
+
+  if (cursor == digits)
+  {
+    return NULL;
+  }
+
+  *value = negative ? -result : result;
+
+  return cursor;
+}
+
+static const char *skip_separator(const char *cursor, const char *end)
+{
+  if (cursor == NULL || cursor == end || *cursor != ',')
+  {
+    return NULL;
+  }
+
+  cursor++;
+
+  while (cursor < end && *cursor == ' ')
+  {
+    cursor++;
+  }
+
+  return cursor;
+}
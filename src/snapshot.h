@@ -0,0 +1,34 @@
+#ifndef TG_SNAPSHOT_H
+#define TG_SNAPSHOT_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Reads the players out of a reassembled snapshot (see protocol.h). The
+ * parser walks the text once, front to back, without writing to it or
+ * copying it anywhere first: numbers are converted as they are passed and
+ * each player lands straight in the caller's table. Nothing is allocated,
+ * so the table can be the one the client draws from.
+ *
+ * A player's id is its slot in the room, the same for as long as it stays,
+ * or SNAPSHOT_NO_ID for one shown from a neighbouring zone. The client
+ * learns its own from its WELCOME and finds itself by it.
+ */
+
+typedef struct
+{
+  int id;
+  int x;
+  int y;
+  char username[MAX_USERNAME_LENGTH];
+} SnapshotPlayer;
+
+// Fills players with up to capacity of the snapshot's players and returns
+// how many. *positions_length is where the positions end: the chat lines,
+// if any, start one CHAT_SEPARATOR after it. Malformed entries are skipped.
+int snapshot_parse(const char *data, size_t length, SnapshotPlayer *players,
+                   int capacity, size_t *positions_length);
+
+#endif
@@ -0,0 +1,140 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spectate.h"
+
+#define BASE_TEN 10
+#define SPECTATOR_TTL 1
+
+/*
+ * spec is <group>:<port>. Datagrams leave through the interface the server
+ * is bound to, when that is a specific IPv4 address, and are looped back so
+ * spectators on the same host see them too.
+ */
+int spectator_open(SpectatorStream *stream, const char *spec,
+                   const struct sockaddr_storage *interface)
+{
+  char group[INET_ADDRSTRLEN];
+  const char *colon;
+  char *endptr;
+  unsigned long port;
+  unsigned char ttl = SPECTATOR_TTL;
+  unsigned char loop = 1;
+
+  colon = strrchr(spec, ':');
+
+  if (colon == NULL || (size_t)(colon - spec) >= sizeof(group))
+  {
+    fprintf(stderr, "Spectator stream must be <group>:<port>: %s\n", spec);
+    return -1;
+  }
+
+  memcpy(group, spec, (size_t)(colon - spec));
+  group[colon - spec] = '\0';
+  errno = 0;
+  port = strtoul(colon + 1, &endptr, BASE_TEN);
+  memset(&stream->group, 0, sizeof(stream->group));
+  stream->group.sin_family = AF_INET;
+
+  if (inet_pton(AF_INET, group, &stream->group.sin_addr) != 1 ||
+      !IN_MULTICAST(ntohl(stream->group.sin_addr.s_addr)) || errno != 0 ||
+      *endptr != '\0' || port == 0 || port > UINT16_MAX)
+  {
+    fprintf(stderr, "Not an IPv4 multicast group and port: %s\n", spec);
+    return -1;
+  }
+
+  stream->group.sin_port = htons((in_port_t)port);
+  stream->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  if (stream->sockfd == -1)
+  {
+    perror("Socket creation failed");
+    return -1;
+  }
+
+  if (setsockopt(stream->sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+                 sizeof(ttl)) == -1 ||
+      setsockopt(stream->sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                 sizeof(loop)) == -1)
+  {
+    perror("setsockopt multicast");
+    close(stream->sockfd);
+    return -1;
+  }
+
+  if (interface->ss_family == AF_INET &&
+      ((const struct sockaddr_in *)interface)->sin_addr.s_addr != INADDR_ANY &&
+      setsockopt(stream->sockfd, IPPROTO_IP, IP_MULTICAST_IF,
+                 &((const struct sockaddr_in *)interface)->sin_addr,
+                 sizeof(struct in_addr)) == -1)
+  {
+    perror("setsockopt IP_MULTICAST_IF");
+    close(stream->sockfd);
+    return -1;
+  }
+
+  return 0;
+}
+
+void spectator_close(SpectatorStream *stream)
+{
+  if (stream->sockfd != -1)
+  {
+    close(stream->sockfd);
+    stream->sockfd = -1;
+  }
+}
+
+/*
+ * Returns a socket receiving the group on port, joined on the interface with
+ * the given local address (the loopback address to watch a server on this
+ * host). Several spectators on one host can join the same stream.
+ */
+int spectator_join(const char *group, in_port_t port, const char *interface)
+{
+  struct sockaddr_in addr;
+  struct ip_mreq membership;
+  int reuse = 1;
+  int sockfd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+
+  if (inet_pton(AF_INET, group, &addr.sin_addr) != 1 ||
+      !IN_MULTICAST(ntohl(addr.sin_addr.s_addr)) ||
+      inet_pton(AF_INET, interface, &membership.imr_interface) != 1)
+  {
+    fprintf(stderr, "Need an IPv4 multicast group and interface address\n");
+    return -1;
+  }
+
+  membership.imr_multiaddr = addr.sin_addr;
+  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  if (sockfd == -1)
+  {
+    perror("Socket creation failed");
+    return -1;
+  }
+
+  // Bound to the group itself, so other groups on this port stay out.
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) ==
+          -1 ||
+      bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                 sizeof(membership)) == -1)
+  {
+    perror("Joining the spectator stream failed");
+    close(sockfd);
+    return -1;
+  }
+
+  return sockfd;
+}
@@ -0,0 +1,36 @@
+#ifndef TG_SPECTATE_H
+#define TG_SPECTATE_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * Read-only spectators watch an IPv4 multicast group instead of joining as
+ * players. Each room publishes its stream once per tick to the group on the
+ * base port plus its room id, so the server's cost is the same for one
+ * watcher as for a thousand. The stream carries the messages a player gets
+ * (see protocol.h and schema.h), just enough for a spectator to follow any
+ * player:
+ *
+ *   WELCOME with no username         world size, once a second
+ *   SNAP:...                         player snapshot, every tick
+ *   FOR:<username>|NPCS:...          NPCs in that player's view, every tick
+ *   CHUNK:<cx>|<cy>|<tiles>          a few chunks around the players a tick
+ *   QUIT                             the server is going away
+ *
+ * Nothing is resent on request, so a spectator that joins late or loses a
+ * datagram fills the gaps from the following ticks.
+ */
+
+typedef struct
+{
+  int sockfd;
+  struct sockaddr_in group;
+} SpectatorStream;
+
+int spectator_open(SpectatorStream *stream, const char *spec,
+                   const struct sockaddr_storage *interface);
+void spectator_close(SpectatorStream *stream);
+int spectator_join(const char *group, in_port_t port, const char *interface);
+
+#endif
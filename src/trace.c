@@ -0,0 +1,164 @@
+// linux/errqueue.h uses struct timespec without declaring it.
+#include <time.h>
+
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "trace.h"
+
+static uint64_t to_monotonic_ns(const struct timespec *realtime);
+
+TraceLog *trace_open(const char *path)
+{
+  TraceLog *log = calloc(1, sizeof(*log));
+  TraceHeader header;
+
+  if (log == NULL)
+  {
+    perror("calloc");
+    return NULL;
+  }
+
+  log->file = fopen(path, "wb");
+
+  if (log->file == NULL)
+  {
+    perror("fopen trace");
+    free(log);
+    return NULL;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(TraceRecord);
+
+  if (fwrite(&header, sizeof(header), 1, log->file) != 1)
+  {
+    perror("fwrite trace");
+    fclose(log->file);
+    free(log);
+    return NULL;
+  }
+
+  pthread_mutex_init(&log->lock, NULL);
+
+  return log;
+}
+
+void trace_write(TraceLog *log, const TraceRecord *records, size_t count)
+{
+  pthread_mutex_lock(&log->lock);
+
+  // A full disk costs the trace, never the game.
+  if (log->file != NULL &&
+      fwrite(records, sizeof(*records), count, log->file) == count)
+  {
+    log->records += count;
+  }
+
+  pthread_mutex_unlock(&log->lock);
+}
+
+void trace_close(TraceLog *log)
+{
+  if (log == NULL)
+  {
+    return;
+  }
+
+  if (fclose(log->file) != 0)
+  {
+    perror("fclose trace");
+  }
+
+  pthread_mutex_destroy(&log->lock);
+  free(log);
+}
+
+int trace_enable_timestamps(int sockfd)
+{
+  int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+  if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                 sizeof(flags)) == -1)
+  {
+    perror("setsockopt SO_TIMESTAMPING");
+    return -1;
+  }
+
+  return 0;
+}
+
+ssize_t trace_recvfrom(int sockfd, void *buffer, size_t length,
+                       struct sockaddr *addr, socklen_t *addr_len,
+                       uint64_t *kernel_ns)
+{
+  char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+  struct iovec iov = {.iov_base = buffer, .iov_len = length};
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t received;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = addr;
+  msg.msg_namelen = *addr_len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  received = recvmsg(sockfd, &msg, 0);
+  *kernel_ns = 0;
+
+  if (received == -1)
+  {
+    return -1;
+  }
+
+  *addr_len = msg.msg_namelen;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_TIMESTAMPING)
+    {
+      struct scm_timestamping stamps;
+
+      memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+
+      // ts[0] is the software stamp; the others are for hardware.
+      if (stamps.ts[0].tv_sec != 0 || stamps.ts[0].tv_nsec != 0)
+      {
+        *kernel_ns = to_monotonic_ns(&stamps.ts[0]);
+      }
+    }
+  }
+
+  return received;
+}
+
+// The kernel stamps in CLOCK_REALTIME. Moved by how long ago that was, it
+// lines up with the other stages unless the wall clock stepped in between.
+static uint64_t to_monotonic_ns(const struct timespec *realtime)
+{
+  struct timespec now;
+  uint64_t stamp = (uint64_t)realtime->tv_sec * NS_PER_SECOND +
+                   (uint64_t)realtime->tv_nsec;
+  uint64_t now_real;
+  uint64_t now_monotonic = monotonic_ns();
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  now_real = (uint64_t)now.tv_sec * NS_PER_SECOND + (uint64_t)now.tv_nsec;
+
+  if (stamp > now_real || now_real - stamp > now_monotonic)
+  {
+    return 0;
+  }
+
+  return now_monotonic - (now_real - stamp);
+}
@@ -0,0 +1,75 @@
+#ifndef TG_TRACE_H
+#define TG_TRACE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * Where a client packet's time goes inside the server, one record per
+ * packet. Every stage is a CLOCK_MONOTONIC time:
+ *
+ *   kernel    the kernel took it off the wire (SO_TIMESTAMPING), 0 if the
+ *             kernel gave no timestamp, as behind -I or shared memory
+ *   dequeued  the network thread read it and queued it for its room
+ *   started   the room's thread took it from the room's inbox
+ *   handled   the room queued the reply, or was done with the packet if
+ *             the reply had to wait for a snapshot
+ *   sent      the reply it caused went out with sendto, 0 if none did
+ *
+ * The reply is the first datagram the room sent while handling the packet,
+ * such as a PONG or a WELCOME, or else the first snapshot the player got
+ * after it, which is where a move or a line of chat shows up.
+ *
+ * The file is a TraceHeader followed by the records, in the order the
+ * replies went out, in the byte order of the machine that wrote them.
+ */
+
+#define TRACE_MAGIC "TGTRACE1"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_VERSION 1
+
+typedef struct
+{
+  char magic[TRACE_MAGIC_LEN];
+  uint32_t version;
+  uint32_t record_size;
+} TraceHeader;
+
+typedef struct
+{
+  uint64_t kernel_ns;
+  uint64_t dequeued_ns;
+  uint64_t started_ns;
+  uint64_t handled_ns;
+  uint64_t sent_ns;
+  uint32_t room;
+  // The packet's MessageType.
+  uint8_t type;
+  uint8_t reserved[3];
+} TraceRecord;
+
+// Written from the room threads and their send threads at once.
+typedef struct
+{
+  FILE *file;
+  pthread_mutex_t lock;
+  uint64_t records;
+} TraceLog;
+
+TraceLog *trace_open(const char *path);
+void trace_write(TraceLog *log, const TraceRecord *records, size_t count);
+void trace_close(TraceLog *log);
+
+// Asks the kernel to timestamp every datagram sockfd receives.
+int trace_enable_timestamps(int sockfd);
+// recvfrom that also returns the kernel's receive time, converted to
+// CLOCK_MONOTONIC, or 0 if there was none.
+ssize_t trace_recvfrom(int sockfd, void *buffer, size_t length,
+                       struct sockaddr *addr, socklen_t *addr_len,
+                       uint64_t *kernel_ns);
+
+#endif
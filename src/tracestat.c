@@ -0,0 +1,333 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "schema.h"
+#include "trace.h"
+
+/*
+ * Reads a trace written by the server's -T and shows where the time went:
+ * percentiles of each stage between two of a packet's timestamps, over all
+ * packets and then per message type. A stage only counts the packets that
+ * have both of its timestamps, so the count column says how many that was.
+ */
+
+typedef struct
+{
+  const char *name;
+  size_t from;
+  size_t to;
+} Stage;
+
+static void parse_arguments(int argc, char *argv[], const char **trace_path);
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message);
+static TraceRecord *read_trace(const char *path, size_t *count);
+static void report(const char *title, const TraceRecord *records,
+                   size_t count, int type, uint64_t *scratch);
+static int stage_ns(const TraceRecord *record, const Stage *stage,
+                    uint64_t *ns);
+static int compare_u64(const void *a, const void *b);
+static double percentile_us(const uint64_t *sorted, size_t count,
+                            unsigned int percent);
+
+#define TYPE_COUNT 256
+#define ANY_TYPE -1
+#define INITIAL_RECORDS 4096
+
+#define TRACESTAT_TYPE_NAME(NAME, Name, name, type) [type] = #name,
+
+static const char *const type_names[TYPE_COUNT] = {
+    [MESSAGE_TEXT] = "text", MESSAGES(TRACESTAT_TYPE_NAME)};
+
+static const Stage stages[] = {
+    {"socket", offsetof(TraceRecord, kernel_ns),
+     offsetof(TraceRecord, dequeued_ns)},
+    {"inbox", offsetof(TraceRecord, dequeued_ns),
+     offsetof(TraceRecord, started_ns)},
+    {"handle", offsetof(TraceRecord, started_ns),
+     offsetof(TraceRecord, handled_ns)},
+    {"reply", offsetof(TraceRecord, handled_ns),
+     offsetof(TraceRecord, sent_ns)},
+    {"total", offsetof(TraceRecord, kernel_ns),
+     offsetof(TraceRecord, sent_ns)},
+};
+
+int main(int argc, char *argv[])
+{
+  const char *trace_path = NULL;
+  TraceRecord *records;
+  size_t count;
+  size_t per_type[TYPE_COUNT] = {0};
+  size_t unanswered = 0;
+  size_t unstamped = 0;
+  uint64_t *scratch;
+
+  parse_arguments(argc, argv, &trace_path);
+  records = read_trace(trace_path, &count);
+
+  if (records == NULL)
+  {
+    return EXIT_FAILURE;
+  }
+
+  scratch = calloc(count != 0 ? count : 1, sizeof(*scratch));
+
+  if (scratch == NULL)
+  {
+    perror("calloc");
+    free(records);
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    per_type[records[i].type]++;
+    unanswered += records[i].sent_ns == 0;
+    unstamped += records[i].kernel_ns == 0;
+  }
+
+  printf("%zu packets traced, %zu never answered, %zu without a kernel "
+         "timestamp\n",
+         count, unanswered, unstamped);
+
+  report("all packets", records, count, ANY_TYPE, scratch);
+
+  for (int type = 0; type < TYPE_COUNT; type++)
+  {
+    char title[64];
+
+    if (per_type[type] == 0)
+    {
+      continue;
+    }
+
+    if (type_names[type] != NULL)
+    {
+      snprintf(title, sizeof(title), "%s (%zu)", type_names[type],
+               per_type[type]);
+    }
+    else
+    {
+      snprintf(title, sizeof(title), "type 0x%02x (%zu)", type,
+               per_type[type]);
+    }
+
+    report(title, records, count, type, scratch);
+  }
+
+  free(scratch);
+  free(records);
+
+  return EXIT_SUCCESS;
+}
+
+static TraceRecord *read_trace(const char *path, size_t *count)
+{
+  FILE *file = fopen(path, "rb");
+  TraceHeader header;
+  TraceRecord *records;
+  size_t capacity = INITIAL_RECORDS;
+
+  *count = 0;
+
+  if (file == NULL)
+  {
+    perror("fopen");
+    return NULL;
+  }
+
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0 ||
+      header.version != TRACE_VERSION ||
+      header.record_size != sizeof(TraceRecord))
+  {
+    fprintf(stderr, "%s is not a trace this build can read\n", path);
+    fclose(file);
+    return NULL;
+  }
+
+  records = malloc(capacity * sizeof(*records));
+
+  if (records == NULL)
+  {
+    perror("malloc");
+    fclose(file);
+    return NULL;
+  }
+
+  for (;;)
+  {
+    size_t read;
+
+    if (*count == capacity)
+    {
+      TraceRecord *grown;
+
+      capacity *= 2;
+      grown = realloc(records, capacity * sizeof(*records));
+
+      if (grown == NULL)
+      {
+        perror("realloc");
+        free(records);
+        fclose(file);
+        return NULL;
+      }
+
+      records = grown;
+    }
+
+    read = fread(records + *count, sizeof(*records), capacity - *count, file);
+    *count += read;
+
+    if (*count != capacity)
+    {
+      break;
+    }
+  }
+
+  // A server that was killed may leave half a record at the end.
+  if (ferror(file))
+  {
+    perror("fread");
+    free(records);
+    fclose(file);
+    return NULL;
+  }
+
+  fclose(file);
+
+  return records;
+}
+
+static void report(const char *title, const TraceRecord *records,
+                   size_t count, int type, uint64_t *scratch)
+{
+  printf("\n%s\n", title);
+  printf("%-8s %9s %10s %10s %10s %10s %10s\n", "stage", "count", "p50 us",
+         "p90 us", "p99 us", "max us", "mean us");
+
+  for (size_t s = 0; s < sizeof(stages) / sizeof(stages[0]); s++)
+  {
+    size_t samples = 0;
+    uint64_t total = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+      if (type == ANY_TYPE || records[i].type == type)
+      {
+        uint64_t ns;
+
+        if (stage_ns(&records[i], &stages[s], &ns))
+        {
+          scratch[samples++] = ns;
+          total += ns;
+        }
+      }
+    }
+
+    if (samples == 0)
+    {
+      printf("%-8s %9d %10s %10s %10s %10s %10s\n", stages[s].name, 0, "-",
+             "-", "-", "-", "-");
+      continue;
+    }
+
+    qsort(scratch, samples, sizeof(*scratch), compare_u64);
+    printf("%-8s %9zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", stages[s].name,
+           samples, percentile_us(scratch, samples, 50),
+           percentile_us(scratch, samples, 90),
+           percentile_us(scratch, samples, 99),
+           (double)scratch[samples - 1] / NS_PER_US,
+           (double)total / (double)samples / NS_PER_US);
+  }
+}
+
+// A timestamp of 0 was never taken. The kernel's is converted from another
+// clock, so it can land a hair after the next one; that sample is dropped.
+static int stage_ns(const TraceRecord *record, const Stage *stage,
+                    uint64_t *ns)
+{
+  uint64_t from;
+  uint64_t to;
+
+  memcpy(&from, (const char *)record + stage->from, sizeof(from));
+  memcpy(&to, (const char *)record + stage->to, sizeof(to));
+
+  if (from == 0 || to == 0 || to < from)
+  {
+    return 0;
+  }
+
+  *ns = to - from;
+
+  return 1;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t left = *(const uint64_t *)a;
+  uint64_t right = *(const uint64_t *)b;
+
+  return (left > right) - (left < right);
+}
+
+// Nearest rank, so the p99 of a handful of samples is their maximum.
+static double percentile_us(const uint64_t *sorted, size_t count,
+                            unsigned int percent)
+{
+  size_t rank = (count * percent + 99) / 100;
+
+  return (double)sorted[rank > 0 ? rank - 1 : 0] / NS_PER_US;
+}
+
+static void parse_arguments(int argc, char *argv[], const char **trace_path)
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "h")) != -1)
+  {
+    switch (opt)
+    {
+    case 'h':
+      usage(argv[0], EXIT_SUCCESS, NULL);
+    default:
+      usage(argv[0], EXIT_FAILURE, NULL);
+    }
+  }
+
+  if (argc - optind != 1)
+  {
+    usage(argv[0], EXIT_FAILURE, "A trace file is required.");
+  }
+
+  *trace_path = argv[optind];
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code,
+                            const char *message)
+{
+  if (message)
+  {
+    fprintf(stderr, "%s\n", message);
+  }
+
+  fprintf(stderr, "Usage: %s [-h] <trace file>\n", program_name);
+  fputs("Options:\n", stderr);
+  fputs("  -h  Display this help message\n", stderr);
+  fputs("Stages, from the timestamps the server took:\n", stderr);
+  fputs("  socket  kernel receive to the network thread queueing it\n",
+        stderr);
+  fputs("  inbox   waiting in the room's inbox\n", stderr);
+  fputs("  handle  the room handling it, up to queueing its reply\n", stderr);
+  fputs("  reply   the reply waiting to go out, which for a move or chat is "
+        "the\n          next snapshot\n",
+        stderr);
+  fputs("  total   kernel receive to the reply's sendto\n", stderr);
+  exit(exit_code);
+}
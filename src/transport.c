@@ -0,0 +1,836 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "netem.h"
+#include "transport.h"
+
+#define SHM_MAGIC 0x474e495254534754ULL
+#define SHM_VERSION 1
+#define SHM_CACHE_LINE 64
+// Large enough for anything the server sends a client, which relays'
+// headers never wrap here.
+#define SHM_OUTPUT_SIZE 1536
+#define SHM_OUTPUT_ENTRIES 64
+#define SHM_INPUT_SIZE 256
+#define SHM_INPUT_ENTRIES 32
+#define SHM_NAME_LENGTH 64
+#define SHM_MAX_FDS 4096
+#define SHM_SERVER_SLOT (-1)
+// Client addresses are "shm:<slot>.<generation>" in fixed-width hex, short
+// enough to fit the part of the address that the server hashes.
+#define SHM_ADDRESS_PREFIX "shm:"
+#define SHM_ADDRESS_PREFIX_LEN 4
+#define SHM_ADDRESS_FORMAT SHM_ADDRESS_PREFIX "%02x.%06x"
+#define SHM_SLOT_DIGITS 2
+#define SHM_GENERATION_DIGITS 6
+#define SHM_GENERATION_MASK 0xffffffU
+#define HEX_DIGIT_VALUE 10
+
+typedef struct
+{
+  // 2n + 1 while datagram n is being written here, 2n + 2 once it is whole.
+  _Atomic uint64_t seq;
+  uint32_t length;
+  char data[SHM_OUTPUT_SIZE];
+} ShmOutputEntry;
+
+typedef struct
+{
+  uint32_t length;
+  char data[SHM_INPUT_SIZE];
+} ShmInputEntry;
+
+typedef struct
+{
+  // 0 while free, otherwise the pid of the process using the slot.
+  _Alignas(SHM_CACHE_LINE) atomic_int owner;
+  atomic_uint generation;
+  // Set by the client when it found its output ring empty.
+  atomic_int reader_waiting;
+  // Client to server, one producer and one consumer. A full ring drops.
+  _Alignas(SHM_CACHE_LINE) atomic_uint input_head;
+  _Alignas(SHM_CACHE_LINE) atomic_uint input_tail;
+  // Server to client. Writers reserve entries with fetch_add, so any room
+  // thread can write, and never wait for the reader.
+  _Alignas(SHM_CACHE_LINE) _Atomic uint64_t output_head;
+  ShmInputEntry input[SHM_INPUT_ENTRIES];
+  ShmOutputEntry output[SHM_OUTPUT_ENTRIES];
+} ShmSlot;
+
+typedef struct
+{
+  uint64_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  // One past the highest slot ever claimed; clients take the lowest free
+  // slot, so the server's scan stops here.
+  atomic_int slot_limit;
+  // Set by the server when it found every input ring empty.
+  _Alignas(SHM_CACHE_LINE) atomic_int server_waiting;
+  ShmSlot slots[TRANSPORT_SHM_SLOTS];
+} ShmSegment;
+
+// What this process knows about one of its segment descriptors.
+typedef struct
+{
+  int used;
+  int slot;
+  int pending;
+  // The next datagram to read from the output ring, on the client side.
+  uint64_t cursor;
+  uint64_t skipped;
+} ShmEndpoint;
+
+static int map_segment(const char *name, int create);
+static socklen_t doorbell_address(struct sockaddr_un *addr, int slot);
+static int doorbell_socket(int slot);
+static void ring_doorbell(int sockfd, int slot);
+static void drain_doorbell(int sockfd);
+static int claim_slot(void);
+static void raise_slot_limit(int limit);
+static ShmEndpoint *find_endpoint(int sockfd);
+static void format_address(struct sockaddr_storage *addr, socklen_t *addr_len,
+                           int slot, unsigned int generation);
+static int parse_address(const struct sockaddr *addr, int *slot,
+                         unsigned int *generation);
+static int parse_hex(const char *str, int digits, unsigned int *value);
+static ssize_t input_push(const ShmEndpoint *endpoint, int sockfd,
+                          const void *buffer, size_t length);
+static ssize_t input_pop(void *buffer, size_t length, struct sockaddr *addr,
+                         socklen_t *addr_len);
+static ssize_t output_push(const struct sockaddr *addr, const void *buffer,
+                           size_t length);
+static ssize_t output_pop(ShmEndpoint *endpoint, void *buffer, size_t length,
+                          struct sockaddr *addr, socklen_t *addr_len);
+static ssize_t endpoint_read(ShmEndpoint *endpoint, void *buffer,
+                             size_t length, struct sockaddr *addr,
+                             socklen_t *addr_len);
+static void set_pending(ShmEndpoint *endpoint, int pending);
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static ShmSegment *segment;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static char segment_name[SHM_NAME_LENGTH];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static int serving;
+
+// The server's doorbell, which room threads also ring clients from.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static int server_fd = -1;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static ShmEndpoint endpoints[SHM_MAX_FDS];
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static int pending_count;
+
+// Where the server's scan of the input rings picks up, so no client can
+// starve the ones after it.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static int next_input_slot;
+
+int transport_shm_listen(const char *name)
+{
+  if (map_segment(name, 1) == -1)
+  {
+    return -1;
+  }
+
+  serving = 1;
+  server_fd = doorbell_socket(SHM_SERVER_SLOT);
+
+  if (server_fd == -1)
+  {
+    transport_shutdown();
+    return -1;
+  }
+
+  memset(&endpoints[server_fd], 0, sizeof(endpoints[server_fd]));
+  endpoints[server_fd].used = 1;
+  endpoints[server_fd].slot = SHM_SERVER_SLOT;
+  printf("Serving local clients through /dev/shm/%s\n", name);
+
+  return server_fd;
+}
+
+int transport_shm_connect(const char *name, struct sockaddr_storage *addr,
+                          socklen_t *addr_len)
+{
+  ShmEndpoint *endpoint;
+  ShmSlot *slot;
+  struct sockaddr_un *server_addr = (struct sockaddr_un *)addr;
+  int index;
+  int sockfd;
+
+  if (segment == NULL && map_segment(name, 0) == -1)
+  {
+    return -1;
+  }
+
+  index = claim_slot();
+
+  if (index == -1)
+  {
+    fprintf(stderr, "All %d shared-memory slots are in use\n",
+            TRANSPORT_SHM_SLOTS);
+    return -1;
+  }
+
+  slot = &segment->slots[index];
+  sockfd = doorbell_socket(index);
+
+  if (sockfd == -1 || sockfd >= SHM_MAX_FDS)
+  {
+    atomic_store(&slot->owner, 0);
+
+    if (sockfd != -1)
+    {
+      close(sockfd);
+    }
+
+    return -1;
+  }
+
+  atomic_fetch_add(&slot->generation, 1);
+  raise_slot_limit(index + 1);
+  endpoint = &endpoints[sockfd];
+  memset(endpoint, 0, sizeof(*endpoint));
+  endpoint->used = 1;
+  endpoint->slot = index;
+  endpoint->cursor = atomic_load(&slot->output_head);
+  // Asleep from the start, so the first reply rings.
+  atomic_store(&slot->reader_waiting, 1);
+
+  memset(addr, 0, sizeof(*addr));
+  server_addr->sun_family = AF_UNIX;
+  snprintf(server_addr->sun_path, sizeof(server_addr->sun_path), "%s", name);
+  *addr_len = sizeof(*addr);
+
+  return sockfd;
+}
+
+int transport_close(int sockfd)
+{
+  ShmEndpoint *endpoint = find_endpoint(sockfd);
+
+  if (endpoint != NULL)
+  {
+    set_pending(endpoint, 0);
+
+    if (endpoint->slot != SHM_SERVER_SLOT)
+    {
+      ShmSlot *slot = &segment->slots[endpoint->slot];
+
+      if (endpoint->skipped != 0)
+      {
+        fprintf(stderr, "Fell behind the server by %llu datagrams\n",
+                (unsigned long long)endpoint->skipped);
+      }
+
+      atomic_store(&slot->reader_waiting, 0);
+      atomic_store(&slot->owner, 0);
+    }
+    else
+    {
+      server_fd = -1;
+    }
+
+    endpoint->used = 0;
+  }
+
+  return close(sockfd);
+}
+
+void transport_shutdown(void)
+{
+  if (segment == NULL)
+  {
+    return;
+  }
+
+  if (server_fd != -1)
+  {
+    transport_close(server_fd);
+  }
+
+  munmap(segment, sizeof(*segment));
+  segment = NULL;
+
+  if (serving)
+  {
+    char path[SHM_NAME_LENGTH + 1];
+
+    snprintf(path, sizeof(path), "/%s", segment_name);
+    shm_unlink(path);
+    serving = 0;
+  }
+}
+
+ssize_t transport_sendto(int sockfd, const void *buffer, size_t length,
+                         int flags, const struct sockaddr *addr,
+                         socklen_t addr_len)
+{
+  ShmEndpoint *endpoint;
+
+  if (segment == NULL || addr == NULL || addr->sa_family != AF_UNIX)
+  {
+    return netem_sendto(sockfd, buffer, length, flags, addr, addr_len);
+  }
+
+  if (serving)
+  {
+    return output_push(addr, buffer, length);
+  }
+
+  endpoint = find_endpoint(sockfd);
+
+  if (endpoint == NULL)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  return input_push(endpoint, sockfd, buffer, length);
+}
+
+/*
+ * An empty ring is only slept on after telling the writer so and looking
+ * once more: a datagram written in between would otherwise sit there with
+ * nobody woken for it. The writer checks the flag after writing, so one of
+ * the two always sees the other.
+ */
+ssize_t transport_recvfrom(int sockfd, void *buffer, size_t length, int flags,
+                           struct sockaddr *addr, socklen_t *addr_len)
+{
+  ShmEndpoint *endpoint = find_endpoint(sockfd);
+  atomic_int *waiting;
+  ssize_t received;
+
+  if (endpoint == NULL)
+  {
+    return netem_recvfrom(sockfd, buffer, length, flags, addr, addr_len);
+  }
+
+  received = endpoint_read(endpoint, buffer, length, addr, addr_len);
+
+  if (received >= 0)
+  {
+    set_pending(endpoint, 1);
+    return received;
+  }
+
+  waiting = endpoint->slot == SHM_SERVER_SLOT
+                ? &segment->server_waiting
+                : &segment->slots[endpoint->slot].reader_waiting;
+  drain_doorbell(sockfd);
+  atomic_store(waiting, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  received = endpoint_read(endpoint, buffer, length, addr, addr_len);
+
+  if (received >= 0)
+  {
+    set_pending(endpoint, 1);
+    return received;
+  }
+
+  set_pending(endpoint, 0);
+  errno = EAGAIN;
+
+  return -1;
+}
+
+int transport_pending(int sockfd)
+{
+  const ShmEndpoint *endpoint = find_endpoint(sockfd);
+
+  return endpoint != NULL && endpoint->pending;
+}
+
+int transport_timeout_ms(void)
+{
+  return pending_count != 0 ? 0 : netem_timeout_ms();
+}
+
+// The server always starts from a fresh segment; clients of a previous
+// server are left holding a mapping nobody reads.
+static int map_segment(const char *name, int create)
+{
+  char path[SHM_NAME_LENGTH + 1];
+  void *mapping;
+  int fd;
+
+  if (strlen(name) >= SHM_NAME_LENGTH || strchr(name, '/') != NULL)
+  {
+    fprintf(stderr, "Invalid shared-memory name: %s\n", name);
+    return -1;
+  }
+
+  snprintf(path, sizeof(path), "/%s", name);
+
+  if (create)
+  {
+    shm_unlink(path);
+    fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  }
+  else
+  {
+    fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+  }
+
+  if (fd == -1)
+  {
+    perror("shm_open");
+    return -1;
+  }
+
+  if (create && ftruncate(fd, sizeof(ShmSegment)) == -1)
+  {
+    perror("ftruncate");
+    close(fd);
+    shm_unlink(path);
+    return -1;
+  }
+
+  mapping = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+  close(fd);
+
+  if (mapping == MAP_FAILED)
+  {
+    perror("mmap");
+
+    if (create)
+    {
+      shm_unlink(path);
+    }
+
+    return -1;
+  }
+
+  segment = mapping;
+  snprintf(segment_name, sizeof(segment_name), "%s", name);
+
+  if (create)
+  {
+    segment->version = SHM_VERSION;
+    segment->slot_count = TRANSPORT_SHM_SLOTS;
+    atomic_store(&segment->server_waiting, 1);
+    atomic_thread_fence(memory_order_release);
+    segment->magic = SHM_MAGIC;
+  }
+  else if (segment->magic != SHM_MAGIC || segment->version != SHM_VERSION ||
+           segment->slot_count != TRANSPORT_SHM_SLOTS)
+  {
+    fprintf(stderr, "/dev/shm/%s is not a segment this build can use\n",
+            name);
+    munmap(segment, sizeof(*segment));
+    segment = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+// Doorbells live in the abstract namespace, so they leave nothing behind.
+static socklen_t doorbell_address(struct sockaddr_un *addr, int slot)
+{
+  int length;
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+
+  if (slot == SHM_SERVER_SLOT)
+  {
+    length = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                      "%s.server", segment_name);
+  }
+  else
+  {
+    length = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                      "%s.%d", segment_name, slot);
+  }
+
+  return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 +
+                     (size_t)length);
+}
+
+static int doorbell_socket(int slot)
+{
+  struct sockaddr_un addr;
+  socklen_t addr_len = doorbell_address(&addr, slot);
+  int sockfd;
+
+  sockfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (sockfd == -1)
+  {
+    perror("socket");
+    return -1;
+  }
+
+  if (bind(sockfd, (struct sockaddr *)&addr, addr_len) == -1)
+  {
+    perror("bind doorbell");
+    close(sockfd);
+    return -1;
+  }
+
+  return sockfd;
+}
+
+// A full doorbell already has a wakeup in it, so a failed send changes
+// nothing.
+static void ring_doorbell(int sockfd, int slot)
+{
+  struct sockaddr_un addr;
+  socklen_t addr_len = doorbell_address(&addr, slot);
+  char byte = 0;
+
+  sendto(sockfd, &byte, 1, MSG_DONTWAIT, (struct sockaddr *)&addr, addr_len);
+}
+
+static void drain_doorbell(int sockfd)
+{
+  char bytes[SHM_CACHE_LINE];
+
+  while (recv(sockfd, bytes, sizeof(bytes), MSG_DONTWAIT) > 0)
+  {
+  }
+}
+
+// Slots of processes that died without closing them are taken back.
+static int claim_slot(void)
+{
+  int pid = (int)getpid();
+
+  for (int i = 0; i < TRANSPORT_SHM_SLOTS; i++)
+  {
+    int owner = atomic_load(&segment->slots[i].owner);
+
+    if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH))
+    {
+      continue;
+    }
+
+    if (atomic_compare_exchange_strong(&segment->slots[i].owner, &owner, pid))
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void raise_slot_limit(int limit)
+{
+  int current = atomic_load(&segment->slot_limit);
+
+  while (current < limit &&
+         !atomic_compare_exchange_weak(&segment->slot_limit, &current, limit))
+  {
+  }
+}
+
+static ShmEndpoint *find_endpoint(int sockfd)
+{
+  if (sockfd < 0 || sockfd >= SHM_MAX_FDS || !endpoints[sockfd].used)
+  {
+    return NULL;
+  }
+
+  return &endpoints[sockfd];
+}
+
+static void format_address(struct sockaddr_storage *addr, socklen_t *addr_len,
+                           int slot, unsigned int generation)
+{
+  struct sockaddr_un *unix_addr = (struct sockaddr_un *)addr;
+
+  // Sessions are matched with memcmp, so the unused tail must be zero.
+  memset(addr, 0, sizeof(*addr));
+  unix_addr->sun_family = AF_UNIX;
+  snprintf(unix_addr->sun_path, sizeof(unix_addr->sun_path),
+           SHM_ADDRESS_FORMAT, (unsigned int)slot,
+           generation & SHM_GENERATION_MASK);
+  *addr_len = sizeof(*addr);
+}
+
+static int parse_address(const struct sockaddr *addr, int *slot,
+                         unsigned int *generation)
+{
+  const char *path = ((const struct sockaddr_un *)addr)->sun_path;
+  unsigned int value;
+
+  if (strncmp(path, SHM_ADDRESS_PREFIX, SHM_ADDRESS_PREFIX_LEN) != 0 ||
+      parse_hex(path + SHM_ADDRESS_PREFIX_LEN, SHM_SLOT_DIGITS, &value) ==
+          -1 ||
+      value >= TRANSPORT_SHM_SLOTS ||
+      path[SHM_ADDRESS_PREFIX_LEN + SHM_SLOT_DIGITS] != '.' ||
+      parse_hex(path + SHM_ADDRESS_PREFIX_LEN + SHM_SLOT_DIGITS + 1,
+                SHM_GENERATION_DIGITS, generation) == -1)
+  {
+    return -1;
+  }
+
+  *slot = (int)value;
+
+  return 0;
+}
+
+static int parse_hex(const char *str, int digits, unsigned int *value)
+{
+  *value = 0;
+
+  for (int i = 0; i < digits; i++)
+  {
+    char c = str[i];
+
+    if (c >= '0' && c <= '9')
+    {
+      *value = *value * 16 + (unsigned int)(c - '0');
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+      *value = *value * 16 + (unsigned int)(c - 'a' + HEX_DIGIT_VALUE);
+    }
+    else
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Like UDP, a datagram the server has no room for is lost, not waited on.
+static ssize_t input_push(const ShmEndpoint *endpoint, int sockfd,
+                          const void *buffer, size_t length)
+{
+  ShmSlot *slot = &segment->slots[endpoint->slot];
+  unsigned int tail;
+  ShmInputEntry *entry;
+
+  if (length > SHM_INPUT_SIZE)
+  {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  tail = atomic_load_explicit(&slot->input_tail, memory_order_relaxed);
+
+  if (tail - atomic_load_explicit(&slot->input_head, memory_order_acquire) ==
+      SHM_INPUT_ENTRIES)
+  {
+    return (ssize_t)length;
+  }
+
+  entry = &slot->input[tail % SHM_INPUT_ENTRIES];
+  entry->length = (uint32_t)length;
+  memcpy(entry->data, buffer, length);
+  atomic_store_explicit(&slot->input_tail, tail + 1, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (atomic_load_explicit(&segment->server_waiting, memory_order_relaxed) &&
+      atomic_exchange(&segment->server_waiting, 0))
+  {
+    ring_doorbell(sockfd, SHM_SERVER_SLOT);
+  }
+
+  return (ssize_t)length;
+}
+
+static ssize_t input_pop(void *buffer, size_t length, struct sockaddr *addr,
+                         socklen_t *addr_len)
+{
+  int limit = atomic_load_explicit(&segment->slot_limit, memory_order_acquire);
+
+  for (int i = 0; i < limit; i++)
+  {
+    int index = (next_input_slot + i) % limit;
+    ShmSlot *slot = &segment->slots[index];
+    unsigned int head;
+    const ShmInputEntry *entry;
+    size_t copied;
+
+    head = atomic_load_explicit(&slot->input_head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&slot->input_tail, memory_order_acquire))
+    {
+      continue;
+    }
+
+    entry = &slot->input[head % SHM_INPUT_ENTRIES];
+    copied = entry->length < length ? entry->length : length;
+    memcpy(buffer, entry->data, copied);
+    atomic_store_explicit(&slot->input_head, head + 1, memory_order_release);
+    next_input_slot = index + 1;
+
+    if (addr != NULL)
+    {
+      struct sockaddr_storage from;
+      socklen_t from_len;
+
+      format_address(&from, &from_len, index, atomic_load(&slot->generation));
+      memcpy(addr, &from, *addr_len < from_len ? *addr_len : from_len);
+      *addr_len = from_len;
+    }
+
+    return (ssize_t)copied;
+  }
+
+  return -1;
+}
+
+/*
+ * A datagram for a client that has since left is lost, as UDP to a closed
+ * port would be. Entries are seqlocked: the reader copies one out and keeps
+ * the copy only if the entry's sequence number did not move meanwhile.
+ */
+static ssize_t output_push(const struct sockaddr *addr, const void *buffer,
+                           size_t length)
+{
+  ShmSlot *slot;
+  ShmOutputEntry *entry;
+  unsigned int generation;
+  uint64_t seq;
+  int index;
+
+  if (parse_address(addr, &index, &generation) == -1)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  slot = &segment->slots[index];
+
+  if (length > SHM_OUTPUT_SIZE)
+  {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  if (atomic_load(&slot->owner) == 0 ||
+      (atomic_load(&slot->generation) & SHM_GENERATION_MASK) != generation)
+  {
+    return (ssize_t)length;
+  }
+
+  seq = atomic_fetch_add(&slot->output_head, 1);
+  entry = &slot->output[seq % SHM_OUTPUT_ENTRIES];
+  atomic_store_explicit(&entry->seq, 2 * seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  entry->length = (uint32_t)length;
+  memcpy(entry->data, buffer, length);
+  atomic_store_explicit(&entry->seq, 2 * seq + 2, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (atomic_load_explicit(&slot->reader_waiting, memory_order_relaxed) &&
+      atomic_exchange(&slot->reader_waiting, 0))
+  {
+    ring_doorbell(server_fd, index);
+  }
+
+  return (ssize_t)length;
+}
+
+static ssize_t output_pop(ShmEndpoint *endpoint, void *buffer, size_t length,
+                          struct sockaddr *addr, socklen_t *addr_len)
+{
+  ShmSlot *slot = &segment->slots[endpoint->slot];
+
+  for (;;)
+  {
+    uint64_t head = atomic_load_explicit(&slot->output_head,
+                                         memory_order_acquire);
+    const ShmOutputEntry *entry;
+    uint64_t seq;
+    size_t copied;
+
+    if (endpoint->cursor == head)
+    {
+      return -1;
+    }
+
+    if (head - endpoint->cursor > SHM_OUTPUT_ENTRIES)
+    {
+      endpoint->skipped += head - SHM_OUTPUT_ENTRIES - endpoint->cursor;
+      endpoint->cursor = head - SHM_OUTPUT_ENTRIES;
+    }
+
+    entry = &slot->output[endpoint->cursor % SHM_OUTPUT_ENTRIES];
+    seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+
+    // Still being written; its writer rings once it is done.
+    if (seq < 2 * endpoint->cursor + 2)
+    {
+      return -1;
+    }
+
+    // Overwritten by a later lap: look at the head again.
+    if (seq > 2 * endpoint->cursor + 2)
+    {
+      endpoint->skipped++;
+      endpoint->cursor++;
+      continue;
+    }
+
+    copied = entry->length < length ? entry->length : length;
+    memcpy(buffer, entry->data, copied);
+    atomic_thread_fence(memory_order_acquire);
+
+    if (atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq)
+    {
+      continue;
+    }
+
+    endpoint->cursor++;
+
+    if (addr != NULL)
+    {
+      struct sockaddr_un from;
+
+      memset(&from, 0, sizeof(from));
+      from.sun_family = AF_UNIX;
+      snprintf(from.sun_path, sizeof(from.sun_path), "%s", segment_name);
+      memcpy(addr, &from,
+             *addr_len < sizeof(from) ? *addr_len : sizeof(from));
+      *addr_len = sizeof(from);
+    }
+
+    return (ssize_t)copied;
+  }
+}
+
+static ssize_t endpoint_read(ShmEndpoint *endpoint, void *buffer,
+                             size_t length, struct sockaddr *addr,
+                             socklen_t *addr_len)
+{
+  if (endpoint->slot == SHM_SERVER_SLOT)
+  {
+    return input_pop(buffer, length, addr, addr_len);
+  }
+
+  return output_pop(endpoint, buffer, length, addr, addr_len);
+}
+
+static void set_pending(ShmEndpoint *endpoint, int pending)
+{
+  pending_count += pending - endpoint->pending;
+  endpoint->pending = pending;
+}
@@ -0,0 +1,51 @@
+#ifndef TG_TRANSPORT_H
+#define TG_TRANSPORT_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * Where datagrams go between clients and the server. Over the network that
+ * is UDP through netem (see netem.h). Clients on the server's own host can
+ * use a shared-memory segment instead, and skip the kernel's network stack:
+ *
+ *   server:  transport_shm_listen("game")  creates /dev/shm/game
+ *   client:  transport_shm_connect("game", &addr, &addr_len)
+ *
+ * The segment holds a slot per connected process. Each slot has a ring of
+ * datagrams from the client, which the server drains, and a ring of
+ * datagrams to the client, which the server never waits on: a client that
+ * falls a whole ring behind skips to the newest ones, as if the others had
+ * been lost. Both sides poll an ordinary descriptor, and a byte is sent to
+ * it only when the other side found its ring empty and went to sleep.
+ *
+ * Clients in the segment have AF_UNIX addresses, unique per slot and
+ * connection, so they are routed, rate limited and matched like any other
+ * address. transport_sendto writes to any such address through the
+ * segment and everything else to netem_sendto; transport_recvfrom on a
+ * descriptor from transport_shm_listen or transport_shm_connect reads the
+ * segment, and on any other descriptor calls netem_recvfrom. Neither ever
+ * blocks on the segment; an empty ring fails with EAGAIN.
+ */
+
+#define TRANSPORT_SHM_SLOTS 128
+
+int transport_shm_listen(const char *name);
+int transport_shm_connect(const char *name, struct sockaddr_storage *addr,
+                          socklen_t *addr_len);
+int transport_close(int sockfd);
+void transport_shutdown(void);
+
+ssize_t transport_sendto(int sockfd, const void *buffer, size_t length,
+                         int flags, const struct sockaddr *addr,
+                         socklen_t addr_len);
+ssize_t transport_recvfrom(int sockfd, void *buffer, size_t length, int flags,
+                           struct sockaddr *addr, socklen_t *addr_len);
+
+// Whether sockfd may have more datagrams waiting in the segment: its
+// descriptor only becomes readable again once a read has found it empty.
+int transport_pending(int sockfd);
+// netem_timeout_ms, or 0 while a segment descriptor is pending.
+int transport_timeout_ms(void);
+
+#endif
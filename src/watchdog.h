@@ -0,0 +1,105 @@
+#ifndef TG_WATCHDOG_H
+#define TG_WATCHDOG_H
+
+#include <stdint.h>
+
+/*
+ * Holds a room's work per tick to a budget. Every tick reports what it
+ * cost: the packets handled since the last one plus the tick itself. A tick
+ * over budget raises the shed level by one, so the next tick does less; the
+ * level only comes down again after WATCHDOG_CALM_TICKS ticks in a row that
+ * used under WATCHDOG_HEADROOM_PERCENT of the budget, so that a room does
+ * not flap between levels when its load sits right at the budget.
+ *
+ * What each level gives up is the room's business. They are cumulative:
+ *
+ *   1  distant entities: NPCs far from a player and players across a zone
+ *      border are sent every few ticks instead of every tick
+ *   2  merged inputs: ticks come half as often, and each applies two
+ *      queued moves per session, so players keep their speed
+ *   3  non-essential work: spectators and the move and JOIN logs are
+ *      skipped
+ */
+
+#define WATCHDOG_LEVELS 4
+#define WATCHDOG_CALM_TICKS 20
+#define WATCHDOG_HEADROOM_PERCENT 50
+
+typedef enum
+{
+  SHED_NONE,
+  SHED_DISTANT,
+  SHED_MERGE_INPUTS,
+  SHED_NON_ESSENTIAL
+} ShedLevel;
+
+typedef struct
+{
+  uint64_t budget_ns;
+  int level;
+  int calm_ticks;
+  // Since the room started: ticks spent at each level, ticks over budget,
+  // and how often the level went up and down.
+  uint64_t level_ticks[WATCHDOG_LEVELS];
+  uint64_t overruns;
+  uint64_t sheds;
+  uint64_t restores;
+  uint64_t worst_ns;
+} Watchdog;
+
+static inline const char *watchdog_level_name(int level)
+{
+  static const char *const names[WATCHDOG_LEVELS] = {
+      "full fidelity", "distant entities thinned", "inputs merged",
+      "non-essential work skipped"};
+
+  return level >= 0 && level < WATCHDOG_LEVELS ? names[level] : "?";
+}
+
+// Returns how the level changed: 1 up, -1 down, or 0.
+static inline int watchdog_record(Watchdog *watchdog, uint64_t work_ns)
+{
+  watchdog->level_ticks[watchdog->level]++;
+  watchdog->worst_ns =
+      work_ns > watchdog->worst_ns ? work_ns : watchdog->worst_ns;
+
+  // A budget of 0 turns the watchdog off.
+  if (watchdog->budget_ns == 0)
+  {
+    return 0;
+  }
+
+  if (work_ns > watchdog->budget_ns)
+  {
+    watchdog->overruns++;
+    watchdog->calm_ticks = 0;
+
+    if (watchdog->level == WATCHDOG_LEVELS - 1)
+    {
+      return 0;
+    }
+
+    watchdog->level++;
+    watchdog->sheds++;
+    return 1;
+  }
+
+  if (watchdog->level == SHED_NONE ||
+      work_ns * 100 >= watchdog->budget_ns * WATCHDOG_HEADROOM_PERCENT)
+  {
+    watchdog->calm_ticks = 0;
+    return 0;
+  }
+
+  if (++watchdog->calm_ticks < WATCHDOG_CALM_TICKS)
+  {
+    return 0;
+  }
+
+  watchdog->calm_ticks = 0;
+  watchdog->level--;
+  watchdog->restores++;
+  return -1;
+}
+
+#endif
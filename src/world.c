@@ -0,0 +1,191 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "world.h"
+
+static void world_attach(World *world, void *mapping, size_t mapping_len);
+
+size_t world_file_size(int chunks_x, int chunks_y)
+{
+  return sizeof(MapHeader) +
+         (size_t)chunks_x * (size_t)chunks_y * sizeof(MapChunk);
+}
+
+void world_chunk_set_cell(MapChunk *chunk, int local_x, int local_y,
+                          char tile, int walkable)
+{
+  int cell = (local_y << WORLD_CHUNK_SHIFT) | local_x;
+
+  chunk->tiles[cell] = tile;
+
+  if (walkable)
+  {
+    chunk->walkable[cell >> 3] |= (unsigned char)(1U << (cell & 7));
+  }
+  else
+  {
+    chunk->walkable[cell >> 3] &= (unsigned char)~(1U << (cell & 7));
+  }
+}
+
+int world_load(World *world, const char *path)
+{
+  int fd;
+  struct stat st;
+  void *mapping;
+  const MapHeader *header;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1)
+  {
+    perror("open map");
+    return -1;
+  }
+
+  if (fstat(fd, &st) == -1)
+  {
+    perror("fstat map");
+    close(fd);
+    return -1;
+  }
+
+  if ((size_t)st.st_size < sizeof(MapHeader))
+  {
+    fprintf(stderr, "%s: map file too small\n", path);
+    close(fd);
+    return -1;
+  }
+
+  mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (mapping == MAP_FAILED)
+  {
+    perror("mmap map");
+    return -1;
+  }
+
+  header = (const MapHeader *)mapping;
+
+  // The dimensions are checked before anything is computed from them, and
+  // in 64 bits, so a corrupt header cannot wrap into one that looks valid.
+  if (memcmp(header->magic, WORLD_MAP_MAGIC, WORLD_MAP_MAGIC_LEN) != 0 ||
+      header->chunk_dim != WORLD_CHUNK_DIM || header->width == 0 ||
+      header->height == 0 || header->width > WORLD_MAX_DIM ||
+      header->height > WORLD_MAX_DIM ||
+      header->chunks_x !=
+          ((uint64_t)header->width + WORLD_CHUNK_DIM - 1) / WORLD_CHUNK_DIM ||
+      header->chunks_y !=
+          ((uint64_t)header->height + WORLD_CHUNK_DIM - 1) / WORLD_CHUNK_DIM ||
+      world_file_size((int)header->chunks_x, (int)header->chunks_y) >
+          (size_t)st.st_size)
+  {
+    fprintf(stderr, "%s: not a valid map file\n", path);
+    munmap(mapping, (size_t)st.st_size);
+    return -1;
+  }
+
+  // Chunks are touched in whatever order players wander into them.
+  madvise(mapping, (size_t)st.st_size, MADV_RANDOM);
+
+  world_attach(world, mapping, (size_t)st.st_size);
+
+  return 0;
+}
+
+int world_create_bordered(World *world, int width, int height)
+{
+  int chunks_x;
+  int chunks_y;
+  size_t mapping_len;
+  void *mapping;
+  MapHeader *header;
+  MapChunk *chunks;
+
+  if (width < 3 || height < 3 || width > WORLD_MAX_DIM ||
+      height > WORLD_MAX_DIM)
+  {
+    fprintf(stderr, "World must be from 3x3 to %dx%d, was %dx%d\n",
+            WORLD_MAX_DIM, WORLD_MAX_DIM, width, height);
+    return -1;
+  }
+
+  chunks_x = (width + WORLD_CHUNK_DIM - 1) / WORLD_CHUNK_DIM;
+  chunks_y = (height + WORLD_CHUNK_DIM - 1) / WORLD_CHUNK_DIM;
+  mapping_len = world_file_size(chunks_x, chunks_y);
+
+  mapping = mmap(NULL, mapping_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (mapping == MAP_FAILED)
+  {
+    perror("mmap world");
+    return -1;
+  }
+
+  header = (MapHeader *)mapping;
+  memcpy(header->magic, WORLD_MAP_MAGIC, WORLD_MAP_MAGIC_LEN);
+  header->width = (uint32_t)width;
+  header->height = (uint32_t)height;
+  header->chunk_dim = WORLD_CHUNK_DIM;
+  header->chunks_x = (uint32_t)chunks_x;
+  header->chunks_y = (uint32_t)chunks_y;
+
+  chunks = (MapChunk *)(header + 1);
+
+  for (int y = 0; y < chunks_y * WORLD_CHUNK_DIM; y++)
+  {
+    for (int x = 0; x < chunks_x * WORLD_CHUNK_DIM; x++)
+    {
+      MapChunk *chunk = &chunks[(y >> WORLD_CHUNK_SHIFT) * chunks_x +
+                                (x >> WORLD_CHUNK_SHIFT)];
+      int local_x = x & WORLD_CHUNK_MASK;
+      int local_y = y & WORLD_CHUNK_MASK;
+
+      if (x >= width || y >= height)
+      {
+        world_chunk_set_cell(chunk, local_x, local_y, WORLD_TILE_VOID, 0);
+      }
+      else if (x == 0 || y == 0 || x == width - 1 || y == height - 1)
+      {
+        world_chunk_set_cell(chunk, local_x, local_y, WORLD_TILE_WALL, 0);
+      }
+      else
+      {
+        world_chunk_set_cell(chunk, local_x, local_y, WORLD_TILE_FLOOR, 1);
+      }
+    }
+  }
+
+  world_attach(world, mapping, mapping_len);
+
+  return 0;
+}
+
+void world_unload(World *world)
+{
+  if (world->mapping != NULL)
+  {
+    munmap(world->mapping, world->mapping_len);
+  }
+
+  memset(world, 0, sizeof(*world));
+}
+
+static void world_attach(World *world, void *mapping, size_t mapping_len)
+{
+  const MapHeader *header = (const MapHeader *)mapping;
+
+  world->width = (int)header->width;
+  world->height = (int)header->height;
+  world->chunks_x = (int)header->chunks_x;
+  world->chunks_y = (int)header->chunks_y;
+  world->chunks = (const MapChunk *)(header + 1);
+  world->mapping = mapping;
+  world->mapping_len = mapping_len;
+}
@@ -0,0 +1,113 @@
+#ifndef TG_WORLD_H
+#define TG_WORLD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On-disk map layout (native byte order):
+ *
+ *   MapHeader
+ *   MapChunk[chunks_y][chunks_x]
+ *
+ * Each chunk holds a WORLD_CHUNK_DIM x WORLD_CHUNK_DIM block of cells as a
+ * walkability bitset followed by the tile characters used for drawing. The
+ * file is mapped read-only, so loading cost does not depend on map size.
+ */
+
+#define WORLD_MAP_MAGIC "TGMAP001"
+#define WORLD_MAP_MAGIC_LEN 8
+#define WORLD_CHUNK_SHIFT 4
+#define WORLD_CHUNK_DIM (1 << WORLD_CHUNK_SHIFT)
+#define WORLD_CHUNK_MASK (WORLD_CHUNK_DIM - 1)
+#define WORLD_CHUNK_CELLS (WORLD_CHUNK_DIM * WORLD_CHUNK_DIM)
+#define WORLD_CHUNK_BITSET_BYTES (WORLD_CHUNK_CELLS / 8)
+// Widest and tallest map there is; cell coordinates are ints.
+#define WORLD_MAX_DIM 65536
+
+#define WORLD_TILE_FLOOR ' '
+#define WORLD_TILE_WALL '#'
+#define WORLD_TILE_VOID ' '
+
+typedef struct
+{
+  char magic[WORLD_MAP_MAGIC_LEN];
+  uint32_t width;
+  uint32_t height;
+  uint32_t chunk_dim;
+  uint32_t chunks_x;
+  uint32_t chunks_y;
+  uint32_t reserved;
+} MapHeader;
+
+typedef struct
+{
+  unsigned char walkable[WORLD_CHUNK_BITSET_BYTES];
+  char tiles[WORLD_CHUNK_CELLS];
+} MapChunk;
+
+// Half-open rectangle of cells: x0 <= x < x1, y0 <= y < y1.
+typedef struct
+{
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+} WorldRect;
+
+typedef struct
+{
+  int width;
+  int height;
+  int chunks_x;
+  int chunks_y;
+  const MapChunk *chunks;
+  void *mapping;
+  size_t mapping_len;
+} World;
+
+int world_load(World *world, const char *path);
+int world_create_bordered(World *world, int width, int height);
+void world_unload(World *world);
+
+size_t world_file_size(int chunks_x, int chunks_y);
+void world_chunk_set_cell(MapChunk *chunk, int local_x, int local_y,
+                          char tile, int walkable);
+
+static inline int world_in_bounds(const World *world, int x, int y)
+{
+  return x >= 0 && y >= 0 && x < world->width && y < world->height;
+}
+
+static inline int world_rect_contains(const WorldRect *rect, int x, int y)
+{
+  return x >= rect->x0 && y >= rect->y0 && x < rect->x1 && y < rect->y1;
+}
+
+static inline const MapChunk *world_chunk(const World *world, int cx, int cy)
+{
+  if (cx < 0 || cy < 0 || cx >= world->chunks_x || cy >= world->chunks_y)
+  {
+    return NULL;
+  }
+
+  return &world->chunks[(size_t)cy * (size_t)world->chunks_x + (size_t)cx];
+}
+
+static inline int world_walkable(const World *world, int x, int y)
+{
+  const MapChunk *chunk;
+  int cell;
+
+  if (!world_in_bounds(world, x, y))
+  {
+    return 0;
+  }
+
+  chunk = world_chunk(world, x >> WORLD_CHUNK_SHIFT, y >> WORLD_CHUNK_SHIFT);
+  cell = ((y & WORLD_CHUNK_MASK) << WORLD_CHUNK_SHIFT) | (x & WORLD_CHUNK_MASK);
+
+  return (chunk->walkable[cell >> 3] >> (cell & 7)) & 1;
+}
+
+#endif
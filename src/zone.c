@@ -0,0 +1,266 @@
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zone.h"
+
+#define LINE_LENGTH 256
+#define BASE_TEN 10
+
+static int resolve_peer(Zone *zone, unsigned int peer_port);
+
+int zone_map_load(ZoneMap *map, const char *path, int self_id)
+{
+  FILE *file;
+  char line[LINE_LENGTH];
+  int line_number;
+
+  memset(map, 0, sizeof(*map));
+  map->self = -1;
+  map->peer_sockfd = -1;
+
+  file = fopen(path, "re");
+
+  if (file == NULL)
+  {
+    perror("open zone file");
+    return -1;
+  }
+
+  line_number = 0;
+
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    Zone *zone;
+    unsigned int client_port;
+    unsigned int peer_port;
+    char *start = line;
+
+    line_number++;
+
+    while (*start == ' ' || *start == '\t')
+    {
+      start++;
+    }
+
+    if (*start == '#' || *start == '\n' || *start == '\0')
+    {
+      continue;
+    }
+
+    if (map->count == MAX_ZONES)
+    {
+      fprintf(stderr, "%s: more than %d zones\n", path, MAX_ZONES);
+      fclose(file);
+      return -1;
+    }
+
+    zone = &map->zones[map->count];
+
+    // NOLINTNEXTLINE(cert-err34-c,-warnings-as-errors)
+    if (sscanf(start, "%d %d %d %d %d %45s %u %u", &zone->id, &zone->area.x0,
+               &zone->area.y0, &zone->area.x1, &zone->area.y1, zone->host,
+               &client_port, &peer_port) != 8 ||
+        client_port > UINT16_MAX || peer_port > UINT16_MAX ||
+        zone->area.x0 >= zone->area.x1 || zone->area.y0 >= zone->area.y1 ||
+        resolve_peer(zone, peer_port) == -1)
+    {
+      fprintf(stderr, "%s:%d: invalid zone line\n", path, line_number);
+      fclose(file);
+      return -1;
+    }
+
+    zone->client_port = (in_port_t)client_port;
+
+    if (zone->id == self_id)
+    {
+      map->self = map->count;
+    }
+
+    map->count++;
+  }
+
+  fclose(file);
+
+  if (map->self == -1)
+  {
+    fprintf(stderr, "%s: no zone with id %d\n", path, self_id);
+    return -1;
+  }
+
+  return 0;
+}
+
+int zone_map_open_peer_socket(ZoneMap *map)
+{
+  const Zone *self = zone_self(map);
+
+  map->peer_sockfd = socket(self->peer_addr.ss_family, SOCK_DGRAM, 0);
+
+  if (map->peer_sockfd == -1)
+  {
+    perror("peer socket");
+    return -1;
+  }
+
+  if (bind(map->peer_sockfd, (const struct sockaddr *)&self->peer_addr,
+           self->peer_addr_len) == -1)
+  {
+    perror("bind peer socket");
+    close(map->peer_sockfd);
+    map->peer_sockfd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+int zone_index_at(const ZoneMap *map, int x, int y)
+{
+  for (int i = 0; i < map->count; i++)
+  {
+    if (world_rect_contains(&map->zones[i].area, x, y))
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+int zone_index_by_id(const ZoneMap *map, int id)
+{
+  for (int i = 0; i < map->count; i++)
+  {
+    if (map->zones[i].id == id)
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+int zone_near(const Zone *zone, int x, int y, int margin)
+{
+  return x >= zone->area.x0 - margin && y >= zone->area.y0 - margin &&
+         x < zone->area.x1 + margin && y < zone->area.y1 + margin;
+}
+
+int zone_format_handoff(const ZoneHandoff *handoff, char *buffer,
+                        size_t size)
+{
+  char host[NI_MAXHOST];
+  char port[NI_MAXSERV];
+  int ret;
+
+  ret = getnameinfo((const struct sockaddr *)&handoff->addr, handoff->addr_len,
+                    host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+
+  if (ret != 0)
+  {
+    fprintf(stderr, "getnameinfo: %s\n", gai_strerror(ret));
+    return -1;
+  }
+
+  return snprintf(buffer, size,
+                  HANDOFF_MESSAGE_PREFIX "%d|%s|%s|%s|%d|%d|%d|%d",
+                  handoff->room_id, host, port, handoff->username, handoff->x,
+                  handoff->y, handoff->view_rows, handoff->view_cols);
+}
+
+int zone_parse_handoff(const char *buffer, ZoneHandoff *handoff)
+{
+  char host[INET6_ADDRSTRLEN];
+  unsigned int port;
+
+  memset(handoff, 0, sizeof(*handoff));
+
+  // NOLINTNEXTLINE(cert-err34-c,-warnings-as-errors)
+  if (sscanf(buffer, HANDOFF_MESSAGE_PREFIX "%d|%45[^|]|%u|%19[^|]|%d|%d|%d|%d",
+             &handoff->room_id, host, &port, handoff->username, &handoff->x,
+             &handoff->y, &handoff->view_rows, &handoff->view_cols) != 8 ||
+      port > UINT16_MAX || handoff->room_id < 0)
+  {
+    return -1;
+  }
+
+  if (inet_pton(AF_INET, host,
+                &((struct sockaddr_in *)&handoff->addr)->sin_addr) == 1)
+  {
+    struct sockaddr_in *ipv4_addr = (struct sockaddr_in *)&handoff->addr;
+
+    ipv4_addr->sin_family = AF_INET;
+    ipv4_addr->sin_port = htons((in_port_t)port);
+    handoff->addr_len = sizeof(*ipv4_addr);
+    return 0;
+  }
+
+  if (inet_pton(AF_INET6, host,
+                &((struct sockaddr_in6 *)&handoff->addr)->sin6_addr) == 1)
+  {
+    struct sockaddr_in6 *ipv6_addr = (struct sockaddr_in6 *)&handoff->addr;
+
+    ipv6_addr->sin6_family = AF_INET6;
+    ipv6_addr->sin6_port = htons((in_port_t)port);
+    handoff->addr_len = sizeof(*ipv6_addr);
+    return 0;
+  }
+
+  return -1;
+}
+
+int zone_parse_room_id(const char *buffer, int *room_id)
+{
+  const char *start = strchr(buffer, ':');
+  char *endptr;
+  long id;
+
+  if (start == NULL)
+  {
+    return -1;
+  }
+
+  id = strtol(start + 1, &endptr, BASE_TEN);
+
+  if (*endptr != '|' || id < 0 || id > INT32_MAX)
+  {
+    return -1;
+  }
+
+  *room_id = (int)id;
+
+  return 0;
+}
+
+static int resolve_peer(Zone *zone, unsigned int peer_port)
+{
+  memset(&zone->peer_addr, 0, sizeof(zone->peer_addr));
+
+  if (inet_pton(AF_INET, zone->host,
+                &((struct sockaddr_in *)&zone->peer_addr)->sin_addr) == 1)
+  {
+    struct sockaddr_in *ipv4_addr = (struct sockaddr_in *)&zone->peer_addr;
+
+    ipv4_addr->sin_family = AF_INET;
+    ipv4_addr->sin_port = htons((in_port_t)peer_port);
+    zone->peer_addr_len = sizeof(*ipv4_addr);
+    return 0;
+  }
+
+  if (inet_pton(AF_INET6, zone->host,
+                &((struct sockaddr_in6 *)&zone->peer_addr)->sin6_addr) == 1)
+  {
+    struct sockaddr_in6 *ipv6_addr = (struct sockaddr_in6 *)&zone->peer_addr;
+
+    ipv6_addr->sin6_family = AF_INET6;
+    ipv6_addr->sin6_port = htons((in_port_t)peer_port);
+    zone->peer_addr_len = sizeof(*ipv6_addr);
+    return 0;
+  }
+
+  return -1;
+}
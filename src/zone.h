@@ -0,0 +1,71 @@
+#ifndef TG_ZONE_H
+#define TG_ZONE_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "world.h"
+
+/*
+ * A sharded world is described by a zone file shared by every server
+ * process. Each non-comment line is
+ *
+ *   <id> <x0> <y0> <x1> <y1> <address> <client port> <peer port>
+ *
+ * giving the half-open rectangle the zone owns, where its clients connect
+ * and where the other zones reach it for handoffs and border updates.
+ */
+
+#define MAX_ZONES 16
+#define ZONE_BORDER_MARGIN 12
+
+typedef struct
+{
+  int id;
+  WorldRect area;
+  char host[INET6_ADDRSTRLEN];
+  in_port_t client_port;
+  struct sockaddr_storage peer_addr;
+  socklen_t peer_addr_len;
+} Zone;
+
+// A player moving between zones, as carried by a HANDOFF message.
+typedef struct
+{
+  int room_id;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  char username[MAX_USERNAME_LENGTH];
+  int x;
+  int y;
+  int view_rows;
+  int view_cols;
+} ZoneHandoff;
+
+typedef struct
+{
+  Zone zones[MAX_ZONES];
+  int count;
+  int self;
+  int peer_sockfd;
+} ZoneMap;
+
+int zone_map_load(ZoneMap *map, const char *path, int self_id);
+int zone_map_open_peer_socket(ZoneMap *map);
+int zone_index_at(const ZoneMap *map, int x, int y);
+int zone_index_by_id(const ZoneMap *map, int id);
+int zone_near(const Zone *zone, int x, int y, int margin);
+
+int zone_format_handoff(const ZoneHandoff *handoff, char *buffer,
+                        size_t size);
+int zone_parse_handoff(const char *buffer, ZoneHandoff *handoff);
+int zone_parse_room_id(const char *buffer, int *room_id);
+
+static inline const Zone *zone_self(const ZoneMap *map)
+{
+  return &map->zones[map->self];
+}
+
+#endif